@@ -0,0 +1,320 @@
+/*
+ * bench.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * The benchmark harness
+ *
+ * Usage: bench [-n runs] [-d directory] [benchmark...]
+ *
+ * Runs each workload script in `directory` ("bench" by default) `runs` times
+ * after a warm-up run, each time in a new context (only the execution is
+ * timed, not the compilation), then it times parsing and compiling a large
+ * generated source text. If benchmarks are named on the command line, only
+ * those are run.
+ *
+ * The results are written to the standard output as tab-separated values,
+ * one benchmark per line, preceded by a header line. Times are CPU times in
+ * milliseconds. The `result` column is the return value of the workload; it
+ * must not change between builds unless the semantics of the language does.
+ * For "parse" and "compile", it is the size of the source in bytes and that
+ * of the bytecode in machine words, respectively. Diagnostics go to stderr.
+ *
+ * For meaningful numbers, build the library with BUILD=release.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spn.h"
+#include "ctx.h"
+
+#define MAX_RUNS	100
+
+/* the workloads: each one returns a number that depends on all of its work */
+static const char *const scripts[] = {
+	"fib",
+	"intloop",
+	"floatloop",
+	"mathcall",
+	"dict_int",
+	"dict_str",
+	"fields",
+	"concat",
+	"splitjoin",
+	"fileio",
+	"foreach",
+	"strbuild",
+	"search",
+	"numbuf",
+	"mandel",
+	"tailcall",
+	"coroutine"
+};
+
+/* the body of one function in the generated source (see gen_source()) */
+static const char srctmpl[] =
+	"function f%lu(a, b, c) {\n"
+	"\tvar i, s = 0, t = \"str%lu\", arr = array();\n"
+	"\tfor i = 0; i < a; i++ {\n"
+	"\t\tif i %% 3 == 0 && b != nil {\n"
+	"\t\t\ts += i * %lu - (b << 2) / 7;\n"
+	"\t\t} else if c {\n"
+	"\t\t\tt = t .. \"-\" .. t;\n"
+	"\t\t} else {\n"
+	"\t\t\tarr[i] = s > 100 ? -s : s + 0.5;\n"
+	"\t\t}\n"
+	"\t}\n"
+	"\twhile s > 1000 { s /= 2; }\n"
+	"\treturn f%lu(s, arr[0], sizeof t) + 1;\n"
+	"}\n\n";
+
+#define SRC_NFUNCS	4000
+
+static double times[MAX_RUNS];
+
+static int compare_times(const void *lhs, const void *rhs)
+{
+	const double *l = lhs, *r = rhs;
+	return *l < *r ? -1 : *l > *r ? +1 : 0;
+}
+
+static double elapsed_ms(clock_t start)
+{
+	return (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+static void print_header()
+{
+	printf("benchmark\truns\tmin_ms\tmedian_ms\tmax_ms\tresult\n");
+}
+
+/* prints the statistics of `times[0...runs)` and `result` */
+static void print_result(const char *name, int runs, const char *result)
+{
+	qsort(times, runs, sizeof(times[0]), compare_times);
+
+	printf(
+		"%s\t%d\t%.3f\t%.3f\t%.3f\t%s\n",
+		name,
+		runs,
+		times[0],
+		times[runs / 2],
+		times[runs - 1],
+		result
+	);
+
+	fflush(stdout);
+}
+
+static void format_value(char *buf, const SpnValue *val)
+{
+	if (val->t != SPN_TYPE_NUMBER) {
+		strcpy(buf, "-");
+	} else if (val->f & SPN_TFLG_FLOAT) {
+		sprintf(buf, "%.17g", val->v.fltv);
+	} else {
+		sprintf(buf, "%ld", val->v.intv);
+	}
+}
+
+static int selected(const char *name, int argc, char *argv[])
+{
+	int i, any = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i] == NULL) {
+			continue;
+		}
+
+		any = 1;
+		if (strcmp(argv[i], name) == 0) {
+			return 1;
+		}
+	}
+
+	return !any;
+}
+
+/* runs the compiled script in a fresh context, since global functions can't
+ * be redefined. Returns the time of the execution, or a negative number on
+ * error. Only the first run formats the result into `result`.
+ */
+static double time_script(const char *path, char *result)
+{
+	SpnContext *ctx = spn_ctx_new();
+	spn_uword *bc = spn_ctx_loadsrcfile(ctx, path);
+	SpnValue *val = NULL;
+	double t = -1.0;
+	clock_t start;
+
+	if (bc != NULL) {
+		start = clock();
+		val = spn_ctx_execbytecode(ctx, bc);
+		t = elapsed_ms(start);
+	}
+
+	if (val == NULL) {
+		fprintf(stderr, "bench: %s: %s\n", path, ctx->errmsg);
+		t = -1.0;
+	} else if (result != NULL) {
+		format_value(result, val);
+	}
+
+	spn_ctx_free(ctx);
+	return t;
+}
+
+/* returns nonzero on error */
+static int run_script(const char *dir, const char *name, int runs)
+{
+	char path[FILENAME_MAX];
+	char result[64];
+	int i;
+
+	if (strlen(dir) + strlen(name) + 6 > sizeof path) {
+		fprintf(stderr, "bench: path of `%s' is too long\n", name);
+		return -1;
+	}
+
+	sprintf(path, "%s/%s.spn", dir, name);
+
+	/* warm up and check the result */
+	if (time_script(path, result) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < runs; i++) {
+		times[i] = time_script(path, NULL);
+		if (times[i] < 0) {
+			return -1;
+		}
+	}
+
+	print_result(name, runs, result);
+	return 0;
+}
+
+/* generates a source text consisting of `n` functions */
+static char *gen_source(unsigned long n, size_t *len)
+{
+	/* an upper bound for the length of one function */
+	size_t maxlen = sizeof srctmpl + 4 * 20;
+	char *src = malloc(n * maxlen + 1);
+	unsigned long i;
+
+	if (src == NULL) {
+		abort();
+	}
+
+	*len = 0;
+	src[0] = 0;
+
+	for (i = 0; i < n; i++) {
+		*len += sprintf(src + *len, srctmpl, i, i, i % 97, (i + 1) % n);
+	}
+
+	return src;
+}
+
+/* times the parser and the compiler separately. Returns nonzero on error. */
+static int run_compiler(int runs)
+{
+	SpnParser *p = spn_parser_new();
+	SpnCompiler *cmp = spn_compiler_new();
+	double ctimes[MAX_RUNS];
+	char result[64];
+	size_t srclen, bclen = 0;
+	char *src = gen_source(SRC_NFUNCS, &srclen);
+	int i, status = 0;
+
+	for (i = 0; i < runs; i++) {
+		clock_t start = clock();
+		SpnAST *ast = spn_parser_parse(p, src);
+		spn_uword *bc;
+
+		times[i] = elapsed_ms(start);
+
+		if (ast == NULL) {
+			fprintf(stderr, "bench: parse: %s\n", p->errmsg);
+			status = -1;
+			break;
+		}
+
+		start = clock();
+		bc = spn_compiler_compile(cmp, ast, &bclen);
+		ctimes[i] = elapsed_ms(start);
+
+		spn_ast_free(ast);
+
+		if (bc == NULL) {
+			fprintf(stderr, "bench: compile: %s\n", spn_compiler_errmsg(cmp));
+			status = -1;
+			break;
+		}
+
+		free(bc);
+	}
+
+	if (status == 0) {
+		sprintf(result, "%lu", (unsigned long)srclen);
+		print_result("parse", runs, result);
+
+		memcpy(times, ctimes, runs * sizeof(times[0]));
+		sprintf(result, "%lu", (unsigned long)bclen);
+		print_result("compile", runs, result);
+	}
+
+	free(src);
+	spn_compiler_free(cmp);
+	spn_parser_free(p);
+
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = "bench";
+	int runs = 5;
+	int status = EXIT_SUCCESS;
+	size_t i;
+
+	/* options are removed from `argv`, the rest are benchmark names */
+	for (i = 1; i < (size_t)argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < (size_t)argc) {
+			runs = atoi(argv[i + 1]);
+			argv[i] = argv[i + 1] = NULL;
+			i++;
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < (size_t)argc) {
+			dir = argv[i + 1];
+			argv[i] = argv[i + 1] = NULL;
+			i++;
+		}
+	}
+
+	if (runs < 1 || runs > MAX_RUNS) {
+		fprintf(stderr, "bench: the number of runs must be in [1, %d]\n", MAX_RUNS);
+		return EXIT_FAILURE;
+	}
+
+	print_header();
+
+	for (i = 0; i < sizeof scripts / sizeof scripts[0]; i++) {
+		if (selected(scripts[i], argc, argv)) {
+			if (run_script(dir, scripts[i], runs) != 0) {
+				status = EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (selected("parse", argc, argv) || selected("compile", argc, argv)) {
+		if (run_compiler(runs) != 0) {
+			status = EXIT_FAILURE;
+		}
+	}
+
+	return status;
+}
@@ -12,10 +12,11 @@
 
 #include "spn.h"
 #include "ctx.h"
+#include "disasm.h"
 #include "repl.h"
 
 #define N_CMDS		4
-#define N_FLAGS		1
+#define N_FLAGS		4
 #define N_ARGS		(N_CMDS + N_FLAGS)
 
 #define CMDS_MASK	0x0f
@@ -30,7 +31,10 @@ enum cmd_args {
 	CMD_RUN		= 1 << 1,
 	CMD_EXECUTE	= 1 << 2,
 	CMD_INTERACT	= 1 << 3,
-	FLAG_PRINTNIL	= 1 << 8
+	FLAG_PRINTNIL	= 1 << 8,
+	FLAG_OPTIMIZE	= 1 << 9,
+	FLAG_PROFILE	= 1 << 10,
+	FLAG_STATS	= 1 << 11
 };
 
 static enum cmd_args process_args(int argc, char *argv[])
@@ -44,7 +48,10 @@ static enum cmd_args process_args(int argc, char *argv[])
 		{ "-r",	"--run",	CMD_RUN		},
 		{ "-e",	"--execute",	CMD_EXECUTE	},
 		{ "-i", "--interact",	CMD_INTERACT	},
-		{ "-n", "--print-nil",	FLAG_PRINTNIL	}
+		{ "-n", "--print-nil",	FLAG_PRINTNIL	},
+		{ "-O", "--optimize",	FLAG_OPTIMIZE	},
+		{ "-p", "--profile",	FLAG_PROFILE	},
+		{ "-s", "--stats",	FLAG_STATS	}
 	};
 
 	enum cmd_args flags = 0;
@@ -80,8 +87,14 @@ static int show_help()
 	printf("\t-e, --execute\tExecute command-line arguments\n");
 	printf("\t-i, --interact\tEnter interactive (REPL) mode\n");
 	printf("\t-n, --print-nil\tExplicitly print nil values\n");
+	printf("\t-O, --optimize\tOptimize the compiled bytecode\n");
+	printf("\t-p, --profile\tProfile the scripts, print a report on exit\n");
+	printf("\t-s, --stats\tPrint the register count of each function\n");
 	printf("\t--\t\tIndicates end of options to the interpreter;\n");
 	printf("\t\t\tsubsequent argments will be passed to the scripts\n\n");
+	printf("\tIf the SPN_CACHEDIR environment variable names a directory,\n");
+	printf("\tthe compiled code of script files is cached in it.\n");
+	printf("\tIf SPN_NOJIT is set, the JIT compiler is turned off.\n\n");
 	printf("\tPlease send bug reports through GitHub:\n");
 	printf("\t<http://github.com/H2CO3/Sparkling>\n\n");
 
@@ -103,9 +116,112 @@ static int endswith(const char *haystack, const char *needle)
 	return strstr(haystack + hsl - ndl, needle) != NULL;
 }
 
+static void start_profiling(SpnContext *ctx, enum cmd_args args)
+{
+	int flags = SPN_PROFILE_COUNTS | SPN_PROFILE_SAMPLES;
+
+	if ((args & FLAG_PROFILE) == 0) {
+		return;
+	}
+
+	if (spn_vm_profile(ctx->vm, flags, SPN_PROFILE_INTERVAL) != 0) {
+		fprintf(stderr, "Sparkling: profiling is not supported by this build (use `make PROFILE=1')\n\n");
+	}
+}
+
+/* the JIT (if it's compiled in at all) can be turned off for debugging */
+static void configure_jit(SpnContext *ctx)
+{
+	const char *nojit = getenv("SPN_NOJIT");
+
+	if (nojit != NULL && nojit[0] != 0) {
+		spn_vm_setjit(ctx->vm, 0);
+	}
+}
+
+static int compare_funcs(const void *lhs, const void *rhs)
+{
+	const SpnFuncProfile *l = lhs, *r = rhs;
+	return l->exclusive < r->exclusive ? +1 : l->exclusive > r->exclusive ? -1 : 0;
+}
+
+static int compare_samples(const void *lhs, const void *rhs)
+{
+	const SpnStackSample *l = lhs, *r = rhs;
+	return l->count < r->count ? +1 : l->count > r->count ? -1 : 0;
+}
+
+/* the report goes to stderr so that it doesn't mix with the output of the
+ * scripts; the samples are printed in the folded stack format
+ */
+static void print_profile(SpnVMachine *vm)
+{
+	SpnFuncProfile *funcs;
+	SpnStackSample *samples;
+	unsigned long *opcounts;
+	unsigned long total = 0;
+	size_t n, i;
+
+	funcs = spn_vm_funcprofile(vm, &n);
+	if (n > 0) {
+		qsort(funcs, n, sizeof(funcs[0]), compare_funcs);
+
+		fprintf(stderr, "\nFunctions, by exclusive time:\n\n");
+		fprintf(stderr, "%12s%14s%14s\tname\n", "calls", "incl. (ms)", "excl. (ms)");
+
+		for (i = 0; i < n; i++) {
+			fprintf(
+				stderr,
+				"%12lu%14.3f%14.3f\t%s\n",
+				funcs[i].calls,
+				funcs[i].inclusive * 1000,
+				funcs[i].exclusive * 1000,
+				funcs[i].name
+			);
+		}
+	}
+
+	opcounts = spn_vm_opcounts(vm, &n);
+	for (i = 0; i < n; i++) {
+		total += opcounts[i];
+	}
+
+	if (total > 0) {
+		fprintf(stderr, "\nInstructions:\n\n");
+
+		for (i = 0; i < n; i++) {
+			if (opcounts[i] > 0) {
+				fprintf(
+					stderr,
+					"%12lu%9.2f%%\t%s\n",
+					opcounts[i],
+					100.0 * opcounts[i] / total,
+					spn_opcode_name(i)
+				);
+			}
+		}
+
+		fprintf(stderr, "%12lu\t\ttotal\n", total);
+	}
+
+	samples = spn_vm_samples(vm, &n);
+	if (n > 0) {
+		qsort(samples, n, sizeof(samples[0]), compare_samples);
+
+		fprintf(stderr, "\nSampled call stacks:\n\n");
+
+		for (i = 0; i < n; i++) {
+			fprintf(stderr, "%s %lu\n", samples[i].stack, samples[i].count);
+		}
+	}
+
+	fprintf(stderr, "\n");
+}
+
 static int run_files_or_args(int argc, char *argv[], enum cmd_args args)
 {
 	SpnContext *ctx = spn_ctx_new();
+	const char *cachedir = getenv("SPN_CACHEDIR");
 	int status = EXIT_SUCCESS;
 
 	/* find the first argument to be passed to the script */
@@ -124,8 +240,17 @@ static int run_files_or_args(int argc, char *argv[], enum cmd_args args)
 	/* register command-line arguments */
 	spn_register_args(argc - i, &argv[i]);
 
+	spn_compiler_set_optimize(ctx->cmp, (args & FLAG_OPTIMIZE) != 0);
+	if (cachedir != NULL && cachedir[0] != 0) {
+		spn_ctx_setcachedir(ctx, cachedir);
+	}
+
+	configure_jit(ctx);
+	start_profiling(ctx, args);
+
 	for (i = 1; i < argc; i++) {
 		SpnValue *val;
+		spn_uword *bc;
 
 		if (argv[i] == NULL) {
 			continue;
@@ -138,18 +263,27 @@ static int run_files_or_args(int argc, char *argv[], enum cmd_args args)
 		if (args & CMD_RUN) {
 			/* check if file is a binary object or source text */
 			if (endswith(argv[i], ".spn")) {
-				val = spn_ctx_execsrcfile(ctx, argv[i]);
+				bc = spn_ctx_loadsrcfile(ctx, argv[i]);
 			} else if (endswith(argv[i], ".spo")) {
-				val = spn_ctx_execobjfile(ctx, argv[i]);
+				bc = spn_ctx_loadobjfile(ctx, argv[i]);
+				if (bc == NULL) {
+					fprintf(stderr, "%s\n", ctx->errmsg);
+				}
 			} else {
 				fprintf(stderr, "Sparkling: generic error: unrecognized file extension\n");
 				status = EXIT_FAILURE;
 				break;
 			}
 		} else {
-			val = spn_ctx_execstring(ctx, argv[i]);
+			bc = spn_ctx_loadstring(ctx, argv[i]);
+		}
+
+		if (bc != NULL && args & FLAG_STATS) {
+			spn_disasm_stats(bc, ctx->bclist->len);
 		}
 
+		val = bc != NULL ? spn_ctx_execbytecode(ctx, bc) : NULL;
+
 		if (val != NULL) {
 			if (val->t != SPN_TYPE_NIL || args & FLAG_PRINTNIL) {
 				spn_value_print(val);
@@ -166,6 +300,10 @@ static int run_files_or_args(int argc, char *argv[], enum cmd_args args)
 		}
 	}
 
+	if (args & FLAG_PROFILE) {
+		print_profile(ctx->vm);
+	}
+
 	spn_ctx_free(ctx);
 	return status;
 }
@@ -175,6 +313,10 @@ static int enter_repl(enum cmd_args args)
 	static char buf[LINE_MAX];
 	SpnContext *ctx = spn_ctx_new();
 
+	spn_compiler_set_optimize(ctx->cmp, (args & FLAG_OPTIMIZE) != 0);
+	configure_jit(ctx);
+	start_profiling(ctx, args);
+
 	while (1) {
 		SpnValue *val;
 
@@ -194,6 +336,10 @@ static int enter_repl(enum cmd_args args)
 		/* else the call stack trace is already printed */
 	}
 
+	if (args & FLAG_PROFILE) {
+		print_profile(ctx->vm);
+	}
+
 	spn_ctx_free(ctx);
 	return EXIT_SUCCESS;
 }
@@ -9,11 +9,13 @@
  */
 
 #include <limits.h>
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "array.h"
+#include "private.h"
 
 #if UINT_MAX <= 0xffff
 #define SPN_LOW_MEMORY_PLATFORM 1
@@ -23,53 +25,45 @@
 
 
 #if SPN_LOW_MEMORY_PLATFORM
-#define HASH_NSIZES	12
+#define HASH_MAXSIZE	0x2000
 #define ARRAY_MAXSIZE	0x8000
 #else
-#define HASH_NSIZES	24
+#define HASH_MAXSIZE	0x2000000
 #define ARRAY_MAXSIZE	0x4000000
 #endif
 
+#define HASH_MINSIZE	8
+
 
 /* 
- * The usual trick for dynamically sized arrays holds for the hash table
- * part -- expand storage exponentially:
+ * The hash table part uses open addressing with linear probing and the
+ * "Robin Hood" insertion strategy: when inserting, an entry which is closer
+ * to its home slot than the one being inserted gives its place up, so the
+ * variance of probe sequence lengths stays low, lookups of missing keys can
+ * stop early, and no tombstones are needed for deletion (entries following
+ * a deleted one are shifted backwards instead).
  * 
- * 	if (size + 1 > allocation_size) {
- * 		allocation_size *= 2;
- * 	}
- *
- * However, we don't want the size to be a power of two, since that would
- * simply truncate the hash to its least significant bits, decreasing entropy
- * (the key for a particular value is taken modulo the size of the array).
- * Instead, the sizes are prime numbers close to consecutive powers of two,
- * from 2^3 to 2^25, inclusive.
+ * The key-value pairs are stored inline in the table, along with the hash of
+ * the key, so that no allocation is needed per entry, most mismatches are
+ * detected without calling `spn_value_equal()`, and rehashing upon expansion
+ * does not need to hash the keys again.
+ * 
+ * The size of the table is a power of two, so the index of the home slot is
+ * computed by masking the hash. Since that only keeps the least significant
+ * bits (and integers are their own hash), the hash of each key is scrambled
+ * by `mix_hash()` first.
  */
-static unsigned long nthsize(int idx)
-{
-	static const unsigned long szprims[HASH_NSIZES] = {
-		0,		7,		17,		29,
-		67,		131,		257,		509,
-		1031,		2053,		4099,		8209,
-#if !SPN_LOW_MEMORY_PLATFORM
-		16381,		32771,		65539,		131063,
-		262139,		524287,		1048583,	2097169,
-		4194301,	8388617,	16777213,	33554467
-#endif
-	};
-
-	return szprims[idx];
-}
 
 typedef struct KVPair {
 	SpnValue key;
 	SpnValue val;
 } KVPair;
 
-typedef struct TList {
-	KVPair pair;
-	struct TList *next;
-} TList;
+typedef struct THashSlot {
+	KVPair		 pair;
+	unsigned long	 hash;	/* mixed hash of the key		*/
+	size_t		 dist;	/* probe distance + 1, 0 if empty	*/
+} THashSlot;
 
 struct SpnArray {
 	SpnObject	  base;		/* for being a valid object		*/
@@ -79,21 +73,25 @@ struct SpnArray {
 	size_t		  arrcnt;	/* logical size				*/
 	size_t		  arrallsz;	/* allocation (actual) size		*/
 
-	TList		**buckets;	/* the hash table part			*/
+	THashSlot	 *hashtbl;	/* the hash table part			*/
 	size_t		  hashcnt;	/* logical size				*/
-	int		  hashszidx;	/* index of allocation (actual) size	*/
+	size_t		  hashallsz;	/* allocation size (power of two)	*/
+
+	SpnArray	 *gcprev;	/* list of the arrays of the thread	*/
+	SpnArray	 *gcnext;
+	size_t		  gcrefs;	/* scratch space of the collector	*/
 };
 
 struct SpnIterator {
 	SpnArray	 *arr;		/* weak reference to owning array	*/
+	SpnPool		 *pool;		/* that of the array			*/
 	size_t		  idx;		/* ordinal number of key-value pair	*/
-	size_t		  cursor;	/* the essence				*/
-	TList		 *list;		/* linked list entry for the hash part	*/
-	int		  inarray;	/* helper flag for traversing hash part	*/
+	long		  cursor;	/* see spn_array_next()			*/
 };
 
 
 static void free_array(void *obj);
+static void clear_array(SpnArray *arr);
 
 
 static const SpnClass spn_class_array = {
@@ -102,16 +100,18 @@ static const SpnClass spn_class_array = {
 	NULL,
 	NULL,
 	NULL,
-	free_array
+	free_array,
+	SPN_MEM_ARRAY,
+	1
 };
 
 static unsigned long hash_key(const SpnValue *key);
+static unsigned long mix_hash(unsigned long h);
 
 
-static TList *list_prepend(TList *head, SpnValue *key, SpnValue *val);
-static KVPair *list_find(TList *head, const SpnValue *key);
-static TList *list_delete_releasing(TList *head, const SpnValue *key);
-static void list_free_releasing(TList *head);
+static THashSlot *hash_find(SpnArray *arr, const SpnValue *key, unsigned long hash);
+static void hash_insert_new(SpnArray *arr, KVPair *pair, unsigned long hash);
+static void hash_delete_releasing(SpnArray *arr, THashSlot *slot);
 
 
 static void expand_array_if_needed(SpnArray *arr, unsigned long idx);
@@ -122,6 +122,7 @@ static void insert_and_update_count_hash(SpnArray *arr, SpnValue *key, SpnValue
 SpnArray *spn_array_new()
 {
 	SpnArray *arr = spn_object_new(&spn_class_array);
+	SpnGCList *gc = spn_pool_gclist(arr->base.pool);
 
 	arr->nilval.t = SPN_TYPE_NIL;
 	arr->nilval.f = 0;
@@ -130,9 +131,19 @@ SpnArray *spn_array_new()
 	arr->arrcnt = 0;
 	arr->arrallsz = 0;
 
-	arr->buckets = NULL;
+	arr->hashtbl = NULL;
 	arr->hashcnt = 0;
-	arr->hashszidx = 0;
+	arr->hashallsz = 0;
+
+	/* link it into the list of its pool, for the cycle collector */
+	arr->gcprev = NULL;
+	arr->gcnext = gc->arrays;
+	if (gc->arrays != NULL) {
+		gc->arrays->gcprev = arr;
+	}
+
+	gc->arrays = arr;
+	gc->live++;
 
 	return arr;
 }
@@ -140,20 +151,52 @@ SpnArray *spn_array_new()
 static void free_array(void *obj)
 {
 	SpnArray *arr = obj;
+	SpnGCList *gc = spn_pool_gclist(arr->base.pool);
+
+	clear_array(arr);
+
+	if (arr->gcprev != NULL) {
+		arr->gcprev->gcnext = arr->gcnext;
+	} else {
+		gc->arrays = arr->gcnext;
+	}
+
+	if (arr->gcnext != NULL) {
+		arr->gcnext->gcprev = arr->gcprev;
+	}
+
+	gc->live--;
+}
+
+/* releases the contents and makes the array empty */
+static void clear_array(SpnArray *arr)
+{
 	size_t i;
 
 	for (i = 0; i < arr->arrallsz; i++) {
 		spn_value_release(&arr->arr[i]);
 	}
 
-	free(arr->arr);
+	spn_mem_free(arr->base.pool, SPN_MEM_ARRAY, arr->arr, arr->arrallsz * sizeof(arr->arr[0]));
+
+	for (i = 0; i < arr->hashallsz; i++) {
+		THashSlot *slot = &arr->hashtbl[i];
 
-	for (i = 0; i < nthsize(arr->hashszidx); i++) {
-		list_free_releasing(arr->buckets[i]);
+		if (slot->dist != 0) {
+			spn_value_release(&slot->pair.key);
+			spn_value_release(&slot->pair.val);
+		}
 	}
 
-	free(arr->buckets);
-	free(arr);
+	spn_mem_free(arr->base.pool, SPN_MEM_ARRAY, arr->hashtbl, arr->hashallsz * sizeof(arr->hashtbl[0]));
+
+	arr->arr = NULL;
+	arr->arrcnt = 0;
+	arr->arrallsz = 0;
+
+	arr->hashtbl = NULL;
+	arr->hashcnt = 0;
+	arr->hashallsz = 0;
 }
 
 size_t spn_array_count(SpnArray *arr)
@@ -165,9 +208,7 @@ size_t spn_array_count(SpnArray *arr)
 
 SpnValue *spn_array_get(SpnArray *arr, const SpnValue *key)
 {
-	unsigned long hash;
-	TList *list;
-	KVPair *hit;
+	THashSlot *hit;
 	
 	/* integer key of which the value fits into the array part */
 	if (key->t == SPN_TYPE_NUMBER) {
@@ -191,19 +232,13 @@ SpnValue *spn_array_get(SpnArray *arr, const SpnValue *key)
 	/* else: the value goes to/comes from the hash table part */
 
 	/* if the hash table is empty, it cannot contain any value at all */
-	if (nthsize(arr->hashszidx) == 0) {
+	if (arr->hashcnt == 0) {
 		return &arr->nilval;
 	}
 
 	/* else return what the hash part can find */
-	hash = hash_key(key) % nthsize(arr->hashszidx);
-
-	/* return what's found in the link list at the computed index
-	 * (behaves correctly if the list is empty/NULL)
-	 */
-	list = arr->buckets[hash];
-	hit = list_find(list, key);
-	return hit != NULL ? &hit->val : &arr->nilval;
+	hit = hash_find(arr, key, mix_hash(hash_key(key)));
+	return hit != NULL ? &hit->pair.val : &arr->nilval;
 }
 
 void spn_array_set(SpnArray *arr, SpnValue *key, SpnValue *val)
@@ -236,6 +271,78 @@ void spn_array_set(SpnArray *arr, SpnValue *key, SpnValue *val)
 	insert_and_update_count_hash(arr, key, val);
 }
 
+/* returns the slot at `hint` if it holds the string object `key` */
+static THashSlot *hinted_slot(SpnArray *arr, const SpnValue *key, size_t hint)
+{
+	THashSlot *slot;
+
+	if (hint >= arr->hashallsz) {
+		return NULL;
+	}
+
+	slot = &arr->hashtbl[hint];
+
+	if (slot->dist != 0
+	 && slot->pair.key.t == SPN_TYPE_STRING
+	 && slot->pair.key.v.ptrv == key->v.ptrv) {
+		return slot;
+	}
+
+	return NULL;
+}
+
+SpnValue *spn_array_get_hinted(SpnArray *arr, const SpnValue *key, size_t *hint)
+{
+	THashSlot *slot;
+
+	if (key->t != SPN_TYPE_STRING) {
+		return spn_array_get(arr, key);
+	}
+
+	slot = hinted_slot(arr, key, *hint);
+	if (slot != NULL) {
+		return &slot->pair.val;
+	}
+
+	if (arr->hashcnt == 0) {
+		return &arr->nilval;
+	}
+
+	slot = hash_find(arr, key, mix_hash(hash_key(key)));
+	if (slot == NULL) {
+		return &arr->nilval;
+	}
+
+	*hint = slot - arr->hashtbl;
+	return &slot->pair.val;
+}
+
+void spn_array_set_hinted(SpnArray *arr, SpnValue *key, SpnValue *val, size_t *hint)
+{
+	THashSlot *slot;
+
+	/* deleting an entry shifts others, so that always takes the long way */
+	if (key->t != SPN_TYPE_STRING || val->t == SPN_TYPE_NIL) {
+		spn_array_set(arr, key, val);
+		return;
+	}
+
+	/* overwrite the value of an existing entry in place */
+	slot = hinted_slot(arr, key, *hint);
+	if (slot != NULL) {
+		spn_value_retain(val);
+		spn_value_release(&slot->pair.val);
+		slot->pair.val = *val;
+		return;
+	}
+
+	spn_array_set(arr, key, val);
+
+	slot = hash_find(arr, key, mix_hash(hash_key(key)));
+	assert(slot != NULL);
+	*hint = slot - arr->hashtbl;
+}
+
 void spn_array_remove(SpnArray *arr, SpnValue *key)
 {
 	SpnValue nilval = { { 0 }, SPN_TYPE_NIL, 0 };
@@ -246,16 +353,12 @@ void spn_array_remove(SpnArray *arr, SpnValue *key)
 
 SpnIterator *spn_iter_new(SpnArray *arr)
 {
-	SpnIterator *it = malloc(sizeof(*it));
-	if (it == NULL) {
-		abort();
-	}
+	SpnIterator *it = spn_mem_xalloc(arr->base.pool, SPN_MEM_ARRAY, sizeof(*it));
 
 	it->arr = arr;
+	it->pool = arr->base.pool;
 	it->idx = 0;
 	it->cursor = 0;
-	it->list = NULL;
-	it->inarray = 1;
 
 	return it;
 }
@@ -267,146 +370,303 @@ SpnArray *spn_iter_getarray(SpnIterator *it)
 
 void spn_iter_free(SpnIterator *it)
 {
-	free(it);
+	spn_mem_free(it->pool, SPN_MEM_ARRAY, it, sizeof(*it));
 }
 
 size_t spn_iter_next(SpnIterator *it, SpnValue *key, SpnValue *val)
 {
-	SpnArray *arr = it->arr;
-	size_t hashsz, i;
+	if (spn_array_next(it->arr, &it->cursor, key, val)) {
+		return it->idx++;
+	}
+
+	/* if not found, there are no more entries */
+	assert(it->idx == spn_array_count(it->arr)); /* sanity check */
+	return it->idx;
+}
 
-	/* search the array part first: cursor in [0...arraysize) (*) */
-	if (it->inarray) {
-		for (i = it->cursor; i < arr->arrallsz; i++) {
+/* the array part is traversed first, with the cursor being the index of
+ * the next slot. In the hash part, it is the complement of the index of the
+ * next slot (i. e. negative), so that growing the array part while
+ * iterating doesn't make the traversal jump back into the hash part.
+ */
+int spn_array_next(SpnArray *arr, long *cursor, SpnValue *key, SpnValue *val)
+{
+	long i = *cursor;
+
+	if (i >= 0) {
+		for (; (size_t)(i) < arr->arrallsz; i++) {
 			if (arr->arr[i].t != SPN_TYPE_NIL) {
-				/* set up key */
 				key->t = SPN_TYPE_NUMBER;
 				key->f = 0;
 				key->v.intv = i;
 
-				/* set up value */
 				*val = arr->arr[i];
-
-				/* advance cursor to next base index */
-				it->cursor = i + 1;
-
-				return it->idx++;
+				*cursor = i + 1;
+				return 1;
 			}
 		}
 
-		/* if not found, search hash part: cursor in [0...hashsize) */
-		it->cursor = 0; /* reset to point to the beginning */
-		it->inarray = 0; /* indicate having finished with the array part */
-	} else {
-		if (it->list != NULL) {
-			*key = it->list->pair.key;
-			*val = it->list->pair.val;
-			it->list = it->list->next;
-			return it->idx++;
-		}
-
-		/* if the node is NULL, it means we finished the traversal of
-		 * the linked list, so we fall through in order to search for
-		 * the next bucket
-		 */
+		i = ~0L;
 	}
 
-	hashsz = nthsize(arr->hashszidx);
-	for (i = it->cursor; i < hashsz; i++) {
-		if (arr->buckets[i] != NULL) {
-			it->list = arr->buckets[i];
-			it->cursor = i + 1;
-			/* sorry for having been clever here, but this is more
-			 * convenient with one level of recursion and it
-			 * avoids redundancy as well
-			 */
-			return spn_iter_next(it, key, val);
+	for (i = ~i; (size_t)(i) < arr->hashallsz; i++) {
+		THashSlot *slot = &arr->hashtbl[i];
+
+		if (slot->dist != 0) {
+			*key = slot->pair.key;
+			*val = slot->pair.val;
+			*cursor = ~(i + 1);
+			return 1;
 		}
 	}
 
-	/* if not found, there are no more entries */
-	assert(it->idx == spn_array_count(arr)); /* sanity check */
-	return it->idx;
+	*cursor = ~i;
+	return 0;
 }
 
-/* 
- * Linked lists for collision resolution with separate chaining
+/*
+ * The cycle collector
  *
  * -----
  *
- * prepend and not append, so that we can write something like
- * 
- * 	head = list_prepend(head, key_val_pair);
- * 
- * and have O(1) running time, instead of appending to the end
- * by traversing the whole list each time a collision occurs, which is O(n)
+ * Reference counting alone can't free arrays that contain themselves,
+ * directly or through other arrays. The collector finds them by trial
+ * deletion: it copies the reference count of every array to `gcrefs`, then
+ * subtracts the references held by arrays. What remains is the number of
+ * references from everywhere else (registers, symbol tables, native code,
+ * objects of other classes). Arrays with such references are alive, and so
+ * is everything they contain, transitively. The rest is only referenced
+ * by garbage.
  *
- * This function does not retain the key and the value, because
- * this very same function is used when performing the rehash upon
- * expansion, and there no change is needed in the ownership.
- * Thus, when a new non-nil value is actually inserted, then we
- * do the retaining manually in spn_array_set().
+ * Every array has to be visited, so all of them are linked into a list.
+ * That costs a little upon creating and destroying an array, but nothing
+ * upon retaining and releasing it.
  */
-static TList *list_prepend(TList *head, SpnValue *key, SpnValue *val)
+
+#define GC_REACHABLE	((size_t)(-1))
+
+typedef struct GCStack {
+	SpnArray	**arrs;
+	size_t		  n;
+	size_t		  allsz;
+} GCStack;
+
+static void gc_push(GCStack *stk, SpnArray *arr)
 {
-	TList *node = malloc(sizeof(*node));
-	if (node == NULL) {
-		abort();
+	if (stk->n >= stk->allsz) {
+		stk->allsz = stk->allsz < 16 ? 16 : stk->allsz * 2;
+		stk->arrs = realloc(stk->arrs, stk->allsz * sizeof(stk->arrs[0]));
+		if (stk->arrs == NULL) {
+			abort();
+		}
+	}
+
+	stk->arrs[stk->n++] = arr;
+}
+
+static void gc_subtract(SpnArray *child, GCStack *stk)
+{
+	(void)stk;
+
+	assert(child->gcrefs > 0);
+	child->gcrefs--;
+}
+
+static void gc_mark(SpnArray *child, GCStack *stk)
+{
+	if (child->gcrefs != GC_REACHABLE) {
+		child->gcrefs = GC_REACHABLE;
+		gc_push(stk, child);
+	}
+}
+
+/* calls `visit` with each array among the keys and values of `arr` */
+static void gc_children(SpnArray *arr, void (*visit)(SpnArray *, GCStack *), GCStack *stk)
+{
+	size_t i;
+
+	for (i = 0; i < arr->arrallsz; i++) {
+		if (arr->arr[i].t == SPN_TYPE_ARRAY) {
+			visit(arr->arr[i].v.ptrv, stk);
+		}
+	}
+
+	for (i = 0; i < arr->hashallsz; i++) {
+		THashSlot *slot = &arr->hashtbl[i];
+
+		if (slot->dist == 0) {
+			continue;
+		}
+
+		if (slot->pair.key.t == SPN_TYPE_ARRAY) {
+			visit(slot->pair.key.v.ptrv, stk);
+		}
+
+		if (slot->pair.val.t == SPN_TYPE_ARRAY) {
+			visit(slot->pair.val.v.ptrv, stk);
+		}
 	}
+}
 
-	node->pair.key = *key;
-	node->pair.val = *val;
-	node->next = head;
-	return node;
+/* the amount of memory the trigger of the collector looks at. The default
+ * pool doesn't keep statistics, so there it's only the array instances.
+ */
+static size_t gc_volume(SpnPool *pool, const SpnGCList *gc)
+{
+	return pool != NULL ? spn_pool_stats(pool)->total : gc->live * sizeof(SpnArray);
 }
 
-static KVPair *list_find(TList *head, const SpnValue *key)
+size_t spn_array_collect(SpnPool *pool)
 {
-	while (head != NULL) {
-		KVPair *pair = &head->pair;
-		SpnValue *pkey = &pair->key;
+	SpnGCList *gc = spn_pool_gclist(pool);
+	GCStack stk = { NULL, 0, 0 };
+	SpnArray *arr;
+	size_t i, n;
+
+	/* count the references from outside the arrays */
+	for (arr = gc->arrays; arr != NULL; arr = arr->gcnext) {
+		arr->gcrefs = arr->base.refcnt;
+	}
+
+	for (arr = gc->arrays; arr != NULL; arr = arr->gcnext) {
+		gc_children(arr, gc_subtract, &stk);
+	}
+
+	/* mark everything reachable from the externally referenced arrays */
+	for (arr = gc->arrays; arr != NULL; arr = arr->gcnext) {
+		if (arr->gcrefs == 0 || arr->gcrefs == GC_REACHABLE) {
+			continue;
+		}
+
+		arr->gcrefs = GC_REACHABLE;
+		gc_push(&stk, arr);
 
-		if (spn_value_equal(key, pkey)) {
-			return pair;
+		while (stk.n > 0) {
+			gc_children(stk.arrs[--stk.n], gc_mark, &stk);
 		}
+	}
 
-		head = head->next;
+	/* the rest is garbage. Each of these arrays is retained while
+	 * emptying them, so none of them is freed while another one may
+	 * still hold a reference to it.
+	 */
+	for (arr = gc->arrays; arr != NULL; arr = arr->gcnext) {
+		if (arr->gcrefs != GC_REACHABLE) {
+			spn_object_retain(arr);
+			gc_push(&stk, arr);
+		}
 	}
 
-	return NULL;
+	n = stk.n;
+
+	for (i = 0; i < n; i++) {
+		clear_array(stk.arrs[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		spn_object_release(stk.arrs[i]);
+	}
+
+	free(stk.arrs);
+
+	gc->mark = gc_volume(pool, gc);
+
+	return n;
 }
 
-static TList *list_delete_releasing(TList *head, const SpnValue *key)
+int spn_array_gcdue(SpnPool *pool, size_t threshold)
+{
+	const SpnGCList *gc = spn_pool_gclist(pool);
+	size_t volume = gc_volume(pool, gc);
+
+	return volume >= gc->mark + threshold && volume - gc->mark >= gc->mark;
+}
+
+/* 
+ * Open addressing with Robin Hood hashing
+ *
+ * -----
+ *
+ * These functions do not retain the key and the value, because
+ * `hash_insert_new()` is also used when performing the rehash upon
+ * expansion, and there no change is needed in the ownership.
+ * Thus, when a new non-nil value is actually inserted, then we
+ * do the retaining manually in insert_and_update_count_hash().
+ */
+static THashSlot *hash_find(SpnArray *arr, const SpnValue *key, unsigned long hash)
 {
-	if (head == NULL) {
+	size_t mask = arr->hashallsz - 1;
+	size_t i = hash & mask;
+	size_t dist = 1;
+
+	if (arr->hashallsz == 0) {
 		return NULL;
 	}
 
-	if (spn_value_equal(&head->pair.key, key)) {
-		TList *tmp = head->next;
+	/* an entry closer to its home slot than `dist' means that the key
+	 * would have displaced it if it was in the table
+	 */
+	while (arr->hashtbl[i].dist >= dist) {
+		THashSlot *slot = &arr->hashtbl[i];
 
-		spn_value_release(&head->pair.key);
-		spn_value_release(&head->pair.val);
+		if (slot->hash == hash && spn_value_equal(&slot->pair.key, key)) {
+			return slot;
+		}
 
-		free(head);
-		return tmp;
+		i = (i + 1) & mask;
+		dist++;
 	}
 
-	head->next = list_delete_releasing(head->next, key);
-	return head;
+	return NULL;
 }
 
-static void list_free_releasing(TList *node)
+/* the key must not already be in the table, and there must be a free slot */
+static void hash_insert_new(SpnArray *arr, KVPair *pair, unsigned long hash)
 {
-	while (node != NULL) {
-		TList *tmp = node->next;
+	size_t mask = arr->hashallsz - 1;
+	size_t i = hash & mask;
+	THashSlot cur;
+
+	cur.pair = *pair;
+	cur.hash = hash;
+	cur.dist = 1;
+
+	while (arr->hashtbl[i].dist != 0) {
+		THashSlot *slot = &arr->hashtbl[i];
+
+		/* take from the rich, give to the poor */
+		if (slot->dist < cur.dist) {
+			THashSlot tmp = *slot;
+			*slot = cur;
+			cur = tmp;
+		}
 
-		spn_value_release(&node->pair.key);
-		spn_value_release(&node->pair.val);
+		i = (i + 1) & mask;
+		cur.dist++;
+	}
 
-		free(node);
-		node = tmp;
+	arr->hashtbl[i] = cur;
+}
+
+static void hash_delete_releasing(SpnArray *arr, THashSlot *slot)
+{
+	size_t mask = arr->hashallsz - 1;
+	size_t i = slot - arr->hashtbl;
+	size_t next = (i + 1) & mask;
+
+	spn_value_release(&slot->pair.key);
+	spn_value_release(&slot->pair.val);
+
+	/* shift back the following entries which aren't in their home slot */
+	while (arr->hashtbl[next].dist > 1) {
+		arr->hashtbl[i] = arr->hashtbl[next];
+		arr->hashtbl[i].dist--;
+
+		i = next;
+		next = (next + 1) & mask;
 	}
+
+	arr->hashtbl[i].dist = 0;
 }
 
 /* Low-level array and hash table helpers */
@@ -427,11 +687,14 @@ static void expand_array_if_needed(SpnArray *arr, unsigned long idx)
 		arr->arrallsz <<= 1;
 	}
 
-	/* ask the OS to do its job */
-	arr->arr = realloc(arr->arr, sizeof(arr->arr[0]) * arr->arrallsz);
-	if (arr->arr == NULL) {
-		abort();
-	}
+	/* ask the allocator of the pool to do its job */
+	arr->arr = spn_mem_xrealloc(
+		arr->base.pool,
+		SPN_MEM_ARRAY,
+		arr->arr,
+		sizeof(arr->arr[0]) * prevsz,
+		sizeof(arr->arr[0]) * arr->arrallsz
+	);
 
 	/* and fill all the not-yet-existent fields with nil */
 	for (i = prevsz; i < arr->arrallsz; i++) {
@@ -473,102 +736,73 @@ static void insert_and_update_count_array(SpnArray *arr, unsigned long idx, SpnV
 
 static void expand_hash(SpnArray *arr)
 {
-	size_t newsz, i, oldsz = nthsize(arr->hashszidx);
-	TList **new_buckets;
+	size_t i, oldsz = arr->hashallsz;
+	THashSlot *oldtbl = arr->hashtbl;
 
-	/* we must perform a complete re-hash upon expansion,
-	 * since the hash values depend on the size of the bucket array.
+	/* the home slots depend on the size of the table, so entries must be
+	 * re-inserted upon expansion (their hashes are stored, though).
 	 * 
 	 * If the hash table reached its maximal capacity,
 	 * it cannot be expanded further.
 	 */
-	if (++arr->hashszidx >= HASH_NSIZES) {
+	arr->hashallsz = oldsz == 0 ? HASH_MINSIZE : oldsz << 1;
+
+	if (arr->hashallsz > HASH_MAXSIZE) {
 		/* error, array too large */
 		fputs("Sparkling: requested array size is too large\n", stderr);
 		abort();
 	}
 
-	/* expand the bucket vector */
-	newsz = nthsize(arr->hashszidx);
-	new_buckets = malloc(sizeof(new_buckets[0]) * newsz);
-	if (new_buckets == NULL) {
-		abort();
-	}
-
-	for (i = 0; i < newsz; i++) {
-		new_buckets[i] = NULL;
-	}
+	/* a `dist' of 0 marks every slot as empty */
+	arr->hashtbl = spn_mem_xalloc(arr->base.pool, SPN_MEM_ARRAY, arr->hashallsz * sizeof(arr->hashtbl[0]));
+	memset(arr->hashtbl, 0, arr->hashallsz * sizeof(arr->hashtbl[0]));
 
 	/* and do a complete rehash */
 	for (i = 0; i < oldsz; i++) {
-		TList *list = arr->buckets[i];
-
-		while (list != NULL) {
-			TList *tmp;
-			KVPair *pair = &list->pair;
-			unsigned long hash = hash_key(&pair->key) % newsz;
-			new_buckets[hash] = list_prepend(new_buckets[hash], &pair->key, &pair->val);
-
-			/* free old list in-place */
-			tmp = list->next;
-			free(list);
-			list = tmp;
+		THashSlot *slot = &oldtbl[i];
+
+		if (slot->dist != 0) {
+			hash_insert_new(arr, &slot->pair, slot->hash);
 		}
 	}
 
-	free(arr->buckets);
-	arr->buckets = new_buckets;
+	spn_mem_free(arr->base.pool, SPN_MEM_ARRAY, oldtbl, oldsz * sizeof(oldtbl[0]));
 }
 
 static void insert_and_update_count_hash(SpnArray *arr, SpnValue *key, SpnValue *val)
 {
-	unsigned long hash, thash;
-	KVPair *pair;
-
-	/* if the hash table is empty, then it "contains nil values only"
-	 * (i. e., for any key, the getter function will return nil).
-	 * As a consequence, if the value to be inserted is nil, then
-	 * we can just do nothing, else the hash part must be expanded
-	 * in order it to be able to hold the first (non-nil) value.
-	 */
-	if (nthsize(arr->hashszidx) == 0) {
-		if (val->t == SPN_TYPE_NIL) {
-			return;
-		}
-
-		expand_hash(arr);
-	}
-
-	thash = hash_key(key);
-	hash = thash % nthsize(arr->hashszidx);
+	unsigned long hash = mix_hash(hash_key(key));
+	THashSlot *slot = hash_find(arr, key, hash);
 
 	/* new element? */
-	pair = list_find(arr->buckets[hash], key);
-	if (pair == NULL) {
+	if (slot == NULL) {
 		/* element not yet in hash table */
 
 		/* if this is a new element, then `val` is non-nil, so we
 		 * increment the count of the hash part
-		 * check if the load factor is greater than 1/2, and if so,
-		 * double the size to minimize collisions
+		 * check if the load factor would be greater than 3/4, and
+		 * if so, double the size to keep probe sequences short
+		 * (this also allocates the table upon the first insertion)
 		 */
 		if (val->t != SPN_TYPE_NIL) {
+			KVPair pair;
+
 			/* check load factor */
-			if (arr->hashcnt > nthsize(arr->hashszidx) / 2) {
+			if (arr->hashcnt + 1 > arr->hashallsz / 4 * 3) {
 				expand_hash(arr);
-				/* the hash changes after resizing! */
-				hash = thash % nthsize(arr->hashszidx);
 			}
 			
-			/* increment hash count, retain key and value, then
-			 * insert them at the beginning of the link list
+			/* increment hash count, retain key and value,
+			 * then insert them into the table
 			 */
 			arr->hashcnt++;
 
 			spn_value_retain(key);
 			spn_value_retain(val);
 
-			arr->buckets[hash] = list_prepend(arr->buckets[hash], key, val);
+			pair.key = *key;
+			pair.val = *val;
+			hash_insert_new(arr, &pair, hash);
 		}
 
 		/* else: if the type of the new value is nil, and it wasn't
@@ -583,13 +817,13 @@ static void insert_and_update_count_hash(SpnArray *arr, SpnValue *key, SpnValue
 		 * to the new one and do nothing with the key and count.
 		 */
 		if (val->t == SPN_TYPE_NIL) {
-			arr->buckets[hash] = list_delete_releasing(arr->buckets[hash], key);
+			hash_delete_releasing(arr, slot);
 			arr->hashcnt--;
 		} else {
 			/* retain first, then release (RBR idiom) */
 			spn_value_retain(val);
-			spn_value_release(&pair->val);
-			pair->val = *val;
+			spn_value_release(&slot->pair.val);
+			slot->pair.val = *val;
 		}
 	}
 }
@@ -597,21 +831,27 @@ static void insert_and_update_count_hash(SpnArray *arr, SpnValue *key, SpnValue
 
 /* 
  * The hash function
- * Depending on the platform, either of the table lookup method or
- * the checksum-style hash with Duff's device may be faster, choose
- * whichever fits the use case better (define the `SPN_HASH_TABLE'
- * macro at compile-time to use the lookup hash, else the SDBM hash
- * will be used).
+ * By default, the data is processed one machine word at a time: each word
+ * is combined with the rotated hash and multiplied by a large odd constant
+ * (like in FxHash). The last, partial word is padded with zeroes, and the
+ * length is mixed in first, so that zeroes at the end still make a
+ * difference. The result is not well distributed in the low bits by
+ * itself; the hash table mixes it further (see `mix_hash()`).
+ * Define the `SPN_HASH_TABLE' macro at compile-time in order to use the
+ * byte-at-a-time table lookup hash instead.
  */
+#if ULONG_MAX > 0xffffffffUL
+#define HASH_MULTIPLIER 0x517cc1b727220a95UL
+#else
+#define HASH_MULTIPLIER 0x9e3779b9UL
+#endif
+
+#define HASH_ROTATE(h) ((h) << 5 | (h) >> (sizeof(h) * CHAR_BIT - 5))
+
 unsigned long spn_hash(const void *data, size_t n)
 {
 	unsigned long h = 0;
 	const unsigned char *p = data;
-	size_t i;
-
-	if (n == 0) {
-		return 0;
-	}
 
 #ifdef SPN_HASH_TABLE
 	static const unsigned long tab[256] = {
@@ -649,22 +889,28 @@ unsigned long spn_hash(const void *data, size_t n)
 		0xd52a8762, 0xa0e3b73e, 0x42470889, 0x24ea177b, 0x40f280ea, 0xf92c9ebe, 0x638ce413, 0x4d1fc937
 	};
 
+	size_t i;
+
 	for (i = 0; i < n; i++) {
 		h ^= tab[p[i] ^ h & 0xff];
 	}
 #else
-	/* this is a variant of the SDBM hash */
-	i = (n + 7) >> 3;
-	switch (n & 7) {
-	case 0: do {	h =  7159 * h + *p++;
-	case 7:		h = 13577 * h + *p++;
-	case 6:		h = 23893 * h + *p++;
-	case 5:		h = 38791 * h + *p++;
-	case 4:		h = 47819 * h + *p++;
-	case 3:		h = 56543 * h + *p++;
-	case 2:		h = 65587 * h + *p++;
-	case 1:		h = 77681 * h + *p++;
-		} while (--i);
+	unsigned long w;
+
+	/* memcpy() of a constant size compiles to a single (unaligned) load */
+	h = n * HASH_MULTIPLIER;
+
+	while (n >= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (HASH_ROTATE(h) ^ w) * HASH_MULTIPLIER;
+		p += sizeof(w);
+		n -= sizeof(w);
+	}
+
+	if (n > 0) {
+		w = 0;
+		memcpy(&w, p, n);
+		h = (HASH_ROTATE(h) ^ w) * HASH_MULTIPLIER;
 	}
 #endif
 
@@ -686,27 +932,7 @@ static unsigned long hash_key(const SpnValue *key)
 		/* the hash value of an integer is itself */
 		return key->v.intv;
 	}
-	case SPN_TYPE_FUNC:	{
-		/* to understand why hashing is done as it is done, see the
-		 * notice about function equality above `function_equal()`
-		 * in src/spn.c
-		 *
-		 * if a function is a pending stub but it has no name, then:
-		 * 1. that doesn't make sense and it should not happen;
-		 * 2. it's impossible to decide whether it's equal to some
-		 * other function.
-		 */
-		assert(key->v.fnv.name != NULL || (key->f & SPN_TFLG_PENDING) == 0);
-
-		/* see http://stackoverflow.com/q/18282032 */
-		if (key->f & SPN_TFLG_NATIVE) {
-			return spn_hash(&key->v.fnv.r.fn, sizeof(key->v.fnv.r.fn));
-		}
-
-		return key->v.fnv.name == NULL
-		     ? (unsigned long)(key->v.fnv.r.bc)
-		     : spn_hash(key->v.fnv.name, strlen(key->v.fnv.name));
-	}
+	case SPN_TYPE_FUNC:
 	case SPN_TYPE_STRING:
 	case SPN_TYPE_ARRAY:	{
 		SpnObject *obj = key->v.ptrv;
@@ -732,3 +958,17 @@ static unsigned long hash_key(const SpnValue *key)
 	return 0;
 }
 
+/* the least significant bits of a hash are used as the index of the home
+ * slot, so all the bits of the original hash shall affect them
+ */
+static unsigned long mix_hash(unsigned long h)
+{
+	h ^= h >> (sizeof(h) * CHAR_BIT / 2);
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+
+	return h;
+}
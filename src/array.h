@@ -30,6 +30,16 @@ SPN_API size_t		 spn_array_count(SpnArray *arr);
 SPN_API SpnValue	*spn_array_get(SpnArray *arr, const SpnValue *key);
 SPN_API void		 spn_array_set(SpnArray *arr, SpnValue *key, SpnValue *val);
 
+/* the same, with a position hint for string keys (field names). `*hint` may
+ * be initialized to anything; it remembers where the key was last found in
+ * the hash table. A matching hint (the same string object at that position)
+ * spares hashing and probing. Since the position of a key only depends on
+ * the keys inserted before it, the hint also fits other arrays that have
+ * been filled with the same keys in the same order.
+ */
+SPN_API SpnValue	*spn_array_get_hinted(SpnArray *arr, const SpnValue *key, size_t *hint);
+SPN_API void		 spn_array_set_hinted(SpnArray *arr, SpnValue *key, SpnValue *val, size_t *hint);
+
 /* this is just a convenience wrapper around spn_array_set():
  * it sets the value corresponding to the key to `nil`.
  */
@@ -44,6 +54,35 @@ SPN_API size_t		 spn_iter_next(SpnIterator *it, SpnValue *key, SpnValue *val);
 SPN_API SpnArray	*spn_iter_getarray(SpnIterator *it);
 SPN_API void		 spn_iter_free(SpnIterator *it);
 
+/* the primitive behind iterators and `foreach': `*cursor' is to be set to 0
+ * before the first call, then it must be passed back unmodified. Returns 1
+ * and sets `*key' and `*val' (without retaining them) to the next key-value
+ * pair, or returns 0 if there are no more pairs. Doesn't allocate memory.
+ * If the array is modified during the traversal, pairs may be skipped or
+ * visited twice, but the cursor stays valid.
+ */
+SPN_API int		 spn_array_next(SpnArray *arr, long *cursor, SpnValue *key, SpnValue *val);
+
+/* the cycle collector. Reference counting can't free arrays that contain
+ * themselves, directly or through other arrays. Each pool (see object.h)
+ * keeps a list of the arrays allocated from it; spn_array_collect() frees
+ * those of `pool` which are only referenced by such cycles, and returns
+ * their number. References from anything other than an array (e. g. a
+ * native function holding a retained array, or an object-based user data
+ * structure) keep an array and its contents alive. Like everything else
+ * of a pool, its arrays must only be used by one thread at a time. (The
+ * default pool, NULL, has a list per thread, so its arrays must be freed
+ * by the thread which created them.)
+ *
+ * spn_array_gcdue() returns nonzero if the memory in use in `pool` (its
+ * `total`, see spn_pool_stats(); in the default pool, which keeps no
+ * statistics, only that of the array instances) has grown by at least
+ * `threshold` bytes, and at least as much as the last collection left in
+ * use, since then, i. e. when collecting again is worth its cost.
+ */
+SPN_API size_t		 spn_array_collect(SpnPool *pool);
+SPN_API int		 spn_array_gcdue(SpnPool *pool, size_t threshold);
+
 /* the generic hash function. it is used by SpnArray to hash all sorts of data. */
 SPN_API unsigned long	 spn_hash(const void *data, size_t n);
 
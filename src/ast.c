@@ -8,20 +8,111 @@
  * AST: a right-leaning abstract syntax tree
  */
 
+#include <stddef.h>
 #include <stdlib.h>
 #include "ast.h"
 #include "private.h"
 
 
+/* requests larger than a quarter of a chunk get their own chunk, so that
+ * not too much space is wasted at the end of the current one
+ */
+#define ARENA_CHUNKSIZE	0x4000
+#define ARENA_ALIGN	sizeof(union ArenaAlign)
+
+typedef union ArenaAlign {
+	long		 l;
+	double		 d;
+	void		*p;
+} ArenaAlign;
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t		 size;		/* of the data, for freeing it	*/
+	ArenaAlign	 data[1];	/* the rest of the chunk follows	*/
+} ArenaChunk;
+
+struct SpnArena {
+	ArenaChunk	*chunks;
+	char		*bump;		/* unused space in the current chunk	*/
+	char		*end;
+	SpnPool		*pool;		/* current when the arena was created	*/
+};
+
 static void dump_ast(SpnAST *ast, int indent);
 
-SpnAST *spn_ast_new(enum spn_ast_node node, unsigned long lineno)
+SpnArena *spn_arena_new()
 {
-	SpnAST *ast = malloc(sizeof(*ast));
-	if (ast == NULL) {
-		abort();
+	SpnPool *pool = spn_pool_get_current();
+	SpnArena *arena = spn_mem_xalloc(pool, SPN_MEM_OTHER, sizeof(*arena));
+
+	arena->pool = pool;
+	arena->chunks = NULL;
+	arena->bump = NULL;
+	arena->end = NULL;
+
+	return arena;
+}
+
+static ArenaChunk *new_chunk(SpnArena *arena, size_t size)
+{
+	ArenaChunk *chunk = spn_mem_xalloc(arena->pool, SPN_MEM_OTHER, offsetof(ArenaChunk, data) + size);
+
+	chunk->size = size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	return chunk;
+}
+
+void *spn_arena_alloc(SpnArena *arena, size_t size)
+{
+	ArenaChunk *chunk;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+	if (arena->end - arena->bump >= (ptrdiff_t)(size)) {
+		ptr = arena->bump;
+		arena->bump += size;
+		return ptr;
 	}
 
+	if (size > ARENA_CHUNKSIZE / 4) {
+		/* behind the current chunk, which thus remains current */
+		chunk = new_chunk(arena, size);
+
+		if (chunk->next != NULL) {
+			arena->chunks = chunk->next;
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+
+		return chunk->data;
+	}
+
+	chunk = new_chunk(arena, ARENA_CHUNKSIZE);
+	arena->bump = (char *)(chunk->data) + size;
+	arena->end = (char *)(chunk->data) + ARENA_CHUNKSIZE;
+
+	return chunk->data;
+}
+
+void spn_arena_free(SpnArena *arena)
+{
+	ArenaChunk *chunk = arena->chunks;
+
+	while (chunk != NULL) {
+		ArenaChunk *next = chunk->next;
+		spn_mem_free(arena->pool, SPN_MEM_OTHER, chunk, offsetof(ArenaChunk, data) + chunk->size);
+		chunk = next;
+	}
+
+	spn_mem_free(arena->pool, SPN_MEM_OTHER, arena, sizeof(*arena));
+}
+
+static void init_node(SpnAST *ast, enum spn_ast_node node, unsigned long lineno)
+{
 	ast->node	= node;
 	ast->value.t	= SPN_TYPE_NIL;
 	ast->value.f	= 0;
@@ -29,6 +120,27 @@ SpnAST *spn_ast_new(enum spn_ast_node node, unsigned long lineno)
 	ast->lineno	= lineno;
 	ast->left	= NULL;
 	ast->right	= NULL;
+	ast->arena	= NULL;
+	ast->ownsarena	= 0;
+}
+
+SpnAST *spn_ast_new(enum spn_ast_node node, unsigned long lineno)
+{
+	SpnAST *ast = malloc(sizeof(*ast));
+	if (ast == NULL) {
+		abort();
+	}
+
+	init_node(ast, node, lineno);
+	return ast;
+}
+
+SpnAST *spn_ast_new_arena(SpnArena *arena, enum spn_ast_node node, unsigned long lineno)
+{
+	SpnAST *ast = spn_arena_alloc(arena, sizeof(*ast));
+
+	init_node(ast, node, lineno);
+	ast->arena = arena;
 
 	return ast;
 }
@@ -48,7 +160,11 @@ void spn_ast_free(SpnAST *ast)
 	spn_ast_free(ast->left);
 	spn_ast_free(ast->right);
 
-	free(ast);
+	if (ast->arena == NULL) {
+		free(ast);
+	} else if (ast->ownsarena) {
+		spn_arena_free(ast->arena);
+	}
 }
 
 static void dump_indent(int i)
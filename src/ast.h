@@ -161,6 +161,19 @@ enum spn_ast_node {
 				 */
 };
 
+/* An arena hands out memory by bumping a pointer in large chunks (which
+ * come from the pool that is current when it's created), and it releases
+ * all of it at once. The parser allocates the nodes of a tree, as
+ * well as the characters of its identifiers and string literals, from an
+ * arena which is owned by the root, so that building and freeing a tree
+ * doesn't call malloc() and free() for every node.
+ */
+typedef struct SpnArena SpnArena;
+
+SPN_API SpnArena	*spn_arena_new();
+SPN_API void		*spn_arena_alloc(SpnArena *arena, size_t size);
+SPN_API void		 spn_arena_free(SpnArena *arena);
+
 /* the Abstract Syntax Tree */
 typedef struct SpnAST {
 	enum spn_ast_node node;		/* public: the node type (see the enum)	*/
@@ -169,10 +182,22 @@ typedef struct SpnAST {
 	unsigned long	  lineno;	/* public: the line where the node is	*/
 	struct SpnAST	 *left;		/* public: left child or NULL		*/
 	struct SpnAST	 *right;	/* public: right child or NULL		*/
+	SpnArena	 *arena;	/* private: where the node lives	*/
+	int		  ownsarena;	/* private: nonzero for the root	*/
 } SpnAST;
 
-/* lineno is the line number where the parser is currently */
+/* lineno is the line number where the parser is currently.
+ * spn_ast_new() allocates the node using malloc(), spn_ast_new_arena() takes
+ * it from `arena`.
+ */
 SPN_API SpnAST	*spn_ast_new(enum spn_ast_node node, unsigned long lineno);
+SPN_API SpnAST	*spn_ast_new_arena(SpnArena *arena, enum spn_ast_node node, unsigned long lineno);
+
+/* releases the values and names in the subtree, and frees the nodes
+ * that were allocated with malloc(). The memory of the nodes in an arena
+ * is only freed along with the root which owns the arena, so the strings
+ * in a parsed tree must not be used after the root has been freed.
+ */
 SPN_API void	 spn_ast_free(SpnAST *ast);
 
 /* dumps a textual representation of the AST to stdout */
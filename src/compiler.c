@@ -11,10 +11,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "compiler.h"
 #include "vm.h"
 #include "array.h"
+#include "func.h"
 #include "private.h"
 
 
@@ -22,6 +24,7 @@ typedef struct TBytecode {
 	spn_uword	*insns;
 	size_t		 len;
 	size_t		 allocsz;
+	SpnPool		*pool;		/* where `insns` is allocated	*/
 } TBytecode;
 
 /* bidirectional hash table: maps indices to values and values to indices */
@@ -42,6 +45,8 @@ struct SpnCompiler {
 	int		 nregs;		/* (II)		*/
 	RoundTripStore	*symtab;	/* (III)	*/
 	RoundTripStore	*varstack;	/* (IV)		*/
+	int		 optimize;	/* (V)		*/
+	spn_uword	 nfldcaches;	/* (VI)		*/
 };
 
 /* Remarks:
@@ -59,6 +64,13 @@ struct SpnCompiler {
  * 
  * (III) - (IV): array of local symbols and stack of global and local variable
  * names and the corresponding register indices
+ * 
+ * (V): nonzero if the optimization passes (constant folding, dead code
+ * elimination and the peephole pass over the bytecode) should be run.
+ * Off by default.
+ * 
+ * (VI): number of the inline caches of field accesses (FLDGET and FLDSET)
+ * used so far by the program being compiled
  */
 
 /* information describing the state of the global scope or a function scope.
@@ -105,6 +117,18 @@ static int compile_return(SpnCompiler *cmp, SpnAST *ast);
 
 /* compile and load string literal */
 static void compile_string_literal(SpnCompiler *cmp, SpnValue *str, int *dst);
+static int string_symidx(SpnCompiler *cmp, SpnValue *str);
+
+/* field access, i. e. subscripting with a string literal */
+static SpnString *field_name(SpnAST *ast);
+static void emit_field_access(
+	SpnCompiler *cmp,
+	enum spn_vm_ins opcode,
+	int a,
+	int b,
+	SpnString *name,
+	spn_uword cache
+);
 
 /* `dst` is a pointer to `int` that will be filled with the index of the
  * destination register (i. e. the one holding the result of the expression)
@@ -113,6 +137,13 @@ static void compile_string_literal(SpnCompiler *cmp, SpnValue *str, int *dst);
  */
 static int compile_expr_toplevel(SpnCompiler *cmp, SpnAST *ast, int *dst);
 
+/* compiles the condition of a loop or an `if' statement, followed by a
+ * conditional jump which is taken if the condition evaluates to `expect`
+ * (nonzero for true, zero for false). The offset of the jump is a stub;
+ * its index in the bytecode is returned in `*off_offset`.
+ */
+static int compile_cond_jump(SpnCompiler *cmp, SpnAST *cond, int expect, spn_sword *off_offset);
+
 /* dst is the preferred destination register index. Pass a pointer to
  * a non-negative `int` to force the function to emit an instruction
  * of which the destination register is `*dst`. If the integer pointed
@@ -121,6 +152,9 @@ static int compile_expr_toplevel(SpnCompiler *cmp, SpnAST *ast, int *dst);
  */
 static int compile_expr(SpnCompiler *cmp, SpnAST *ast, int *dst);
 
+/* compiles a function call, using `opcode' (CALL or TAILCALL) */
+static int emit_call(SpnCompiler *cmp, SpnAST *ast, int *dst, enum spn_vm_ins opcode);
+
 /* takes a printf format string */
 static void compiler_error(SpnCompiler *cmp, unsigned long lineno, const char *fmt, ...);
 
@@ -167,14 +201,26 @@ static int rts_count(RoundTripStore *rts);
 static void rts_delete_top(RoundTripStore *rts, int newsize);
 static void rts_free(RoundTripStore *rts);
 
+/* optimization passes (see the end of this file). `fold_ast()` simplifies
+ * the AST in place, `allocate_registers()` and then `optimize_bytecode()`
+ * are run on the bytecode of the entire program, right before the symbol
+ * table is written.
+ */
+static SpnAST *fold_ast(SpnAST *ast);
+static void optimize_bytecode(SpnCompiler *cmp);
+static int allocate_registers(spn_uword *bc, size_t begin, size_t end, int argc, int nregs);
+
 SpnCompiler *spn_compiler_new()
 {
-	SpnCompiler *cmp = malloc(sizeof(*cmp));
-	if (cmp == NULL) {
-		abort();
-	}
+	SpnPool *pool = spn_pool_get_current();
+	SpnCompiler *cmp = spn_mem_xalloc(pool, SPN_MEM_OTHER, sizeof(*cmp));
 
+	/* the bytecode is handed out, so it must come from the same pool
+	 * every time, regardless of the pool which is current then
+	 */
+	cmp->bc.pool = pool;
 	cmp->errmsg = NULL;
+	cmp->optimize = 0;
 
 	return cmp;
 }
@@ -182,24 +228,46 @@ SpnCompiler *spn_compiler_new()
 void spn_compiler_free(SpnCompiler *cmp)
 {
 	free(cmp->errmsg);
-	free(cmp);
+	spn_mem_free(cmp->bc.pool, SPN_MEM_OTHER, cmp, sizeof(*cmp));
+}
+
+void spn_compiler_set_optimize(SpnCompiler *cmp, int enable)
+{
+	cmp->optimize = enable;
+}
+
+int spn_compiler_get_optimize(SpnCompiler *cmp)
+{
+	return cmp->optimize;
 }
 
 spn_uword *spn_compiler_compile(SpnCompiler *cmp, SpnAST *ast, size_t *sz)
 {
 	bytecode_init(&cmp->bc);
 
+	/* the program node itself is never replaced, only its children */
+	if (cmp->optimize) {
+		fold_ast(ast);
+	}
+
 	/* compile program */
 	if (compile_program(cmp, ast)) { /* success */
 		if (sz != NULL) {
 			*sz = cmp->bc.len;
 		}
 
-		return cmp->bc.insns;
+		/* the caller only knows the length, so it has to be the size */
+		return spn_mem_xrealloc(
+			cmp->bc.pool,
+			SPN_MEM_BYTECODE,
+			cmp->bc.insns,
+			cmp->bc.allocsz * sizeof(cmp->bc.insns[0]),
+			cmp->bc.len * sizeof(cmp->bc.insns[0])
+		);
 	}
 
 	/* error */
-	free(cmp->bc.insns);
+	spn_mem_free(cmp->bc.pool, SPN_MEM_BYTECODE, cmp->bc.insns, cmp->bc.allocsz * sizeof(cmp->bc.insns[0]));
 	return NULL;
 }
 
@@ -219,6 +287,8 @@ static void bytecode_init(TBytecode *bc)
 static void bytecode_append(TBytecode *bc, spn_uword *words, size_t n)
 {
 	if (bc->allocsz < bc->len + n) {
+		size_t oldsz = bc->allocsz;
+
 		if (bc->allocsz == 0) {
 			bc->allocsz = 0x40;
 		}
@@ -227,10 +297,13 @@ static void bytecode_append(TBytecode *bc, spn_uword *words, size_t n)
 			bc->allocsz <<= 1;
 		}
 
-		bc->insns = realloc(bc->insns, bc->allocsz * sizeof(bc->insns[0]));
-		if (bc->insns == NULL) {
-			abort();
-		}
+		bc->insns = spn_mem_xrealloc(
+			bc->pool,
+			SPN_MEM_BYTECODE,
+			bc->insns,
+			oldsz * sizeof(bc->insns[0]),
+			bc->allocsz * sizeof(bc->insns[0])
+		);
 	}
 
 	memcpy(bc->insns + bc->len, words, n * sizeof(bc->insns[0]));
@@ -448,14 +521,15 @@ static int write_symtab(SpnCompiler *cmp)
 		case SPN_TYPE_FUNC: {
 			/* unresolved function stub */
 
-			size_t namelen = strlen(sym->v.fnv.name);
+			SpnFunction *stub = sym->v.ptrv;
+			size_t namelen = strlen(stub->name);
 
 			/* append symbol type */
 			spn_uword ins = SPN_MKINS_LONG(SPN_LOCSYM_FUNCSTUB, namelen);
 			bytecode_append(&cmp->bc, &ins, 1);
 
 			/* append function name */
-			append_cstring(&cmp->bc, sym->v.fnv.name, namelen);
+			append_cstring(&cmp->bc, stub->name, namelen);
 			break;
 		}
 		case SPN_TYPE_NUMBER: {
@@ -463,7 +537,7 @@ static int write_symtab(SpnCompiler *cmp)
 			 * as a number... But a lambda function is represented
 			 * only by the offset of its header (counting from the
 			 * beginning of the whole bytecode). However, the
-			 * `SpnValue.fnv.r` union does not have a member which
+			 * `SpnFunction.r` union does not have a member which
 			 * could store that integer. That is intentional: at
 			 * runtime, the VM is only concerned about pointers -
 			 * I could add the aforementioned field, but I thought
@@ -522,6 +596,9 @@ static int compile_program(SpnCompiler *cmp, SpnAST *ast)
 	/* set up the maximal number of registers needed at global scope */
 	cmp->nregs = 0;
 
+	/* inline caches are numbered per program */
+	cmp->nfldcaches = 0;
+
 	/* compile children */
 	if (compile(cmp, ast->left) == 0 || compile(cmp, ast->right) == 0) {
 		/* on error, clean up and return error */
@@ -542,6 +619,15 @@ static int compile_program(SpnCompiler *cmp, SpnAST *ast)
 	 */
 	regcnt = max(cmp->nregs, cmp->varstack->maxsize);
 
+	/* the bytecode passes need to see all the code at once (jumps and
+	 * function bodies may have to be relocated), but they must be run
+	 * before the header and the symbol table are filled in.
+	 */
+	if (cmp->optimize) {
+		regcnt = allocate_registers(cmp->bc.insns, SPN_PRGHDR_LEN, cmp->bc.len, 0, regcnt);
+		optimize_bytecode(cmp);
+	}
+
 	assert(regcnt >= 0);
 	assert(rts_count(cmp->symtab) >= 0);
 
@@ -689,22 +775,24 @@ static int compile_funcdef(SpnCompiler *cmp, SpnAST *ast, int *symidx)
 	return 1;
 }
 
+/* loops are compiled with the condition at the bottom, so that each
+ * iteration only executes one (conditional) jump:
+ *
+ *	jmp cond
+ * body:
+ *	...
+ * cond:
+ *	<evaluate condition>
+ *	jump to body if condition is true
+ */
 static int compile_while(SpnCompiler *cmp, SpnAST *ast)
 {
-	int cndidx = -1;
 	spn_uword ins[2] = { 0 }; /* stub */
-	spn_sword off_cond, off_cndjmp, off_body, off_jmpback, off_end;
-
-	off_cond = cmp->bc.len;
-
-	/* compile condition */
-	if (compile_expr_toplevel(cmp, ast->left, &cndidx) == 0) {
-		return 0;
-	}
+	spn_sword off_jmp, off_body, off_cond, off_cndjmp, off_end;
 
-	off_cndjmp = cmp->bc.len;
+	off_jmp = cmp->bc.len;
 
-	/* append jump over the loop body if condition is false (stub) */
+	/* append jump to the condition (stub) */
 	bytecode_append(&cmp->bc, ins, COUNT(ins));
 
 	off_body = cmp->bc.len;
@@ -714,18 +802,19 @@ static int compile_while(SpnCompiler *cmp, SpnAST *ast)
 		return 0;
 	}
 
-	off_jmpback = cmp->bc.len;
+	off_cond = cmp->bc.len;
 
-	/* compile jump back to the condition */
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
+	/* compile condition and jump back to the body if it's true */
+	if (compile_cond_jump(cmp, ast->left, 1, &off_cndjmp) == 0) {
+		return 0;
+	}
 
 	off_end = cmp->bc.len;
 
-	cmp->bc.insns[off_cndjmp + 0] = SPN_MKINS_A(SPN_INS_JZE, cndidx);
-	cmp->bc.insns[off_cndjmp + 1] = off_end - off_body;
+	cmp->bc.insns[off_jmp + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
+	cmp->bc.insns[off_jmp + 1] = off_cond - off_body;
 
-	cmp->bc.insns[off_jmpback + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
-	cmp->bc.insns[off_jmpback + 1] = off_cond - off_end;
+	cmp->bc.insns[off_cndjmp] = off_body - off_end;
 
 	return 1;
 }
@@ -733,35 +822,26 @@ static int compile_while(SpnCompiler *cmp, SpnAST *ast)
 static int compile_do(SpnCompiler *cmp, SpnAST *ast)
 {
 	spn_sword off_body = cmp->bc.len;
-	spn_sword off_jmp, diff;
-	spn_uword ins[2];
-	int reg = -1;
+	spn_sword off_cndjmp;
 
 	/* compile body */
 	if (compile(cmp, ast->right) == 0) {
 		return 0;
 	}
 
-	/* compile condition */
-	if (compile_expr_toplevel(cmp, ast->left, &reg) == 0) {
+	/* compile condition, jump back to body if condition is true */
+	if (compile_cond_jump(cmp, ast->left, 1, &off_cndjmp) == 0) {
 		return 0;
 	}
 
-	off_jmp = cmp->bc.len + COUNT(ins);
-	diff = off_body - off_jmp;
-
-	/* jump back to body if condition is true */
-	ins[0] = SPN_MKINS_A(SPN_INS_JNZ, reg);
-	ins[1] = diff;
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
+	cmp->bc.insns[off_cndjmp] = off_body - (spn_sword)(cmp->bc.len);
 
 	return 1;
 }
 
 static int compile_for(SpnCompiler *cmp, SpnAST *ast)
 {
-	int regidx = -1;
-	spn_sword off_cond, off_body_begin, off_body_end, off_cond_jmp, off_uncd_jmp;
+	spn_sword off_uncd_jmp, off_body, off_cond, off_cond_jmp, off_end;
 	spn_uword jmpins[2] = { 0 }; /* dummy */
 	SpnAST *header, *init, *cond, *icmt;
 
@@ -778,18 +858,14 @@ static int compile_for(SpnCompiler *cmp, SpnAST *ast)
 		return 0;
 	}
 
-	/* compile condition */
-	off_cond = cmp->bc.len;
-	if (compile_expr_toplevel(cmp, cond, &regidx) == 0) {
-		return 0;
-	}
-
-	/* compile "skip body if condition is false" jump */
-	off_cond_jmp = cmp->bc.len;
+	/* compile unconditional jump to the condition
+	 * (see the remark above compile_while())
+	 */
+	off_uncd_jmp = cmp->bc.len;
 	bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
 
 	/* compile body and incrementing expression */
-	off_body_begin = cmp->bc.len;
+	off_body = cmp->bc.len;
 	if (compile(cmp, ast->right) == 0) {
 		return 0;
 	}
@@ -798,30 +874,137 @@ static int compile_for(SpnCompiler *cmp, SpnAST *ast)
 		return 0;
 	}
 
-	/* compile unconditional jump back to the condition */
-	off_uncd_jmp = cmp->bc.len;
-	bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
+	/* compile condition and "repeat body if condition is true" jump */
+	off_cond = cmp->bc.len;
+	if (compile_cond_jump(cmp, cond, 1, &off_cond_jmp) == 0) {
+		return 0;
+	}
 
-	off_body_end = cmp->bc.len;
+	off_end = cmp->bc.len;
 
 	/* fill in stub jump instructions
-	 * 1. jump over body if condition not met
+	 * 1. jump to the condition before the first iteration
 	 */
-	cmp->bc.insns[off_cond_jmp + 0] = SPN_MKINS_A(SPN_INS_JZE, regidx);
-	cmp->bc.insns[off_cond_jmp + 1] = off_body_end - off_body_begin;
-
-	/* 2. always jump back to beginning and check condition */
 	cmp->bc.insns[off_uncd_jmp + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
-	cmp->bc.insns[off_uncd_jmp + 1] = off_cond - off_body_end;
+	cmp->bc.insns[off_uncd_jmp + 1] = off_cond - off_body;
+
+	/* 2. jump back to the beginning of the body if condition is met */
+	cmp->bc.insns[off_cond_jmp] = off_body - off_end;
 
 	return 1;
 }
 
-/* Why do I have the feeling this will only be implemented in alpha 2 only? */
+/* foreach loops are laid out just like while loops (see the remark above
+ * `compile_while()'): the array and the iteration cursor are kept in two
+ * unnamed variables, and the `next' instruction at the bottom of the loop
+ * both fetches the next key-value pair and jumps back to the body:
+ *
+ *	<array expression>
+ *	ld	cursor, 0
+ *	jmp	step
+ * body:
+ *	...
+ * step:
+ *	next	array, key, value, cursor, body
+ *
+ * The key and value variables are declared in the scope of the loop unless
+ * there already are variables with those names in scope.
+ */
+static int hidden_var(SpnCompiler *cmp)
+{
+	SpnValue name;
+	name.t = SPN_TYPE_NUMBER;
+	name.f = 0;
+	name.v.intv = rts_count(cmp->varstack);
+
+	return rts_add(cmp->varstack, &name);
+}
+
+static int loop_var(SpnCompiler *cmp, SpnAST *ident)
+{
+	int idx;
+
+	SpnValue name;
+	name.t = SPN_TYPE_STRING;
+	name.f = SPN_TFLG_OBJECT;
+	name.v.ptrv = ident->name;
+
+	idx = rts_getidx(cmp->varstack, &name);
+	if (idx < 0) {
+		/* a new variable must not be read before the first iteration */
+		spn_uword ins;
+
+		idx = rts_add(cmp->varstack, &name);
+		ins = SPN_MKINS_AB(SPN_INS_LDCONST, idx, SPN_CONST_NIL);
+		bytecode_append(&cmp->bc, &ins, 1);
+	}
+
+	return idx;
+}
+
 static int compile_foreach(SpnCompiler *cmp, SpnAST *ast)
 {
-	compiler_error(cmp, ast->lineno, "compiling `foreach' is currently unimplemented");
-	return 0;
+	spn_uword ldins[1 + ROUNDUP(sizeof(long), sizeof(spn_uword))] = { 0 };
+	spn_uword ins[3] = { 0 };
+	spn_sword off_jmp, off_body, off_next;
+	long zero = 0;
+	int arr, cursor, key, val, success;
+
+	int old_stack_size = rts_count(cmp->varstack);
+
+	SpnAST *header = ast->left;
+	SpnAST *keyname = header->left;
+	SpnAST *valname = header->right->left;
+	SpnAST *arrexpr = header->right->right->left;
+
+	if (strcmp(keyname->name->cstr, valname->name->cstr) == 0) {
+		compiler_error(
+			cmp,
+			ast->lineno,
+			"key and value of foreach loop must be distinct variables (`%s')",
+			keyname->name->cstr
+		);
+		return 0;
+	}
+
+	/* evaluate the array, then set the cursor to the first pair */
+	arr = hidden_var(cmp);
+	cursor = hidden_var(cmp);
+
+	if (compile_expr_toplevel(cmp, arrexpr, &arr) == 0) {
+		rts_delete_top(cmp->varstack, old_stack_size);
+		return 0;
+	}
+
+	ldins[0] = SPN_MKINS_AB(SPN_INS_LDCONST, cursor, SPN_CONST_INT);
+	memcpy(&ldins[1], &zero, sizeof(zero));
+	bytecode_append(&cmp->bc, ldins, COUNT(ldins));
+
+	key = loop_var(cmp, keyname);
+	val = loop_var(cmp, valname);
+
+	/* append jump to the `next' instruction (stub) */
+	off_jmp = cmp->bc.len;
+	bytecode_append(&cmp->bc, ins, 2);
+
+	off_body = cmp->bc.len;
+	success = compile(cmp, ast->right);
+
+	if (success) {
+		off_next = cmp->bc.len;
+
+		ins[0] = SPN_MKINS_ABC(SPN_INS_NEXT, arr, key, val);
+		ins[1] = off_body - (off_next + 2);
+		ins[2] = cursor;
+		bytecode_append(&cmp->bc, ins, COUNT(ins));
+
+		cmp->bc.insns[off_jmp + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
+		cmp->bc.insns[off_jmp + 1] = off_next - off_body;
+	}
+
+	rts_delete_top(cmp->varstack, old_stack_size);
+
+	return success;
 }
 
 static int compile_if(SpnCompiler *cmp, SpnAST *ast)
@@ -829,7 +1012,6 @@ static int compile_if(SpnCompiler *cmp, SpnAST *ast)
 	spn_sword off_then, off_else, off_jze_b4_then, off_jmp_b4_else;
 	spn_sword len_then, len_else;
 	spn_uword ins[2] = { 0 };
-	int condidx = -1;
 
 	SpnAST *cond = ast->left;
 	SpnAST *branches = ast->right;
@@ -839,16 +1021,11 @@ static int compile_if(SpnCompiler *cmp, SpnAST *ast)
 	/* sanity check */
 	assert(branches->node == SPN_NODE_BRANCHES);
 
-	/* compile condition */
-	if (compile_expr_toplevel(cmp, cond, &condidx) == 0) {
+	/* compile condition and stub "jump if false" instruction */
+	if (compile_cond_jump(cmp, cond, 0, &off_jze_b4_then) == 0) {
 		return 0;
 	}
 
-	off_jze_b4_then = cmp->bc.len;
-
-	/* append stub "jump if zero" instruction */
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_then = cmp->bc.len;
 
 	/* compile "then" branch */
@@ -856,6 +1033,12 @@ static int compile_if(SpnCompiler *cmp, SpnAST *ast)
 		return 0;
 	}
 
+	/* if there's no "else" branch, there's nothing to jump over */
+	if (br_else == NULL) {
+		cmp->bc.insns[off_jze_b4_then] = cmp->bc.len - off_then;
+		return 1;
+	}
+
 	off_jmp_b4_else = cmp->bc.len;
 
 	/* append stub unconditional jump */
@@ -872,8 +1055,7 @@ static int compile_if(SpnCompiler *cmp, SpnAST *ast)
 	len_then = off_else - off_then;
 	len_else = cmp->bc.len - off_else;
 
-	cmp->bc.insns[off_jze_b4_then + 0] = SPN_MKINS_A(SPN_INS_JZE, condidx);
-	cmp->bc.insns[off_jze_b4_then + 1] = len_then;
+	cmp->bc.insns[off_jze_b4_then] = len_then;
 
 	cmp->bc.insns[off_jmp_b4_else + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
 	cmp->bc.insns[off_jmp_b4_else + 1] = len_else;
@@ -940,7 +1122,22 @@ static int compile_vardecl(SpnCompiler *cmp, SpnAST *ast)
 static int compile_return(SpnCompiler *cmp, SpnAST *ast)
 {
 	/* compile expression (left child) if any; else return nil */
-	if (ast->left != NULL) {
+	if (ast->left != NULL && ast->left->node == SPN_NODE_FUNCCALL) {
+		/* a tail call. The `ret' is still needed: it returns the
+		 * result of a native function (see Remark (XII) in vm.h)
+		 */
+		spn_uword ins;
+		int dst = -1;
+
+		cmp->tmpidx = rts_count(cmp->varstack);
+
+		if (emit_call(cmp, ast->left, &dst, SPN_INS_TAILCALL) == 0) {
+			return 0;
+		}
+
+		ins = SPN_MKINS_A(SPN_INS_RET, dst);
+		bytecode_append(&cmp->bc, &ins, 1);
+	} else if (ast->left != NULL) {
 		spn_uword ins;
 
 		int dst = -1;
@@ -972,6 +1169,20 @@ static int compile_expr_toplevel(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	 */
 	cmp->tmpidx = rts_count(cmp->varstack);
 
+	/* if the value of a postfix increment or decrement is not used (as in
+	 * the incrementing expression of a `for` loop), then compile it as the
+	 * corresponding prefix operator, so that the old value isn't copied
+	 */
+	if (dst == NULL
+	 && (ast->node == SPN_NODE_POSTINCRMT || ast->node == SPN_NODE_POSTDECRMT)) {
+		SpnAST prefix = *ast;
+		prefix.node = ast->node == SPN_NODE_POSTINCRMT
+			    ? SPN_NODE_PREINCRMT
+			    : SPN_NODE_PREDECRMT;
+
+		return compile_expr(cmp, &prefix, &reg);
+	}
+
 	/* actually compile expression */
 	if (compile_expr(cmp, ast, &reg)) {
 		if (dst != NULL) {
@@ -984,29 +1195,154 @@ static int compile_expr_toplevel(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	return 0;
 }
 
-/* helper function for loading a string literal */
-static void compile_string_literal(SpnCompiler *cmp, SpnValue *str, int *dst)
+static int compile_cond_jump(SpnCompiler *cmp, SpnAST *cond, int expect, spn_sword *off_offset)
 {
-	spn_uword ins;
-	int idx;
+	spn_uword ins[2] = { 0 };
+	enum spn_vm_ins opcode;
 
-	assert(str->t == SPN_TYPE_STRING);
+	/* if the condition is a comparison, then compare-and-branch */
+	switch (cond->node) {
+	case SPN_NODE_EQUAL:	opcode = SPN_INS_JEQ; break;
+	case SPN_NODE_NOTEQ:	opcode = SPN_INS_JNE; break;
+	case SPN_NODE_LESS:	opcode = SPN_INS_JLT; break;
+	case SPN_NODE_LEQ:	opcode = SPN_INS_JLE; break;
+	case SPN_NODE_GREATER:	opcode = SPN_INS_JGT; break;
+	case SPN_NODE_GEQ:	opcode = SPN_INS_JGE; break;
+	default:		opcode = SPN_INS_JZE; break;
+	}
 
-	if (*dst < 0) {
-		*dst = tmp_push(cmp);
+	if (opcode == SPN_INS_JZE) {
+		int reg = -1;
+
+		if (compile_expr_toplevel(cmp, cond, &reg) == 0) {
+			return 0;
+		}
+
+		ins[0] = SPN_MKINS_A(expect ? SPN_INS_JNZ : SPN_INS_JZE, reg);
+	} else {
+		int lhs = -1, rhs = -1;
+
+		/* same as in compile_expr_toplevel() */
+		cmp->tmpidx = rts_count(cmp->varstack);
+
+		if (compile_expr(cmp, cond->left,  &lhs) == 0
+		 || compile_expr(cmp, cond->right, &rhs) == 0) {
+			return 0;
+		}
+
+		ins[0] = SPN_MKINS_ABC(opcode, lhs, rhs, expect != 0);
+	}
+
+	*off_offset = cmp->bc.len + 1;
+	bytecode_append(&cmp->bc, ins, COUNT(ins));
+
+	return 1;
+}
+
+/* if `ast` is an integer literal which (or the negation of which, if `neg`
+ * is nonzero) fits into the immediate operand of ADDI, then this sets `*imm`
+ * to that value and returns nonzero. Returns zero otherwise.
+ */
+static int get_addi_imm(SpnAST *ast, int neg, long *imm)
+{
+	long val;
+
+	if (ast->node != SPN_NODE_LITERAL
+	 || ast->value.t != SPN_TYPE_NUMBER
+	 || ast->value.f & SPN_TFLG_FLOAT) {
+		return 0;
+	}
+
+	/* range check before negation so that it can't overflow */
+	val = ast->value.v.intv;
+	if (val < -128 || val > 128) {
+		return 0;
+	}
+
+	if (neg) {
+		val = -val;
+	}
+
+	if (val < -128 || val > 127) {
+		return 0;
 	}
 
+	*imm = val;
+	return 1;
+}
+
+/* returns the index of a string in the local symbol table */
+static int string_symidx(SpnCompiler *cmp, SpnValue *str)
+{
+	int idx;
+
+	assert(str->t == SPN_TYPE_STRING);
+
 	/* if the string is not in the symtab yet, add it */
 	idx = rts_getidx(cmp->symtab, str);
 	if (idx < 0) {
 		idx = rts_add(cmp->symtab, str);
 	}
 
+	return idx;
+}
+
+/* helper function for loading a string literal */
+static void compile_string_literal(SpnCompiler *cmp, SpnValue *str, int *dst)
+{
+	spn_uword ins;
+	int idx = string_symidx(cmp, str);
+
+	if (*dst < 0) {
+		*dst = tmp_push(cmp);
+	}
+
 	/* emit load instruction */
 	ins = SPN_MKINS_MID(SPN_INS_LDSYM, *dst, idx);
 	bytecode_append(&cmp->bc, &ins, 1);
 }
 
+/* returns the name of the field if `ast` (an ARRSUB or MEMBEROF node)
+ * is subscripted with a string literal, NULL otherwise
+ */
+static SpnString *field_name(SpnAST *ast)
+{
+	if (ast->node == SPN_NODE_MEMBEROF) {
+		return ast->right->name;
+	}
+
+	if (ast->right->node == SPN_NODE_LITERAL
+	 && ast->right->value.t == SPN_TYPE_STRING) {
+		return ast->right->value.v.ptrv;
+	}
+
+	return NULL;
+}
+
+/* emits FLDGET or FLDSET. See Remark (X) in vm.h for the format. */
+static void emit_field_access(
+	SpnCompiler *cmp,
+	enum spn_vm_ins opcode,
+	int a,
+	int b,
+	SpnString *name,
+	spn_uword cache
+)
+{
+	spn_uword ins[3];
+	SpnValue nameval;
+
+	nameval.t = SPN_TYPE_STRING;
+	nameval.f = SPN_TFLG_OBJECT;
+	nameval.v.ptrv = name;
+
+	ins[0] = SPN_MKINS_AB(opcode, a, b);
+	ins[1] = string_symidx(cmp, &nameval);
+	ins[2] = cache;
+
+	bytecode_append(&cmp->bc, ins, COUNT(ins));
+}
+
 /* simple (non short-circuiting) binary operators: arithmetic, bitwise ops,
  * comparison and equality tests, string concatenation
  */
@@ -1039,6 +1375,38 @@ static int compile_simple_binop(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	default:		SHANT_BE_REACHED();	 break;
 	}
 
+	/* adding or subtracting a small integer constant */
+	if (opcode == SPN_INS_ADD || opcode == SPN_INS_SUB) {
+		long imm;
+		SpnAST *reg_ast = NULL;
+
+		if (get_addi_imm(ast->right, opcode == SPN_INS_SUB, &imm)) {
+			reg_ast = ast->left;
+		} else if (opcode == SPN_INS_ADD && get_addi_imm(ast->left, 0, &imm)) {
+			reg_ast = ast->right;
+		}
+
+		if (reg_ast != NULL) {
+			int src = -1;
+
+			if (compile_expr(cmp, reg_ast, &src) == 0) {
+				return 0;
+			}
+
+			if (src >= rts_count(cmp->varstack)) {
+				tmp_pop(cmp);
+			}
+
+			if (*dst < 0) {
+				*dst = tmp_push(cmp);
+			}
+
+			ins = SPN_MKINS_ABC(SPN_INS_ADDI, *dst, src, imm);
+			bytecode_append(&cmp->bc, &ins, 1);
+			return 1;
+		}
+	}
+
 	dst_left  = -1;
 	dst_right = -1;
 	if (compile_expr(cmp, ast->left,  &dst_left)  == 0
@@ -1068,35 +1436,163 @@ static int compile_simple_binop(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	return 1;
 }
 
-static int compile_assignment_var(SpnCompiler *cmp, SpnAST *ast, int *dst)
+/* the maximal number of operands of CONCAT_ALL (it must fit into argument B) */
+#define MAX_CONCAT_OPERANDS 0xff
+
+/* counts the operands of a chain of concatenations. Since concatenation is
+ * associative, the operands of parenthesized sub-chains are counted as well.
+ */
+static int count_concat_operands(SpnAST *ast)
 {
-	int idx;
+	if (ast->node != SPN_NODE_CONCAT) {
+		return 1;
+	}
 
-	/* get register index of variable using its name */
-	SpnValue ident;
-	ident.t = SPN_TYPE_STRING;
-	ident.f = SPN_TFLG_OBJECT;
-	ident.v.ptrv = ast->left->name;
+	return count_concat_operands(ast->left) + count_concat_operands(ast->right);
+}
 
-	idx = rts_getidx(cmp->varstack, &ident);
-	if (idx < 0) {
-		compiler_error(
-			cmp,
-			ast->left->lineno,
-			"variable `%s' is undeclared",
-			ast->left->name->cstr
-		);
-		return 0;
+/* collects the operands of a chain of concatenations, from left to right */
+static void collect_concat_operands(SpnAST *ast, SpnAST **ops, int *n)
+{
+	if (ast->node == SPN_NODE_CONCAT) {
+		collect_concat_operands(ast->left, ops, n);
+		collect_concat_operands(ast->right, ops, n);
+	} else {
+		ops[(*n)++] = ast;
 	}
+}
 
-	/* store RHS to the variable register */
-	if (compile_expr(cmp, ast->right, &idx) == 0) {
-		return 0;
+/* evaluates `nops' operands from left to right, then emits one CONCAT_ALL
+ * instruction joining them. If `first' is not negative, it is the register
+ * index of an additional leftmost operand.
+ */
+static int compile_concat_all(SpnCompiler *cmp, SpnAST **ops, int nops, int first, int *dst)
+{
+	spn_uword ins, idc[ROUNDUP(MAX_CONCAT_OPERANDS, SPN_WORD_OCTETS)];
+	int i, nvars, n = 0;
+
+	assert(nops + (first >= 0) <= MAX_CONCAT_OPERANDS);
+
+	for (i = 0; i < (int)(COUNT(idc)); i++) {
+		idc[i] = 0;
 	}
 
-	/* if we are free to choose the destination register, then we
-	 * just return the left-hand side, the variable that is being
-	 * assigned to. If, however, the destination is determinate,
+	if (first >= 0) {
+		idc[0] = first;
+		n = 1;
+	}
+
+	for (i = 0; i < nops; i++) {
+		int reg = -1;
+
+		if (compile_expr(cmp, ops[i], &reg) == 0) {
+			return 0;
+		}
+
+		assert(reg < 256);
+
+		idc[n / SPN_WORD_OCTETS] |= (spn_uword)(reg) << (8 * (n % SPN_WORD_OCTETS));
+		n++;
+	}
+
+	/* if operands went into temporaries, then "pop" */
+	nvars = rts_count(cmp->varstack);
+	for (i = 0; i < n; i++) {
+		if (nth_arg_idx(idc, i) >= nvars) {
+			tmp_pop(cmp);
+		}
+	}
+
+	if (*dst < 0) {
+		*dst = tmp_push(cmp);
+	}
+
+	ins = SPN_MKINS_AB(SPN_INS_CONCAT_ALL, *dst, n);
+	bytecode_append(&cmp->bc, &ins, 1);
+	bytecode_append(&cmp->bc, idc, ROUNDUP(n, SPN_WORD_OCTETS));
+
+	return 1;
+}
+
+/* a chain of concatenations, like `a .. b .. c .. d', is compiled into a
+ * single CONCAT_ALL instruction instead of one CONCAT per `..' operator
+ * (which would copy the partial results over and over again). Chains of
+ * more than MAX_CONCAT_OPERANDS operands are compiled into several ones,
+ * each of which takes the result of the previous one as its first operand.
+ * If `first' is not negative, it is the register index of an additional
+ * leftmost operand (this is used for compiling `..=').
+ */
+static int compile_concat(SpnCompiler *cmp, SpnAST *ast, int first, int *dst)
+{
+	SpnAST **ops;
+	int i = 0, nops = count_concat_operands(ast);
+
+	/* a lone `..' gains nothing from being flattened */
+	if (first < 0 && nops <= 2) {
+		return compile_simple_binop(cmp, ast, dst);
+	}
+
+	ops = malloc(nops * sizeof(ops[0]));
+	if (ops == NULL) {
+		abort();
+	}
+
+	collect_concat_operands(ast, ops, &i);
+	assert(i == nops);
+
+	for (i = 0; i < nops; ) {
+		int room = MAX_CONCAT_OPERANDS - (first >= 0);
+		int k = nops - i < room ? nops - i : room;
+
+		/* partial results go into a temporary, since the destination
+		 * may be a variable which is also one of the later operands
+		 */
+		int reg = i + k == nops ? *dst : -1;
+
+		if (compile_concat_all(cmp, ops + i, k, first, &reg) == 0) {
+			free(ops);
+			return 0;
+		}
+
+		i += k;
+		first = reg;
+	}
+
+	*dst = first;
+	free(ops);
+
+	return 1;
+}
+
+static int compile_assignment_var(SpnCompiler *cmp, SpnAST *ast, int *dst)
+{
+	int idx;
+
+	/* get register index of variable using its name */
+	SpnValue ident;
+	ident.t = SPN_TYPE_STRING;
+	ident.f = SPN_TFLG_OBJECT;
+	ident.v.ptrv = ast->left->name;
+
+	idx = rts_getidx(cmp->varstack, &ident);
+	if (idx < 0) {
+		compiler_error(
+			cmp,
+			ast->left->lineno,
+			"variable `%s' is undeclared",
+			ast->left->name->cstr
+		);
+		return 0;
+	}
+
+	/* store RHS to the variable register */
+	if (compile_expr(cmp, ast->right, &idx) == 0) {
+		return 0;
+	}
+
+	/* if we are free to choose the destination register, then we
+	 * just return the left-hand side, the variable that is being
+	 * assigned to. If, however, the destination is determinate,
 	 * then we emit a 'move' instruction.
 	 */
 	if (*dst < 0) {
@@ -1115,6 +1611,7 @@ static int compile_assignment_array(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	spn_uword ins;
 	SpnAST *lhs = ast->left;
 	SpnAST *rhs = ast->right;
+	SpnString *name = field_name(lhs);
 	int nvars;
 
 	/* array and subscript indices: just like in `compile_arrsub()` */
@@ -1134,24 +1631,18 @@ static int compile_assignment_array(SpnCompiler *cmp, SpnAST *ast, int *dst)
 		return 0;
 	}
 
-	/* compile subscript */
-	if (lhs->node == SPN_NODE_ARRSUB) {
-		/* indexing with brackets */
+	/* compile subscript, unless it's the name of a field */
+	if (name != NULL) {
+		emit_field_access(cmp, SPN_INS_FLDSET, arridx, *dst, name, cmp->nfldcaches++);
+	} else {
 		if (compile_expr(cmp, lhs->right, &subidx) == 0) {
 			return 0;
 		}
-	} else {
-		/* memberof */
-		SpnValue nameval;
-		nameval.t = SPN_TYPE_STRING;
-		nameval.f = SPN_TFLG_OBJECT;
-		nameval.v.ptrv = lhs->right->name;
-		compile_string_literal(cmp, &nameval, &subidx);
-	}
 
-	/* emit "store to array" instruction */
-	ins = SPN_MKINS_ABC(SPN_INS_ARRSET, arridx, subidx, *dst);
-	bytecode_append(&cmp->bc, &ins, 1);
+		/* emit "store to array" instruction */
+		ins = SPN_MKINS_ABC(SPN_INS_ARRSET, arridx, subidx, *dst);
+		bytecode_append(&cmp->bc, &ins, 1);
+	}
 
 	/* XXX: is this correct? since we need neither the value of the
 	 * array nor the value of the subscripting expression, we can
@@ -1194,6 +1685,7 @@ static int compile_cmpd_assgmt_var(SpnCompiler *cmp, SpnAST *ast, int *dst, enum
 {
 	int idx, nvars, rhs = -1;
 	spn_uword ins;
+	long imm;
 
 	/* get register index of variable using its name */
 	SpnValue ident;
@@ -1212,20 +1704,35 @@ static int compile_cmpd_assgmt_var(SpnCompiler *cmp, SpnAST *ast, int *dst, enum
 		return 0;
 	}
 
-	/* evaluate RHS */
-	if (compile_expr(cmp, ast->right, &rhs) == 0) {
-		return 0;
-	}
+	if ((opcode == SPN_INS_ADD || opcode == SPN_INS_SUB)
+	 && get_addi_imm(ast->right, opcode == SPN_INS_SUB, &imm)) {
+		/* `x += 1` and `x -= 1`: no need to load the constant */
+		ins = SPN_MKINS_ABC(SPN_INS_ADDI, idx, idx, imm);
+		bytecode_append(&cmp->bc, &ins, 1);
+	} else if (opcode == SPN_INS_CONCAT
+		&& ast->right->node == SPN_NODE_CONCAT
+		&& count_concat_operands(ast->right) < MAX_CONCAT_OPERANDS) {
+		/* `x ..= y .. z`: the LHS is the first operand of CONCAT_ALL */
+		int res = idx;
+		if (compile_concat(cmp, ast->right, idx, &res) == 0) {
+			return 0;
+		}
+	} else {
+		/* evaluate RHS */
+		if (compile_expr(cmp, ast->right, &rhs) == 0) {
+			return 0;
+		}
 
-	/* if RHS went into a temporary register, then pop() */
-	nvars = rts_count(cmp->varstack);
-	if (rhs >= nvars) {
-		tmp_pop(cmp);
-	}
+		/* if RHS went into a temporary register, then pop() */
+		nvars = rts_count(cmp->varstack);
+		if (rhs >= nvars) {
+			tmp_pop(cmp);
+		}
 
-	/* emit instruction to operate on LHS and RHS */
-	ins = SPN_MKINS_ABC(opcode, idx, idx, rhs);
-	bytecode_append(&cmp->bc, &ins, 1);
+		/* emit instruction to operate on LHS and RHS */
+		ins = SPN_MKINS_ABC(opcode, idx, idx, rhs);
+		bytecode_append(&cmp->bc, &ins, 1);
+	}
 
 	/* finally, yield the LHS. (this just means that we set the destination
 	 * register to the index of the variable if we can, and we emit a move
@@ -1246,6 +1753,7 @@ static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnAST *ast, int *dst, enum
 	spn_uword ins[3];
 	SpnAST *lhs = ast->left;
 	SpnAST *rhs = ast->right;
+	SpnString *name = field_name(lhs);
 
 	int nvars, arridx = -1, subidx = -1, rhsidx = -1;
 
@@ -1263,31 +1771,33 @@ static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnAST *ast, int *dst, enum
 		return 0;
 	}
 
-	/* compile subscript */
-	if (lhs->node == SPN_NODE_ARRSUB) {
-		/* indexing with brackets */
+	if (name != NULL) {
+		/* a field: the load and the store share their inline cache */
+		spn_uword cache = cmp->nfldcaches++;
+
+		emit_field_access(cmp, SPN_INS_FLDGET, *dst, arridx, name, cache);
+
+		ins[0] = SPN_MKINS_ABC(opcode, *dst, *dst, rhsidx);
+		bytecode_append(&cmp->bc, ins, 1);
+
+		emit_field_access(cmp, SPN_INS_FLDSET, arridx, *dst, name, cache);
+	} else {
+		/* compile subscript */
 		if (compile_expr(cmp, lhs->right, &subidx) == 0) {
 			return 0;
 		}
-	} else {
-		/* memberof */
-		SpnValue nameval;
-		nameval.t = SPN_TYPE_STRING;
-		nameval.f = SPN_TFLG_OBJECT;
-		nameval.v.ptrv = lhs->right->name;
-		compile_string_literal(cmp, &nameval, &subidx);
-	}
 
-	/* load LHS into destination register */
-	ins[0] = SPN_MKINS_ABC(SPN_INS_ARRGET, *dst, arridx, subidx);
+		/* load LHS into destination register */
+		ins[0] = SPN_MKINS_ABC(SPN_INS_ARRGET, *dst, arridx, subidx);
 
-	/* evaluate "LHS = LHS <op> RHS" */
-	ins[1] = SPN_MKINS_ABC(opcode, *dst, *dst, rhsidx);
+		/* evaluate "LHS = LHS <op> RHS" */
+		ins[1] = SPN_MKINS_ABC(opcode, *dst, *dst, rhsidx);
 
-	/* store value of updated destination register into array */
-	ins[2] = SPN_MKINS_ABC(SPN_INS_ARRSET, arridx, subidx, *dst);
+		/* store value of updated destination register into array */
+		ins[2] = SPN_MKINS_ABC(SPN_INS_ARRSET, arridx, subidx, *dst);
 
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
+		bytecode_append(&cmp->bc, ins, COUNT(ins));
+	}
 
 	/* pop as many times as we used a temporary register (XXX: correct?) */
 	nvars = rts_count(cmp->varstack);
@@ -1349,12 +1859,17 @@ static int compile_logical(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	spn_uword movins, jumpins[2] = { 0 }; /* dummy */
 
 	enum spn_vm_ins opcode = ast->node == SPN_NODE_LOGAND ? SPN_INS_JZE : SPN_INS_JNZ;
+	int idx;
+
+	if (*dst < 0) {
+		*dst = tmp_push(cmp);
+	}
 
 	/* we can't compile the result directly into the destination register,
 	 * because if the destination is a variable which will be examined in
 	 * the righ-hand side expression too, we will be in trouble.
 	 */
-	int idx = tmp_push(cmp);
+	idx = tmp_push(cmp);
 
 	/* compile left-hand side */
 	if (compile_expr(cmp, ast->left, &idx) == 0) {
@@ -1479,9 +1994,7 @@ static int compile_ident(SpnCompiler *cmp, SpnAST *ast, int *dst)
 		int sym;
 
 		SpnValue stub;
-		stub.t = SPN_TYPE_FUNC;
-		stub.f = SPN_TFLG_PENDING;
-		stub.v.fnv.name = ast->name->cstr;
+		spn_func_value(&stub, spn_func_new_stub(ast->name->cstr));
 
 		sym = rts_getidx(cmp->symtab, &stub);
 		if (sym < 0) {
@@ -1489,6 +2002,9 @@ static int compile_ident(SpnCompiler *cmp, SpnAST *ast, int *dst)
 			sym = rts_add(cmp->symtab, &stub);
 		}
 
+		/* the symtab retains the stub if it's been added */
+		spn_value_release(&stub);
+
 		/* compile "load symbol" instruction */
 		if (*dst < 0) {
 			*dst = tmp_push(cmp);
@@ -1594,8 +2110,11 @@ static int compile_arrsub(SpnCompiler *cmp, SpnAST *ast, int *dst)
 
 	/* array index: register index of the array expression
 	 * subscript index: register index of the subscripting expression
+	 * (fields, i. e. memberof and string literal subscripts, are
+	 * accessed by name, without loading it into a register)
 	 */
 	int arridx = -1, subidx = -1;
+	SpnString *name = field_name(ast);
 
 	/* compile array expression */
 	if (compile_expr(cmp, ast->left, &arridx) == 0) {
@@ -1603,18 +2122,10 @@ static int compile_arrsub(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	}
 
 	/* compile subscripting expression */
-	if (ast->node == SPN_NODE_ARRSUB) {
-		/* normal subscripting with brackets */
+	if (name == NULL) {
 		if (compile_expr(cmp, ast->right, &subidx) == 0) {
 			return 0;
 		}
-	} else {
-		/* memberof, dot/arrow notation */
-		SpnValue nameval;
-		nameval.t = SPN_TYPE_STRING;
-		nameval.f = SPN_TFLG_OBJECT;
-		nameval.v.ptrv = ast->right->name;
-		compile_string_literal(cmp, &nameval, &subidx);
 	}
 
 	/* the usual "pop as many times as we pushed" optimization */
@@ -1633,8 +2144,12 @@ static int compile_arrsub(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	}
 
 	/* emit "load from array" instruction */
-	ins = SPN_MKINS_ABC(SPN_INS_ARRGET, *dst, arridx, subidx);
-	bytecode_append(&cmp->bc, &ins, 1);
+	if (name != NULL) {
+		emit_field_access(cmp, SPN_INS_FLDGET, *dst, arridx, name, cmp->nfldcaches++);
+	} else {
+		ins = SPN_MKINS_ABC(SPN_INS_ARRGET, *dst, arridx, subidx);
+		bytecode_append(&cmp->bc, &ins, 1);
+	}
 
 	return 1;
 }
@@ -1695,6 +2210,11 @@ static int compile_callargs(SpnCompiler *cmp, SpnAST *ast, spn_uword **idc, int
  * right child: link list of call argument expressions
  */
 static int compile_call(SpnCompiler *cmp, SpnAST *ast, int *dst)
+{
+	return emit_call(cmp, ast, dst, SPN_INS_CALL);
+}
+
+static int emit_call(SpnCompiler *cmp, SpnAST *ast, int *dst, enum spn_vm_ins opcode)
 {
 	spn_uword *idc = NULL;
 	/* 0-initializing `argc` is needed by `compile_callargs()` */
@@ -1718,7 +2238,7 @@ static int compile_call(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	}
 
 	/* actually emit call instruction */
-	ins = SPN_MKINS_ABC(SPN_INS_CALL, *dst, fnreg, argc);
+	ins = SPN_MKINS_ABC(opcode, *dst, fnreg, argc);
 	bytecode_append(&cmp->bc, &ins, 1);
 	bytecode_append(&cmp->bc, idc, ROUNDUP(argc, SPN_WORD_OCTETS));
 
@@ -1893,7 +2413,8 @@ static int compile_incdec(SpnCompiler *cmp, SpnAST *ast, int *dst)
 static int compile_expr(SpnCompiler *cmp, SpnAST *ast, int *dst)
 {
 	switch (ast->node) {
-	case SPN_NODE_CONCAT:		/* concat.	*/
+	case SPN_NODE_CONCAT:		return compile_concat(cmp, ast, -1, dst);
+
 	case SPN_NODE_ADD:		/* arithmetic	*/
 	case SPN_NODE_SUB:
 	case SPN_NODE_MUL:
@@ -1974,3 +2495,1073 @@ static int compile_expr(SpnCompiler *cmp, SpnAST *ast, int *dst)
 	}
 }
 
+
+/*
+ * Optimizations, part I: the AST
+ * 
+ * Constant expressions are folded (only as long as the result is known
+ * to be identical to what the VM would compute at runtime -- operations
+ * that would raise a runtime error are left alone), branches and loops
+ * with a constant condition are simplified, and statements which can
+ * never be executed (e. g. the ones following a `return') are removed.
+ */
+
+static int is_literal(SpnAST *ast)
+{
+	return ast != NULL && ast->node == SPN_NODE_LITERAL;
+}
+
+static int is_bool_literal(SpnAST *ast)
+{
+	return is_literal(ast) && ast->value.t == SPN_TYPE_BOOL;
+}
+
+static int is_int_literal(SpnAST *ast)
+{
+	return is_literal(ast)
+	    && ast->value.t == SPN_TYPE_NUMBER
+	    && (ast->value.f & SPN_TFLG_FLOAT) == 0;
+}
+
+static int is_num_literal(SpnAST *ast)
+{
+	return is_literal(ast) && ast->value.t == SPN_TYPE_NUMBER;
+}
+
+/* replaces `ast' with a literal node. Takes ownership of `val'. */
+static SpnAST *replace_with_literal(SpnAST *ast, SpnValue *val)
+{
+	SpnAST *lit = spn_ast_new(SPN_NODE_LITERAL, ast->lineno);
+	lit->value = *val;
+	spn_ast_free(ast);
+	return lit;
+}
+
+/* replaces `ast' with one of its (direct or indirect) children */
+static SpnAST *replace_with_child(SpnAST *ast, SpnAST **child)
+{
+	SpnAST *res = *child;
+	*child = NULL;
+	spn_ast_free(ast);
+	return res;
+}
+
+static SpnAST *make_bool(SpnAST *ast, int b)
+{
+	SpnValue val;
+	val.t = SPN_TYPE_BOOL;
+	val.f = 0;
+	val.v.boolv = b != 0;
+	return replace_with_literal(ast, &val);
+}
+
+static double num_as_double(const SpnValue *val)
+{
+	return val->f & SPN_TFLG_FLOAT ? val->v.fltv : val->v.intv;
+}
+
+static SpnAST *fold_arith(SpnAST *ast)
+{
+	SpnValue *a, *b, res;
+
+	if (!is_num_literal(ast->left) || !is_num_literal(ast->right)) {
+		return ast;
+	}
+
+	a = &ast->left->value;
+	b = &ast->right->value;
+
+	res.t = SPN_TYPE_NUMBER;
+
+	if (a->f & SPN_TFLG_FLOAT || b->f & SPN_TFLG_FLOAT) {
+		double x = num_as_double(a);
+		double y = num_as_double(b);
+
+		res.f = SPN_TFLG_FLOAT;
+
+		switch (ast->node) {
+		case SPN_NODE_ADD: res.v.fltv = x + y; break;
+		case SPN_NODE_SUB: res.v.fltv = x - y; break;
+		case SPN_NODE_MUL: res.v.fltv = x * y; break;
+		case SPN_NODE_DIV: res.v.fltv = x / y; break;
+		default: /* modulo division on non-integers: runtime error */
+			return ast;
+		}
+	} else {
+		long x = a->v.intv;
+		long y = b->v.intv;
+
+		/* avoid trapping at compile time */
+		if ((ast->node == SPN_NODE_DIV || ast->node == SPN_NODE_MOD)
+		 && (y == 0 || (y == -1 && x == LONG_MIN))) {
+			return ast;
+		}
+
+		res.f = 0;
+
+		/* unsigned arithmetic wraps around just like the VM does */
+		switch (ast->node) {
+		case SPN_NODE_ADD: res.v.intv = (unsigned long)(x) + (unsigned long)(y); break;
+		case SPN_NODE_SUB: res.v.intv = (unsigned long)(x) - (unsigned long)(y); break;
+		case SPN_NODE_MUL: res.v.intv = (unsigned long)(x) * (unsigned long)(y); break;
+		case SPN_NODE_DIV: res.v.intv = x / y; break;
+		case SPN_NODE_MOD: res.v.intv = x % y; break;
+		default: SHANT_BE_REACHED();
+		}
+	}
+
+	return replace_with_literal(ast, &res);
+}
+
+static SpnAST *fold_bitwise(SpnAST *ast)
+{
+	SpnValue res;
+	long x, y;
+
+	if (!is_int_literal(ast->left) || !is_int_literal(ast->right)) {
+		return ast;
+	}
+
+	x = ast->left->value.v.intv;
+	y = ast->right->value.v.intv;
+
+	/* shifts which are undefined in C are left to the VM */
+	if ((ast->node == SPN_NODE_SHL || ast->node == SPN_NODE_SHR)
+	 && (y < 0 || y >= (long)(sizeof(long) * CHAR_BIT) || x < 0)) {
+		return ast;
+	}
+
+	res.t = SPN_TYPE_NUMBER;
+	res.f = 0;
+
+	switch (ast->node) {
+	case SPN_NODE_BITAND:	res.v.intv = x & y;	break;
+	case SPN_NODE_BITOR:	res.v.intv = x | y;	break;
+	case SPN_NODE_BITXOR:	res.v.intv = x ^ y;	break;
+	case SPN_NODE_SHL:	res.v.intv = x << y;	break;
+	case SPN_NODE_SHR:	res.v.intv = x >> y;	break;
+	default:		SHANT_BE_REACHED();
+	}
+
+	return replace_with_literal(ast, &res);
+}
+
+static SpnAST *fold_compare(SpnAST *ast)
+{
+	const SpnValue *a, *b;
+	int res;
+
+	if (!is_literal(ast->left) || !is_literal(ast->right)) {
+		return ast;
+	}
+
+	a = &ast->left->value;
+	b = &ast->right->value;
+
+	/* equality is defined for every pair of values */
+	if (ast->node == SPN_NODE_EQUAL) {
+		return make_bool(ast, spn_value_equal(a, b));
+	}
+
+	if (ast->node == SPN_NODE_NOTEQ) {
+		return make_bool(ast, spn_value_noteq(a, b));
+	}
+
+	/* ordering: only numbers are folded (strings are compared by the VM) */
+	if (a->t != SPN_TYPE_NUMBER || b->t != SPN_TYPE_NUMBER) {
+		return ast;
+	}
+
+	/* this mirrors `numeric_compare()' in vm.c, NaN included */
+	if (a->f & SPN_TFLG_FLOAT || b->f & SPN_TFLG_FLOAT) {
+		double x = num_as_double(a);
+		double y = num_as_double(b);
+		res = x < y ? -1 : x > y ? +1 : 0;
+	} else {
+		long x = a->v.intv;
+		long y = b->v.intv;
+		res = x < y ? -1 : x > y ? +1 : 0;
+	}
+
+	switch (ast->node) {
+	case SPN_NODE_LESS:	return make_bool(ast, res <  0);
+	case SPN_NODE_LEQ:	return make_bool(ast, res <= 0);
+	case SPN_NODE_GREATER:	return make_bool(ast, res >  0);
+	case SPN_NODE_GEQ:	return make_bool(ast, res >= 0);
+	default:		SHANT_BE_REACHED();
+	}
+
+	return ast;
+}
+
+static SpnAST *fold_concat(SpnAST *ast)
+{
+	SpnValue res;
+
+	if (!is_literal(ast->left) || ast->left->value.t != SPN_TYPE_STRING
+	 || !is_literal(ast->right) || ast->right->value.t != SPN_TYPE_STRING) {
+		return ast;
+	}
+
+	res.t = SPN_TYPE_STRING;
+	res.f = SPN_TFLG_OBJECT;
+	res.v.ptrv = spn_string_concat(ast->left->value.v.ptrv, ast->right->value.v.ptrv);
+
+	/* too large for the memory limit: leave it to the VM */
+	if (res.v.ptrv == NULL) {
+		return ast;
+	}
+
+	return replace_with_literal(ast, &res);
+}
+
+static SpnAST *fold_unary(SpnAST *ast)
+{
+	SpnAST *op = ast->left;
+	SpnValue res;
+
+	switch (ast->node) {
+	case SPN_NODE_UNPLUS:
+		/* unary plus is a no-op anyway */
+		return replace_with_child(ast, &ast->left);
+	case SPN_NODE_UNMINUS:
+		if (!is_num_literal(op)) {
+			return ast;
+		}
+
+		res = op->value;
+
+		if (res.f & SPN_TFLG_FLOAT) {
+			res.v.fltv = -res.v.fltv;
+		} else if (res.v.intv != LONG_MIN) {
+			res.v.intv = -res.v.intv;
+		} else {
+			return ast;
+		}
+
+		return replace_with_literal(ast, &res);
+	case SPN_NODE_LOGNOT:
+		if (!is_bool_literal(op)) {
+			return ast;
+		}
+
+		return make_bool(ast, !op->value.v.boolv);
+	case SPN_NODE_BITNOT:
+		if (!is_int_literal(op)) {
+			return ast;
+		}
+
+		res = op->value;
+		res.v.intv = ~res.v.intv;
+		return replace_with_literal(ast, &res);
+	default:
+		SHANT_BE_REACHED();
+	}
+
+	return ast;
+}
+
+/* `&&' and `||' yield their LHS if it decides the result,
+ * else they yield their RHS (see `compile_logical()')
+ */
+static SpnAST *fold_logical(SpnAST *ast)
+{
+	int lhs;
+
+	if (!is_bool_literal(ast->left)) {
+		return ast;
+	}
+
+	lhs = ast->left->value.v.boolv;
+
+	if (ast->node == SPN_NODE_LOGAND ? lhs : !lhs) {
+		return replace_with_child(ast, &ast->right);
+	}
+
+	return replace_with_child(ast, &ast->left);
+}
+
+/* conditional expression or `if' statement with a constant condition.
+ * The condition has to be a Boolean, as the VM rejects anything else.
+ */
+static SpnAST *fold_branches(SpnAST *ast)
+{
+	SpnAST *branches = ast->right;
+
+	if (!is_bool_literal(ast->left)) {
+		return ast;
+	}
+
+	assert(branches->node == SPN_NODE_BRANCHES);
+
+	if (ast->left->value.v.boolv) {
+		return replace_with_child(ast, &branches->left);
+	}
+
+	return replace_with_child(ast, &branches->right);
+}
+
+static SpnAST *fold_loop(SpnAST *ast)
+{
+	if (!is_bool_literal(ast->left) || ast->left->value.v.boolv) {
+		return ast;
+	}
+
+	/* `while (false)' never runs, `do {} while (false)' runs once */
+	if (ast->node == SPN_NODE_WHILE) {
+		spn_ast_free(ast);
+		return NULL;
+	}
+
+	return replace_with_child(ast, &ast->right);
+}
+
+/* returns nonzero if control can never go past the end of `ast' */
+static int ends_with_return(SpnAST *ast)
+{
+	if (ast == NULL) {
+		return 0;
+	}
+
+	switch (ast->node) {
+	case SPN_NODE_RETURN:
+		return 1;
+	case SPN_NODE_COMPOUND:
+	case SPN_NODE_BLOCK:
+		return ends_with_return(ast->left) || ends_with_return(ast->right);
+	case SPN_NODE_IF:
+		return ends_with_return(ast->right->left)
+		    && ends_with_return(ast->right->right);
+	default:
+		return 0;
+	}
+}
+
+/* statement lists are left-leaning: the right child is the last statement */
+static SpnAST *fold_stmt_list(SpnAST *ast)
+{
+	/* literals as expression statements have no effect */
+	if (is_literal(ast->left)) {
+		spn_ast_free(ast->left);
+		ast->left = NULL;
+	}
+
+	if (is_literal(ast->right)) {
+		spn_ast_free(ast->right);
+		ast->right = NULL;
+	}
+
+	/* statements after an unconditional `return' are unreachable. Global
+	 * function definitions are kept, though: they are not mere code.
+	 */
+	if (ast->right != NULL
+	 && ast->right->node != SPN_NODE_FUNCSTMT
+	 && ends_with_return(ast->left)) {
+		spn_ast_free(ast->right);
+		ast->right = NULL;
+	}
+
+	return ast;
+}
+
+static SpnAST *fold_ast(SpnAST *ast)
+{
+	if (ast == NULL) {
+		return NULL;
+	}
+
+	/* bottom-up: simplify the children first */
+	ast->left = fold_ast(ast->left);
+	ast->right = fold_ast(ast->right);
+
+	switch (ast->node) {
+	case SPN_NODE_PROGRAM:
+	case SPN_NODE_BLOCK:
+	case SPN_NODE_COMPOUND:	return fold_stmt_list(ast);
+
+	case SPN_NODE_IF:
+	case SPN_NODE_CONDEXPR:	return fold_branches(ast);
+
+	case SPN_NODE_WHILE:
+	case SPN_NODE_DO:	return fold_loop(ast);
+
+	case SPN_NODE_ADD:
+	case SPN_NODE_SUB:
+	case SPN_NODE_MUL:
+	case SPN_NODE_DIV:
+	case SPN_NODE_MOD:	return fold_arith(ast);
+
+	case SPN_NODE_BITAND:
+	case SPN_NODE_BITOR:
+	case SPN_NODE_BITXOR:
+	case SPN_NODE_SHL:
+	case SPN_NODE_SHR:	return fold_bitwise(ast);
+
+	case SPN_NODE_EQUAL:
+	case SPN_NODE_NOTEQ:
+	case SPN_NODE_LESS:
+	case SPN_NODE_LEQ:
+	case SPN_NODE_GREATER:
+	case SPN_NODE_GEQ:	return fold_compare(ast);
+
+	case SPN_NODE_CONCAT:	return fold_concat(ast);
+
+	case SPN_NODE_UNPLUS:
+	case SPN_NODE_UNMINUS:
+	case SPN_NODE_LOGNOT:
+	case SPN_NODE_BITNOT:	return fold_unary(ast);
+
+	case SPN_NODE_LOGAND:
+	case SPN_NODE_LOGOR:	return fold_logical(ast);
+
+	default:		return ast;
+	}
+}
+
+/*
+ * Optimizations, part II: the bytecode
+ * 
+ * A simple peephole pass: chains of unconditional jumps are threaded,
+ * then unreachable instructions (the ones following a `ret' or `jmp',
+ * up to the next jump target or function boundary) and no-ops (`jmp +0',
+ * `mov a, a' and the second half of `mov a, b; mov b, a') are removed.
+ * Finally, the remaining code is compacted, and jump offsets, function
+ * body lengths and lambda offsets in the local symbol table are relocated.
+ */
+
+enum {
+	PH_LEADER	= 1 << 0,	/* beginning of a basic block	*/
+	PH_DEAD		= 1 << 1	/* word is to be removed	*/
+};
+
+static int is_jump(spn_uword ins)
+{
+	switch (OPCODE(ins)) {
+	case SPN_INS_JMP:
+	case SPN_INS_JZE:
+	case SPN_INS_JNZ:
+	case SPN_INS_JEQ:
+	case SPN_INS_JNE:
+	case SPN_INS_JLT:
+	case SPN_INS_JLE:
+	case SPN_INS_JGT:
+	case SPN_INS_JGE:
+	case SPN_INS_NEXT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* address of the target of the jump at `bc[i]' */
+static size_t jump_target(const spn_uword *bc, size_t i)
+{
+	return i + 2 + (spn_sword)(bc[i + 1]);
+}
+
+/* follows a chain of unconditional jumps, starting at the jump at
+ * `bc[i]'; returns the address of the final destination. The number of
+ * hops is limited so that jumping around in circles terminates.
+ */
+static size_t thread_jump(const spn_uword *bc, size_t len, size_t i)
+{
+	size_t dst = jump_target(bc, i);
+	int hops;
+
+	for (hops = 0; hops < 16 && dst < len && OPCODE(bc[dst]) == SPN_INS_JMP; hops++) {
+		size_t next = jump_target(bc, dst);
+
+		if (next == dst) {
+			break;
+		}
+
+		dst = next;
+	}
+
+	return dst;
+}
+
+static void optimize_bytecode(SpnCompiler *cmp)
+{
+	spn_uword *bc = cmp->bc.insns;
+	size_t len = cmp->bc.len;
+	size_t i, j, n, prev;
+	size_t *newaddr;
+	unsigned char *flags;
+	int reachable, changed, nsyms, k;
+
+	flags = calloc(len + 1, sizeof(*flags));
+	newaddr = malloc((len + 1) * sizeof(*newaddr));
+	if (flags == NULL || newaddr == NULL) {
+		abort();
+	}
+
+	/* 1. thread jumps */
+	for (i = SPN_PRGHDR_LEN; i < len; i += insn_length(bc, i)) {
+		if (is_jump(bc[i])) {
+			size_t dst = thread_jump(bc, len, i);
+			bc[i + 1] = (spn_sword)(dst) - (spn_sword)(i + 2);
+		}
+	}
+
+	/* 2. mark unreachable code and no-ops. Removing a jump may make
+	 * its target unreachable, so this is repeated until nothing changes.
+	 */
+	do {
+		changed = 0;
+
+		/* find the beginning of basic blocks */
+		for (i = SPN_PRGHDR_LEN; i < len; i++) {
+			flags[i] &= ~PH_LEADER;
+		}
+
+		for (i = SPN_PRGHDR_LEN; i < len; i += insn_length(bc, i)) {
+			spn_uword ins = bc[i];
+
+			if (flags[i] & PH_DEAD) {
+				continue;
+			}
+
+			if (is_jump(ins)) {
+				flags[jump_target(bc, i)] |= PH_LEADER;
+			} else if (OPCODE(ins) == SPN_INS_GLBSYM) {
+				size_t entry = i + insn_length(bc, i);
+				size_t bodylen = bc[entry - SPN_FUNCHDR_LEN + SPN_FUNCHDR_IDX_BODYLEN];
+
+				/* the body is skipped over by the enclosing code */
+				flags[i] |= PH_LEADER;
+				flags[entry] |= PH_LEADER;
+				flags[entry + bodylen] |= PH_LEADER;
+			}
+		}
+
+		reachable = 1;
+		prev = 0; /* last live instruction in the current basic block or 0 */
+
+		for (i = SPN_PRGHDR_LEN; i < len; i += n) {
+			spn_uword ins = bc[i];
+			int dead = 0;
+
+			n = insn_length(bc, i);
+
+			if (flags[i] & PH_DEAD) {
+				continue;
+			}
+
+			if (flags[i] & PH_LEADER) {
+				reachable = 1;
+				prev = 0;
+			}
+
+			if (reachable == 0) {
+				dead = 1;
+			} else if (OPCODE(ins) == SPN_INS_JMP) {
+				dead = jump_target(bc, i) == i + n;
+				reachable = dead;
+			} else if (OPCODE(ins) == SPN_INS_RET) {
+				reachable = 0;
+			} else if (OPCODE(ins) == SPN_INS_MOV) {
+				dead = OPA(ins) == OPB(ins)
+				    || (prev != 0
+				     && OPCODE(bc[prev]) == SPN_INS_MOV
+				     && OPA(bc[prev]) == OPB(ins)
+				     && OPB(bc[prev]) == OPA(ins));
+			}
+
+			if (dead) {
+				for (j = i; j < i + n; j++) {
+					flags[j] |= PH_DEAD;
+				}
+
+				changed = 1;
+			} else {
+				prev = i;
+			}
+		}
+	} while (changed);
+
+	/* 3. compute the new address of each word */
+	for (i = 0, j = 0; i < len; i++) {
+		newaddr[i] = j;
+		if ((flags[i] & PH_DEAD) == 0) {
+			j++;
+		}
+	}
+
+	newaddr[len] = j;
+
+	/* nothing to remove (threaded jumps are already patched) */
+	if (j == len) {
+		free(flags);
+		free(newaddr);
+		return;
+	}
+
+	/* 4. relocate jumps and function headers */
+	for (i = SPN_PRGHDR_LEN; i < len; i += insn_length(bc, i)) {
+		spn_uword ins = bc[i];
+
+		if (flags[i] & PH_DEAD) {
+			continue;
+		}
+
+		if (is_jump(ins)) {
+			size_t dst = jump_target(bc, i);
+			bc[i + 1] = (spn_sword)(newaddr[dst]) - (spn_sword)(newaddr[i] + 2);
+		} else if (OPCODE(ins) == SPN_INS_GLBSYM) {
+			size_t entry = i + insn_length(bc, i);
+			spn_uword *bodylen = &bc[entry - SPN_FUNCHDR_LEN + SPN_FUNCHDR_IDX_BODYLEN];
+			*bodylen = newaddr[entry + *bodylen] - newaddr[entry];
+		}
+	}
+
+	/* 5. relocate the header offsets of lambda functions (see the remark
+	 * in `write_symtab()'). Only the forward mapping is updated, since
+	 * the inverse one isn't used anymore after code generation.
+	 */
+	nsyms = rts_count(cmp->symtab);
+	for (k = 0; k < nsyms; k++) {
+		SpnValue *sym = rts_getval(cmp->symtab, k);
+
+		if (sym->t == SPN_TYPE_NUMBER) {
+			SpnValue idxval, offval;
+
+			idxval.t = SPN_TYPE_NUMBER;
+			idxval.f = 0;
+			idxval.v.intv = k;
+
+			offval.t = SPN_TYPE_NUMBER;
+			offval.f = 0;
+			offval.v.intv = newaddr[sym->v.intv];
+
+			spn_array_set(cmp->symtab->fwd, &idxval, &offval);
+		}
+	}
+
+	/* 6. compact code */
+	for (i = 0, j = 0; i < len; i++) {
+		if ((flags[i] & PH_DEAD) == 0) {
+			bc[j++] = bc[i];
+		}
+	}
+
+	cmp->bc.len = j;
+
+	free(flags);
+	free(newaddr);
+}
+
+/*
+ * Optimizations, part III: registers
+ *
+ * During code generation, registers are handed out like a stack: a variable
+ * keeps its register until the end of the enclosing block, and temporaries
+ * are pushed above the variables in scope. This pass assigns the registers
+ * of each function (and of the main program) anew, so that registers whose
+ * values are never needed at the same time share a slot, which makes the
+ * frames smaller (every slot of a frame is initialized and released on
+ * each call).
+ *
+ * Liveness is computed by the usual backward data-flow analysis over the
+ * instructions of the function. A register written by an instruction then
+ * interferes with the registers live after it, and also with the other
+ * operands of the instruction, except for the source of a `mov'. Registers
+ * are colored greedily, in the order of their first appearance. Declared
+ * arguments, and registers that may be read before being written (those
+ * rely on the VM initializing them to nil), keep their index. The
+ * destination of a `mov' prefers the color of the source and vice versa,
+ * so that the copy becomes a no-op which the peephole pass removes.
+ */
+
+#define MAX_REGS	256
+
+typedef struct RegSet {
+	unsigned char bits[ROUNDUP(MAX_REGS, CHAR_BIT)];
+} RegSet;
+
+#define REGSET_HAS(s, r)	((s)->bits[(r) / CHAR_BIT] & (1 << ((r) % CHAR_BIT)))
+#define REGSET_ADD(s, r)	((s)->bits[(r) / CHAR_BIT] |= 1 << ((r) % CHAR_BIT))
+#define REGSET_DEL(s, r)	((s)->bits[(r) / CHAR_BIT] &= ~(1 << ((r) % CHAR_BIT)))
+
+/* a register operand: bits [shift...shift + 8) of `bc[word]', and whether
+ * the instruction reads and/or writes it
+ */
+typedef struct RegOperand {
+	size_t	word;
+	int	shift;
+	int	access;
+} RegOperand;
+
+enum {
+	RA_READ		= 1 << 0,
+	RA_WRITE	= 1 << 1
+};
+
+#define OPERAND_REG(bc, op)	((int)(((bc)[(op).word] >> (op).shift) & 0xff))
+
+static void set_operand(RegOperand *op, size_t word, int shift, int access)
+{
+	op->word = word;
+	op->shift = shift;
+	op->access = access;
+}
+
+/* fills `ops' with the register operands of the instruction at `bc[i]'
+ * (at most 2 + MAX_REGS of them, for a call), returns their number
+ */
+static int reg_operands(const spn_uword *bc, size_t i, RegOperand *ops)
+{
+	spn_uword ins = bc[i];
+	int n = 0, nargs = 0, dst = RA_WRITE, k;
+
+	switch (OPCODE(ins)) {
+	case SPN_INS_CALL:
+	case SPN_INS_TAILCALL:		n = 2; nargs = OPC(ins); break;
+	case SPN_INS_CONCAT_ALL:	n = 1; nargs = OPB(ins); break;
+
+	case SPN_INS_EQ:
+	case SPN_INS_NE:
+	case SPN_INS_LT:
+	case SPN_INS_LE:
+	case SPN_INS_GT:
+	case SPN_INS_GE:
+	case SPN_INS_ADD:
+	case SPN_INS_SUB:
+	case SPN_INS_MUL:
+	case SPN_INS_DIV:
+	case SPN_INS_MOD:
+	case SPN_INS_AND:
+	case SPN_INS_OR:
+	case SPN_INS_XOR:
+	case SPN_INS_SHL:
+	case SPN_INS_SHR:
+	case SPN_INS_CONCAT:
+	case SPN_INS_ARRGET:		n = 3; break;
+
+	case SPN_INS_NEG:
+	case SPN_INS_BITNOT:
+	case SPN_INS_LOGNOT:
+	case SPN_INS_SIZEOF:
+	case SPN_INS_TYPEOF:
+	case SPN_INS_MOV:
+	case SPN_INS_NTHARG:
+	case SPN_INS_ADDI:
+	case SPN_INS_FLDGET:		n = 2; break;
+
+	case SPN_INS_LDCONST:
+	case SPN_INS_LDSYM:
+	case SPN_INS_NEWARR:		n = 1; break;
+
+	case SPN_INS_INC:
+	case SPN_INS_DEC:		n = 1; dst = RA_READ | RA_WRITE; break;
+
+	case SPN_INS_ARRSET:		n = 3; dst = RA_READ; break;
+
+	case SPN_INS_JEQ:
+	case SPN_INS_JNE:
+	case SPN_INS_JLT:
+	case SPN_INS_JLE:
+	case SPN_INS_JGT:
+	case SPN_INS_JGE:
+	case SPN_INS_FLDSET:		n = 2; dst = RA_READ; break;
+
+	case SPN_INS_RET:
+	case SPN_INS_JZE:
+	case SPN_INS_JNZ:		n = 1; dst = RA_READ; break;
+
+	case SPN_INS_NEXT:
+		/* the key, the value and the cursor are only written if
+		 * there is another pair, so they're considered live before
+		 * the instruction just like the array is (the cursor is
+		 * read anyway)
+		 */
+		set_operand(&ops[0], i, 8, RA_READ);
+		set_operand(&ops[1], i, 16, RA_READ | RA_WRITE);
+		set_operand(&ops[2], i, 24, RA_READ | RA_WRITE);
+		set_operand(&ops[3], i + 2, 0, RA_READ | RA_WRITE);
+		return 4;
+
+	default:			n = 0; break;
+	}
+
+	/* operands A, B and C, then the octets following the instruction.
+	 * The destination is always operand A.
+	 */
+	for (k = 0; k < n; k++) {
+		set_operand(&ops[k], i, 8 * (k + 1), k == 0 ? dst : RA_READ);
+	}
+
+	for (k = 0; k < nargs; k++) {
+		set_operand(&ops[n + k], i + 1 + k / SPN_WORD_OCTETS, 8 * (k % SPN_WORD_OCTETS), RA_READ);
+	}
+
+	return n + nargs;
+}
+
+/* stores the positions (in `insns') of the successors of the `k'th
+ * instruction in `succ', returns their number. `at[addr - begin]' is the
+ * position of the instruction at `addr' in the function occupying
+ * `bc[begin...end)'; `at[end - begin]' stands for the end of the function.
+ */
+static int successors(const spn_uword *bc, const size_t *insns, const size_t *at, size_t begin, size_t end, size_t k, size_t *succ)
+{
+	size_t i = insns[k];
+	spn_uword ins = bc[i];
+	int nsucc = 0;
+
+	if (OPCODE(ins) == SPN_INS_RET) {
+		return 0;
+	}
+
+	if (OPCODE(ins) != SPN_INS_JMP) {
+		succ[nsucc++] = k + 1;
+	}
+
+	if (is_jump(ins)) {
+		size_t dst = jump_target(bc, i);
+		assert(dst >= begin && dst <= end);
+		succ[nsucc++] = at[dst - begin];
+	}
+
+	return nsucc;
+}
+
+/* the union of the live sets of the successors of the `k'th instruction */
+static void live_out(const spn_uword *bc, const size_t *insns, const size_t *at, size_t begin, size_t end, size_t k, const RegSet *live, RegSet *out)
+{
+	size_t succ[2];
+	int nsucc = successors(bc, insns, at, begin, end, k, succ);
+	int s;
+	size_t b;
+
+	memset(out, 0, sizeof(*out));
+
+	for (s = 0; s < nsucc; s++) {
+		for (b = 0; b < sizeof(out->bits); b++) {
+			out->bits[b] |= live[succ[s]].bits[b];
+		}
+	}
+}
+
+/* reassigns the registers of the function whose code is `bc[begin...end)'
+ * and which has `argc' declared arguments and `nregs' registers, then
+ * returns the new number of registers. The bodies of nested functions are
+ * processed recursively, and their headers are updated.
+ */
+static int allocate_registers(spn_uword *bc, size_t begin, size_t end, int argc, int nregs)
+{
+	RegOperand ops[2 + MAX_REGS];
+	int color[MAX_REGS], pref[MAX_REGS], order[MAX_REGS];
+	size_t *insns, *at;
+	RegSet *live, *interf, seen;
+	size_t i, k, n, len;
+	int norder = 0, newnregs, changed, nops, j, r, q;
+
+	insns = malloc((end - begin) * sizeof(*insns));
+	at = malloc((end - begin + 1) * sizeof(*at));
+	if (insns == NULL || at == NULL) {
+		abort();
+	}
+
+	/* collect the instructions of this function */
+	for (i = begin, n = 0; i < end; i += len) {
+		len = insn_length(bc, i);
+		at[i - begin] = n;
+		insns[n++] = i;
+
+		if (OPCODE(bc[i]) == SPN_INS_GLBSYM) {
+			spn_uword *hdr = &bc[i + len - SPN_FUNCHDR_LEN];
+			size_t entry = i + len;
+			size_t bodylen = hdr[SPN_FUNCHDR_IDX_BODYLEN];
+
+			hdr[SPN_FUNCHDR_IDX_NREGS] = allocate_registers(
+				bc,
+				entry,
+				entry + bodylen,
+				hdr[SPN_FUNCHDR_IDX_ARGC],
+				hdr[SPN_FUNCHDR_IDX_NREGS]
+			);
+
+			len += bodylen;
+		}
+	}
+
+	at[end - begin] = n;
+
+	/* operands are only 8 bits wide, so this can't be right anyway */
+	if (n == 0 || nregs > MAX_REGS) {
+		free(insns);
+		free(at);
+		return nregs;
+	}
+
+	/* don't touch code that refers to registers outside of the frame */
+	for (k = 0; k < n; k++) {
+		nops = reg_operands(bc, insns[k], ops);
+
+		for (j = 0; j < nops; j++) {
+			if (OPERAND_REG(bc, ops[j]) >= nregs) {
+				free(insns);
+				free(at);
+				return nregs;
+			}
+		}
+	}
+
+	/* compute the registers live before each instruction until a fixed
+	 * point is reached. `live[n]' (at the end) is always empty.
+	 */
+	live = calloc(n + 1, sizeof(*live));
+	interf = calloc(nregs, sizeof(*interf));
+	if (live == NULL || interf == NULL) {
+		abort();
+	}
+
+	do {
+		changed = 0;
+
+		for (k = n; k-- > 0; ) {
+			RegSet in;
+
+			live_out(bc, insns, at, begin, end, k, live, &in);
+			nops = reg_operands(bc, insns[k], ops);
+
+			for (j = 0; j < nops; j++) {
+				if (ops[j].access == RA_WRITE) {
+					REGSET_DEL(&in, OPERAND_REG(bc, ops[j]));
+				}
+			}
+
+			for (j = 0; j < nops; j++) {
+				if (ops[j].access & RA_READ) {
+					REGSET_ADD(&in, OPERAND_REG(bc, ops[j]));
+				}
+			}
+
+			if (memcmp(&in, &live[k], sizeof(in)) != 0) {
+				live[k] = in;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	/* build the interference graph, record move-related registers
+	 * and the order of the first appearance of registers
+	 */
+	memset(&seen, 0, sizeof(seen));
+
+	for (r = 0; r < nregs; r++) {
+		color[r] = -1;
+		pref[r] = -1;
+	}
+
+	for (k = 0; k < n; k++) {
+		int mov = OPCODE(bc[insns[k]]) == SPN_INS_MOV;
+		nops = reg_operands(bc, insns[k], ops);
+
+		for (j = 0; j < nops; j++) {
+			r = OPERAND_REG(bc, ops[j]);
+
+			if (!REGSET_HAS(&seen, r)) {
+				REGSET_ADD(&seen, r);
+				order[norder++] = r;
+			}
+		}
+
+		/* every register written interferes with what's live after the
+		 * instruction and with the other operands
+		 */
+		for (j = 0; j < nops; j++) {
+			RegSet out;
+			int dst, src, m;
+
+			if ((ops[j].access & RA_WRITE) == 0) {
+				continue;
+			}
+
+			dst = OPERAND_REG(bc, ops[j]);
+			src = mov ? OPERAND_REG(bc, ops[1]) : -1;
+
+			live_out(bc, insns, at, begin, end, k, live, &out);
+
+			for (m = 0; m < nops; m++) {
+				REGSET_ADD(&out, OPERAND_REG(bc, ops[m]));
+			}
+
+			for (r = 0; r < nregs; r++) {
+				if (REGSET_HAS(&out, r) && r != dst && r != src) {
+					REGSET_ADD(&interf[dst], r);
+					REGSET_ADD(&interf[r], dst);
+				}
+			}
+
+			if (mov && dst != src) {
+				if (pref[dst] < 0) {
+					pref[dst] = src;
+				}
+
+				if (pref[src] < 0) {
+					pref[src] = dst;
+				}
+			}
+		}
+	}
+
+	/* pin the arguments and the registers live on entry */
+	for (r = 0; r < nregs; r++) {
+		if (r < argc || REGSET_HAS(&live[0], r)) {
+			color[r] = r;
+		}
+	}
+
+	newnregs = max(argc, 1);
+
+	for (j = 0; j < norder; j++) {
+		RegSet taken;
+		int c;
+
+		r = order[j];
+
+		if (color[r] < 0) {
+			memset(&taken, 0, sizeof(taken));
+
+			for (q = 0; q < nregs; q++) {
+				if (REGSET_HAS(&interf[r], q) && color[q] >= 0) {
+					REGSET_ADD(&taken, color[q]);
+				}
+			}
+
+			if (pref[r] >= 0 && color[pref[r]] >= 0 && !REGSET_HAS(&taken, color[pref[r]])) {
+				c = color[pref[r]];
+			} else {
+				c = 0;
+				while (REGSET_HAS(&taken, c)) {
+					c++;
+				}
+			}
+
+			assert(c < nregs);
+			color[r] = c;
+		}
+
+		newnregs = max(newnregs, color[r] + 1);
+	}
+
+	/* rewrite the operands */
+	for (k = 0; k < n; k++) {
+		nops = reg_operands(bc, insns[k], ops);
+
+		for (j = 0; j < nops; j++) {
+			spn_uword mask = (spn_uword)(0xff) << ops[j].shift;
+			spn_uword reg = color[OPERAND_REG(bc, ops[j])];
+			bc[ops[j].word] = (bc[ops[j].word] & ~mask) | (reg << ops[j].shift);
+		}
+	}
+
+	free(insns);
+	free(at);
+	free(live);
+	free(interf);
+
+	return newnregs;
+}
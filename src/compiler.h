@@ -23,10 +23,21 @@ typedef struct SpnCompiler SpnCompiler;
 SPN_API SpnCompiler	*spn_compiler_new();
 SPN_API void		 spn_compiler_free(SpnCompiler *cmp);
 
+/* turns optimizations (constant folding, dead code elimination and
+ * peephole optimization of the bytecode) on or off. Off by default.
+ * When enabled, the AST passed to spn_compiler_compile() is simplified
+ * in place.
+ */
+SPN_API void		 spn_compiler_set_optimize(SpnCompiler *cmp, int enable);
+SPN_API int		 spn_compiler_get_optimize(SpnCompiler *cmp);
+
 /* returns a pointer to bytecode that can be passed to spn_vm_exec()
  * or it can be written to a file. If `sz' is not a NULL pointer, it is
  * set to the length of the bytecode (measured in sizeof(spn_uword) units).
- * the returned pointer must be `free()`ed by the caller.
+ * The bytecode is allocated from the pool which was current when the
+ * compiler was created, and it belongs to the caller: with the default
+ * pool, it must be `free()`ed, otherwise it must be released using
+ * spn_mem_free(pool, SPN_MEM_BYTECODE, bc, *sz * sizeof(spn_uword)).
  * returns NULL on error.
  */
 SPN_API spn_uword	*spn_compiler_compile(SpnCompiler *cmp, SpnAST *ast, size_t *sz);
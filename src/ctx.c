@@ -8,18 +8,70 @@
  * A convenience context API
  */
 
+/* the temporary files of the bytecode cache are named after the process
+ * on POSIX systems, where rename() also replaces the old entry atomically.
+ * This must come before any header is included.
+ */
+#ifndef SPN_USE_GETPID
+#if defined(__unix__) || defined(__APPLE__)
+#define SPN_USE_GETPID 1
+#else
+#define SPN_USE_GETPID 0
+#endif
+#endif
+
+#if SPN_USE_GETPID
+#define _POSIX_C_SOURCE 200112L
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
 #include "ctx.h"
+#include "array.h"
+#include "verify.h"
+#include "private.h"
+
+/* layout of the trailer of a bytecode cache entry (see below) */
+#define CACHE_MAGIC		0x4350537f	/* "\x7fSPC" */
+
+#define CACHE_IDX_HASH		0
+#define CACHE_IDX_FNV		1
+#define CACHE_IDX_LENGTH	2
+#define CACHE_IDX_VERSION	3
+#define CACHE_IDX_MAGIC		4
+#define CACHE_TRAILER_LEN	5
 
-static void prepend_bytecode_list(SpnContext *ctx, spn_uword *bc, size_t len);
-static void free_bytecode_list(struct spn_bc_list *head);
+static SpnContext *new_context(SpnPool *pool);
+static void memlimit_exceeded(void *ud);
+
+static void prepend_bytecode_list(SpnContext *ctx, spn_uword *bc, size_t len, size_t mapsize);
+static void free_bytecode_list(SpnContext *ctx);
+
+static char *cache_path(SpnContext *ctx, const char *fname);
+static void cache_trailer(SpnContext *ctx, const char *src, spn_uword *trailer);
+static spn_uword *cache_lookup(SpnContext *ctx, const char *path, const spn_uword *trailer);
+static void cache_store(SpnContext *ctx, const char *path, const spn_uword *bc, size_t len, const spn_uword *trailer);
 
 SpnContext *spn_ctx_new()
 {
-	SpnContext *ctx = malloc(sizeof(*ctx));
-	if (ctx == NULL) {
-		abort();
-	}
+	return new_context(spn_pool_new());
+}
+
+SpnContext *spn_ctx_new_allocator(SpnAllocator alloc, void *ud)
+{
+	return new_context(spn_pool_new_allocator(alloc, ud));
+}
 
+static SpnContext *new_context(SpnPool *pool)
+{
+	SpnPool *prev = spn_pool_set_current(pool);
+	SpnContext *ctx = spn_mem_xalloc(pool, SPN_MEM_OTHER, sizeof(*ctx));
+
+	ctx->pool   = pool;
 	ctx->p      = spn_parser_new();
 	ctx->cmp    = spn_compiler_new();
 	ctx->vm     = spn_vm_new();
@@ -27,31 +79,64 @@ SpnContext *spn_ctx_new()
 	ctx->errmsg = NULL;
 	ctx->info   = NULL;
 
+	ctx->cachedir    = NULL;
+	ctx->cachehits   = 0;
+	ctx->cachemisses = 0;
+
 	spn_vm_setcontext(ctx->vm, ctx);
 	spn_load_stdlib(ctx->vm);
 
+	spn_pool_set_current(prev);
+
 	return ctx;
 }
 
 void spn_ctx_free(SpnContext *ctx)
 {
+	SpnPool *pool = ctx->pool;
+
 	spn_parser_free(ctx->p);
 	spn_compiler_free(ctx->cmp);
 	spn_vm_free(ctx->vm);
 
-	free_bytecode_list(ctx->bclist);
-	free(ctx);
+	free_bytecode_list(ctx);
+	spn_ctx_setcachedir(ctx, NULL);
+	spn_mem_free(pool, SPN_MEM_OTHER, ctx, sizeof(*ctx));
+
+	spn_pool_free(pool);
+}
+
+const SpnMemStats *spn_ctx_memstats(SpnContext *ctx)
+{
+	return spn_pool_stats(ctx->pool);
+}
+
+void spn_ctx_setmemlimit(SpnContext *ctx, size_t limit)
+{
+	spn_pool_setlimit(ctx->pool, limit, memlimit_exceeded, ctx);
 }
 
+/* called by the pool while the context is allocating */
+static void memlimit_exceeded(void *ud)
+{
+	SpnContext *ctx = ud;
+	spn_vm_interrupt(ctx->vm, "memory limit exceeded");
+}
+
+
 spn_uword *spn_ctx_loadstring(SpnContext *ctx, const char *str)
 {
 	SpnAST *ast;
 	spn_uword *bc;
 	size_t len;
+	SpnPool *prev;
+
+	prev = spn_pool_set_current(ctx->pool);
 
 	/* attempt parsing, handle error */
 	ast = spn_parser_parse(ctx->p, str);
 	if (ast == NULL) {
+		spn_pool_set_current(prev);
 		ctx->errmsg = ctx->p->errmsg;
 		return NULL;
 	}
@@ -59,22 +144,32 @@ spn_uword *spn_ctx_loadstring(SpnContext *ctx, const char *str)
 	/* attempt compilation, handle error */
 	bc = spn_compiler_compile(ctx->cmp, ast, &len);
 	spn_ast_free(ast);
+	spn_pool_set_current(prev);
 
 	if (bc == NULL) {
 		ctx->errmsg = spn_compiler_errmsg(ctx->cmp);
 		return NULL;
 	}
 
+#ifndef NDEBUG
+	/* the VM relies on the compiler producing valid code */
+	{
+		size_t addr;
+		assert(spn_verify(bc, len, &addr) == NULL);
+	}
+#endif
+
 	/* prepend bytecode to the link list */
-	prepend_bytecode_list(ctx, bc, len);
+	prepend_bytecode_list(ctx, bc, len, 0);
 
 	return bc;
 }
 
 spn_uword *spn_ctx_loadsrcfile(SpnContext *ctx, const char *fname)
 {
-	char *src;
+	char *src, *path;
 	spn_uword *bc;
+	spn_uword trailer[CACHE_TRAILER_LEN];
 
 	src = spn_read_text_file(fname);
 	if (src == NULL) {
@@ -82,7 +177,29 @@ spn_uword *spn_ctx_loadsrcfile(SpnContext *ctx, const char *fname)
 		return NULL;
 	}
 
-	bc = spn_ctx_loadstring(ctx, src);
+	if (ctx->cachedir == NULL) {
+		bc = spn_ctx_loadstring(ctx, src);
+		free(src);
+		return bc;
+	}
+
+	path = cache_path(ctx, fname);
+	cache_trailer(ctx, src, trailer);
+
+	bc = cache_lookup(ctx, path, trailer);
+	if (bc != NULL) {
+		ctx->cachehits++;
+	} else {
+		ctx->cachemisses++;
+
+		/* on success, the new bytecode is at the head of the list */
+		bc = spn_ctx_loadstring(ctx, src);
+		if (bc != NULL) {
+			cache_store(ctx, path, bc, ctx->bclist->len, trailer);
+		}
+	}
+
+	free(path);
 	free(src);
 
 	return bc;
@@ -91,9 +208,10 @@ spn_uword *spn_ctx_loadsrcfile(SpnContext *ctx, const char *fname)
 spn_uword *spn_ctx_loadobjfile(SpnContext *ctx, const char *fname)
 {
 	spn_uword *bc;
-	size_t filesize, nwords;
+	size_t filesize, nwords, addr;
+	const char *err;
 
-	bc = spn_read_binary_file(fname, &filesize);
+	bc = spn_map_binary_file(fname, &filesize);
 	if (bc == NULL) {
 		ctx->errmsg = "Sparkling: I/O error: could not read object file";
 		return NULL;
@@ -103,11 +221,36 @@ spn_uword *spn_ctx_loadobjfile(SpnContext *ctx, const char *fname)
 	 * as the number of machine words in the bytecode
 	 */
 	nwords = filesize / sizeof(spn_uword);
-	prepend_bytecode_list(ctx, bc, nwords);
+
+	/* an object file may come from anywhere, and the VM doesn't
+	 * check the code it runs, so do that once, before running it
+	 */
+	err = spn_verify(bc, nwords, &addr);
+	if (err != NULL) {
+		spn_unmap_binary_file(bc, filesize);
+		sprintf(ctx->errbuf, "Sparkling: invalid bytecode at address 0x%08lx: %.64s", (unsigned long)(addr), err);
+		ctx->errmsg = ctx->errbuf;
+		return NULL;
+	}
+
+	prepend_bytecode_list(ctx, bc, nwords, filesize);
 
 	return bc;
 }
 
+void spn_ctx_setcachedir(SpnContext *ctx, const char *dir)
+{
+	if (ctx->cachedir != NULL) {
+		spn_mem_free(ctx->pool, SPN_MEM_OTHER, ctx->cachedir, strlen(ctx->cachedir) + 1);
+		ctx->cachedir = NULL;
+	}
+
+	if (dir != NULL) {
+		ctx->cachedir = spn_mem_xalloc(ctx->pool, SPN_MEM_OTHER, strlen(dir) + 1);
+		strcpy(ctx->cachedir, dir);
+	}
+}
+
 SpnValue *spn_ctx_execstring(SpnContext *ctx, const char *str)
 {
 	spn_uword *bc = spn_ctx_loadstring(ctx, str);
@@ -141,8 +284,11 @@ SpnValue *spn_ctx_execobjfile(SpnContext *ctx, const char *fname)
 /* NB: this does **not** add the bytecode to the linked list */
 SpnValue *spn_ctx_execbytecode(SpnContext *ctx, spn_uword *bc)
 {
+	SpnPool *prev = spn_pool_set_current(ctx->pool);
 	SpnValue *val = spn_vm_exec(ctx->vm, bc);
-	if (val == NULL) {
+	spn_pool_set_current(prev);
+
+	if (val == NULL && !spn_vm_suspended(ctx->vm)) {
 		ctx->errmsg = spn_vm_errmsg(ctx->vm);
 		return NULL;
 	}
@@ -150,28 +296,194 @@ SpnValue *spn_ctx_execbytecode(SpnContext *ctx, spn_uword *bc)
 	return val;
 }
 
-/* private bytecode link list functions */
+SpnValue *spn_ctx_resume(SpnContext *ctx)
+{
+	SpnPool *prev = spn_pool_set_current(ctx->pool);
+	SpnValue *val = spn_vm_resume(ctx->vm);
+	spn_pool_set_current(prev);
+
+	if (val == NULL && !spn_vm_suspended(ctx->vm)) {
+		ctx->errmsg = spn_vm_errmsg(ctx->vm);
+		return NULL;
+	}
+
+	return val;
+}
 
-static void prepend_bytecode_list(SpnContext *ctx, spn_uword *bc, size_t len)
+/* The bytecode cache
+ *
+ * A cache entry is an ordinary object file followed by a trailer of
+ * CACHE_TRAILER_LEN words, so that it can be mapped and executed in place.
+ * The trailer identifies the source text (by two independent hashes and
+ * its length) and the compiler that produced the code, and it ends in a
+ * magic number, so a truncated file never matches.
+ * The file name is derived from the path of the source file, hence each
+ * source file has at most one entry, which is replaced when it changes.
+ */
+
+/* 32-bit FNV-1a, a second hash independent of spn_hash() */
+static unsigned long fnv_hash(const char *str, size_t n)
+{
+	unsigned long h = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		h ^= (unsigned char)(str[i]);
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+
+	return h;
+}
+
+/* returns "<cachedir>/<hash of fname>.spo", to be free()'d by the caller */
+static char *cache_path(SpnContext *ctx, const char *fname)
+{
+	size_t n = strlen(fname);
+	char *path = malloc(strlen(ctx->cachedir) + 1 + 16 + 4 + 1);
+
+	if (path == NULL) {
+		abort();
+	}
+
+	sprintf(
+		path,
+		"%s/%08lx%08lx.spo",
+		ctx->cachedir,
+		spn_hash(fname, n) & 0xffffffffUL,
+		fnv_hash(fname, n)
+	);
+
+	return path;
+}
+
+static void cache_trailer(SpnContext *ctx, const char *src, spn_uword *trailer)
+{
+	size_t n = strlen(src);
+
+	trailer[CACHE_IDX_HASH] = spn_hash(src, n) & 0xffffffffUL;
+	trailer[CACHE_IDX_FNV] = fnv_hash(src, n);
+	trailer[CACHE_IDX_LENGTH] = n & 0xffffffffUL;
+	trailer[CACHE_IDX_VERSION] = (SPN_BYTECODE_VERSION & 0xff) << 24
+				   | (SPN_INS_COUNT & 0xff) << 16
+				   | (sizeof(spn_uword) & 0xff) << 8
+				   | (spn_compiler_get_optimize(ctx->cmp) != 0);
+	trailer[CACHE_IDX_MAGIC] = CACHE_MAGIC;
+}
+
+/* maps the cache entry at `path' and adds it to the bytecode list
+ * if its trailer is the same as `trailer' and its code passes the
+ * verifier (since the cache directory may be writable by others).
+ * Returns NULL otherwise.
+ */
+static spn_uword *cache_lookup(SpnContext *ctx, const char *path, const spn_uword *trailer)
+{
+	size_t filesize, nwords, addr;
+	spn_uword *bc = spn_map_binary_file(path, &filesize);
+
+	if (bc == NULL) {
+		return NULL;
+	}
+
+	nwords = filesize / sizeof(spn_uword);
+
+	if (filesize % sizeof(spn_uword) != 0
+	 || nwords < SPN_PRGHDR_LEN + CACHE_TRAILER_LEN
+	 || bc[SPN_HDRIDX_MAGIC] != SPN_MAGIC
+	 || memcmp(bc + nwords - CACHE_TRAILER_LEN, trailer, CACHE_TRAILER_LEN * sizeof(spn_uword)) != 0
+	 || spn_verify(bc, nwords - CACHE_TRAILER_LEN, &addr) != NULL) {
+		spn_unmap_binary_file(bc, filesize);
+		return NULL;
+	}
+
+	prepend_bytecode_list(ctx, bc, nwords - CACHE_TRAILER_LEN, filesize);
+	return bc;
+}
+
+/* writes a temporary file first and renames it. Each writer has a file of
+ * its own, named after the process and the context (which only writes one
+ * at a time), so processes starting at once don't clobber each other's
+ * files, and an entry only ever appears complete. Where rename() can't
+ * replace an existing file, the old entry is removed first, and a reader
+ * may then find none; a damaged one is still rejected by the trailer and
+ * the verifier.
+ */
+static void cache_store(SpnContext *ctx, const char *path, const spn_uword *bc, size_t len, const spn_uword *trailer)
 {
-	struct spn_bc_list *node = malloc(sizeof(*node));
-	if (node == NULL) {
+	char *tmp = malloc(strlen(path) + 4 + 3 * sizeof(long) + 1 + 4 * sizeof(void *) + 16);
+	FILE *f;
+	int ok;
+
+	if (tmp == NULL) {
 		abort();
 	}
 
+#if SPN_USE_GETPID
+	sprintf(tmp, "%s.tmp%lu-%p", path, (unsigned long)(getpid()), (void *)(ctx));
+#else
+	sprintf(tmp, "%s.tmp%p", path, (void *)(ctx));
+#endif
+
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(tmp);
+		return;
+	}
+
+	ok = fwrite(bc, sizeof(bc[0]), len, f) == len
+	  && fwrite(trailer, sizeof(trailer[0]), CACHE_TRAILER_LEN, f) == CACHE_TRAILER_LEN;
+
+	if (fclose(f) != 0) {
+		ok = 0;
+	}
+
+#if SPN_USE_GETPID
+	ok = ok && rename(tmp, path) == 0;
+#else
+	/* rename() doesn't replace an existing file on every platform */
+	if (ok && rename(tmp, path) != 0) {
+		remove(path);
+		ok = rename(tmp, path) == 0;
+	}
+#endif
+
+	if (!ok) {
+		remove(tmp);
+	}
+
+	free(tmp);
+}
+
+/* private bytecode link list functions */
+
+static void prepend_bytecode_list(SpnContext *ctx, spn_uword *bc, size_t len, size_t mapsize)
+{
+	struct spn_bc_list *node = spn_mem_xalloc(ctx->pool, SPN_MEM_BYTECODE, sizeof(*node));
+
 	node->bc = bc;
 	node->len = len;
+	node->mapsize = mapsize;
 	node->next = ctx->bclist;
 	ctx->bclist = node;
 }
 
-static void free_bytecode_list(struct spn_bc_list *head)
+/* the code of a mapped file is not counted, the compiled one is */
+static void free_bytecode_list(SpnContext *ctx)
 {
+	struct spn_bc_list *head = ctx->bclist;
+
 	while (head != NULL) {
 		struct spn_bc_list *tmp = head->next;
-		free(head->bc);
-		free(head);
+
+		if (head->mapsize != 0) {
+			spn_unmap_binary_file(head->bc, head->mapsize);
+		} else {
+			spn_mem_free(ctx->pool, SPN_MEM_BYTECODE, head->bc, head->len * sizeof(head->bc[0]));
+		}
+
+		spn_mem_free(ctx->pool, SPN_MEM_BYTECODE, head, sizeof(*head));
 		head = tmp;
 	}
+
+	ctx->bclist = NULL;
 }
 
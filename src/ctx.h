@@ -21,6 +21,7 @@
 struct spn_bc_list {
 	spn_uword *bc;
 	size_t len;
+	size_t mapsize; /* nonzero if `bc' is a mapped file of this size */
 	struct spn_bc_list *next;
 };
 
@@ -28,14 +29,46 @@ typedef struct SpnContext {
 	SpnParser *p;
 	SpnCompiler *cmp;
 	SpnVMachine *vm;
+	SpnPool *pool; /* objects created through the context live here */
 	struct spn_bc_list *bclist; /* holds all bytecodes ever compiled */
 	const char *errmsg; /* most recent error message */
 	void *info; /* user data initialized to NULL, use freely */
+	char *cachedir; /* private, see spn_ctx_setcachedir() */
+	unsigned long cachehits; /* readonly, ditto */
+	unsigned long cachemisses; /* readonly, ditto */
+	char errbuf[128]; /* private, holds formatted error messages */
 } SpnContext;
 
+/* every context has its own object pool, which is made current while
+ * the context compiles or runs code. Freeing the context releases the
+ * pool in bulk (see spn_pool_free() for objects that outlive it).
+ * All the memory of the context (its objects, their buffers, the stack of
+ * its VM, its bytecode...) comes from that pool, thus from `alloc` if the
+ * context is created by spn_ctx_new_allocator() (see SpnAllocator).
+ */
 SPN_API SpnContext	*spn_ctx_new();
+SPN_API SpnContext	*spn_ctx_new_allocator(SpnAllocator alloc, void *ud);
 SPN_API void		 spn_ctx_free(SpnContext *ctx);
 
+/* returns the memory statistics of the pool of the context (see
+ * SpnMemStats). The pointer stays valid while the context is alive,
+ * and the numbers it points to are kept up to date.
+ */
+SPN_API const SpnMemStats *spn_ctx_memstats(SpnContext *ctx);
+
+/* sets a limit (in bytes, 0 means none) on the memory in use by the context.
+ * When a running program allocates beyond it, the program fails with the
+ * runtime error "memory limit exceeded" at its next step (see
+ * spn_vm_interrupt()), so it can overshoot the limit by what a single step
+ * allocates. Buffers sized by the script (strings, numeric buffers...) are
+ * refused instead, and the step which asks for one fails right away (see
+ * spn_pool_setlimit()). So does a program which
+ * starts over the limit, e. g. because loading it took too much memory.
+ * The frames of the failed program are released when the next one is run
+ * (or when the context is freed), along with the memory they hold.
+ */
+SPN_API void		 spn_ctx_setmemlimit(SpnContext *ctx, size_t limit);
+
 /* these return non-owning pointers that should *not* be freed --
  * they will be deallocated automatically when you free the context.
  */
@@ -43,10 +76,30 @@ SPN_API spn_uword	*spn_ctx_loadstring(SpnContext *ctx, const char *str);
 SPN_API spn_uword	*spn_ctx_loadsrcfile(SpnContext *ctx, const char *fname);
 SPN_API spn_uword	*spn_ctx_loadobjfile(SpnContext *ctx, const char *fname);
 
+/* enables the bytecode cache of spn_ctx_loadsrcfile() (and
+ * spn_ctx_execsrcfile()), or disables it if `dir' is NULL (the default).
+ * The compiled code of each source file is stored in an object file
+ * in `dir' (which must exist), named after the path of the source file.
+ * The next time the same path is loaded, the cached code is mapped
+ * instead of recompiling the source, provided it was compiled from the
+ * same text, with the same optimization setting and by a compiler with
+ * the same bytecode format; otherwise the cache entry is replaced.
+ * The cache is best effort: I/O errors merely result in a miss.
+ * `cachehits' and `cachemisses' count the loads that used an entry
+ * and those that had to compile.
+ */
+SPN_API void		 spn_ctx_setcachedir(SpnContext *ctx, const char *dir);
+
 SPN_API SpnValue	*spn_ctx_execstring(SpnContext *ctx, const char *str);
 SPN_API SpnValue	*spn_ctx_execsrcfile(SpnContext *ctx, const char *fname);
 SPN_API SpnValue	*spn_ctx_execobjfile(SpnContext *ctx, const char *fname);
 SPN_API SpnValue	*spn_ctx_execbytecode(SpnContext *ctx, spn_uword *bc);
 
+/* continues the program which was suspended (see spn_vm_setbudget()). The
+ * functions which run code return NULL without setting `errmsg' when the
+ * program is suspended.
+ */
+SPN_API SpnValue	*spn_ctx_resume(SpnContext *ctx);
+
 #endif /* SPN_CTX_H */
 
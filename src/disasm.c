@@ -65,6 +65,44 @@ void spn_disasm(spn_uword *bc, size_t len)
 	disasm_symtab(bc, symtaboff, len - symtaboff, symtablen);
 }
 
+void spn_disasm_stats(spn_uword *bc, size_t len)
+{
+	size_t i, symtaboff;
+
+	if (bc[SPN_HDRIDX_MAGIC] != SPN_MAGIC) {
+		bail("invalid magic number");
+	}
+
+	symtaboff = bc[SPN_HDRIDX_SYMTABOFF];
+	if (symtaboff > len) {
+		bail("symbol table offset is out of bounds");
+	}
+
+	printf("# entry\t\tregs\targs\tlength\tfunction\n");
+	printf(
+		"0x%08lx\t%lu\t0\t%lu\t<main program>\n",
+		(unsigned long)(SPN_PRGHDR_LEN),
+		(unsigned long)(bc[SPN_HDRIDX_FRMSIZE]),
+		(unsigned long)(symtaboff - SPN_PRGHDR_LEN)
+	);
+
+	/* the bodies of functions aren't skipped, so nested ones are found */
+	for (i = SPN_PRGHDR_LEN; i < symtaboff; i += insn_length(bc, i)) {
+		if (OPCODE(bc[i]) == SPN_INS_GLBSYM) {
+			size_t entry = i + insn_length(bc, i);
+			spn_uword *hdr = &bc[entry - SPN_FUNCHDR_LEN];
+
+			printf(
+				"0x%08lx\t%lu\t%lu\t%lu\t%s\n",
+				(unsigned long)(entry),
+				(unsigned long)(hdr[SPN_FUNCHDR_IDX_NREGS]),
+				(unsigned long)(hdr[SPN_FUNCHDR_IDX_ARGC]),
+				(unsigned long)(hdr[SPN_FUNCHDR_IDX_BODYLEN]),
+				(const char *)(&bc[i + 1])
+			);
+		}
+	}
+}
 
 /* hopefully there'll be no more than 256 levels of nested function bodies.
  * if you write code that has more of them, you should feel bad.
@@ -72,6 +110,68 @@ void spn_disasm(spn_uword *bc, size_t len)
 #define MAX_FUNC_NEST	0x100
 
 /* process executable section ("text") */
+const char *spn_opcode_name(int opcode)
+{
+	/* the order of the names must match that of `enum spn_vm_ins' */
+	static const char *const names[] = {
+		"call",
+		"ret",
+		"jmp",
+		"jze",
+		"jnz",
+		"eq",
+		"ne",
+		"lt",
+		"le",
+		"gt",
+		"ge",
+		"add",
+		"sub",
+		"mul",
+		"div",
+		"mod",
+		"neg",
+		"inc",
+		"dec",
+		"and",
+		"or",
+		"xor",
+		"shl",
+		"shr",
+		"bitnot",
+		"lognot",
+		"sizeof",
+		"typeof",
+		"concat",
+		"ldconst",
+		"ldsym",
+		"mov",
+		"newarr",
+		"arrget",
+		"arrset",
+		"getarg",
+		"glbsym",
+		"jeq",
+		"jne",
+		"jlt",
+		"jle",
+		"jgt",
+		"jge",
+		"addi",
+		"concatall",
+		"fldget",
+		"fldset",
+		"next",
+		"tailcall"
+	};
+
+	if (opcode < 0 || opcode >= (int)COUNT(names)) {
+		return NULL;
+	}
+
+	return names[opcode];
+}
+
 static void disasm_exec(spn_uword *bc, size_t textlen)
 {
 	spn_uword *text = bc + SPN_PRGHDR_LEN;
@@ -130,13 +230,14 @@ static void disasm_exec(spn_uword *bc, size_t textlen)
 		}
 
 		switch (opcode) {
-		case SPN_INS_CALL: {
+		case SPN_INS_CALL:
+		case SPN_INS_TAILCALL: {
 			int retv = OPA(ins);
 			int func = OPB(ins);
 			int argc = OPC(ins);
 			int i;
 
-			printf("call\tr%d = r%d(", retv, func);
+			printf("%s\tr%d = r%d(", spn_opcode_name(opcode), retv, func);
 
 			for (i = 0; i < argc; i++) {
 				if (i > 0) {
@@ -396,6 +497,103 @@ static void disasm_exec(spn_uword *bc, size_t textlen)
 
 			break;
 		}
+		case SPN_INS_JEQ:
+		case SPN_INS_JNE:
+		case SPN_INS_JLT:
+		case SPN_INS_JLE:
+		case SPN_INS_JGT:
+		case SPN_INS_JGE: {
+			/* the same order as in the enum, as usual */
+			static const char *const opnames[] = {
+				"jeq",
+				"jne",
+				"jlt",
+				"jle",
+				"jgt",
+				"jge"
+			};
+
+			int opidx = opcode - SPN_INS_JEQ;
+			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+			spn_sword offset = *ip++;
+			unsigned long dstaddr = ip + offset - bc;
+
+			printf("%s\tr%d, r%d, %s, %+" SPN_SWORD_FMT "\t# target: 0x%08lx\n",
+				opnames[opidx],
+				opa,
+				opb,
+				opc ? "true" : "false",
+				offset,
+				dstaddr
+			);
+
+			break;
+		}
+		case SPN_INS_ADDI: {
+			int opa = OPA(ins), opb = OPB(ins);
+			long imm = OPSIMMC(ins);
+			printf("addi\tr%d, r%d, %ld\n", opa, opb, imm);
+			break;
+		}
+		case SPN_INS_CONCAT_ALL: {
+			int dest = OPA(ins);
+			int n = OPB(ins);
+			int i;
+
+			printf("concat\tr%d = ", dest);
+
+			for (i = 0; i < n; i++) {
+				if (i > 0) {
+					printf(" .. ");
+				}
+
+				printf("r%d", nth_arg_idx(ip, i));
+			}
+
+			printf("\n");
+
+			/* skip operand register indices */
+			ip += ROUNDUP(n, SPN_WORD_OCTETS);
+
+			break;
+		}
+		case SPN_INS_FLDGET: {
+			int opa = OPA(ins), opb = OPB(ins);
+			unsigned long symidx = ip[0], cache = ip[1];
+			ip += 2;
+
+			printf("fldget\tr%d, r%d, symbol %lu\t# r%d = r%d.<symbol %lu>, cache %lu\n", opa, opb, symidx, opa, opb, symidx, cache);
+			break;
+		}
+		case SPN_INS_FLDSET: {
+			int opa = OPA(ins), opb = OPB(ins);
+			unsigned long symidx = ip[0], cache = ip[1];
+			ip += 2;
+
+			printf("fldset\tr%d, symbol %lu, r%d\t# r%d.<symbol %lu> = r%d, cache %lu\n", opa, symidx, opb, opa, symidx, opb, cache);
+			break;
+		}
+		case SPN_INS_NEXT: {
+			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+			spn_sword offset = *ip++;
+			unsigned long dstaddr = ip + offset - bc;
+			int cursor = *ip++ & 0xff;
+
+			printf("next\tr%d, r%d, r%d, r%d, %+" SPN_SWORD_FMT "\t# r%d, r%d = next pair in r%d, cursor r%d, target: 0x%08lx\n",
+				opa,
+				opb,
+				opc,
+				cursor,
+				offset,
+				opb,
+				opc,
+				opa,
+				cursor,
+				dstaddr
+			);
+
+			break;
+		}
 		default:
 			bail("unrecognized opcode %d at address %08lx\n", opcode, addr);
 			break;
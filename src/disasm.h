@@ -17,5 +17,14 @@
 /* prints disassembly of file to standard output stream */
 SPN_API void spn_disasm(spn_uword *bc, size_t len);
 
+/* prints the number of registers, the number of declared arguments and
+ * the length of the code of the main program and of each function, one
+ * function per line, in tab-separated columns
+ */
+SPN_API void spn_disasm_stats(spn_uword *bc, size_t len);
+
+/* returns the mnemonic of an opcode, or NULL if it's not a valid one */
+SPN_API const char *spn_opcode_name(int opcode);
+
 #endif /* SPN_DISASM_H */
 
@@ -0,0 +1,173 @@
+/*
+ * func.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Function objects
+ */
+
+#include <string.h>
+
+#include "func.h"
+#include "array.h"
+#include "jit.h"
+
+static int equal_funcs(const void *l, const void *r);
+static unsigned long hash_func(void *obj);
+static void free_func(void *obj);
+
+static const SpnClass spn_class_func = {
+	"function",
+	sizeof(SpnFunction),
+	equal_funcs,
+	NULL,
+	hash_func,
+	free_func,
+	SPN_MEM_OTHER,
+	1
+};
+
+/* functions are considered equal if either their names are not
+ * NULL (i. e. none of them are closures) and the names are the
+ * same, or their names are both NULL (both functions are
+ * lambdas) and they point to the same entry point inside
+ * the bytecode.
+ */
+static int equal_funcs(const void *l, const void *r)
+{
+	const SpnFunction *lhs = l, *rhs = r;
+
+	/* a native function cannot be the same as a script function */
+	if ((lhs->flags & SPN_TFLG_NATIVE) != (rhs->flags & SPN_TFLG_NATIVE)) {
+		return 0;
+	}
+
+	/* if both are native, then they must point to the same function */
+	if (lhs->flags & SPN_TFLG_NATIVE) {
+		if ((lhs->flags & SPN_TFLG_REGARGS) != (rhs->flags & SPN_TFLG_REGARGS)) {
+			return 0;
+		}
+
+		if (lhs->flags & SPN_TFLG_REGARGS) {
+			return lhs->r.regfn == rhs->r.regfn;
+		}
+
+		return lhs->r.fn == rhs->r.fn;
+	}
+
+	/* if both are script functions, then they must either have the same
+	 * name to be equal, or they must point to the same lambda function
+	 */
+	if (lhs->name != NULL && rhs->name != NULL) {
+		return strcmp(lhs->name, rhs->name) == 0;
+	} else if (lhs->name == NULL && rhs->name == NULL) {
+		/* an unnamed stub is nonsense (it's impossible to resolve) */
+		assert((lhs->flags & SPN_TFLG_PENDING) == 0);
+		assert((rhs->flags & SPN_TFLG_PENDING) == 0);
+
+		return lhs->r.bc == rhs->r.bc;
+	} else {
+		/* if one of them has a name but the other one hasn't, then
+		 * they cannot possibly be equal
+		 */
+		return 0;
+	}
+}
+
+/* consistent with equal_funcs(): see http://stackoverflow.com/q/18282032 */
+static unsigned long hash_func(void *obj)
+{
+	SpnFunction *func = obj;
+
+	if (func->flags & SPN_TFLG_REGARGS) {
+		return spn_hash(&func->r.regfn, sizeof(func->r.regfn));
+	}
+
+	if (func->flags & SPN_TFLG_NATIVE) {
+		return spn_hash(&func->r.fn, sizeof(func->r.fn));
+	}
+
+	return func->name == NULL
+	     ? (unsigned long)(func->r.bc)
+	     : spn_hash(func->name, strlen(func->name));
+}
+
+static void free_func(void *obj)
+{
+	SpnFunction *func = obj;
+
+	if (func->jit != NULL) {
+		spn_jit_free(func->jit);
+	}
+}
+
+SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, int symtabidx)
+{
+	SpnFunction *func = spn_object_new(&spn_class_func);
+
+	func->name = name;
+	func->flags = 0;
+	func->symtabidx = symtabidx;
+	func->r.bc = bc;
+	func->jit = NULL;
+	func->hotness = 0;
+
+	return func;
+}
+
+SpnFunction *spn_func_new_native(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *))
+{
+	SpnFunction *func = spn_object_new(&spn_class_func);
+
+	func->name = name;
+	func->flags = SPN_TFLG_NATIVE;
+	func->symtabidx = -1;
+	func->r.fn = fn;
+	func->jit = NULL;
+	func->hotness = 0;
+
+	return func;
+}
+
+SpnFunction *spn_func_new_fastnative(const char *name, int (*regfn)(SpnValue *, int, SpnValue **, void *), int flags)
+{
+	SpnFunction *func = spn_object_new(&spn_class_func);
+
+	func->name = name;
+	func->flags = SPN_TFLG_NATIVE | flags;
+	func->symtabidx = -1;
+	func->r.regfn = regfn;
+	func->jit = NULL;
+	func->hotness = 0;
+
+	return func;
+}
+
+SpnFunction *spn_func_new_stub(const char *name)
+{
+	SpnFunction *func = spn_object_new(&spn_class_func);
+
+	/* the symbol table index must not be set: a function stub is
+	 * merely an unresolved reference to a global function, we don't
+	 * know yet in which translation unit the actual definition will be.
+	 */
+	assert(name != NULL);
+
+	func->name = name;
+	func->flags = SPN_TFLG_PENDING;
+	func->symtabidx = -1;
+	func->r.bc = NULL;
+	func->jit = NULL;
+	func->hotness = 0;
+
+	return func;
+}
+
+void spn_func_value(SpnValue *val, SpnFunction *func)
+{
+	val->t = SPN_TYPE_FUNC;
+	val->f = SPN_TFLG_OBJECT | func->flags;
+	val->v.ptrv = func;
+}
+
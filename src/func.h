@@ -0,0 +1,58 @@
+/*
+ * func.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Function objects
+ */
+
+#ifndef SPN_FUNC_H
+#define SPN_FUNC_H
+
+#include "spn.h"
+#include "object.h"
+
+/* A function value is a reference to one of these (its `f` member has the
+ * `SPN_TFLG_OBJECT` flag set, along with `flags` below). Keeping the
+ * metadata out of line is what makes an SpnValue only as large as a pointer
+ * plus the type tags.
+ *
+ * `name` is NULL for lambdas. It is not owned by the function: it points to
+ * a static string (native functions) or into the bytecode (script functions
+ * and stubs), which must outlive the function object anyway.
+ * `symtabidx` is the index of the local symbol table which represents the
+ * environment of a script function (`r.bc` points to its header).
+ * A stub (`SPN_TFLG_PENDING`) only has a name.
+ * `jit` and `hotness` belong to the VM: the native code of a script function
+ * (see jit.h), and the number of times it was called or went round a loop.
+ */
+typedef struct SpnFunction {
+	SpnObject	 base;		/* private			*/
+	const char	*name;		/* public, readonly		*/
+	int		 flags;		/* public, readonly		*/
+	int		 symtabidx;	/* public, readonly		*/
+	union {
+		int (*fn)(SpnValue *, int, SpnValue *, void *);
+		int (*regfn)(SpnValue *, int, SpnValue **, void *);
+		spn_uword *bc;
+	} r;				/* representation		*/
+	struct SpnJitCode *jit;		/* private			*/
+	unsigned long	 hotness;	/* private			*/
+} SpnFunction;
+
+/* constructors. `flags` is a combination of `SPN_TFLG_REGARGS` and
+ * `SPN_TFLG_NOFAIL` for fast native functions.
+ */
+SPN_API SpnFunction	*spn_func_new_script(const char *name, spn_uword *bc, int symtabidx);
+SPN_API SpnFunction	*spn_func_new_native(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *));
+SPN_API SpnFunction	*spn_func_new_fastnative(const char *name, int (*regfn)(SpnValue *, int, SpnValue **, void *), int flags);
+SPN_API SpnFunction	*spn_func_new_stub(const char *name);
+
+/* makes `val` a function value referring to `func`. The reference owned by
+ * the caller is transferred to the value (it's not retained).
+ */
+SPN_API void		 spn_func_value(SpnValue *val, SpnFunction *func);
+
+#endif /* SPN_FUNC_H */
+
@@ -0,0 +1,1033 @@
+/*
+ * jit.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Baseline JIT compiler
+ */
+
+/* MAP_ANONYMOUS is not part of POSIX.1-2001 */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "jit.h"
+#include "private.h"
+
+#if SPN_USE_JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* The generated code is called as `spn_uword *code(SpnValue *regs)`, where
+ * `regs` points to register 0 of the stack frame. It returns the address
+ * of the instruction at which the interpreter has to continue. Registers
+ * are laid out in decreasing order of addresses (see FRMHDR() in vm.c), so
+ * register `k` is at `regs - k`. Only RAX, RCX, RDX, XMM0 and XMM1 are
+ * used, all of which are caller-saved, and nothing is called, so there is
+ * no prologue: each instruction can be jumped to directly.
+ *
+ * The templates never write to a register before all of the checks of
+ * their instruction have passed, so when the code bails out, the
+ * interpreter can simply execute the instruction from the beginning.
+ */
+
+/* displacement of the parts of register `k' relative to RDI */
+#define DISP(k, off)	(-(long)(k) * (long)sizeof(SpnValue) + (long)(off))
+#define VAL(k)		DISP(k, offsetof(SpnValue, v))
+#define TAG(k)		DISP(k, offsetof(SpnValue, t))
+#define FLG(k)		DISP(k, offsetof(SpnValue, f))
+
+/* the type tag and the flags, read as one 64-bit word */
+#define TAG_INT		SPN_TYPE_NUMBER
+#define TAG_BOOL	SPN_TYPE_BOOL
+
+/* no native code for an instruction, or no exit stub for a word */
+#define NONE		((size_t)(-1))
+
+enum {
+	RAX = 0,
+	RCX = 1,
+	RDX = 2,
+	RDI = 7
+};
+
+enum {
+	XMM0 = 0,
+	XMM1 = 1
+};
+
+/* condition codes, as encoded in Jcc and SETcc. Flipping the lowest bit of
+ * a condition negates it.
+ */
+enum {
+	CC_E	= 0x4,
+	CC_NE	= 0x5,
+	CC_BE	= 0x6,
+	CC_A	= 0x7,
+	CC_L	= 0xc,
+	CC_GE	= 0xd,
+	CC_LE	= 0xe,
+	CC_G	= 0xf,
+	CC_ALWAYS = -1
+};
+
+struct SpnJitCode {
+	unsigned char	 *mem;		/* executable mapping		*/
+	size_t		  size;		/* size of the mapping		*/
+	spn_uword	 *code;		/* bytecode it was compiled from	*/
+	size_t		  len;		/* length of the bytecode	*/
+	unsigned char	**entries;	/* native code of each word	*/
+	SpnPool		 *pool;		/* current when compiled	*/
+};
+
+/* a 32-bit relative jump to be resolved once all code is emitted. If `exit'
+ * is nonzero, or if the target word is not the start of an instruction, the
+ * jump goes to a stub that leaves the native code at `target'.
+ */
+typedef struct TFixup {
+	size_t	 pos;		/* offset of the rel32 field		*/
+	size_t	 target;	/* index of the target word		*/
+	int	 exit;
+} TFixup;
+
+typedef struct TAsm {
+	unsigned char	*buf;		/* code emitted so far		*/
+	size_t		 len;
+	size_t		 allsz;
+
+	TFixup		*fix;		/* unresolved jumps		*/
+	size_t		 nfix;
+	size_t		 fixallsz;
+
+	spn_uword	*code;		/* bytecode being compiled	*/
+	size_t		 nwords;
+	size_t		 insn;		/* index of current instruction	*/
+
+	size_t		*offs;		/* native code of each insn	*/
+	size_t		*stubs;		/* exit stub of each word	*/
+	char		*entry;		/* insn has a template		*/
+} TAsm;
+
+/* set when the OS refuses to give us executable memory */
+static int jit_disabled = 0;
+
+
+/* Low-level code emission */
+
+static void emit_byte(TAsm *as, int byte)
+{
+	if (as->len == as->allsz) {
+		as->allsz = as->allsz > 0 ? 2 * as->allsz : 4096;
+		as->buf = realloc(as->buf, as->allsz);
+		if (as->buf == NULL) {
+			abort();
+		}
+	}
+
+	as->buf[as->len++] = byte & 0xff;
+}
+
+static void emit_str(TAsm *as, const char *bytes)
+{
+	while (*bytes != 0) {
+		emit_byte(as, *bytes++);
+	}
+}
+
+static void put_u32(unsigned char *p, unsigned long x)
+{
+	p[0] = x >>  0 & 0xff;
+	p[1] = x >>  8 & 0xff;
+	p[2] = x >> 16 & 0xff;
+	p[3] = x >> 24 & 0xff;
+}
+
+static void emit_u32(TAsm *as, unsigned long x)
+{
+	emit_byte(as, x >>  0 & 0xff);
+	emit_byte(as, x >>  8 & 0xff);
+	emit_byte(as, x >> 16 & 0xff);
+	emit_byte(as, x >> 24 & 0xff);
+}
+
+/* `unsigned long' is 64 bits wide on x86-64 with the System V ABI */
+static void emit_u64(TAsm *as, unsigned long x)
+{
+	emit_u32(as, x & 0xffffffffUL);
+	emit_u32(as, x >> 16 >> 16);
+}
+
+/* emits `pfx REX.W op ModR/M disp32', where the memory operand is
+ * [RDI + disp]. The REX prefix is only emitted if `rexw' is nonzero.
+ */
+static void emit_mem(TAsm *as, const char *pfx, int rexw, const char *op, int reg, long disp)
+{
+	emit_str(as, pfx);
+
+	if (rexw) {
+		emit_byte(as, 0x48);
+	}
+
+	emit_str(as, op);
+	emit_byte(as, 0x80 | reg << 3 | RDI);
+	emit_u32(as, (unsigned long)(disp));
+}
+
+/* same for two register operands */
+static void emit_rr(TAsm *as, const char *pfx, int rexw, const char *op, int reg, int rm)
+{
+	emit_str(as, pfx);
+
+	if (rexw) {
+		emit_byte(as, 0x48);
+	}
+
+	emit_str(as, op);
+	emit_byte(as, 0xc0 | reg << 3 | rm);
+}
+
+
+/* Jumps and exits */
+
+static void add_fixup(TAsm *as, size_t pos, size_t target, int exit)
+{
+	if (as->nfix == as->fixallsz) {
+		as->fixallsz = as->fixallsz > 0 ? 2 * as->fixallsz : 64;
+		as->fix = realloc(as->fix, as->fixallsz * sizeof(as->fix[0]));
+		if (as->fix == NULL) {
+			abort();
+		}
+	}
+
+	as->fix[as->nfix].pos = pos;
+	as->fix[as->nfix].target = target;
+	as->fix[as->nfix].exit = exit;
+	as->nfix++;
+}
+
+/* emits a Jcc (or a JMP for CC_ALWAYS) with a zero offset, and returns the
+ * position of the offset, so that the jump can be pointed somewhere later
+ */
+static size_t emit_jump(TAsm *as, int cc)
+{
+	if (cc == CC_ALWAYS) {
+		emit_byte(as, 0xe9);
+	} else {
+		emit_byte(as, 0x0f);
+		emit_byte(as, 0x80 | cc);
+	}
+
+	emit_u32(as, 0);
+	return as->len - 4;
+}
+
+/* points the jump of which the offset is at `pos' to the next instruction */
+static void jump_here(TAsm *as, size_t pos)
+{
+	put_u32(&as->buf[pos], (unsigned long)(as->len) - (unsigned long)(pos + 4));
+}
+
+/* jumps to the instruction at index `target' of the bytecode */
+static void jump_to(TAsm *as, int cc, size_t target)
+{
+	add_fixup(as, emit_jump(as, cc), target, 0);
+}
+
+/* leaves the native code, so that the current instruction is executed by
+ * the interpreter
+ */
+static void exit_if(TAsm *as, int cc)
+{
+	add_fixup(as, emit_jump(as, cc), as->insn, 1);
+}
+
+/* mov rax, <address of word `w'>; ret */
+static void emit_exit(TAsm *as, size_t w)
+{
+	emit_byte(as, 0x48);
+	emit_byte(as, 0xb8 | RAX);
+	emit_u64(as, (unsigned long)(as->code + w));
+	emit_byte(as, 0xc3);
+}
+
+
+/* Type checks and common operations */
+
+/* cmp qword [tag of k], tag */
+static void cmp_tag(TAsm *as, int k, int tag)
+{
+	emit_mem(as, "", 1, "\x83", 7, TAG(k));
+	emit_byte(as, tag);
+}
+
+/* cmp dword [type of k], type */
+static void cmp_type(TAsm *as, int k, int type)
+{
+	emit_mem(as, "", 0, "\x83", 7, TAG(k));
+	emit_byte(as, type);
+}
+
+/* test byte [flags of k], flag */
+static void test_flag(TAsm *as, int k, int flag)
+{
+	emit_mem(as, "", 0, "\xf6", 0, FLG(k));
+	emit_byte(as, flag);
+}
+
+static void guard_number(TAsm *as, int k)
+{
+	cmp_type(as, k, SPN_TYPE_NUMBER);
+	exit_if(as, CC_NE);
+}
+
+/* values which hold a reference can only be overwritten after releasing
+ * them, which is up to the interpreter
+ */
+static void guard_not_object(TAsm *as, int k)
+{
+	test_flag(as, k, SPN_TFLG_OBJECT);
+	exit_if(as, CC_NE);
+}
+
+/* mov reg, imm64 */
+static void load_imm(TAsm *as, int reg, unsigned long imm)
+{
+	emit_byte(as, 0x48);
+	emit_byte(as, 0xb8 | reg);
+	emit_u64(as, imm);
+}
+
+/* the tag is written with a single store, since the guards read it as one
+ * word, and a load can't be forwarded from two smaller stores. Clobbers RCX.
+ */
+static void set_tag(TAsm *as, int k, int type, int flags)
+{
+	if (flags == 0) {
+		emit_mem(as, "", 1, "\xc7", 0, TAG(k));	/* mov qword [tag], imm32 */
+		emit_u32(as, type);
+	} else {
+		load_imm(as, RCX, (unsigned long)(flags) << 16 << 16 | type);
+		emit_mem(as, "", 1, "\x89", RCX, TAG(k));
+	}
+}
+
+/* mov reg, [value of k] */
+static void load_value(TAsm *as, int reg, int k)
+{
+	emit_mem(as, "", 1, "\x8b", reg, VAL(k));
+}
+
+/* mov [value of k], reg */
+static void store_value(TAsm *as, int k, int reg)
+{
+	emit_mem(as, "", 1, "\x89", reg, VAL(k));
+}
+
+/* loads the number in `k' into an SSE register, converting it if needed */
+static void load_double(TAsm *as, int xmm, int k)
+{
+	size_t isfloat, done;
+
+	test_flag(as, k, SPN_TFLG_FLOAT);
+	isfloat = emit_jump(as, CC_NE);
+	emit_mem(as, "\xf2", 1, "\x0f\x2a", xmm, VAL(k));	/* cvtsi2sd */
+	done = emit_jump(as, CC_ALWAYS);
+	jump_here(as, isfloat);
+	emit_mem(as, "\xf2", 0, "\x0f\x10", xmm, VAL(k));	/* movsd */
+	jump_here(as, done);
+}
+
+static void store_double(TAsm *as, int k, int xmm)
+{
+	emit_mem(as, "\xf2", 0, "\x0f\x11", xmm, VAL(k));	/* movsd */
+	set_tag(as, k, SPN_TYPE_NUMBER, SPN_TFLG_FLOAT);
+}
+
+/* setcc al; movzx eax, al; mov [value of k], rax */
+static void store_bool(TAsm *as, int k, int cc)
+{
+	emit_byte(as, 0x0f);
+	emit_byte(as, 0x90 | cc);
+	emit_byte(as, 0xc0);
+	emit_rr(as, "", 0, "\x0f\xb6", RAX, RAX);
+	store_value(as, k, RAX);
+	set_tag(as, k, SPN_TYPE_BOOL, 0);
+}
+
+/* Comparisons. Ordered comparison of numbers yields the same as
+ * `numeric_compare()' in vm.c, which compares with `<' and `>' only, so
+ * LE and GE are true if one of the operands is NaN. UCOMISD sets both ZF
+ * and CF for unordered operands, so `A' (CF = ZF = 0) is a strict ordered
+ * `greater than' and `BE' is its negation, true for NaN.
+ */
+static int int_cond(int op)
+{
+	switch (op) {
+	case SPN_INS_LT: return CC_L;
+	case SPN_INS_LE: return CC_LE;
+	case SPN_INS_GT: return CC_G;
+	case SPN_INS_GE: return CC_GE;
+	default:	 SHANT_BE_REACHED();
+	}
+
+	return CC_E;
+}
+
+/* compares XMM0 with XMM1 */
+static int float_cond(TAsm *as, int op)
+{
+	int swap = op == SPN_INS_LT || op == SPN_INS_GE;
+
+	/* ucomisd */
+	if (swap) {
+		emit_rr(as, "\x66", 0, "\x0f\x2e", XMM1, XMM0);
+	} else {
+		emit_rr(as, "\x66", 0, "\x0f\x2e", XMM0, XMM1);
+	}
+
+	return op == SPN_INS_LT || op == SPN_INS_GT ? CC_A : CC_BE;
+}
+
+
+/* Templates */
+
+/* ADD, SUB, MUL, DIV */
+static void tmpl_arith(TAsm *as, int op, int a, int b, int c)
+{
+	size_t notint[2], done = 0;
+	const char *fltop;
+
+	cmp_tag(as, b, TAG_INT);
+	notint[0] = emit_jump(as, CC_NE);
+	cmp_tag(as, c, TAG_INT);
+
+	if (op == SPN_INS_DIV) {
+		/* integer division traps on zero; let the interpreter do it */
+		exit_if(as, CC_E);
+		jump_here(as, notint[0]);
+	} else {
+		notint[1] = emit_jump(as, CC_NE);
+		guard_not_object(as, a);
+		load_value(as, RAX, b);
+
+		switch (op) {
+		case SPN_INS_ADD: emit_mem(as, "", 1, "\x03", RAX, VAL(c)); break;
+		case SPN_INS_SUB: emit_mem(as, "", 1, "\x2b", RAX, VAL(c)); break;
+		case SPN_INS_MUL: emit_mem(as, "", 1, "\x0f\xaf", RAX, VAL(c)); break;
+		default:	  SHANT_BE_REACHED();
+		}
+
+		store_value(as, a, RAX);
+		set_tag(as, a, SPN_TYPE_NUMBER, 0);
+		done = emit_jump(as, CC_ALWAYS);
+
+		jump_here(as, notint[0]);
+		jump_here(as, notint[1]);
+	}
+
+	guard_number(as, b);
+	guard_number(as, c);
+	guard_not_object(as, a);
+	load_double(as, XMM0, b);
+	load_double(as, XMM1, c);
+
+	switch (op) {
+	case SPN_INS_ADD: fltop = "\x0f\x58"; break;
+	case SPN_INS_SUB: fltop = "\x0f\x5c"; break;
+	case SPN_INS_MUL: fltop = "\x0f\x59"; break;
+	case SPN_INS_DIV: fltop = "\x0f\x5e"; break;
+	default:	  fltop = NULL; SHANT_BE_REACHED();
+	}
+
+	emit_rr(as, "\xf2", 0, fltop, XMM0, XMM1);
+	store_double(as, a, XMM0);
+
+	if (op != SPN_INS_DIV) {
+		jump_here(as, done);
+	}
+}
+
+static void tmpl_mod(TAsm *as, int a, int b, int c)
+{
+	cmp_tag(as, b, TAG_INT);
+	exit_if(as, CC_NE);
+	cmp_tag(as, c, TAG_INT);
+	exit_if(as, CC_NE);
+	guard_not_object(as, a);
+
+	/* IDIV traps on division by zero and on LONG_MIN % -1 */
+	load_value(as, RCX, c);
+	emit_rr(as, "", 1, "\x85", RCX, RCX);		/* test rcx, rcx */
+	exit_if(as, CC_E);
+	emit_rr(as, "", 1, "\x83", 7, RCX);		/* cmp rcx, -1 */
+	emit_byte(as, 0xff);
+	exit_if(as, CC_E);
+
+	load_value(as, RAX, b);
+	emit_byte(as, 0x48);				/* cqo */
+	emit_byte(as, 0x99);
+	emit_rr(as, "", 1, "\xf7", 7, RCX);		/* idiv rcx */
+	store_value(as, a, RDX);
+	set_tag(as, a, SPN_TYPE_NUMBER, 0);
+}
+
+static void tmpl_neg(TAsm *as, int a, int b)
+{
+	size_t notint, done;
+
+	cmp_tag(as, b, TAG_INT);
+	notint = emit_jump(as, CC_NE);
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+	emit_rr(as, "", 1, "\xf7", 3, RAX);		/* neg rax */
+	store_value(as, a, RAX);
+	set_tag(as, a, SPN_TYPE_NUMBER, 0);
+	done = emit_jump(as, CC_ALWAYS);
+
+	jump_here(as, notint);
+	guard_number(as, b);
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+	emit_rr(as, "", 1, "\x0f\xba", 7, RAX);		/* btc rax, 63 */
+	emit_byte(as, 63);
+	store_value(as, a, RAX);
+	set_tag(as, a, SPN_TYPE_NUMBER, SPN_TFLG_FLOAT);
+
+	jump_here(as, done);
+}
+
+/* INC, DEC */
+static void tmpl_incdec(TAsm *as, int op, int a)
+{
+	double one = 1.0;
+	unsigned long bits;
+	size_t notint, done;
+
+	memcpy(&bits, &one, sizeof(bits));
+
+	cmp_tag(as, a, TAG_INT);
+	notint = emit_jump(as, CC_NE);
+	emit_mem(as, "", 1, "\xff", op == SPN_INS_INC ? 0 : 1, VAL(a));
+	done = emit_jump(as, CC_ALWAYS);
+
+	jump_here(as, notint);
+	guard_number(as, a);
+	emit_mem(as, "\xf2", 0, "\x0f\x10", XMM0, VAL(a));
+	load_imm(as, RAX, bits);
+	emit_rr(as, "\x66", 1, "\x0f\x6e", XMM1, RAX);	/* movq xmm1, rax */
+	emit_rr(as, "\xf2", 0, op == SPN_INS_INC ? "\x0f\x58" : "\x0f\x5c", XMM0, XMM1);
+	emit_mem(as, "\xf2", 0, "\x0f\x11", XMM0, VAL(a));
+
+	jump_here(as, done);
+}
+
+/* AND, OR, XOR, SHL, SHR, and BITNOT (which ignores `c') */
+static void tmpl_bitwise(TAsm *as, int op, int a, int b, int c)
+{
+	cmp_tag(as, b, TAG_INT);
+	exit_if(as, CC_NE);
+
+	if (op != SPN_INS_BITNOT) {
+		cmp_tag(as, c, TAG_INT);
+		exit_if(as, CC_NE);
+	}
+
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+
+	switch (op) {
+	case SPN_INS_AND:
+		emit_mem(as, "", 1, "\x23", RAX, VAL(c));
+		break;
+	case SPN_INS_OR:
+		emit_mem(as, "", 1, "\x0b", RAX, VAL(c));
+		break;
+	case SPN_INS_XOR:
+		emit_mem(as, "", 1, "\x33", RAX, VAL(c));
+		break;
+	case SPN_INS_SHL:
+		load_value(as, RCX, c);
+		emit_rr(as, "", 1, "\xd3", 4, RAX);	/* shl rax, cl */
+		break;
+	case SPN_INS_SHR:
+		load_value(as, RCX, c);
+		emit_rr(as, "", 1, "\xd3", 7, RAX);	/* sar rax, cl */
+		break;
+	case SPN_INS_BITNOT:
+		emit_rr(as, "", 1, "\xf7", 2, RAX);	/* not rax */
+		break;
+	default:
+		SHANT_BE_REACHED();
+	}
+
+	store_value(as, a, RAX);
+	set_tag(as, a, SPN_TYPE_NUMBER, 0);
+}
+
+static void tmpl_lognot(TAsm *as, int a, int b)
+{
+	cmp_tag(as, b, TAG_BOOL);
+	exit_if(as, CC_NE);
+	guard_not_object(as, a);
+	emit_mem(as, "", 0, "\x83", 7, VAL(b));		/* cmp dword [b], 0 */
+	emit_byte(as, 0);
+	store_bool(as, a, CC_E);
+}
+
+/* EQ, NE: only integers, anything else compares by type and identity */
+static void tmpl_equal(TAsm *as, int op, int a, int b, int c)
+{
+	cmp_tag(as, b, TAG_INT);
+	exit_if(as, CC_NE);
+	cmp_tag(as, c, TAG_INT);
+	exit_if(as, CC_NE);
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+	emit_mem(as, "", 1, "\x3b", RAX, VAL(c));
+	store_bool(as, a, op == SPN_INS_EQ ? CC_E : CC_NE);
+}
+
+/* LT, LE, GT, GE */
+static void tmpl_compare(TAsm *as, int op, int a, int b, int c)
+{
+	size_t notint[2], done;
+
+	cmp_tag(as, b, TAG_INT);
+	notint[0] = emit_jump(as, CC_NE);
+	cmp_tag(as, c, TAG_INT);
+	notint[1] = emit_jump(as, CC_NE);
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+	emit_mem(as, "", 1, "\x3b", RAX, VAL(c));
+	store_bool(as, a, int_cond(op));
+	done = emit_jump(as, CC_ALWAYS);
+
+	jump_here(as, notint[0]);
+	jump_here(as, notint[1]);
+	guard_number(as, b);
+	guard_number(as, c);
+	guard_not_object(as, a);
+	load_double(as, XMM0, b);
+	load_double(as, XMM1, c);
+	store_bool(as, a, float_cond(as, op));
+
+	jump_here(as, done);
+}
+
+/* JZE, JNZ */
+static void tmpl_jbool(TAsm *as, int op, int a, size_t target)
+{
+	cmp_tag(as, a, TAG_BOOL);
+	exit_if(as, CC_NE);
+	emit_mem(as, "", 0, "\x83", 7, VAL(a));		/* cmp dword [a], 0 */
+	emit_byte(as, 0);
+	jump_to(as, op == SPN_INS_JZE ? CC_E : CC_NE, target);
+}
+
+/* JEQ, JNE */
+static void tmpl_jequal(TAsm *as, int op, int a, int b, int expect, size_t target)
+{
+	int cc = op == SPN_INS_JEQ ? CC_E : CC_NE;
+
+	cmp_tag(as, a, TAG_INT);
+	exit_if(as, CC_NE);
+	cmp_tag(as, b, TAG_INT);
+	exit_if(as, CC_NE);
+	load_value(as, RAX, a);
+	emit_mem(as, "", 1, "\x3b", RAX, VAL(b));
+	jump_to(as, expect ? cc : cc ^ 1, target);
+}
+
+/* JLT, JLE, JGT, JGE */
+static void tmpl_jcompare(TAsm *as, int op, int a, int b, int expect, size_t target)
+{
+	size_t notint[2], done;
+	int cc;
+
+	cmp_tag(as, a, TAG_INT);
+	notint[0] = emit_jump(as, CC_NE);
+	cmp_tag(as, b, TAG_INT);
+	notint[1] = emit_jump(as, CC_NE);
+	load_value(as, RAX, a);
+	emit_mem(as, "", 1, "\x3b", RAX, VAL(b));
+	cc = int_cond(op);
+	jump_to(as, expect ? cc : cc ^ 1, target);
+	done = emit_jump(as, CC_ALWAYS);
+
+	jump_here(as, notint[0]);
+	jump_here(as, notint[1]);
+	guard_number(as, a);
+	guard_number(as, b);
+	load_double(as, XMM0, a);
+	load_double(as, XMM1, b);
+	cc = float_cond(as, op);
+	jump_to(as, expect ? cc : cc ^ 1, target);
+
+	jump_here(as, done);
+}
+
+static void tmpl_addi(TAsm *as, int a, int b, long imm)
+{
+	size_t notint, done;
+
+	cmp_tag(as, b, TAG_INT);
+	notint = emit_jump(as, CC_NE);
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+	emit_byte(as, 0x48);				/* add rax, imm32 */
+	emit_byte(as, 0x05);
+	emit_u32(as, (unsigned long)(imm));
+	store_value(as, a, RAX);
+	set_tag(as, a, SPN_TYPE_NUMBER, 0);
+	done = emit_jump(as, CC_ALWAYS);
+
+	jump_here(as, notint);
+	guard_number(as, b);
+	guard_not_object(as, a);
+	emit_mem(as, "\xf2", 0, "\x0f\x10", XMM0, VAL(b));
+	load_imm(as, RAX, (unsigned long)(imm));
+	emit_rr(as, "\xf2", 1, "\x0f\x2a", XMM1, RAX);	/* cvtsi2sd */
+	emit_rr(as, "\xf2", 0, "\x0f\x58", XMM0, XMM1);
+	store_double(as, a, XMM0);
+
+	jump_here(as, done);
+}
+
+static void tmpl_ldconst(TAsm *as, int a, int kind, const spn_uword *data)
+{
+	unsigned long bits;
+
+	guard_not_object(as, a);
+
+	switch (kind) {
+	case SPN_CONST_NIL:
+		set_tag(as, a, SPN_TYPE_NIL, 0);
+		break;
+	case SPN_CONST_TRUE:
+	case SPN_CONST_FALSE:
+		emit_mem(as, "", 0, "\xc7", 0, VAL(a));
+		emit_u32(as, kind == SPN_CONST_TRUE);
+		set_tag(as, a, SPN_TYPE_BOOL, 0);
+		break;
+	case SPN_CONST_INT:
+	case SPN_CONST_FLOAT:
+		/* a long and a double are both 8 bytes long */
+		memcpy(&bits, data, sizeof(bits));
+		load_imm(as, RAX, bits);
+		store_value(as, a, RAX);
+		set_tag(as, a, SPN_TYPE_NUMBER, kind == SPN_CONST_FLOAT ? SPN_TFLG_FLOAT : 0);
+		break;
+	default:
+		SHANT_BE_REACHED();
+	}
+}
+
+/* only non-objects are moved, because objects need to be retained */
+static void tmpl_mov(TAsm *as, int a, int b)
+{
+	guard_not_object(as, b);
+	guard_not_object(as, a);
+	load_value(as, RAX, b);
+	emit_mem(as, "", 1, "\x8b", RDX, TAG(b));
+	store_value(as, a, RAX);
+	emit_mem(as, "", 1, "\x89", RDX, TAG(a));
+}
+
+/* computes the target of the jump instruction at `i'. Returns nonzero if it
+ * is outside of the code being compiled.
+ */
+static int jump_target(TAsm *as, size_t i, size_t *target)
+{
+	/* the offset is relative to the end of the offset word */
+	spn_sword offset = as->code[i + 1];
+	long dest = (long)(i) + 2 + offset;
+
+	if (dest < 0 || (size_t)(dest) >= as->nwords) {
+		return -1;
+	}
+
+	*target = dest;
+	return 0;
+}
+
+/* emits the template of the instruction at `as->insn', if there is one.
+ * Returns nonzero if there isn't.
+ */
+static int compile_insn(TAsm *as)
+{
+	size_t i = as->insn;
+	spn_uword ins = as->code[i];
+	int opcode = OPCODE(ins);
+	int a = OPA(ins), b = OPB(ins), c = OPC(ins);
+	size_t target;
+
+	switch (opcode) {
+	case SPN_INS_ADD:
+	case SPN_INS_SUB:
+	case SPN_INS_MUL:
+	case SPN_INS_DIV:
+		tmpl_arith(as, opcode, a, b, c);
+		return 0;
+	case SPN_INS_MOD:
+		tmpl_mod(as, a, b, c);
+		return 0;
+	case SPN_INS_NEG:
+		tmpl_neg(as, a, b);
+		return 0;
+	case SPN_INS_INC:
+	case SPN_INS_DEC:
+		tmpl_incdec(as, opcode, a);
+		return 0;
+	case SPN_INS_AND:
+	case SPN_INS_OR:
+	case SPN_INS_XOR:
+	case SPN_INS_SHL:
+	case SPN_INS_SHR:
+	case SPN_INS_BITNOT:
+		tmpl_bitwise(as, opcode, a, b, c);
+		return 0;
+	case SPN_INS_LOGNOT:
+		tmpl_lognot(as, a, b);
+		return 0;
+	case SPN_INS_EQ:
+	case SPN_INS_NE:
+		tmpl_equal(as, opcode, a, b, c);
+		return 0;
+	case SPN_INS_LT:
+	case SPN_INS_LE:
+	case SPN_INS_GT:
+	case SPN_INS_GE:
+		tmpl_compare(as, opcode, a, b, c);
+		return 0;
+	case SPN_INS_ADDI:
+		tmpl_addi(as, a, b, OPSIMMC(ins));
+		return 0;
+	case SPN_INS_LDCONST:
+		tmpl_ldconst(as, a, b, &as->code[i + 1]);
+		return 0;
+	case SPN_INS_MOV:
+		tmpl_mov(as, a, b);
+		return 0;
+	case SPN_INS_JMP:
+	case SPN_INS_JZE:
+	case SPN_INS_JNZ:
+	case SPN_INS_JEQ:
+	case SPN_INS_JNE:
+	case SPN_INS_JLT:
+	case SPN_INS_JLE:
+	case SPN_INS_JGT:
+	case SPN_INS_JGE:
+		if (jump_target(as, i, &target) != 0) {
+			return -1;
+		}
+
+		switch (opcode) {
+		case SPN_INS_JMP:
+			jump_to(as, CC_ALWAYS, target);
+			break;
+		case SPN_INS_JZE:
+		case SPN_INS_JNZ:
+			tmpl_jbool(as, opcode, a, target);
+			break;
+		case SPN_INS_JEQ:
+		case SPN_INS_JNE:
+			tmpl_jequal(as, opcode, a, b, c != 0, target);
+			break;
+		default:
+			/* JLT...JGE are in the same order as LT...GE */
+			tmpl_jcompare(as, opcode - SPN_INS_JLT + SPN_INS_LT, a, b, c != 0, target);
+			break;
+		}
+
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static void assemble(TAsm *as)
+{
+	size_t i, n, k;
+
+	for (i = 0; i < as->nwords; i += n) {
+		n = insn_length(as->code, i);
+
+		/* the bodies of nested functions are not part of this code */
+		if (OPCODE(as->code[i]) == SPN_INS_GLBSYM) {
+			n += as->code[i + n - SPN_FUNCHDR_LEN + SPN_FUNCHDR_IDX_BODYLEN];
+		}
+
+		as->insn = i;
+		as->offs[i] = as->len;
+
+		if (compile_insn(as) == 0) {
+			as->entry[i] = 1;
+		} else {
+			emit_exit(as, i);
+		}
+	}
+
+	/* in case the last instruction is not a return or a jump */
+	emit_exit(as, as->nwords);
+
+	/* resolve jumps, emit exit stubs on demand */
+	for (k = 0; k < as->nfix; k++) {
+		TFixup *fix = &as->fix[k];
+		size_t w = fix->target;
+		size_t dest;
+
+		if (fix->exit == 0 && as->offs[w] != NONE) {
+			dest = as->offs[w];
+		} else {
+			if (as->stubs[w] == NONE) {
+				as->stubs[w] = as->len;
+				emit_exit(as, w);
+			}
+
+			dest = as->stubs[w];
+		}
+
+		put_u32(&as->buf[fix->pos], (unsigned long)(dest) - (unsigned long)(fix->pos + 4));
+	}
+}
+
+SpnJitCode *spn_jit_compile(spn_uword *code, size_t len)
+{
+	SpnJitCode *jit;
+	TAsm as;
+	void *mem;
+	size_t i;
+
+	/* the templates read the type and the flags as one word */
+	assert(sizeof(unsigned long) == 8 && sizeof(SpnValue) == 16);
+	assert(offsetof(SpnValue, f) == offsetof(SpnValue, t) + 4);
+
+	if (jit_disabled || len == 0) {
+		return NULL;
+	}
+
+	as.buf = NULL;
+	as.len = 0;
+	as.allsz = 0;
+	as.fix = NULL;
+	as.nfix = 0;
+	as.fixallsz = 0;
+	as.code = code;
+	as.nwords = len;
+	as.insn = 0;
+	as.offs = malloc(len * sizeof(as.offs[0]));
+	as.stubs = malloc(len * sizeof(as.stubs[0]));
+	as.entry = calloc(len, sizeof(as.entry[0]));
+
+	if (as.offs == NULL || as.stubs == NULL || as.entry == NULL) {
+		abort();
+	}
+
+	for (i = 0; i < len; i++) {
+		as.offs[i] = NONE;
+		as.stubs[i] = NONE;
+	}
+
+	assemble(&as);
+
+	/* the code is copied into a fresh mapping, which is then made
+	 * executable, but never writable and executable at the same time
+	 */
+	mem = mmap(NULL, as.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem != MAP_FAILED) {
+		memcpy(mem, as.buf, as.len);
+
+		if (mprotect(mem, as.len, PROT_READ | PROT_EXEC) != 0) {
+			munmap(mem, as.len);
+			mem = MAP_FAILED;
+		}
+	}
+
+	if (mem == MAP_FAILED) {
+		jit_disabled = 1;
+		jit = NULL;
+	} else {
+		SpnPool *pool = spn_pool_get_current();
+
+		jit = spn_mem_xalloc(pool, SPN_MEM_BYTECODE, sizeof(*jit));
+		jit->mem = mem;
+		jit->size = as.len;
+		jit->code = code;
+		jit->len = len;
+		jit->entries = spn_mem_xalloc(pool, SPN_MEM_BYTECODE, len * sizeof(jit->entries[0]));
+		jit->pool = pool;
+
+		for (i = 0; i < len; i++) {
+			jit->entries[i] = as.entry[i] ? jit->mem + as.offs[i] : NULL;
+		}
+	}
+
+	free(as.buf);
+	free(as.fix);
+	free(as.offs);
+	free(as.stubs);
+	free(as.entry);
+
+	return jit;
+}
+
+void spn_jit_free(SpnJitCode *jit)
+{
+	if (jit != NULL) {
+		munmap(jit->mem, jit->size);
+		spn_mem_free(jit->pool, SPN_MEM_BYTECODE, jit->entries, jit->len * sizeof(jit->entries[0]));
+		spn_mem_free(jit->pool, SPN_MEM_BYTECODE, jit, sizeof(*jit));
+	}
+}
+
+spn_uword *spn_jit_run(SpnJitCode *jit, spn_uword *ip, SpnValue *regs)
+{
+	/* ISO C has no conversion between object and function pointers */
+	union {
+		unsigned char *p;
+		spn_uword *(*fn)(SpnValue *);
+	} entry;
+
+	assert(ip >= jit->code && ip < jit->code + jit->len);
+
+	entry.p = jit->entries[ip - jit->code];
+
+	return entry.p != NULL ? entry.fn(regs) : ip;
+}
+
+#else /* SPN_USE_JIT */
+
+SpnJitCode *spn_jit_compile(spn_uword *code, size_t len)
+{
+	(void)code;
+	(void)len;
+	return NULL;
+}
+
+void spn_jit_free(SpnJitCode *jit)
+{
+	assert(jit == NULL);
+	(void)jit;
+}
+
+spn_uword *spn_jit_run(SpnJitCode *jit, spn_uword *ip, SpnValue *regs)
+{
+	(void)jit;
+	(void)regs;
+	SHANT_BE_REACHED();
+	return ip;
+}
+
+#endif /* SPN_USE_JIT */
@@ -0,0 +1,63 @@
+/*
+ * jit.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Baseline JIT compiler
+ */
+
+#ifndef SPN_JIT_H
+#define SPN_JIT_H
+
+#include <stddef.h>
+
+#include "spn.h"
+
+/* The JIT compiler is only built if SPN_JIT is defined (`make JIT=1`), and
+ * only for x86-64 with the System V calling convention. Elsewhere, the
+ * functions below are stubs which never produce any code.
+ */
+#ifndef SPN_USE_JIT
+#if defined(SPN_JIT) && defined(__x86_64__) && !defined(_WIN32)
+#define SPN_USE_JIT 1
+#else
+#define SPN_USE_JIT 0
+#endif
+#endif
+
+/* the number of calls and loop iterations after which a function (or the
+ * top-level code of a program) is compiled
+ */
+#ifndef SPN_JIT_THRESHOLD
+#define SPN_JIT_THRESHOLD 1000
+#endif
+
+/* The code is translated one instruction at a time, using a template for
+ * each opcode. The templates compute their result inline for integers and
+ * floating-point numbers (and for Booleans where it makes sense), after
+ * checking the types of the operands. All other cases, and opcodes which
+ * don't have a template, leave the native code, and the interpreter executes
+ * the instruction instead. Since the native code keeps no state of its own
+ * between two instructions (the operands are read from and the result is
+ * written to the registers of the stack frame), it can be left and entered
+ * at any instruction boundary.
+ */
+typedef struct SpnJitCode SpnJitCode;
+
+/* compiles `len` words of bytecode starting at `code`. Returns NULL if the
+ * JIT is not available, for example because the operating system does not
+ * allow executable memory to be allocated. (In that case, the JIT disables
+ * itself, and subsequent calls return NULL right away.)
+ */
+SPN_API SpnJitCode	*spn_jit_compile(spn_uword *code, size_t len);
+SPN_API void		 spn_jit_free(SpnJitCode *jit);
+
+/* runs the compiled code of the instruction at `ip` in the frame of which
+ * the first register is `regs`, and everything after it, until it reaches
+ * an instruction that the interpreter must execute. Returns the address of
+ * that instruction (which is `ip' itself if it has no native code).
+ */
+SPN_API spn_uword	*spn_jit_run(SpnJitCode *jit, spn_uword *ip, SpnValue *regs);
+
+#endif /* SPN_JIT_H */
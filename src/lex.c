@@ -11,6 +11,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #include "lex.h"
@@ -33,42 +34,10 @@ typedef struct TReserved {
 
 static int is_special(char c)
 {
-	static char flags[1 << CHAR_BIT] = { 0 };
-	static int init = 0;
-	int idx = c; /* suppress 'index is a char' warning */
-
-	if (!init) {
-		flags['+'] = 1;
-		flags['-'] = 1;
-		flags['*'] = 1;
-		flags['/'] = 1;
-		flags['%'] = 1;
-		flags['='] = 1;
-		flags['!'] = 1;
-		flags['?'] = 1;
-		flags[':'] = 1;
-		flags['.'] = 1;
-		flags[','] = 1;
-		flags[';'] = 1;
-		flags['<'] = 1;
-		flags['>'] = 1;
-		flags['&'] = 1;
-		flags['|'] = 1;
-		flags['^'] = 1;
-		flags['~'] = 1;
-		flags['#'] = 1;
-		flags['('] = 1;
-		flags[')'] = 1;
-		flags['['] = 1;
-		flags[']'] = 1;
-		flags['{'] = 1;
-		flags['}'] = 1;
-		
-		init = 1;
-	}
-
-	/* no negative indices for the array, please */
-	return idx < 0 ? 0 : flags[idx];
+	/* a constant table (rather than one filled in on first use) is safe
+	 * to read from several threads
+	 */
+	return c != 0 && strchr("+-*/%=!?:.,;<>&|^~#()[]{}", c) != NULL;
 }
 
 static int is_ident_begin(char c)
@@ -110,23 +79,39 @@ static int hexch_to_int(char c)
 	return -1;
 }
 
-/* Because not every system may have this in libc */
-static char *spn_strndup(const char *s, size_t n)
+/* the characters of identifiers and string literals are allocated from the
+ * arena of the tree being parsed, and then the strings don't own them.
+ * Otherwise (if spn_lex() is called outside spn_parser_parse()), they are
+ * scanned into a temporary buffer of `n` bytes, which is then copied into
+ * a string of its own.
+ */
+static char *alloc_token(SpnParser *p, size_t n)
 {
-	const char *t = s;
-	char *r = malloc(n + 1);
-	char *p = r;
+	if (p->arena != NULL) {
+		return spn_arena_alloc(p->arena, n);
+	}
+
+	return spn_mem_xalloc(p->pool, SPN_MEM_STRING, n);
+}
 
-	if (r == NULL) {
-		abort();
+static void free_token(SpnParser *p, char *buf, size_t n)
+{
+	if (p->arena == NULL) {
+		spn_mem_free(p->pool, SPN_MEM_STRING, buf, n);
 	}
+}
 
-	while (*t && t < s + n) {
-		*p++ = *t++;
+static SpnString *token_string(SpnParser *p, char *buf, size_t n, size_t len)
+{
+	SpnString *str;
+
+	if (p->arena != NULL) {
+		return spn_string_new_nocopy_len(buf, len, 0);
 	}
 
-	*p = 0;
-	return r;
+	str = spn_string_new_len(buf, len);
+	free_token(p, buf, n);
+	return str;
 }
 
 /* For characters and strings */
@@ -437,41 +422,88 @@ static int lex_number(SpnParser *p)
 	}
 }
 
+/* The keywords are looked up in a perfect hash table: KEYWORD_HASH() maps
+ * each of them to a different slot, so a word can only be the keyword
+ * in the slot it's hashed to. The hash only depends on the length and on
+ * the first and last characters of the word, which is enough to tell the
+ * keywords apart. Debug builds check that there are no collisions.
+ */
+#define KEYWORD_HASH(s, n)	((3 * (unsigned char)(s)[0] + 55 * (unsigned char)(s)[(n) - 1] + (n)) & 63)
+#define EMPTY_ENTRY		{ NULL, 0, SPN_TOK_EOF }
+
 static int lex_ident(SpnParser *p)
 {
-	size_t diff, i;
+	size_t diff;
 	char *buf;
 	const char *end = p->pos;
-	SpnString *str;
+	const TReserved *kwd;
 
-	/* here, order does not matter - keywords and identifiers have to be
-	 * delimited by whitespace or special characters, so there's no
-	 * ambiguity in lexing them
-	 */
-	static const TReserved kwds[] = {
-		RESERVED_ENTRY("and",		SPN_TOK_LOGAND),
-		RESERVED_ENTRY("as",		SPN_TOK_AS),
-		RESERVED_ENTRY("break",		SPN_TOK_BREAK),
-		RESERVED_ENTRY("continue",	SPN_TOK_CONTINUE),
+	/* `and', `or' and `not' are the logical operators, `null' is `nil' */
+	static const TReserved kwds[64] = {
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("nil",		SPN_TOK_NIL),
+		RESERVED_ENTRY("null",		SPN_TOK_NIL),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("do",		SPN_TOK_DO),
-		RESERVED_ENTRY("else",		SPN_TOK_ELSE),
-		RESERVED_ENTRY("false",		SPN_TOK_FALSE),
-		RESERVED_ENTRY("for",		SPN_TOK_FOR),
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("sizeof",	SPN_TOK_SIZEOF),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("typeof",	SPN_TOK_TYPEOF),
+		RESERVED_ENTRY("or",		SPN_TOK_LOGOR),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("foreach",	SPN_TOK_FOREACH),
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("true",		SPN_TOK_TRUE),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("as",		SPN_TOK_AS),
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("function",	SPN_TOK_FUNCTION),
-		RESERVED_ENTRY("if",		SPN_TOK_IF),
+		RESERVED_ENTRY("while",		SPN_TOK_WHILE),
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("in",		SPN_TOK_IN),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("and",		SPN_TOK_LOGAND),
+		RESERVED_ENTRY("var",		SPN_TOK_VAR),
+		RESERVED_ENTRY("continue",	SPN_TOK_CONTINUE),
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("else",		SPN_TOK_ELSE),
+		RESERVED_ENTRY("if",		SPN_TOK_IF),
+		RESERVED_ENTRY("break",		SPN_TOK_BREAK),
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("false",		SPN_TOK_FALSE),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("nan",		SPN_TOK_NAN),
-		RESERVED_ENTRY("nil",		SPN_TOK_NIL),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		RESERVED_ENTRY("for",		SPN_TOK_FOR),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("not",		SPN_TOK_LOGNOT),
-		RESERVED_ENTRY("null",		SPN_TOK_NIL),
-		RESERVED_ENTRY("or",		SPN_TOK_LOGOR),
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
+		EMPTY_ENTRY,
 		RESERVED_ENTRY("return",	SPN_TOK_RETURN),
-		RESERVED_ENTRY("sizeof",	SPN_TOK_SIZEOF),
-		RESERVED_ENTRY("true",		SPN_TOK_TRUE),
-		RESERVED_ENTRY("typeof",	SPN_TOK_TYPEOF),
-		RESERVED_ENTRY("var",		SPN_TOK_VAR),
-		RESERVED_ENTRY("while",		SPN_TOK_WHILE)
+		EMPTY_ENTRY
 	};
 
 	while (is_ident(*end)) {
@@ -480,26 +512,36 @@ static int lex_ident(SpnParser *p)
 
 	diff = end - p->pos;
 
+#ifndef NDEBUG
+	{
+		/* every keyword must be in the slot it hashes to. If a new
+		 * one collides with another, change KEYWORD_HASH().
+		 */
+		size_t i;
+		for (i = 0; i < COUNT(kwds); i++) {
+			assert(kwds[i].word == NULL || KEYWORD_HASH(kwds[i].word, kwds[i].len) == i);
+		}
+	}
+#endif
+
 	/* check if the word is one of the reserved keywords */
-	
-	for (i = 0; i < COUNT(kwds); i++) {
-		if (diff == kwds[i].len
-		 && strncmp(p->pos, kwds[i].word, kwds[i].len) == 0) {
-		 	p->pos = end;
-		 	p->curtok.tok = kwds[i].tok;
-		 	return 1; /* if so, mark it as such */
-		 }
+	kwd = &kwds[KEYWORD_HASH(p->pos, diff)];
+	if (diff == kwd->len && memcmp(p->pos, kwd->word, diff) == 0) {
+		p->pos = end;
+		p->curtok.tok = kwd->tok;
+		return 1; /* if so, mark it as such */
 	}
 
 	/* if not, it's a proper identifier */
 	p->curtok.tok = SPN_TOK_IDENT;
 
-	buf = spn_strndup(p->pos, diff);
-	str = spn_string_new_nocopy_len(buf, diff, 1);
+	buf = alloc_token(p, diff + 1);
+	memcpy(buf, p->pos, diff);
+	buf[diff] = 0;
 
 	p->curtok.val.t = SPN_TYPE_STRING;
 	p->curtok.val.f = SPN_TFLG_OBJECT;
-	p->curtok.val.v.ptrv = str;
+	p->curtok.val.v.ptrv = token_string(p, buf, diff + 1, diff);
 
 	p->pos = end;
 
@@ -566,21 +608,28 @@ static int lex_char(SpnParser *p)
 
 static int lex_string(SpnParser *p)
 {
-	size_t sz = 0x20;
 	size_t n = 0;
-	char *buf = malloc(sz);
+	const char *end = p->pos + 1;
+	size_t size;
+	char *buf;
 
-	if (buf == NULL) {
-		abort();
+	/* an escape sequence is never shorter than the character it stands
+	 * for, so the contents fit into as many bytes as the source text
+	 */
+	while (end[0] != '"' && end[0] != 0) {
+		end += end[0] == '\\' && end[1] != 0 ? 2 : 1;
 	}
 
+	size = end - p->pos;
+	buf = alloc_token(p, size);
+
 	/* skip string beginning marker double quotation mark */
 	p->pos++;
 
 	while (p->pos[0] != '"') {
 		if (p->pos[0] == 0) {
 			/* premature end of string literal */
-			free(buf);
+			free_token(p, buf, size);
 			spn_parser_error(p, "end of input before closing \" in string literal");
 			return 0;
 		}
@@ -589,7 +638,7 @@ static int lex_string(SpnParser *p)
 			int c = unescape_char(p);
 			if (c < 0) {
 				/* error unescaping the character */
-				free(buf);
+				free_token(p, buf, size);
 				return 0;
 			}
 
@@ -597,15 +646,6 @@ static int lex_string(SpnParser *p)
 		} else {
 			buf[n++] = *p->pos++;
 		}
-
-		/* expand the buffer if necessary */
-		if (n >= sz) {
-			sz <<= 1;
-			buf = realloc(buf, sz);
-			if (buf == NULL) {
-				abort();
-			}
-		}
 	}
 
 	buf[n] = 0;
@@ -616,7 +656,7 @@ static int lex_string(SpnParser *p)
 	p->curtok.tok = SPN_TOK_STR;
 	p->curtok.val.t = SPN_TYPE_STRING;
 	p->curtok.val.f = SPN_TFLG_OBJECT;
-	p->curtok.val.v.ptrv = spn_string_new_nocopy_len(buf, n, 1);
+	p->curtok.val.v.ptrv = token_string(p, buf, size, n);
 
 	return 1;
 }
@@ -0,0 +1,124 @@
+/*
+ * numbuf.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Typed numeric buffers
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "numbuf.h"
+
+static void free_numbuf(void *obj);
+
+static const SpnClass spn_class_numbuf = {
+	"numeric buffer",
+	sizeof(SpnNumBuffer),
+	NULL,
+	NULL,
+	NULL,
+	free_numbuf,
+	SPN_MEM_ARRAY,
+	1
+};
+
+static void free_numbuf(void *obj)
+{
+	SpnNumBuffer *buf = obj;
+	size_t len = buf->len > 0 ? buf->len : 1;
+
+	if (buf->type == SPN_NUMBUF_INT) {
+		spn_mem_free(buf->base.pool, SPN_MEM_ARRAY, buf->data.i, len * sizeof(long));
+	} else {
+		spn_mem_free(buf->base.pool, SPN_MEM_ARRAY, buf->data.f, len * sizeof(double));
+	}
+}
+
+SpnNumBuffer *spn_numbuf_new(int type, size_t len)
+{
+	SpnNumBuffer *buf;
+	size_t elsize = type == SPN_NUMBUF_INT ? sizeof(long) : sizeof(double);
+	size_t n = len > 0 ? len : 1;
+	void *data;
+
+	assert(type == SPN_NUMBUF_INT || type == SPN_NUMBUF_FLOAT);
+
+	/* allocate at least one element, so that an empty buffer
+	 * doesn't look like a failed allocation. The elements come from
+	 * the current pool, like the buffer object.
+	 */
+	if (n > (size_t)(-1) / elsize) {
+		return NULL;
+	}
+
+	data = spn_mem_alloc(spn_pool_get_current(), SPN_MEM_ARRAY, n * elsize);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	memset(data, 0, n * elsize);
+	buf = spn_object_new(&spn_class_numbuf);
+
+	/* all bits zero is 0.0 on every IEEE-754 platform */
+	if (type == SPN_NUMBUF_INT) {
+		buf->data.i = data;
+	} else {
+		buf->data.f = data;
+	}
+
+	buf->type = type;
+	buf->len = len;
+
+	return buf;
+}
+
+SpnNumBuffer *spn_value_numbuf(const SpnValue *val)
+{
+	if (val->t == SPN_TYPE_USRDAT
+	 && val->f & SPN_TFLG_OBJECT
+	 && ((SpnObject *)(val->v.ptrv))->isa == &spn_class_numbuf) {
+		return val->v.ptrv;
+	}
+
+	return NULL;
+}
+
+void spn_numbuf_get(SpnNumBuffer *buf, size_t idx, SpnValue *val)
+{
+	assert(idx < buf->len);
+
+	val->t = SPN_TYPE_NUMBER;
+
+	if (buf->type == SPN_NUMBUF_INT) {
+		val->f = 0;
+		val->v.intv = buf->data.i[idx];
+	} else {
+		val->f = SPN_TFLG_FLOAT;
+		val->v.fltv = buf->data.f[idx];
+	}
+}
+
+int spn_numbuf_set(SpnNumBuffer *buf, size_t idx, const SpnValue *val)
+{
+	assert(idx < buf->len);
+
+	if (val->t != SPN_TYPE_NUMBER) {
+		return -1;
+	}
+
+	if (buf->type == SPN_NUMBUF_INT) {
+		if (val->f & SPN_TFLG_FLOAT) {
+			return -1;
+		}
+
+		buf->data.i[idx] = val->v.intv;
+	} else {
+		buf->data.f[idx] = val->f & SPN_TFLG_FLOAT ? val->v.fltv : val->v.intv;
+	}
+
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * numbuf.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Typed numeric buffers
+ */
+
+#ifndef SPN_NUMBUF_H
+#define SPN_NUMBUF_H
+
+#include <stddef.h>
+
+#include "spn.h"
+#include "object.h"
+
+/* A numeric buffer is a fixed-size, contiguous vector of either integers
+ * or floating-point numbers. Unlike an array, it doesn't store a type tag
+ * with each element, so it takes a quarter of the memory and bulk numeric
+ * operations can run over it in tight loops (see the numeric buffer library
+ * in rtlb.c). Scripts index it with the `[]' operator like an array.
+ * Buffers are objects, and they are passed to scripts as object-typed
+ * user data values.
+ */
+enum {
+	SPN_NUMBUF_INT,
+	SPN_NUMBUF_FLOAT
+};
+
+typedef struct SpnNumBuffer {
+	SpnObject	 base;		/* private			*/
+	int		 type;		/* public, readonly		*/
+	size_t		 len;		/* public, readonly		*/
+	union {
+		long	*i;		/* if `type' is SPN_NUMBUF_INT	*/
+		double	*f;		/* if `type' is SPN_NUMBUF_FLOAT	*/
+	} data;				/* public, elements writable	*/
+} SpnNumBuffer;
+
+/* creates a buffer of `len` elements, all of which are zero. Returns NULL
+ * if they can't be allocated (see spn_mem_alloc()).
+ */
+SPN_API	SpnNumBuffer	*spn_numbuf_new(int type, size_t len);
+
+/* returns the buffer if `val` is one (an object-typed user data), or NULL */
+SPN_API	SpnNumBuffer	*spn_value_numbuf(const SpnValue *val);
+
+/* element access. The index must be less than the length of the buffer.
+ * Integers are converted when they are stored into a float buffer; storing
+ * a non-number anywhere, or a float into an integer buffer, fails, and
+ * then spn_numbuf_set() returns nonzero and leaves the buffer unchanged.
+ */
+SPN_API	void		 spn_numbuf_get(SpnNumBuffer *buf, size_t idx, SpnValue *val);
+SPN_API	int		 spn_numbuf_set(SpnNumBuffer *buf, size_t idx, const SpnValue *val);
+
+#endif /* SPN_NUMBUF_H */
@@ -9,8 +9,53 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "spn.h"
+#include "private.h"
+
+/* blocks are handed out in multiples of POOL_GRANULE bytes, so that
+ * every block is suitably aligned. Requests larger than
+ * POOL_GRANULE * POOL_NCLASSES bytes are passed through to the allocator.
+ */
+#define POOL_GRANULE	16
+#define POOL_NCLASSES	16
+#define POOL_CHUNKSIZE	0x4000
+
+/* size of the chunk header, rounded up to keep blocks aligned */
+#define POOL_CHUNKHDR	((sizeof(struct PoolChunk) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+typedef struct PoolBlock {
+	struct PoolBlock *next;
+} PoolBlock;
+
+struct PoolChunk {
+	struct PoolChunk *next;
+};
+
+struct SpnPool {
+	PoolBlock *freelist[POOL_NCLASSES];
+	struct PoolChunk *chunks;
+	char *bump;	/* unused space in the most recent chunk	*/
+	char *end;
+	size_t live;	/* number of blocks not yet released		*/
+	int dying;	/* spn_pool_free() was called on this pool	*/
+
+	SpnAllocator alloc;
+	void *ud;	/* the user data of `alloc`			*/
+
+	SpnMemStats stats;
+	void (*handler)(void *);	/* see spn_pool_setlimit()	*/
+	void *handlerud;
+
+	SpnGCList gc;
+};
+
+/* NULL is the default pool, i. e. malloc() */
+static SPN_THREAD_LOCAL SpnPool *current_pool = NULL;
+static SPN_THREAD_LOCAL SpnGCList default_gc = { NULL, 0, 0 };
+
+static void destroy_pool(SpnPool *pool);
 
 const char *spn_object_type(const void *o) /* for typeof() */
 {
@@ -43,14 +88,419 @@ int spn_object_cmp(const void *lhs, const void *rhs)
 	return lo->isa->compare(lo, ro);
 }
 
-void *spn_object_new(const SpnClass *isa)
+static void *default_allocator(void *ud, void *ptr, size_t oldsize, size_t newsize)
 {
-	SpnObject *obj = malloc(isa->instsz);
-	if (obj == NULL) {
+	if (newsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, newsize);
+}
+
+/* calls the allocator of the pool, which must not fail */
+static void *pool_realloc(SpnPool *pool, void *ptr, size_t oldsize, size_t newsize)
+{
+	ptr = pool->alloc(pool->ud, ptr, oldsize, newsize);
+	if (ptr == NULL && newsize > 0) {
 		abort();
 	}
 
+	return ptr;
+}
+
+/* `oldsize` bytes of `kind` become `newsize` bytes. The unsigned
+ * arithmetic wraps around, so this works for shrinking too. This is done
+ * for every object, so the peak and the limit are dealt with out of line.
+ */
+#define ACCOUNT(pool, kind, oldsize, newsize)	do {			\
+		SpnMemStats *stats_ = &(pool)->stats;			\
+		size_t old_ = (oldsize), new_ = (newsize);		\
+		assert((kind) >= 0 && (kind) < SPN_MEM_NKINDS);		\
+		stats_->bytes[kind] += new_ - old_;			\
+		stats_->total += new_ - old_;				\
+		if (new_ > old_						\
+		 && (stats_->total > stats_->peak || stats_->limit != 0)) { \
+			grown(pool);					\
+		}							\
+	} while (0)
+
+static void grown(SpnPool *pool)
+{
+	SpnMemStats *stats = &pool->stats;
+
+	if (stats->total > stats->peak) {
+		stats->peak = stats->total;
+	}
+
+	spn_pool_checklimit(pool);
+}
+
+SpnPool *spn_pool_new()
+{
+	return spn_pool_new_allocator(default_allocator, NULL);
+}
+
+SpnPool *spn_pool_new_allocator(SpnAllocator alloc, void *ud)
+{
+	SpnPool *pool = alloc(ud, NULL, 0, sizeof(*pool));
+	size_t i;
+
+	if (pool == NULL) {
+		abort();
+	}
+
+	for (i = 0; i < POOL_NCLASSES; i++) {
+		pool->freelist[i] = NULL;
+	}
+
+	pool->chunks = NULL;
+	pool->bump = NULL;
+	pool->end = NULL;
+	pool->live = 0;
+	pool->dying = 0;
+
+	pool->alloc = alloc;
+	pool->ud = ud;
+
+	for (i = 0; i < SPN_MEM_NKINDS; i++) {
+		pool->stats.bytes[i] = 0;
+		pool->stats.objects[i] = 0;
+	}
+
+	pool->stats.total = 0;
+	pool->stats.peak = 0;
+	pool->stats.limit = 0;
+	pool->handler = NULL;
+	pool->handlerud = NULL;
+
+	pool->gc.arrays = NULL;
+	pool->gc.live = 0;
+	pool->gc.mark = 0;
+
+	return pool;
+}
+
+void spn_pool_free(SpnPool *pool)
+{
+	assert(pool != NULL);
+
+	if (pool->live == 0) {
+		destroy_pool(pool);
+	} else {
+		pool->dying = 1;
+	}
+}
+
+static void destroy_pool(SpnPool *pool)
+{
+	struct PoolChunk *chunk = pool->chunks;
+
+	while (chunk != NULL) {
+		struct PoolChunk *next = chunk->next;
+		pool_realloc(pool, chunk, POOL_CHUNKSIZE, 0);
+		chunk = next;
+	}
+
+	pool->alloc(pool->ud, pool, sizeof(*pool), 0);
+}
+
+/* a block of the pool has been given back */
+static void block_released(SpnPool *pool)
+{
+	if (--pool->live == 0 && pool->dying) {
+		destroy_pool(pool);
+	}
+}
+
+SpnPool *spn_pool_set_current(SpnPool *pool)
+{
+	SpnPool *prev = current_pool;
+	current_pool = pool;
+	return prev;
+}
+
+SpnPool *spn_pool_get_current()
+{
+	return current_pool;
+}
+
+SpnGCList *spn_pool_gclist(SpnPool *pool)
+{
+	return pool != NULL ? &pool->gc : &default_gc;
+}
+
+/* the free lists, without the accounting */
+static void *get_block(SpnPool *pool, size_t size)
+{
+	size_t cls = (size + POOL_GRANULE - 1) / POOL_GRANULE;
+	PoolBlock *block;
+
+	assert(size > 0);
+
+	if (pool == NULL) {
+		void *ptr = malloc(size);
+		if (ptr == NULL) {
+			abort();
+		}
+
+		return ptr;
+	}
+
+	pool->live++;
+
+	if (cls > POOL_NCLASSES) {
+		return pool_realloc(pool, NULL, 0, size);
+	}
+
+	size = cls * POOL_GRANULE;
+	block = pool->freelist[cls - 1];
+
+	if (block != NULL) {
+		pool->freelist[cls - 1] = block->next;
+	} else {
+		/* carve a new block from the current chunk. whatever is left
+		 * at the end of a full chunk is simply not used.
+		 */
+		if (pool->end - pool->bump < (ptrdiff_t)(size)) {
+			struct PoolChunk *chunk = pool_realloc(pool, NULL, 0, POOL_CHUNKSIZE);
+
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+			pool->bump = (char *)(chunk) + POOL_CHUNKHDR;
+			pool->end = (char *)(chunk) + POOL_CHUNKSIZE;
+		}
+
+		block = (PoolBlock *)(pool->bump);
+		pool->bump += size;
+	}
+
+	return block;
+}
+
+static void put_block(SpnPool *pool, void *ptr, size_t size)
+{
+	size_t cls = (size + POOL_GRANULE - 1) / POOL_GRANULE;
+
+	if (pool == NULL) {
+		free(ptr);
+		return;
+	}
+
+	if (cls > POOL_NCLASSES) {
+		pool_realloc(pool, ptr, size, 0);
+	} else {
+		PoolBlock *block = ptr;
+		block->next = pool->freelist[cls - 1];
+		pool->freelist[cls - 1] = block;
+	}
+
+	block_released(pool);
+}
+
+void *spn_pool_alloc(SpnPool *pool, size_t size)
+{
+	void *ptr = get_block(pool, size);
+
+	if (pool != NULL) {
+		ACCOUNT(pool, SPN_MEM_OTHER, 0, size);
+	}
+
+	return ptr;
+}
+
+void spn_pool_release(SpnPool *pool, void *ptr, size_t size)
+{
+	if (pool != NULL) {
+		ACCOUNT(pool, SPN_MEM_OTHER, size, 0);
+	}
+
+	put_block(pool, ptr, size);
+}
+
+const SpnMemStats *spn_pool_stats(SpnPool *pool)
+{
+	assert(pool != NULL);
+	return &pool->stats;
+}
+
+void spn_pool_setlimit(SpnPool *pool, size_t limit, void (*handler)(void *), void *ud)
+{
+	assert(pool != NULL);
+
+	pool->stats.limit = limit;
+	pool->handler = handler;
+	pool->handlerud = ud;
+}
+
+void spn_pool_checklimit(SpnPool *pool)
+{
+	const SpnMemStats *stats = &pool->stats;
+
+	if (stats->limit != 0
+	 && stats->total > stats->limit
+	 && pool->handler != NULL) {
+		pool->handler(pool->handlerud);
+	}
+}
+
+/* spn_mem_xrealloc(), which spn_mem_realloc() falls back to whenever it
+ * can't fail
+ */
+static void *mem_resize(SpnPool *pool, int kind, void *ptr, size_t oldsize, size_t newsize)
+{
+	if (pool == NULL) {
+		if (newsize == 0) {
+			free(ptr);
+			return NULL;
+		}
+
+		ptr = realloc(ptr, newsize);
+		if (ptr == NULL) {
+			abort();
+		}
+
+		return ptr;
+	}
+
+	/* the block may be the last thing keeping a dying pool alive */
+	if (newsize == 0) {
+		if (ptr != NULL) {
+			ACCOUNT(pool, kind, oldsize, 0);
+			put_block(pool, ptr, oldsize);
+		}
+
+		return NULL;
+	}
+
+	/* small blocks come from the free lists, like objects */
+	if (ptr == NULL) {
+		ptr = get_block(pool, newsize);
+	} else {
+		size_t oldcls = (oldsize + POOL_GRANULE - 1) / POOL_GRANULE;
+		size_t newcls = (newsize + POOL_GRANULE - 1) / POOL_GRANULE;
+
+		if (oldcls > POOL_NCLASSES && newcls > POOL_NCLASSES) {
+			ptr = pool_realloc(pool, ptr, oldsize, newsize);
+		} else if (oldcls != newcls) {
+			void *block = get_block(pool, newsize);
+			memcpy(block, ptr, oldsize < newsize ? oldsize : newsize);
+			put_block(pool, ptr, oldsize);
+			ptr = block;
+		}
+	}
+
+	ACCOUNT(pool, kind, oldsize, newsize);
+	return ptr;
+}
+
+void *spn_mem_alloc(SpnPool *pool, int kind, size_t size)
+{
+	return spn_mem_realloc(pool, kind, NULL, 0, size);
+}
+
+void *spn_mem_realloc(SpnPool *pool, int kind, void *ptr, size_t oldsize, size_t newsize)
+{
+	const SpnMemStats *stats;
+	void *block;
+
+	if (newsize <= oldsize) {
+		return mem_resize(pool, kind, ptr, oldsize, newsize);
+	}
+
+	/* realloc() leaves the block alone if it fails */
+	if (pool == NULL) {
+		return realloc(ptr, newsize);
+	}
+
+	/* growing past the limit is refused, and reported to the handler
+	 * like exceeding it would be
+	 */
+	stats = &pool->stats;
+	if (stats->limit != 0
+	 && (stats->total > stats->limit || newsize - oldsize > stats->limit - stats->total)) {
+		if (pool->handler != NULL) {
+			pool->handler(pool->handlerud);
+		}
+
+		return NULL;
+	}
+
+	/* small blocks come from the chunks of the free lists, so only large
+	 * ones can be refused by the allocator
+	 */
+	if ((newsize + POOL_GRANULE - 1) / POOL_GRANULE <= POOL_NCLASSES) {
+		return mem_resize(pool, kind, ptr, oldsize, newsize);
+	}
+
+	if ((oldsize + POOL_GRANULE - 1) / POOL_GRANULE > POOL_NCLASSES) {
+		block = pool->alloc(pool->ud, ptr, oldsize, newsize);
+		if (block == NULL) {
+			return NULL;
+		}
+	} else {
+		block = pool->alloc(pool->ud, NULL, 0, newsize);
+		if (block == NULL) {
+			return NULL;
+		}
+
+		/* a new block of the pool replaces a small one, if any */
+		pool->live++;
+
+		if (ptr != NULL) {
+			memcpy(block, ptr, oldsize);
+			put_block(pool, ptr, oldsize);
+		}
+	}
+
+	ACCOUNT(pool, kind, oldsize, newsize);
+	return block;
+}
+
+void *spn_mem_xalloc(SpnPool *pool, int kind, size_t size)
+{
+	return mem_resize(pool, kind, NULL, 0, size);
+}
+
+void *spn_mem_xrealloc(SpnPool *pool, int kind, void *ptr, size_t oldsize, size_t newsize)
+{
+	return mem_resize(pool, kind, ptr, oldsize, newsize);
+}
+
+void spn_mem_free(SpnPool *pool, int kind, void *ptr, size_t size)
+{
+	if (ptr != NULL) {
+		mem_resize(pool, kind, ptr, size, 0);
+	}
+}
+
+void *spn_object_new(const SpnClass *isa)
+{
+	SpnObject *obj;
+
+	/* the destructor frees the instance itself */
+	if (isa->pooled == 0) {
+		obj = malloc(isa->instsz);
+		if (obj == NULL) {
+			abort();
+		}
+
+		obj->isa = isa;
+		obj->pool = NULL;
+		obj->refcnt = 1;
+
+		return obj;
+	}
+
+	obj = get_block(current_pool, isa->instsz);
+
+	if (current_pool != NULL) {
+		ACCOUNT(current_pool, isa->memkind, 0, isa->instsz);
+		current_pool->stats.objects[isa->memkind]++;
+	}
+
 	obj->isa = isa;
+	obj->pool = current_pool;
 	obj->refcnt = 1;
 
 	return obj;
@@ -67,9 +517,26 @@ void spn_object_release(void *o)
 	SpnObject *obj = o;
 
 	if (--obj->refcnt == 0) {
+		SpnPool *pool = obj->pool;
+
+		if (obj->isa->pooled == 0) {
+			if (obj->isa->destructor != NULL) {
+				obj->isa->destructor(obj);
+			}
+
+			return;
+		}
+
 		if (obj->isa->destructor != NULL) {
 			obj->isa->destructor(obj);
 		}
+
+		if (pool != NULL) {
+			ACCOUNT(pool, obj->isa->memkind, obj->isa->instsz, 0);
+			pool->stats.objects[obj->isa->memkind]--;
+		}
+
+		put_block(pool, obj, obj->isa->instsz);
 	}
 }
 
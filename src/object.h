@@ -27,16 +27,145 @@ typedef struct SpnClass {
 	int (*equal)(const void *, const void *);	/* non-zero: equal, zero: different	*/
 	int (*compare)(const void *, const void *);	/* -1, +1, 0: lhs is <, >, == to rhs	*/
 	unsigned long (*hashfn)(void *);		/* cache the hash if immutable!		*/
-	void (*destructor)(void *);			/* should call free() on its argument	*/
+	void (*destructor)(void *);			/* see `pooled'				*/
+	int memkind;					/* SPN_MEM_*, what instances count as	*/
+	int pooled;					/* nonzero: allocated from the pool	*/
 } SpnClass;
 
+/* Instances of a class whose `pooled` member is nonzero are allocated from
+ * the current pool (see below) and counted in its statistics. Their memory
+ * is given back by spn_object_release() after the destructor has run, so the
+ * destructor must *not* free its argument. All the classes of the runtime
+ * are like this.
+ *
+ * If `pooled` is 0, instances are malloc()'d and the destructor should call
+ * free() on its argument, like every destructor did before pools existed.
+ * A class defined with an initializer which leaves out the members after
+ * `destructor` gets this behavior, so it keeps working unchanged.
+ */
+
+typedef struct SpnPool SpnPool;
+
 typedef struct SpnObject {
 	const SpnClass *isa;
+	SpnPool *pool;	/* the pool the instance was allocated from */
 	unsigned refcnt;
 } SpnObject;
 
-/* allocates a partially uninitialized (only the `isa` and `refcount` members
- * are set up) object of clas `isa`. The returned instance should go through
+/* Object memory pools. Instances are not malloc()'d one by one: a pool
+ * carves them out of large chunks and recycles freed instances through
+ * a free list per size class. Objects are allocated from the current pool,
+ * which is per thread (if the compiler supports thread-local variables,
+ * see SPN_THREAD_LOCAL in private.h). Unless another pool has been made
+ * current using spn_pool_set_current(), it's the default one, which is
+ * simply malloc(), so it can be used from any thread (but see the cycle
+ * collector in array.h about its arrays). An instance always
+ * goes back to the pool it came from, so pools may be switched at any time.
+ * A pool itself must only be used by one thread at a time.
+ *
+ * spn_pool_free() releases all the memory of a pool at once. If some objects
+ * (or blocks, see spn_mem_alloc()) allocated from it are still alive, the
+ * pool is only marked for deletion, and it is deallocated when its last
+ * block is released.
+ */
+SPN_API SpnPool *spn_pool_new();
+SPN_API void spn_pool_free(SpnPool *pool);
+
+/* a pool gets all of its memory from its allocator. It is called with
+ * `newsize` > 0 to allocate (`ptr` is NULL and `oldsize` is 0) or resize
+ * a block, like realloc(), and with `newsize` == 0 to free it (then it
+ * should return NULL). `oldsize` is always the size the block was last
+ * allocated with. It may fail (return NULL) for large blocks: spn_mem_alloc()
+ * and spn_mem_realloc() then return NULL too, so the buffers a script asks
+ * for (strings, numeric buffers...) fail with a runtime error. Anywhere
+ * else, failing to allocate is fatal (the runtime calls abort()), see
+ * spn_pool_setlimit() for stopping runaway programs before that.
+ * The pools made by spn_pool_new() use realloc() and free(). `ud` is
+ * passed to every call, so it must outlive the pool.
+ */
+typedef void *(*SpnAllocator)(void *ud, void *ptr, size_t oldsize, size_t newsize);
+
+SPN_API SpnPool *spn_pool_new_allocator(SpnAllocator alloc, void *ud);
+
+/* makes `pool` current in the calling thread and returns the previously
+ * current pool. NULL denotes the default pool, both here and as the return
+ * value.
+ */
+SPN_API SpnPool *spn_pool_set_current(SpnPool *pool);
+SPN_API SpnPool *spn_pool_get_current();
+
+/* low-level block allocation. `size` must be the same for the allocation
+ * and the corresponding call to spn_pool_release(). `pool` may be NULL.
+ */
+SPN_API void *spn_pool_alloc(SpnPool *pool, size_t size);
+SPN_API void spn_pool_release(SpnPool *pool, void *ptr, size_t size);
+
+/* Memory accounting. Apart from objects, the buffers of the runtime (the
+ * contents of strings and arrays, the stacks of virtual machines, bytecode,
+ * symbol tables...) are also allocated from a pool: the one their object
+ * lives in, or the one which was current when the VM, the compiler or the
+ * parser owning them was created. Every block counts as one of these kinds:
+ */
+enum spn_mem_kind {
+	SPN_MEM_OTHER,		/* functions, parsers, parse trees, the VM...	*/
+	SPN_MEM_STRING,		/* strings and string builders			*/
+	SPN_MEM_ARRAY,		/* arrays, iterators and numeric buffers	*/
+	SPN_MEM_FRAMES,		/* call stacks of the VM and of coroutines	*/
+	SPN_MEM_BYTECODE,	/* compiled programs and their symbol tables	*/
+	SPN_MEM_NKINDS
+};
+
+/* the bookkeeping of a pool. Sizes are those requested, so the memory the
+ * allocator provides is somewhat more (chunks are only partially used, the
+ * free lists keep released objects, the allocator has its own overhead).
+ * The default pool doesn't keep statistics. Transient working memory of
+ * the optimizer, the verifier, the JIT assembler, the cycle collector and
+ * the profiler is malloc()'d directly, and so are error messages and the
+ * buffers which the API hands out to be free()'d (see e. g.
+ * spn_vm_stacktrace()).
+ */
+typedef struct SpnMemStats {
+	size_t bytes[SPN_MEM_NKINDS];	/* in use, by kind			*/
+	size_t objects[SPN_MEM_NKINDS];	/* live objects, by class kind		*/
+	size_t total;			/* sum of `bytes`			*/
+	size_t peak;			/* highest `total` so far		*/
+	size_t limit;			/* see spn_pool_setlimit(), 0: none	*/
+} SpnMemStats;
+
+SPN_API const SpnMemStats *spn_pool_stats(SpnPool *pool);
+
+/* whenever an allocation makes `total` exceed `limit` (0 means no limit),
+ * `handler(ud)` is called. spn_mem_alloc() and spn_mem_realloc() refuse
+ * such requests (and call the handler all the same), so the buffers which
+ * a script sizes itself never exceed the limit. Objects and the bookkeeping
+ * of the runtime (stacks, symbol tables, the elements of arrays...) are
+ * allocated anyway, and the handler decides what to do about it; typically
+ * it calls spn_vm_interrupt() (as the limit of a context does, see
+ * spn_ctx_setmemlimit()), so the program stops soon after.
+ */
+SPN_API void spn_pool_setlimit(SpnPool *pool, size_t limit, void (*handler)(void *), void *ud);
+
+/* calls the handler if `total` is over the limit right now. The VM does
+ * so whenever it starts or resumes a program (see spn_vm_new()).
+ */
+SPN_API void spn_pool_checklimit(SpnPool *pool);
+
+/* like malloc(), realloc() and free(), but through the allocator of `pool`
+ * (the C library functions if it's NULL), and counted as `kind`. The size of
+ * the block must be passed back for reallocating and freeing it. Allocating
+ * 0 bytes returns NULL, so does reallocating to 0 bytes, which frees the
+ * block. Small blocks come from the free lists of the pool, only the large
+ * ones are passed to the allocator one by one. Growing a block fails, i. e.
+ * NULL is returned and the block is left as it was, if it would take the
+ * pool over its limit or if the allocator fails; shrinking and freeing
+ * never fail.
+ */
+SPN_API void *spn_mem_alloc(SpnPool *pool, int kind, size_t size);
+SPN_API void *spn_mem_realloc(SpnPool *pool, int kind, void *ptr, size_t oldsize, size_t newsize);
+SPN_API void spn_mem_free(SpnPool *pool, int kind, void *ptr, size_t size);
+
+/* allocates a partially uninitialized (only the `isa`, `pool` and `refcount`
+ * members are set up) object of clas `isa` from the current pool. The returned instance should go through
  * a dedicated constructor (see e. g. spn_string_new()).
  */
 SPN_API void *spn_object_new(const SpnClass *isa);
@@ -64,8 +193,8 @@ SPN_API int spn_object_cmp(const void *lhs, const void *rhs);
 SPN_API void spn_object_retain(void *o);
 
 /* decrements the reference count of an object.
- * calls the destructor and frees the instance if its reference count
- * drops to 0.
+ * calls the destructor and returns the instance to its pool if its
+ * reference count drops to 0.
  */
 SPN_API void spn_object_release(void *o);
 
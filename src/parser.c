@@ -5,7 +5,8 @@
  * Created by Árpád Goretity on 02/05/2013
  * Licensed under the 2-clause BSD License
  *
- * Simple recursive descent parser
+ * Simple recursive descent parser, with precedence climbing for binary
+ * operators
  */
 
 #include <stdio.h>
@@ -24,20 +25,8 @@ static SpnAST *parse_stmt_list(SpnParser *p);
 static SpnAST *parse_function(SpnParser *p, int is_stmt);
 static SpnAST *parse_expr(SpnParser *p);
 
-static SpnAST *parse_assignment(SpnParser *p);
-static SpnAST *parse_concat(SpnParser *p);
-static SpnAST *parse_condexpr(SpnParser *p);
-
-static SpnAST *parse_logical_or(SpnParser *p);
-static SpnAST *parse_logical_and(SpnParser *p);
-static SpnAST *parse_bitwise_or(SpnParser *p);
-static SpnAST *parse_bitwise_xor(SpnParser *p);
-static SpnAST *parse_bitwise_and(SpnParser *p);
-
-static SpnAST *parse_comparison(SpnParser *p);
-static SpnAST *parse_shift(SpnParser *p);
-static SpnAST *parse_additive(SpnParser *p);
-static SpnAST *parse_multiplicative(SpnParser *p);
+static SpnAST *parse_binary(SpnParser *p, int minprec);
+static SpnAST *parse_condexpr(SpnParser *p, SpnAST *cond);
 
 static SpnAST *parse_prefix(SpnParser *p);
 static SpnAST *parse_postfix(SpnParser *p);
@@ -59,36 +48,41 @@ static SpnAST *parse_expr_stmt(SpnParser *p);
 static SpnAST *parse_empty(SpnParser *p);
 static SpnAST *parse_block(SpnParser *p);
 
-
-static SpnAST *parse_binexpr_rightassoc(
-	SpnParser *p,
-	const enum spn_lex_token toks[],
-	const enum spn_ast_node nodes[],
-	size_t n,
-	SpnAST *(*subexpr)(SpnParser *)
-);
-
-static SpnAST *parse_binexpr_leftassoc(
-	SpnParser *p,
-	const enum spn_lex_token toks[],
-	const enum spn_ast_node nodes[],
-	size_t n,
-	SpnAST *(*subexpr)(SpnParser *)
-);
-
+/* precedence levels of binary operators, from the loosest to the tightest */
+enum {
+	PREC_NONE,
+	PREC_ASSIGN,
+	PREC_CONCAT,
+	PREC_COND,
+	PREC_LOGOR,
+	PREC_LOGAND,
+	PREC_COMPARE,
+	PREC_BITOR,
+	PREC_BITXOR,
+	PREC_BITAND,
+	PREC_SHIFT,
+	PREC_ADD,
+	PREC_MUL
+};
+
+/* allocates a node in the arena of the tree being parsed */
+static SpnAST *new_node(SpnParser *p, enum spn_ast_node node)
+{
+	return spn_ast_new_arena(p->arena, node, p->lineno);
+}
 
 SpnParser *spn_parser_new()
 {
-	SpnParser *p = malloc(sizeof(*p));
-	if (p == NULL) {
-		abort();
-	}
+	SpnPool *pool = spn_pool_get_current();
+	SpnParser *p = spn_mem_xalloc(pool, SPN_MEM_OTHER, sizeof(*p));
 
+	p->pool = pool;
 	p->pos = NULL;
 	p->eof = 0;
 	p->error = 0;
 	p->lineno = 1;
 	p->errmsg = NULL;
+	p->arena = NULL;
 
 	return p;
 }
@@ -96,7 +90,7 @@ SpnParser *spn_parser_new()
 void spn_parser_free(SpnParser *p)
 {
 	free(p->errmsg);
-	free(p);
+	spn_mem_free(p->pool, SPN_MEM_OTHER, p, sizeof(*p));
 }
 
 #define ERRMSG_FORMAT "Sparkling: syntax error near line %lu: "
@@ -142,12 +136,25 @@ void spn_parser_error(SpnParser *p, const char *fmt, ...)
  */
 SpnAST *spn_parser_parse(SpnParser *p, const char *src)
 {
+	SpnAST *tree;
+
 	p->pos = src;
 	p->eof = 0;
 	p->error = 0;
 	p->lineno = 1;
+	p->arena = spn_arena_new();
 
-	return parse_program(p);
+	tree = parse_program(p);
+
+	/* the tree is responsible for its arena from now on */
+	if (tree != NULL) {
+		tree->ownsarena = 1;
+	} else {
+		spn_arena_free(p->arena);
+	}
+
+	p->arena = NULL;
+	return tree;
 }
 
 static SpnAST *parse_program(SpnParser *p)
@@ -157,7 +164,7 @@ static SpnAST *parse_program(SpnParser *p)
 	if (spn_lex(p))	{	/* there are tokens */
 		tree = parse_program_nonempty(p);
 	} else {
-		return p->error ? NULL : spn_ast_new(SPN_NODE_PROGRAM, p->lineno);
+		return p->error ? NULL : new_node(p, SPN_NODE_PROGRAM);
 	}
 
 	if (p->eof) {		/* if EOF after parsing, then all went fine */
@@ -192,7 +199,7 @@ static SpnAST *parse_program_nonempty(SpnParser *p)
 			return NULL;
 		}
 
-		tmp = spn_ast_new(SPN_NODE_COMPOUND, p->lineno);
+		tmp = new_node(p, SPN_NODE_COMPOUND);
 		tmp->left = sub;	/* this node	*/
 		tmp->right = right;	/* next node	*/
 		sub = tmp;		/* update head	*/
@@ -207,7 +214,7 @@ static SpnAST *parse_program_nonempty(SpnParser *p)
 		return sub;
 	}
 
-	ast = spn_ast_new(SPN_NODE_PROGRAM, p->lineno);
+	ast = new_node(p, SPN_NODE_PROGRAM);
 	ast->left = sub;
 	return ast;
 }
@@ -229,7 +236,7 @@ static SpnAST *parse_stmt_list(SpnParser *p)
 			return NULL;
 		}
 
-		tmp = spn_ast_new(SPN_NODE_COMPOUND, p->lineno);
+		tmp = new_node(p, SPN_NODE_COMPOUND);
 		tmp->left = ast;	/* this node	*/
 		tmp->right = right;	/* next node	*/
 		ast = tmp;		/* update head	*/
@@ -309,7 +316,7 @@ static SpnAST *parse_function(SpnParser *p, int is_stmt)
 		return NULL;
 	}
 
-	ast = spn_ast_new(node, p->lineno);
+	ast = new_node(p, node);
 	ast->name = name;
 
 	if (!spn_accept(p, SPN_TOK_RPAREN)) {
@@ -350,7 +357,7 @@ static SpnAST *parse_block(SpnParser *p)
 	}
 
 	if (spn_accept(p, SPN_TOK_RBRACE)) {	/* empty block */
-		return spn_ast_new(SPN_NODE_EMPTY, p->lineno);
+		return new_node(p, SPN_NODE_EMPTY);
 	}
 
 	list = parse_stmt_list(p);
@@ -383,74 +390,120 @@ static SpnAST *parse_block(SpnParser *p)
 		return list;
 	}
 
-	ast = spn_ast_new(SPN_NODE_BLOCK, p->lineno);
+	ast = new_node(p, SPN_NODE_BLOCK);
 	ast->left = list;
 	return ast;
 }
 
 static SpnAST *parse_expr(SpnParser *p)
 {
-	return parse_assignment(p);
+	return parse_binary(p, PREC_ASSIGN);
 }
 
-static SpnAST *parse_assignment(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = {
-		SPN_TOK_ASSIGN,
-		SPN_TOK_PLUSEQ,
-		SPN_TOK_MINUSEQ,
-		SPN_TOK_MULEQ,
-		SPN_TOK_DIVEQ,
-		SPN_TOK_MODEQ,
-		SPN_TOK_ANDEQ,
-		SPN_TOK_OREQ,
-		SPN_TOK_XOREQ,
-		SPN_TOK_SHLEQ,
-		SPN_TOK_SHREQ,
-		SPN_TOK_DOTDOTEQ,
-	};
-
-	static const enum spn_ast_node nodes[] = {
-		SPN_NODE_ASSIGN,
-		SPN_NODE_ASSIGN_ADD,
-		SPN_NODE_ASSIGN_SUB,
-		SPN_NODE_ASSIGN_MUL,
-		SPN_NODE_ASSIGN_DIV,
-		SPN_NODE_ASSIGN_MOD,
-		SPN_NODE_ASSIGN_AND,
-		SPN_NODE_ASSIGN_OR,
-		SPN_NODE_ASSIGN_XOR,
-		SPN_NODE_ASSIGN_SHL,
-		SPN_NODE_ASSIGN_SHR,
-		SPN_NODE_ASSIGN_CONCAT,
-	};
-
-	return parse_binexpr_rightassoc(p, toks, nodes, COUNT(toks), parse_concat);
-}
-
-static SpnAST *parse_concat(SpnParser *p)
+/* Binary operators are parsed by precedence climbing: parse_binary() reads
+ * an operand, then it keeps consuming operators which bind at least as
+ * tightly as `minprec`, along with their right-hand side operands, which
+ * may only contain operators binding even more tightly (or just as tightly
+ * for right-associative ones). This needs one function call per operand,
+ * rather than one per precedence level.
+ */
+static int binop_prec(enum spn_lex_token tok, enum spn_ast_node *node)
 {
-	static const enum spn_lex_token toks[] = { SPN_TOK_DOTDOT };
-	static const enum spn_ast_node nodes[] = { SPN_NODE_CONCAT };
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_condexpr);
+	switch (tok) {
+	case SPN_TOK_ASSIGN:	*node = SPN_NODE_ASSIGN;	return PREC_ASSIGN;
+	case SPN_TOK_PLUSEQ:	*node = SPN_NODE_ASSIGN_ADD;	return PREC_ASSIGN;
+	case SPN_TOK_MINUSEQ:	*node = SPN_NODE_ASSIGN_SUB;	return PREC_ASSIGN;
+	case SPN_TOK_MULEQ:	*node = SPN_NODE_ASSIGN_MUL;	return PREC_ASSIGN;
+	case SPN_TOK_DIVEQ:	*node = SPN_NODE_ASSIGN_DIV;	return PREC_ASSIGN;
+	case SPN_TOK_MODEQ:	*node = SPN_NODE_ASSIGN_MOD;	return PREC_ASSIGN;
+	case SPN_TOK_ANDEQ:	*node = SPN_NODE_ASSIGN_AND;	return PREC_ASSIGN;
+	case SPN_TOK_OREQ:	*node = SPN_NODE_ASSIGN_OR;	return PREC_ASSIGN;
+	case SPN_TOK_XOREQ:	*node = SPN_NODE_ASSIGN_XOR;	return PREC_ASSIGN;
+	case SPN_TOK_SHLEQ:	*node = SPN_NODE_ASSIGN_SHL;	return PREC_ASSIGN;
+	case SPN_TOK_SHREQ:	*node = SPN_NODE_ASSIGN_SHR;	return PREC_ASSIGN;
+	case SPN_TOK_DOTDOTEQ:	*node = SPN_NODE_ASSIGN_CONCAT;	return PREC_ASSIGN;
+
+	case SPN_TOK_DOTDOT:	*node = SPN_NODE_CONCAT;	return PREC_CONCAT;
+	case SPN_TOK_QMARK:	*node = SPN_NODE_CONDEXPR;	return PREC_COND;
+	case SPN_TOK_LOGOR:	*node = SPN_NODE_LOGOR;		return PREC_LOGOR;
+	case SPN_TOK_LOGAND:	*node = SPN_NODE_LOGAND;	return PREC_LOGAND;
+
+	case SPN_TOK_EQUAL:	*node = SPN_NODE_EQUAL;		return PREC_COMPARE;
+	case SPN_TOK_NOTEQ:	*node = SPN_NODE_NOTEQ;		return PREC_COMPARE;
+	case SPN_TOK_LESS:	*node = SPN_NODE_LESS;		return PREC_COMPARE;
+	case SPN_TOK_GREATER:	*node = SPN_NODE_GREATER;	return PREC_COMPARE;
+	case SPN_TOK_LEQ:	*node = SPN_NODE_LEQ;		return PREC_COMPARE;
+	case SPN_TOK_GEQ:	*node = SPN_NODE_GEQ;		return PREC_COMPARE;
+
+	case SPN_TOK_BITOR:	*node = SPN_NODE_BITOR;		return PREC_BITOR;
+	case SPN_TOK_XOR:	*node = SPN_NODE_BITXOR;	return PREC_BITXOR;
+	case SPN_TOK_BITAND:	*node = SPN_NODE_BITAND;	return PREC_BITAND;
+
+	case SPN_TOK_SHL:	*node = SPN_NODE_SHL;		return PREC_SHIFT;
+	case SPN_TOK_SHR:	*node = SPN_NODE_SHR;		return PREC_SHIFT;
+
+	case SPN_TOK_PLUS:	*node = SPN_NODE_ADD;		return PREC_ADD;
+	case SPN_TOK_MINUS:	*node = SPN_NODE_SUB;		return PREC_ADD;
+
+	case SPN_TOK_MUL:	*node = SPN_NODE_MUL;		return PREC_MUL;
+	case SPN_TOK_DIV:	*node = SPN_NODE_DIV;		return PREC_MUL;
+	case SPN_TOK_MOD:	*node = SPN_NODE_MOD;		return PREC_MUL;
+
+	default:		return PREC_NONE;
+	}
 }
 
-static SpnAST *parse_condexpr(SpnParser *p)
+static SpnAST *parse_binary(SpnParser *p, int minprec)
 {
-	SpnAST *ast, *br_true, *br_false, *branches, *tmp;
-
-	ast = parse_logical_or(p);
+	SpnAST *ast = parse_prefix(p);
 	if (ast == NULL) {
 		return NULL;
 	}
 
-	if (!spn_accept(p, SPN_TOK_QMARK)) {
-		return ast;
+	for (;;) {
+		enum spn_ast_node node;
+		SpnAST *right, *tmp;
+		int prec = binop_prec(p->curtok.tok, &node);
+
+		if (prec < minprec || prec == PREC_NONE) {
+			return ast;
+		}
+
+		spn_lex(p);
+
+		if (node == SPN_NODE_CONDEXPR) {
+			ast = parse_condexpr(p, ast);
+			if (ast == NULL) {
+				return NULL;
+			}
+
+			continue;
+		}
+
+		/* assignments are right-associative, everything else
+		 * is left-associative
+		 */
+		right = parse_binary(p, prec == PREC_ASSIGN ? prec : prec + 1);
+		if (right == NULL) {
+			spn_ast_free(ast);
+			return NULL;
+		}
+
+		tmp = new_node(p, node);
+		tmp->left = ast;
+		tmp->right = right;
+		ast = tmp;
 	}
+}
+
+/* the `?' after the condition has already been consumed */
+static SpnAST *parse_condexpr(SpnParser *p, SpnAST *cond)
+{
+	SpnAST *br_true, *br_false, *branches, *tmp;
 
 	br_true = parse_expr(p);
 	if (br_true == NULL) {
-		spn_ast_free(ast);
+		spn_ast_free(cond);
 		return NULL;
 	}
 
@@ -458,137 +511,29 @@ static SpnAST *parse_condexpr(SpnParser *p)
 		/* error, expected ':' */
 		spn_parser_error(p, "expected `:' in conditional expression");
 		spn_value_release(&p->curtok.val);
-		spn_ast_free(ast);
+		spn_ast_free(cond);
 		spn_ast_free(br_true);
 		return NULL;
 	}
 
-	br_false = parse_condexpr(p);
+	br_false = parse_binary(p, PREC_COND);
 	if (br_false == NULL) {
-		spn_ast_free(ast);
+		spn_ast_free(cond);
 		spn_ast_free(br_true);
 		return NULL;
 	}
 
-	branches = spn_ast_new(SPN_NODE_BRANCHES, p->lineno);
+	branches = new_node(p, SPN_NODE_BRANCHES);
 	branches->left  = br_true;
 	branches->right = br_false;
 
-	tmp = spn_ast_new(SPN_NODE_CONDEXPR, p->lineno);
-	tmp->left = ast; /* condition */
+	tmp = new_node(p, SPN_NODE_CONDEXPR);
+	tmp->left = cond; /* condition */
 	tmp->right = branches; /* true and false values */
 
 	return tmp;
 }
 
-/* Functions to parse binary mathematical expressions
- * in ascending precedence order.
- */
-static SpnAST *parse_logical_or(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = { SPN_TOK_LOGOR };
-	static const enum spn_ast_node nodes[] = { SPN_NODE_LOGOR };
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_logical_and);
-}
-
-static SpnAST *parse_logical_and(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = { SPN_TOK_LOGAND };
-	static const enum spn_ast_node nodes[] = { SPN_NODE_LOGAND };
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_comparison);
-}
-
-static SpnAST *parse_comparison(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = {
-		SPN_TOK_EQUAL,
-		SPN_TOK_NOTEQ,
-		SPN_TOK_LESS,
-		SPN_TOK_GREATER,
-		SPN_TOK_LEQ,
-		SPN_TOK_GEQ
-	};
-
-	static const enum spn_ast_node nodes[] = {
-		SPN_NODE_EQUAL,
-		SPN_NODE_NOTEQ,
-		SPN_NODE_LESS,
-		SPN_NODE_GREATER,
-		SPN_NODE_LEQ,
-		SPN_NODE_GEQ
-	};
-
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_bitwise_or);
-}
-
-static SpnAST *parse_bitwise_or(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = { SPN_TOK_BITOR };
-	static const enum spn_ast_node nodes[] = { SPN_NODE_BITOR };
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_bitwise_xor);
-}
-
-static SpnAST *parse_bitwise_xor(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = { SPN_TOK_XOR };
-	static const enum spn_ast_node nodes[] = { SPN_NODE_BITXOR };
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_bitwise_and);
-}
-
-static SpnAST *parse_bitwise_and(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = { SPN_TOK_BITAND };
-	static const enum spn_ast_node nodes[] = { SPN_NODE_BITAND };
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_shift);
-}
-
-static SpnAST *parse_shift(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = {
-		SPN_TOK_SHL,
-		SPN_TOK_SHR
-	};
-
-	static const enum spn_ast_node nodes[] = {
-		SPN_NODE_SHL,
-		SPN_NODE_SHR
-	};
-
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_additive);
-}
-
-static SpnAST *parse_additive(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = {
-		SPN_TOK_PLUS,
-		SPN_TOK_MINUS
-	};
-
-	static const enum spn_ast_node nodes[] = {
-		SPN_NODE_ADD,
-		SPN_NODE_SUB
-	};
-
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_multiplicative);
-}
-
-static SpnAST *parse_multiplicative(SpnParser *p)
-{
-	static const enum spn_lex_token toks[] = {
-		SPN_TOK_MUL,
-		SPN_TOK_DIV,
-		SPN_TOK_MOD
-	};
-
-	static const enum spn_ast_node nodes[] = {
-		SPN_NODE_MUL,
-		SPN_NODE_DIV,
-		SPN_NODE_MOD
-	};
-
-	return parse_binexpr_leftassoc(p, toks, nodes, COUNT(toks), parse_prefix);
-}
-
 static SpnAST *parse_prefix(SpnParser *p)
 {
 	static const enum spn_lex_token toks[] = {
@@ -771,7 +716,7 @@ static SpnAST *parse_term(SpnParser *p)
 		/* only allow function expressions in an expression */
 		return parse_function(p, 0);
 	case SPN_TOK_IDENT:
-		ast = spn_ast_new(SPN_NODE_IDENT, p->lineno);
+		ast = new_node(p, SPN_NODE_IDENT);
 		ast->name = p->curtok.val.v.ptrv;
 
 		spn_lex(p);
@@ -782,7 +727,7 @@ static SpnAST *parse_term(SpnParser *p)
 
 		return ast;
 	case SPN_TOK_TRUE:
-		ast = spn_ast_new(SPN_NODE_LITERAL, p->lineno);
+		ast = new_node(p, SPN_NODE_LITERAL);
 		ast->value.t = SPN_TYPE_BOOL;
 		ast->value.f = 0;
 		ast->value.v.boolv = 1;
@@ -795,7 +740,7 @@ static SpnAST *parse_term(SpnParser *p)
 
 		return ast;
 	case SPN_TOK_FALSE:
-		ast = spn_ast_new(SPN_NODE_LITERAL, p->lineno);
+		ast = new_node(p, SPN_NODE_LITERAL);
 		ast->value.t = SPN_TYPE_BOOL;
 		ast->value.f = 0;
 		ast->value.v.boolv = 0;
@@ -808,7 +753,7 @@ static SpnAST *parse_term(SpnParser *p)
 
 		return ast;
 	case SPN_TOK_NIL:
-		ast = spn_ast_new(SPN_NODE_LITERAL, p->lineno);
+		ast = new_node(p, SPN_NODE_LITERAL);
 		ast->value.t = SPN_TYPE_NIL;
 		ast->value.f = 0;
 
@@ -820,7 +765,7 @@ static SpnAST *parse_term(SpnParser *p)
 
 		return ast;
 	case SPN_TOK_NAN:
-		ast = spn_ast_new(SPN_NODE_LITERAL, p->lineno);
+		ast = new_node(p, SPN_NODE_LITERAL);
 		ast->value.t = SPN_TYPE_NUMBER;
 		ast->value.f = SPN_TFLG_FLOAT;
 		ast->value.v.fltv = 0.0 / 0.0; /* silent NaN */
@@ -835,7 +780,7 @@ static SpnAST *parse_term(SpnParser *p)
 	case SPN_TOK_INT:
 	case SPN_TOK_FLOAT:
 	case SPN_TOK_STR:
-		ast = spn_ast_new(SPN_NODE_LITERAL, p->lineno);
+		ast = new_node(p, SPN_NODE_LITERAL);
 		ast->value = p->curtok.val;
 
 		spn_lex(p);
@@ -864,7 +809,7 @@ static SpnAST *parse_decl_args(SpnParser *p)
 		return NULL;
 	}
 
-	ast = spn_ast_new(SPN_NODE_DECLARGS, p->lineno);
+	ast = new_node(p, SPN_NODE_DECLARGS);
 	ast->name = name;
 
 	res = ast; /* preserve head */
@@ -880,7 +825,7 @@ static SpnAST *parse_decl_args(SpnParser *p)
 			return NULL;
 		}
 
-		tmp = spn_ast_new(SPN_NODE_DECLARGS, p->lineno);
+		tmp = new_node(p, SPN_NODE_DECLARGS);
 		tmp->name = name;	/* this is the actual name */
 		ast->left = tmp;	/* this builds the link list */
 		ast = tmp;		/* update head */
@@ -898,7 +843,7 @@ static SpnAST *parse_call_args(SpnParser *p)
 		return NULL; /* fail */
 	}
 
-	ast = spn_ast_new(SPN_NODE_CALLARGS, p->lineno);
+	ast = new_node(p, SPN_NODE_CALLARGS);
 	ast->right = expr;
 
 	while (spn_accept(p, SPN_TOK_COMMA)) {
@@ -908,7 +853,7 @@ static SpnAST *parse_call_args(SpnParser *p)
 			spn_ast_free(ast);
 			return NULL;
 		} else {
-			SpnAST *tmp = spn_ast_new(SPN_NODE_CALLARGS, p->lineno);
+			SpnAST *tmp = new_node(p, SPN_NODE_CALLARGS);
 			tmp->left = ast;	/* this node */
 			tmp->right = right;	/* next node */
 			ast = tmp;		/* update head */
@@ -918,74 +863,6 @@ static SpnAST *parse_call_args(SpnParser *p)
 	return ast;
 }
 
-static SpnAST *parse_binexpr_rightassoc(
-	SpnParser *p,
-	const enum spn_lex_token toks[],
-	const enum spn_ast_node nodes[],
-	size_t n,
-	SpnAST *(*subexpr)(SpnParser *)
-)
-{
-	int idx;
-	SpnAST *ast, *right, *tmp;
-
-	ast = subexpr(p);
-	if (ast == NULL) {
-		return NULL;
-	}
-
-	idx = spn_accept_multi(p, toks, n);
-	if (idx < 0) {
-		return ast;
-	}
-
-	/* apply right recursion */
-	right = parse_binexpr_rightassoc(p, toks, nodes, n, subexpr);
-
-	if (right == NULL) {
-		spn_ast_free(ast);
-		return NULL;
-	}
-
-	tmp = spn_ast_new(nodes[idx], p->lineno);
-	tmp->left = ast;
-	tmp->right = right;
-
-	return tmp;
-}
-
-static SpnAST *parse_binexpr_leftassoc(
-	SpnParser *p,
-	const enum spn_lex_token toks[],
-	const enum spn_ast_node nodes[],
-	size_t n,
-	SpnAST *(*subexpr)(SpnParser *)
-)
-{
-	int idx;
-	SpnAST *ast = subexpr(p);
-	if (ast == NULL) {
-		return NULL;
-	}
-
-	/* iteration instead of left recursion (which wouldn't terminate) */
-	while ((idx = spn_accept_multi(p, toks, n)) >= 0) {
-		SpnAST *tmp, *right = subexpr(p);
-
-		if (right == NULL) {
-			spn_ast_free(ast);
-			return NULL;
-		}
-
-		tmp = spn_ast_new(nodes[idx], p->lineno);
-		tmp->left = ast;
-		tmp->right = right;
-		ast = tmp;
-	}
-
-	return ast;
-}
-
 /**************
  * Statements *
  **************/
@@ -1035,11 +912,11 @@ static SpnAST *parse_if(SpnParser *p)
 		}
 	}
 
-	br = spn_ast_new(SPN_NODE_BRANCHES, p->lineno);
+	br = new_node(p, SPN_NODE_BRANCHES);
 	br->left = br_then;
 	br->right = br_else;
 
-	ast = spn_ast_new(SPN_NODE_IF, p->lineno);
+	ast = new_node(p, SPN_NODE_IF);
 	ast->left = cond;
 	ast->right = br;
 
@@ -1066,7 +943,7 @@ static SpnAST *parse_while(SpnParser *p)
 		return NULL;
 	}
 
-	ast = spn_ast_new(SPN_NODE_WHILE, p->lineno);
+	ast = new_node(p, SPN_NODE_WHILE);
 	ast->left = cond;
 	ast->right = body;
 
@@ -1109,7 +986,7 @@ static SpnAST *parse_do(SpnParser *p)
 		return NULL;
 	}
 
-	ast = spn_ast_new(SPN_NODE_DO, p->lineno);
+	ast = new_node(p, SPN_NODE_DO);
 	ast->left = cond;
 	ast->right = body;
 
@@ -1167,9 +1044,9 @@ static SpnAST *parse_for(SpnParser *p)
 	}
 
 	/* linked list for the loop header */
-	h1 = spn_ast_new(SPN_NODE_FORHEADER, p->lineno);
-	h2 = spn_ast_new(SPN_NODE_FORHEADER, p->lineno);
-	h3 = spn_ast_new(SPN_NODE_FORHEADER, p->lineno);
+	h1 = new_node(p, SPN_NODE_FORHEADER);
+	h2 = new_node(p, SPN_NODE_FORHEADER);
+	h3 = new_node(p, SPN_NODE_FORHEADER);
 
 	h1->left = init;
 	h1->right = h2;
@@ -1177,7 +1054,7 @@ static SpnAST *parse_for(SpnParser *p)
 	h2->right = h3;
 	h3->left = incr;
 
-	ast = spn_ast_new(SPN_NODE_FOR, p->lineno);
+	ast = new_node(p, SPN_NODE_FOR);
 	ast->left = h1;
 	ast->right = body;
 
@@ -1201,7 +1078,7 @@ static SpnAST *parse_foreach(SpnParser *p)
 		return NULL;
 	}
 
-	key = spn_ast_new(SPN_NODE_IDENT, p->lineno);
+	key = new_node(p, SPN_NODE_IDENT);
 	key->name = name;
 
 	if (!spn_accept(p, SPN_TOK_AS)) {
@@ -1219,7 +1096,7 @@ static SpnAST *parse_foreach(SpnParser *p)
 		return NULL;
 	}
 
-	val = spn_ast_new(SPN_NODE_IDENT, p->lineno);
+	val = new_node(p, SPN_NODE_IDENT);
 	val->name = name;
 
 	if (!spn_accept(p, SPN_TOK_IN)) {
@@ -1247,9 +1124,9 @@ static SpnAST *parse_foreach(SpnParser *p)
 	}
 
 	/* linked list for the loop header */
-	h1 = spn_ast_new(SPN_NODE_FORHEADER, p->lineno);
-	h2 = spn_ast_new(SPN_NODE_FORHEADER, p->lineno);
-	h3 = spn_ast_new(SPN_NODE_FORHEADER, p->lineno);
+	h1 = new_node(p, SPN_NODE_FORHEADER);
+	h2 = new_node(p, SPN_NODE_FORHEADER);
+	h3 = new_node(p, SPN_NODE_FORHEADER);
 
 	h1->left = key;
 	h1->right = h2;
@@ -1257,7 +1134,7 @@ static SpnAST *parse_foreach(SpnParser *p)
 	h2->right = h3;
 	h3->left = arr;
 
-	ast = spn_ast_new(SPN_NODE_FOREACH, p->lineno);
+	ast = new_node(p, SPN_NODE_FOREACH);
 	ast->left = h1;
 	ast->right = body;
 
@@ -1277,7 +1154,7 @@ static SpnAST *parse_break(SpnParser *p)
 		return NULL;
 	}
 
-	return spn_ast_new(SPN_NODE_BREAK, p->lineno);
+	return new_node(p, SPN_NODE_BREAK);
 }
 
 static SpnAST *parse_continue(SpnParser *p)
@@ -1293,7 +1170,7 @@ static SpnAST *parse_continue(SpnParser *p)
 		return NULL;
 	}
 
-	return spn_ast_new(SPN_NODE_CONTINUE, p->lineno);
+	return new_node(p, SPN_NODE_CONTINUE);
 }
 
 static SpnAST *parse_return(SpnParser *p)
@@ -1306,7 +1183,7 @@ static SpnAST *parse_return(SpnParser *p)
 	}
 
 	if (spn_accept(p, SPN_TOK_SEMICOLON)) {
-		return spn_ast_new(SPN_NODE_RETURN, p->lineno); /* return without value */
+		return new_node(p, SPN_NODE_RETURN); /* return without value */
 	}
 
 	expr = parse_expr(p);
@@ -1315,7 +1192,7 @@ static SpnAST *parse_return(SpnParser *p)
 	}
 
 	if (spn_accept(p, SPN_TOK_SEMICOLON)) {
-		SpnAST *ast = spn_ast_new(SPN_NODE_RETURN, p->lineno);
+		SpnAST *ast = new_node(p, SPN_NODE_RETURN);
 		ast->left = expr;
 		return ast;
 	}
@@ -1355,7 +1232,7 @@ static SpnAST *parse_vardecl(SpnParser *p)
 			}
 		}
 
-		tmp = spn_ast_new(SPN_NODE_VARDECL, p->lineno);
+		tmp = new_node(p, SPN_NODE_VARDECL);
 		tmp->name = name;
 		tmp->left = expr;
 
@@ -1405,6 +1282,6 @@ static SpnAST *parse_empty(SpnParser *p)
 		return NULL;
 	}
 
-	return spn_ast_new(SPN_NODE_EMPTY, p->lineno);
+	return new_node(p, SPN_NODE_EMPTY);
 }
 
@@ -35,6 +35,8 @@ typedef struct SpnParser {
 	int		 eof;		/* private */
 	int		 error;		/* private */
 	unsigned long	 lineno;	/* private */
+	SpnArena	*arena;		/* private: of the tree being parsed */
+	SpnPool		*pool;		/* private: current when created */
 	char		*errmsg;	/* public: the last error message */
 } SpnParser;
 
@@ -43,7 +45,8 @@ SPN_API SpnParser	*spn_parser_new();
 SPN_API void	 	 spn_parser_free(SpnParser *p);
 
 /* parse `src' to an abstract syntax tree. returns NULL on error
- * (in which case, one should inspect p->errmsg)
+ * (in which case, one should inspect p->errmsg). The tree is allocated
+ * from an arena of its own, see ast.h.
  */
 SPN_API SpnAST		*spn_parser_parse(SpnParser *p, const char *src);
 
@@ -9,6 +9,7 @@
  */
 
 #include "private.h"
+#include "vm.h"
 
 int nth_arg_idx(spn_uword *ip, int idx)
 {
@@ -21,3 +22,39 @@ int nth_arg_idx(spn_uword *ip, int idx)
 	return regidx;
 }
 
+size_t insn_length(const spn_uword *bc, size_t i)
+{
+	spn_uword ins = bc[i];
+
+	switch (OPCODE(ins)) {
+	case SPN_INS_CALL:
+	case SPN_INS_TAILCALL:
+		return 1 + ROUNDUP(OPC(ins), SPN_WORD_OCTETS);
+	case SPN_INS_CONCAT_ALL:
+		return 1 + ROUNDUP(OPB(ins), SPN_WORD_OCTETS);
+	case SPN_INS_FLDGET:
+	case SPN_INS_FLDSET:
+	case SPN_INS_NEXT:
+		return 3;
+	case SPN_INS_JMP:
+	case SPN_INS_JZE:
+	case SPN_INS_JNZ:
+	case SPN_INS_JEQ:
+	case SPN_INS_JNE:
+	case SPN_INS_JLT:
+	case SPN_INS_JLE:
+	case SPN_INS_JGT:
+	case SPN_INS_JGE:
+		return 2;
+	case SPN_INS_LDCONST:
+		switch (OPB(ins)) {
+		case SPN_CONST_INT:	return 1 + ROUNDUP(sizeof(long), sizeof(spn_uword));
+		case SPN_CONST_FLOAT:	return 1 + ROUNDUP(sizeof(double), sizeof(spn_uword));
+		default:		return 1;
+		}
+	case SPN_INS_GLBSYM:
+		return 1 + ROUNDUP(OPLONG(ins) + 1, sizeof(spn_uword)) + SPN_FUNCHDR_LEN;
+	default:
+		return 1;
+	}
+}
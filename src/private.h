@@ -14,6 +14,20 @@
 #include <assert.h>
 #include "spn.h"
 
+/* storage class of the few variables that are per thread rather than per
+ * VM. Without compiler support, they're simply static, and then VMs must not
+ * run on several threads at the same time. Define it in order to override.
+ */
+#ifndef SPN_THREAD_LOCAL
+#if defined(__GNUC__)
+#define SPN_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define SPN_THREAD_LOCAL __declspec(thread)
+#else
+#define SPN_THREAD_LOCAL
+#endif
+#endif /* SPN_THREAD_LOCAL */
+
 /* you shall not pass! (assertion for unreachable code paths) */
 #define SHANT_BE_REACHED() assert(((void)("code path must not be reached"), 0))
 
@@ -31,8 +45,38 @@
 #define OPMID(i)	(((i) >> 16) & 0x0000ffff)
 #define OPLONG(i)	(((i) >>  8) & 0x00ffffff)
 
+/* argument C interpreted as a signed 8-bit immediate (without relying on
+ * the implementation-defined unsigned -> signed conversion)
+ */
+#define OPSIMMC(i)	((long)(OPC(i) ^ 0x80) - 0x80)
+
+/* what the cycle collector (see array.c) keeps for the arrays of a pool.
+ * The default pool has one of these per thread.
+ */
+typedef struct SpnGCList {
+	struct SpnArray	*arrays;	/* all of them, linked	*/
+	size_t		 live;		/* length of the list	*/
+	size_t		 mark;		/* volume after the last collection */
+} SpnGCList;
+
+SPN_API SpnGCList *spn_pool_gclist(SpnPool *pool);
+
+/* spn_mem_alloc() and spn_mem_realloc() for the runtime's own bookkeeping,
+ * which has no way of reporting an error: these never fail. They go over
+ * the limit of the pool (which only calls its handler), and call abort()
+ * if the allocator fails.
+ */
+SPN_API void *spn_mem_xalloc(SpnPool *pool, int kind, size_t size);
+SPN_API void *spn_mem_xrealloc(SpnPool *pool, int kind, void *ptr, size_t oldsize, size_t newsize);
+
 /* this is a common function so that the disassembler can use it too */
 SPN_API int nth_arg_idx(spn_uword *ip, int idx);
 
+/* returns the length of the instruction at `bc[i]', in words. For GLBSYM,
+ * only the name and the function header is considered part of the
+ * instruction; its body is code like any other.
+ */
+SPN_API size_t insn_length(const spn_uword *bc, size_t i);
+
 #endif /* SPN_PRIVATE_H */
 
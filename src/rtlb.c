@@ -8,10 +8,24 @@
  * Run-time support library
  */
 
+/* localtime_r() and gmtime_r() are used on POSIX systems, since they are
+ * reentrant. This must come before any header is included.
+ */
+#ifndef SPN_USE_TIME_R
+#if defined(__unix__) || defined(__APPLE__)
+#define SPN_USE_TIME_R 1
+#else
+#define SPN_USE_TIME_R 0
+#endif
+#endif
+
+#if SPN_USE_TIME_R
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <math.h>
 #include <time.h>
 #include <limits.h>
@@ -19,6 +33,25 @@
 #include "rtlb.h"
 #include "str.h"
 #include "array.h"
+#include "func.h"
+#include "numbuf.h"
+#include "private.h"
+
+/* SSE2 is part of the x86-64 baseline, so where the compiler targets it,
+ * the string scanning primitives process 16 bytes at a time. Elsewhere,
+ * they fall back to portable code. (`__builtin_ctz()' is a GNU extension.)
+ */
+#ifndef SPN_USE_SSE2
+#if defined(__SSE2__) && defined(__GNUC__)
+#define SPN_USE_SSE2 1
+#else
+#define SPN_USE_SSE2 0
+#endif
+#endif
+
+#if SPN_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifndef LINE_MAX
 #define LINE_MAX 0x1000
@@ -76,6 +109,50 @@ static int rtlb_print(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
+/* formats the arguments after the format string, which is `argv[0]` */
+static int rtlb_aux_format(FILE *fp, int argc, SpnValue *argv)
+{
+	SpnStringBuilder *sb;
+	int err;
+
+	if (argc < 1) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_STRING) {
+		return -2;
+	}
+
+	sb = spn_strbuilder_new();
+	err = spn_strbuilder_format(sb, spn_string_cstr(argv[0].v.ptrv), argc - 1, argv + 1);
+
+	if (err == 0 && sb->len > 0) {
+		fwrite(sb->buf, 1, sb->len, fp);
+	}
+
+	spn_object_release(sb);
+
+	return err != 0 ? -3 : 0;
+}
+
+static int rtlb_printf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_format(stdout, argc, argv);
+}
+
+static int rtlb_fprintf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc < 1) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_USRDAT) {
+		return -2;
+	}
+
+	return rtlb_aux_format(argv[0].v.ptrv, argc - 1, argv + 1);
+}
+
 static int rtlb_fopen(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	FILE *fp;
@@ -91,7 +168,7 @@ static int rtlb_fopen(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	fname = argv[0].v.ptrv;
 	mode = argv[1].v.ptrv;
-	fp = fopen(fname->cstr, mode->cstr);
+	fp = fopen(spn_string_cstr(fname), spn_string_cstr(mode));
 	if (fp != NULL) {
 		ret->t = SPN_TYPE_USRDAT;
 		ret->f = 0;
@@ -150,7 +227,7 @@ static int rtlb_fgetline(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 static int rtlb_fread(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	long n;
-	char *buf;
+	SpnString *str;
 	FILE *fp;
 
 	if (argc != 2) {
@@ -159,28 +236,250 @@ static int rtlb_fread(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	if (argv[0].t != SPN_TYPE_USRDAT
 	 || argv[1].t != SPN_TYPE_NUMBER
-	 || argv[1].f != 0) {
+	 || argv[1].f != 0
+	 || argv[1].v.intv < 0) {
 		return -2;
 	}
 
 	fp = argv[0].v.ptrv;
 	n = argv[1].v.intv;
 
-	buf = malloc(n);
-	if (buf == NULL) {
-		abort();
+	str = spn_string_new_buffer(n);
+	if (str == NULL) {
+		return -3;
 	}
 
-	if (fread(buf, n, 1, fp) != 1) {
-		free(buf);
+	if (fread(str->cstr, n, 1, fp) != 1) {
+		spn_object_release(str);
 		ret->t = SPN_TYPE_NIL;
 		ret->f = 0;
 	} else {
 		ret->t = SPN_TYPE_STRING;
 		ret->f = SPN_TFLG_OBJECT;
-		ret->v.ptrv = spn_string_new_nocopy_len(buf, n, 1);
+		ret->v.ptrv = str;
+	}
+
+	return 0;
+}
+
+static int rtlb_mapfile(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnString *fname, *str;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_STRING) {
+		return -2;
+	}
+
+	fname = argv[0].v.ptrv;
+	str = spn_string_new_mapped(spn_string_cstr(fname));
+
+	if (str != NULL) {
+		ret->t = SPN_TYPE_STRING;
+		ret->f = SPN_TFLG_OBJECT;
+		ret->v.ptrv = str;
+	} else {
+		ret->t = SPN_TYPE_NIL;
+		ret->f = 0;
+	}
+
+	return 0;
+}
+
+/* A line reader splits a string or an open file into records, which are
+ * terminated by a separator character (or by the end of the input).
+ * Strings are scanned in place, and their records are slices. Files are
+ * read in large chunks into a buffer that only grows if a record doesn't
+ * fit in it, so that lines of any length can be read, and only one record
+ * at a time is copied. The reader is an object, so it is freed when the
+ * script drops it.
+ */
+#define LINE_READER_CHUNK 0x10000
+
+typedef struct LineReader {
+	SpnObject	 base;
+	SpnString	*str;	/* the string being read, or NULL	*/
+	FILE		*fp;	/* the file being read, or NULL		*/
+	char		*buf;	/* buffered contents of the file	*/
+	size_t		 len;	/* number of bytes in the buffer	*/
+	size_t		 cap;	/* size of the buffer			*/
+	size_t		 pos;	/* beginning of the next record		*/
+	int		 sep;	/* the separator character		*/
+	int		 eof;	/* the file has no more bytes		*/
+} LineReader;
+
+static void free_line_reader(void *obj)
+{
+	LineReader *rd = obj;
+
+	if (rd->str != NULL) {
+		spn_object_release(rd->str);
+	}
+
+	spn_mem_free(rd->base.pool, SPN_MEM_OTHER, rd->buf, rd->cap);
+}
+
+static const SpnClass rtlb_class_line_reader = {
+	"line reader",
+	sizeof(LineReader),
+	NULL,
+	NULL,
+	NULL,
+	free_line_reader,
+	SPN_MEM_OTHER,
+	1
+};
+
+static int rtlb_lines(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	LineReader *rd;
+	int sep = '\n';
+
+	if (argc < 1 || argc > 2) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_STRING && argv[0].t != SPN_TYPE_USRDAT) {
+		return -2;
+	}
+
+	/* the separator is a single character */
+	if (argc > 1) {
+		SpnString *sepstr;
+
+		if (argv[1].t != SPN_TYPE_STRING) {
+			return -2;
+		}
+
+		sepstr = argv[1].v.ptrv;
+		if (sepstr->len != 1) {
+			return -3;
+		}
+
+		sep = (unsigned char)(sepstr->cstr[0]);
+	}
+
+	rd = spn_object_new(&rtlb_class_line_reader);
+	rd->str = NULL;
+	rd->fp = NULL;
+	rd->buf = NULL;
+	rd->len = 0;
+	rd->cap = 0;
+	rd->pos = 0;
+	rd->sep = sep;
+	rd->eof = 0;
+
+	if (argv[0].t == SPN_TYPE_STRING) {
+		rd->str = argv[0].v.ptrv;
+		spn_object_retain(rd->str);
+	} else {
+		rd->fp = argv[0].v.ptrv;
+	}
+
+	ret->t = SPN_TYPE_USRDAT;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = rd;
+
+	return 0;
+}
+
+/* finds the next record in the buffer of a file reader, reading more of
+ * the file when necessary. Returns a pointer to the separator, or NULL if
+ * the rest of the file doesn't contain it.
+ */
+static char *line_reader_fill(LineReader *rd)
+{
+	size_t scanned = rd->pos;
+
+	while (1) {
+		size_t n;
+		char *end = NULL;
+
+		if (scanned < rd->len) {
+			end = memchr(rd->buf + scanned, rd->sep, rd->len - scanned);
+		}
+
+		if (end != NULL || rd->eof) {
+			return end;
+		}
+
+		/* move the partial record to the beginning of the buffer */
+		if (rd->pos > 0) {
+			memmove(rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+			rd->len -= rd->pos;
+			rd->pos = 0;
+		}
+
+		scanned = rd->len;
+
+		if (rd->len == rd->cap) {
+			size_t cap = rd->cap ? 2 * rd->cap : LINE_READER_CHUNK;
+			rd->buf = spn_mem_xrealloc(rd->base.pool, SPN_MEM_OTHER, rd->buf, rd->cap, cap);
+			rd->cap = cap;
+		}
+
+		n = fread(rd->buf + rd->len, 1, rd->cap - rd->len, rd->fp);
+		if (n == 0) {
+			rd->eof = 1;
+		}
+
+		rd->len += n;
+	}
+}
+
+static int rtlb_nextline(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	LineReader *rd;
+	const char *begin, *end, *limit;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_USRDAT
+	 || (argv[0].f & SPN_TFLG_OBJECT) == 0
+	 || ((SpnObject *)(argv[0].v.ptrv))->isa != &rtlb_class_line_reader) {
+		return -2;
+	}
+
+	rd = argv[0].v.ptrv;
+
+	if (rd->str != NULL) {
+		begin = rd->str->cstr + rd->pos;
+		limit = rd->str->cstr + rd->str->len;
+		end = memchr(begin, rd->sep, limit - begin);
+	} else {
+		end = line_reader_fill(rd);
+		begin = rd->buf + rd->pos;
+		limit = rd->buf + rd->len;
+	}
+
+	/* at the end of the input, there's no more records (not even an
+	 * empty one after a trailing separator); return nil
+	 */
+	if (begin == limit) {
+		return 0;
+	}
+
+	if (end == NULL) {
+		end = limit;
 	}
 
+	/* records of a string are slices of it; the buffer of a file reader
+	 * is reused, though, so those are copied
+	 */
+	ret->t = SPN_TYPE_STRING;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = rd->str != NULL
+		    ? spn_string_new_slice(rd->str, rd->pos, end - begin)
+		    : spn_string_new_len(begin, end - begin);
+
+	/* skip the separator too, if any */
+	rd->pos += end - begin + (end < limit);
+
 	return 0;
 }
 
@@ -298,11 +597,11 @@ static int rtlb_fseek(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	off = argv[1].v.intv;
 	whence =  argv[2].v.ptrv;
 
-	if (strcmp(whence->cstr, "set") == 0) {
+	if (strcmp(spn_string_cstr(whence), "set") == 0) {
 		flag = SEEK_SET;
-	} else if (strcmp(whence->cstr, "cur") == 0) {
+	} else if (strcmp(spn_string_cstr(whence), "cur") == 0) {
 		flag = SEEK_CUR;
-	} else if (strcmp(whence->cstr, "end") == 0) {
+	} else if (strcmp(spn_string_cstr(whence), "end") == 0) {
 		flag = SEEK_END;
 	} else {
 		return -3;
@@ -352,7 +651,7 @@ static int rtlb_remove(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	ret->t = SPN_TYPE_BOOL;
 	ret->f = 0;
-	ret->v.boolv = !remove(fname->cstr);
+	ret->v.boolv = !remove(spn_string_cstr(fname));
 
 	return 0;
 }
@@ -374,7 +673,7 @@ static int rtlb_rename(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	ret->t = SPN_TYPE_BOOL;
 	ret->f = 0;
-	ret->v.boolv = !rename(oldname->cstr, newname->cstr);
+	ret->v.boolv = !rename(spn_string_cstr(oldname), spn_string_cstr(newname));
 
 	return 0;
 }
@@ -416,13 +715,16 @@ static int rtlb_tmpfile(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 const SpnExtFunc spn_libio[SPN_LIBSIZE_IO] = {
 	{ "getline",	rtlb_getline	},
 	{ "print",	rtlb_print	},
-	{ "printf",	NULL		},
+	{ "printf",	rtlb_printf	},
 	{ "fopen",	rtlb_fopen	},
 	{ "fclose",	rtlb_fclose	},
-	{ "fprintf",	NULL		},
+	{ "fprintf",	rtlb_fprintf	},
 	{ "fgetline",	rtlb_fgetline	},
 	{ "fread",	rtlb_fread	},
 	{ "fwrite",	rtlb_fwrite	},
+	{ "mapfile",	rtlb_mapfile	},
+	{ "lines",	rtlb_lines	},
+	{ "nextline",	rtlb_nextline	},
 	{ "stdin",	rtlb_stdin	},
 	{ "stdout",	rtlb_stdout	},
 	{ "stderr",	rtlb_stderr	},
@@ -441,6 +743,71 @@ const SpnExtFunc spn_libio[SPN_LIBSIZE_IO] = {
  * String library *
  ******************/
 
+/* finds the first occurrence of `needle` in `haystack`, starting at offset
+ * `off`. Unlike strstr(), this works on slices and on strings containing
+ * 0 bytes too. A single byte is searched for using memchr(), which libc
+ * implementations vectorize. For longer needles, the candidates are the
+ * positions where the first and the last byte of the needle both match;
+ * only those are compared in full. With SSE2, 16 of them are tested at once.
+ */
+static const char *rtlb_aux_find(SpnString *haystack, size_t off, SpnString *needle)
+{
+	const char *p = haystack->cstr + off;
+	const char *end = haystack->cstr + haystack->len;
+	const char *nd = needle->cstr;
+	size_t k = needle->len;
+
+	if (k == 0) {
+		return p;
+	}
+
+	if (k == 1) {
+		return memchr(p, nd[0], end - p);
+	}
+
+#if SPN_USE_SSE2
+	{
+		__m128i first = _mm_set1_epi8(nd[0]);
+		__m128i last = _mm_set1_epi8(nd[k - 1]);
+
+		while ((size_t)(end - p) >= k - 1 + 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(p));
+			__m128i b = _mm_loadu_si128((const __m128i *)(p + k - 1));
+			__m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last));
+			unsigned mask = _mm_movemask_epi8(eq);
+
+			while (mask != 0) {
+				int i = __builtin_ctz(mask);
+
+				if (memcmp(p + i + 1, nd + 1, k - 2) == 0) {
+					return p + i;
+				}
+
+				mask &= mask - 1;
+			}
+
+			p += 16;
+		}
+	}
+#endif
+
+	while ((size_t)(end - p) >= k) {
+		p = memchr(p, nd[0], end - p - k + 1);
+
+		if (p == NULL) {
+			return NULL;
+		}
+
+		if (p[k - 1] == nd[k - 1] && memcmp(p + 1, nd + 1, k - 2) == 0) {
+			return p;
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
 static int rtlb_indexof(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	SpnString *haystack, *needle;
@@ -480,7 +847,7 @@ static int rtlb_indexof(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -4;
 	}
 
-	pos = strstr(haystack->cstr + off, needle->cstr);
+	pos = rtlb_aux_find(haystack, off, needle);
 
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = 0;
@@ -489,10 +856,11 @@ static int rtlb_indexof(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;	
 }
 
-/* main substring function, used by substr(), substrto() and substrfrom() */
+/* main substring function, used by substr(), substrto() and substrfrom().
+ * The substring is a slice, it shares the bytes of `str`.
+ */
 static int rtlb_aux_substr(SpnValue *ret, SpnString *str, long begin, long length)
 {
-	char *buf;
 	long slen = str->len;
 
 	if (begin < 0 || begin > slen) {
@@ -507,17 +875,9 @@ static int rtlb_aux_substr(SpnValue *ret, SpnString *str, long begin, long lengt
 		return -3;
 	}
 
-	buf = malloc(length + 1);
-	if (buf == NULL) {
-		abort();
-	}
-
-	memcpy(buf, str->cstr + begin, length);
-	buf[length] = 0;
-
 	ret->t = SPN_TYPE_STRING;
 	ret->f = SPN_TFLG_OBJECT;
-	ret->v.ptrv = spn_string_new_nocopy_len(buf, length, 1);
+	ret->v.ptrv = spn_string_new_slice(str, begin, length);
 
 	return 0;
 }
@@ -605,6 +965,11 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	haystack = argv[0].v.ptrv;
 	needle = argv[1].v.ptrv;
 
+	/* an empty separator would be found over and over again */
+	if (needle->len == 0) {
+		return -3;
+	}
+
 	arr = spn_array_new();
 
 	ret->t = SPN_TYPE_ARRAY;
@@ -617,22 +982,15 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	val.t = SPN_TYPE_STRING;
 	val.f = SPN_TFLG_OBJECT;
 
+	/* the pieces are slices of the original string */
 	s = haystack->cstr;
-	t = strstr(s, needle->cstr);
+	t = rtlb_aux_find(haystack, 0, needle);
 
 	while (1) {
 		const char *p = t != NULL ? t : haystack->cstr + haystack->len;
-		size_t len = p - s;
-		char *buf = malloc(len + 1);
-		if (buf == NULL) {
-			abort();
-		}
-
-		memcpy(buf, s, len);
-		buf[len] = 0;
 
 		key.v.intv = i++;
-		val.v.ptrv = spn_string_new_nocopy_len(buf, len, 1);
+		val.v.ptrv = spn_string_new_slice(haystack, s - haystack->cstr, p - s);
 		spn_array_set(arr, &key, &val);
 		spn_object_release(val.v.ptrv);
 
@@ -641,7 +999,7 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		}
 
 		s = t + needle->len;
-		t = strstr(s, needle->cstr);
+		t = rtlb_aux_find(haystack, s - haystack->cstr, needle);
 	}
 
 	return 0;
@@ -649,9 +1007,9 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 static int rtlb_repeat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	char *buf;
-	size_t i, len, n;
-	SpnString *str, *rep;
+	size_t i, n;
+	SpnString *str;
+	SpnStringBuilder *sb;
 
 	if (argc != 2) {
 		return -1;
@@ -669,32 +1027,62 @@ static int rtlb_repeat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	str = argv[0].v.ptrv;
 	n = argv[1].v.intv;
-	len = str->len * n;
 
-	buf = malloc(len + 1);
-	if (buf == NULL) {
-		abort();
+	/* the length of the result must not overflow */
+	if (str->len > 0 && n > (size_t)(-1) / 2 / str->len) {
+		return -4;
 	}
 
-	for (i = 0; i < n; i++) {
-		memcpy(buf + i * str->len, str->cstr, str->len);
+	sb = spn_strbuilder_new();
+
+	if (spn_strbuilder_reserve(sb, str->len * n) != 0) {
+		spn_object_release(sb);
+		return -5;
 	}
 
-	buf[len] = 0;
-	rep = spn_string_new_nocopy_len(buf, len, 1);
+	for (i = 0; i < n; i++) {
+		spn_strbuilder_append_string(sb, str);
+	}
 
 	ret->t = SPN_TYPE_STRING;
 	ret->f = SPN_TFLG_OBJECT;
-	ret->v.ptrv = rep;
+	ret->v.ptrv = spn_strbuilder_finish(sb);
 
+	spn_object_release(sb);
 	return 0;
 }
 
+/* converts `n` bytes to upper or lower case. Only ASCII letters are
+ * converted, so that the bytes of UTF-8 sequences are left intact.
+ */
+static void rtlb_aux_convcase(char *dst, const char *src, size_t n, int upc)
+{
+	unsigned char from = upc ? 'a' : 'A';
+	size_t i = 0;
+
+#if SPN_USE_SSE2
+	/* bytes >= 0x80 are negative, so they are never in the range */
+	__m128i below = _mm_set1_epi8(from - 1);
+	__m128i above = _mm_set1_epi8(from + 26);
+	__m128i flip = _mm_set1_epi8(0x20);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i in = _mm_and_si128(_mm_cmpgt_epi8(x, below), _mm_cmplt_epi8(x, above));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(x, _mm_and_si128(in, flip)));
+	}
+#endif
+
+	for (; i < n; i++) {
+		unsigned char c = src[i];
+		dst[i] = (unsigned char)(c - from) < 26 ? c ^ 0x20 : c;
+	}
+}
+
 static int rtlb_aux_trcase(SpnValue *ret, int argc, SpnValue *argv, int upc)
 {
-	const char *p;
-	char *buf, *s;
-	SpnString *str;
+	SpnString *str, *res;
 
 	if (argc != 1) {
 		return -1;
@@ -705,23 +1093,18 @@ static int rtlb_aux_trcase(SpnValue *ret, int argc, SpnValue *argv, int upc)
 	}
 
 	str = argv[0].v.ptrv;
-	p = str->cstr;
-
-	buf = malloc(str->len + 1);
-	if (buf == NULL) {
-		abort();
-	}
 
-	s = buf;
-	while (*p) {
-		*s++ = upc ? toupper(*p++) : tolower(*p++);
+	/* the characters are converted right into the new string */
+	res = spn_string_new_buffer(str->len);
+	if (res == NULL) {
+		return -3;
 	}
 
-	*s = 0;
+	rtlb_aux_convcase(res->cstr, str->cstr, str->len, upc);
 
 	ret->t = SPN_TYPE_STRING;
 	ret->f = SPN_TFLG_OBJECT;
-	ret->v.ptrv = spn_string_new_nocopy_len(buf, str->len, 1);
+	ret->v.ptrv = res;
 
 	return 0;
 }
@@ -739,15 +1122,10 @@ static int rtlb_toupper(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 /* TODO: implement */
 static int rtlb_fmtstring(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	return -1;
-}
-
-static int rtlb_toint(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	SpnString *str;
-	long base;
+	SpnStringBuilder *sb;
+	int err;
 
-	if (argc < 1 || argc > 2) {
+	if (argc < 1) {
 		return -1;
 	}
 
@@ -755,47 +1133,195 @@ static int rtlb_toint(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -2;
 	}
 
-	if (argc == 2 && (argv[1].t != SPN_TYPE_NUMBER || argv[1].f != 0)) {
-		return -3;
+	sb = spn_strbuilder_new();
+	err = spn_strbuilder_format(sb, spn_string_cstr(argv[0].v.ptrv), argc - 1, argv + 1);
+
+	if (err == 0) {
+		ret->t = SPN_TYPE_STRING;
+		ret->f = SPN_TFLG_OBJECT;
+		ret->v.ptrv = spn_strbuilder_finish(sb);
 	}
 
-	str = argv[0].v.ptrv;
-	base = argc == 2 ? argv[1].v.intv : 0;
+	spn_object_release(sb);
+	return err != 0 ? -3 : 0;
+}
 
-	if (base == 1 || base < 0 || base > 36) {
-		return -4;
+/* string builders, for assembling a string from many pieces */
+static int rtlb_strbuilder(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc != 0) {
+		return -1;
 	}
 
-	ret->t = SPN_TYPE_NUMBER;
-	ret->f = 0;
-	ret->v.intv = strtol(str->cstr, NULL, base);
+	ret->t = SPN_TYPE_USRDAT;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = spn_strbuilder_new();
 
 	return 0;
 }
 
-static int rtlb_tofloat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_sbappend(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	SpnString *str;
+	SpnStringBuilder *sb;
+	int i;
 
-	if (argc != 1) {
+	if (argc < 1) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_STRING) {
+	sb = spn_value_strbuilder(&argv[0]);
+	if (sb == NULL) {
 		return -2;
 	}
 
-	str = argv[0].v.ptrv;
-
-	ret->t = SPN_TYPE_NUMBER;
-	ret->f = SPN_TFLG_FLOAT;
-	ret->v.fltv = strtod(str->cstr, NULL);
+	for (i = 1; i < argc; i++) {
+		spn_strbuilder_append_value(sb, &argv[i]);
+	}
 
-	return 0;
+	return sb->failed ? -3 : 0;
 }
 
-static int rtlb_tonumber(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_sbformat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
+	SpnStringBuilder *sb;
+
+	if (argc < 2) {
+		return -1;
+	}
+
+	sb = spn_value_strbuilder(&argv[0]);
+	if (sb == NULL || argv[1].t != SPN_TYPE_STRING) {
+		return -2;
+	}
+
+	if (spn_strbuilder_format(sb, spn_string_cstr(argv[1].v.ptrv), argc - 2, argv + 2) != 0) {
+		return -3;
+	}
+
+	return 0;
+}
+
+static int rtlb_sbreserve(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *sb;
+
+	if (argc != 2) {
+		return -1;
+	}
+
+	sb = spn_value_strbuilder(&argv[0]);
+	if (sb == NULL || argv[1].t != SPN_TYPE_NUMBER || argv[1].f != 0) {
+		return -2;
+	}
+
+	if (argv[1].v.intv < 0) {
+		return -3;
+	}
+
+	if (spn_strbuilder_reserve(sb, argv[1].v.intv) != 0) {
+		return -4;
+	}
+
+	return 0;
+}
+
+static int rtlb_sblength(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *sb;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	sb = spn_value_strbuilder(&argv[0]);
+	if (sb == NULL) {
+		return -2;
+	}
+
+	ret->t = SPN_TYPE_NUMBER;
+	ret->f = 0;
+	ret->v.intv = sb->len;
+
+	return 0;
+}
+
+static int rtlb_sbfinish(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *sb;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	sb = spn_value_strbuilder(&argv[0]);
+	if (sb == NULL) {
+		return -2;
+	}
+
+	/* the contents are incomplete */
+	if (sb->failed) {
+		return -3;
+	}
+
+	ret->t = SPN_TYPE_STRING;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = spn_strbuilder_finish(sb);
+
+	return 0;
+}
+
+/* numbers are usually short, so they are parsed from a 0-terminated copy
+ * on the stack, instead of flattening the string if it's a slice
+ */
+#define RTLB_NUMBUF_SIZE 64
+
+static const char *rtlb_aux_numstr(SpnString *str, char *buf)
+{
+	if (str->len >= RTLB_NUMBUF_SIZE) {
+		return spn_string_cstr(str);
+	}
+
+	memcpy(buf, str->cstr, str->len);
+	buf[str->len] = 0;
+
+	return buf;
+}
+
+static int rtlb_toint(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	char buf[RTLB_NUMBUF_SIZE];
+	SpnString *str;
+	long base;
+
+	if (argc < 1 || argc > 2) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_STRING) {
+		return -2;
+	}
+
+	if (argc == 2 && (argv[1].t != SPN_TYPE_NUMBER || argv[1].f != 0)) {
+		return -3;
+	}
+
+	str = argv[0].v.ptrv;
+	base = argc == 2 ? argv[1].v.intv : 0;
+
+	if (base == 1 || base < 0 || base > 36) {
+		return -4;
+	}
+
+	ret->t = SPN_TYPE_NUMBER;
+	ret->f = 0;
+	ret->v.intv = strtol(rtlb_aux_numstr(str, buf), NULL, base);
+
+	return 0;
+}
+
+static int rtlb_tofloat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	char buf[RTLB_NUMBUF_SIZE];
 	SpnString *str;
 
 	if (argc != 1) {
@@ -808,11 +1334,37 @@ static int rtlb_tonumber(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	str = argv[0].v.ptrv;
 
-	if (strpbrk(str->cstr, ".eE") != NULL) {
-		return rtlb_tofloat(ret, argc, argv, ctx);
-	} else {
-		return rtlb_toint(ret, argc, argv, ctx);
+	ret->t = SPN_TYPE_NUMBER;
+	ret->f = SPN_TFLG_FLOAT;
+	ret->v.fltv = strtod(rtlb_aux_numstr(str, buf), NULL);
+
+	return 0;
+}
+
+static int rtlb_tonumber(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnString *str;
+	const char *p, *end;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	if (argv[0].t != SPN_TYPE_STRING) {
+		return -2;
+	}
+
+	str = argv[0].v.ptrv;
+
+	end = str->cstr + str->len;
+
+	for (p = str->cstr; p < end; p++) {
+		if (*p == '.' || *p == 'e' || *p == 'E') {
+			return rtlb_tofloat(ret, argc, argv, ctx);
+		}
 	}
+
+	return rtlb_toint(ret, argc, argv, ctx);
 }
 
 const SpnExtFunc spn_libstring[SPN_LIBSIZE_STRING] = {
@@ -828,6 +1380,12 @@ const SpnExtFunc spn_libstring[SPN_LIBSIZE_STRING] = {
 	{ "tonumber",	rtlb_tonumber	},
 	{ "toint",	rtlb_toint	},
 	{ "tofloat",	rtlb_tofloat	},
+	{ "strbuilder",	rtlb_strbuilder	},
+	{ "sbappend",	rtlb_sbappend	},
+	{ "sbformat",	rtlb_sbformat	},
+	{ "sbreserve",	rtlb_sbreserve	},
+	{ "sblength",	rtlb_sblength	},
+	{ "sbfinish",	rtlb_sbfinish	},
 };
 
 
@@ -880,8 +1438,7 @@ static int rtlb_dict(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 static int rtlb_contains(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t n;
-	SpnIterator *it;
+	long cursor = 0;
 	SpnArray *arr;
 	SpnValue key, val;
 
@@ -898,26 +1455,23 @@ static int rtlb_contains(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	ret->v.boolv = 0;
 
 	arr = argv[0].v.ptrv;
-	n = spn_array_count(arr);
-	it = spn_iter_new(arr);
 
-	while (spn_iter_next(it, &key, &val) < n) {
+	while (spn_array_next(arr, &cursor, &key, &val)) {
 		if (spn_value_equal(&argv[1], &val)) {
 			ret->v.boolv = 1;
 			break;
 		}
 	}
 
-	spn_iter_free(it);
 	return 0;
 }
 
 static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t n, i, len = 0;
-	char *buf = NULL;
+	size_t n, i;
 	SpnArray *arr;
 	SpnString *delim;
+	SpnStringBuilder *sb;
 
 	if (argc != 2) {
 		return -1;
@@ -932,10 +1486,10 @@ static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	delim = argv[1].v.ptrv;
 
+	sb = spn_strbuilder_new();
+
 	for (i = 0; i < n; i++) {
-		size_t addlen;
 		SpnValue *val;
-		SpnString *str;
 
 		SpnValue key;
 		key.t = SPN_TYPE_NUMBER;
@@ -944,52 +1498,27 @@ static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 		val = spn_array_get(arr, &key);
 		if (val->t != SPN_TYPE_STRING) {
-			free(buf);
+			spn_object_release(sb);
 			return -3;
 		}
 
-		/* XXX: this should really be solved using
-		 * exponential buffer expansion. Maybe in alpha 2...
-		 */
-
-		str = val->v.ptrv;
-		addlen = i > 0 ? delim->len + str->len : str->len;
-
-		buf = realloc(buf, len + addlen + 1);
-		if (buf == NULL) {
-			abort();
-		}
-
 		if (i > 0) {
-			memcpy(buf + len, delim->cstr, delim->len);
-			memcpy(buf + len + delim->len, str->cstr, str->len);
-		} else {
-			memcpy(buf + len, str->cstr, str->len);
+			spn_strbuilder_append_string(sb, delim);
 		}
 
-		len += addlen;
+		spn_strbuilder_append_string(sb, val->v.ptrv);
+	}
+
+	if (sb->failed) {
+		spn_object_release(sb);
+		return -4;
 	}
 
 	ret->t = SPN_TYPE_STRING;
 	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = spn_strbuilder_finish(sb);
 
-	if (i > 0) {
-		/* this may catch one error or two */
-		assert(buf != NULL);
-
-		/* add NUL terminator */
-		buf[len] = 0;
-		ret->v.ptrv = spn_string_new_nocopy_len(buf, len, 1);
-	} else {
-		assert(buf == NULL);
-
-		/* if there were no items to concatenate, return empty string
-		 * (this is necessary because `buf` is now NULL,
-		 * and we definitely don't want this to segfault)
-		 */
-		ret->v.ptrv = spn_string_new_nocopy_len("", 0, 0);
-	}
-
+	spn_object_release(sb);
 	return 0;
 }
 
@@ -1009,6 +1538,12 @@ static int rtlb_iter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	arr = argv[0].v.ptrv;
 	it = spn_iter_new(arr);
 
+	/* the iterator only has a weak reference to the array, but the
+	 * script may drop its own one while iterating. The array is
+	 * released by next() along with the iterator.
+	 */
+	spn_object_retain(arr);
+
 	ret->t = SPN_TYPE_USRDAT;
 	ret->f = 0;
 	ret->v.ptrv = it;
@@ -1062,6 +1597,7 @@ static int rtlb_next(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		ret->v.boolv = 1;
 	} else {
 		spn_iter_free(it);
+		spn_object_release(inarray);
 		ret->v.boolv = 0;
 	}
 
@@ -1131,7 +1667,7 @@ static double rtlb_aux_round(double x)
 	return floor(x + 0.5);
 }
 
-static int rtlb_aux_intize(SpnValue *ret, int argc, SpnValue *argv, void *ctx, double (*fn)(double))
+static int rtlb_aux_intize(SpnValue *ret, int argc, SpnValue **argv, void *ctx, double (*fn)(double))
 {
 	double x;
 
@@ -1139,11 +1675,11 @@ static int rtlb_aux_intize(SpnValue *ret, int argc, SpnValue *argv, void *ctx, d
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
-	x = val2float(&argv[0]);
+	x = val2float(argv[0]);
 
 	if (x < LONG_MIN || x > LONG_MAX) {
 		return -3;
@@ -1156,22 +1692,22 @@ static int rtlb_aux_intize(SpnValue *ret, int argc, SpnValue *argv, void *ctx, d
 	return 0;
 }
 
-static int rtlb_floor(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_floor(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_intize(ret, argc, argv, ctx, floor);
 }
 
-static int rtlb_ceil(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_ceil(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_intize(ret, argc, argv, ctx, ceil);
 }
 
-static int rtlb_round(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_round(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_intize(ret, argc, argv, ctx, rtlb_aux_round);
 }
 
-static int rtlb_aux_unmath(SpnValue *ret, int argc, SpnValue *argv, void *ctx, double (*fn)(double))
+static int rtlb_aux_unmath(SpnValue *ret, int argc, SpnValue **argv, void *ctx, double (*fn)(double))
 {
 	double x;
 
@@ -1179,11 +1715,11 @@ static int rtlb_aux_unmath(SpnValue *ret, int argc, SpnValue *argv, void *ctx, d
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
-	x = val2float(&argv[0]);
+	x = val2float(argv[0]);
 
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = SPN_TFLG_FLOAT;
@@ -1193,111 +1729,111 @@ static int rtlb_aux_unmath(SpnValue *ret, int argc, SpnValue *argv, void *ctx, d
 }
 
 /* I've done my best refactoring this. Still utterly ugly. Any suggestions? */
-static int rtlb_sqrt(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_sqrt(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, sqrt);
 }
 
-static int rtlb_cbrt(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_cbrt(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, rtlb_aux_cbrt);
 }
 
-static int rtlb_exp(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_exp(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, exp);
 }
 
-static int rtlb_exp2(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_exp2(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, rtlb_aux_exp2);
 }
 
-static int rtlb_exp10(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_exp10(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, rtlb_aux_exp10);
 }
 
-static int rtlb_log(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_log(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, log);
 }
 
-static int rtlb_log2(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_log2(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, rtlb_aux_log2);
 }
 
-static int rtlb_log10(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_log10(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, log10);
 }
 
-static int rtlb_sin(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_sin(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, sin);
 }
 
-static int rtlb_cos(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_cos(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, cos);
 }
 
-static int rtlb_tan(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_tan(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, tan);
 }
 
-static int rtlb_sinh(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_sinh(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, sinh);
 }
 
-static int rtlb_cosh(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_cosh(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, cosh);
 }
 
-static int rtlb_tanh(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_tanh(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, tanh);
 }
 
-static int rtlb_asin(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_asin(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, asin);
 }
 
-static int rtlb_acos(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_acos(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, acos);
 }
 
-static int rtlb_atan(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_atan(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_unmath(ret, argc, argv, ctx, atan);
 }
 /* end of horror */
 
-static int rtlb_atan2(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_atan2(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 2) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER
-	 || argv[1].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER
+	 || argv[1]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = SPN_TFLG_FLOAT;
-	ret->v.fltv = atan2(val2float(&argv[0]), val2float(&argv[1]));
+	ret->v.fltv = atan2(val2float(argv[0]), val2float(argv[1]));
 
 	return 0;
 }
 
-static int rtlb_hypot(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_hypot(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	double h = 0.0;
 	int i;
@@ -1305,11 +1841,11 @@ static int rtlb_hypot(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	for (i = 0; i < argc; i++) {
 		double x;
 
-		if (argv[i].t != SPN_TYPE_NUMBER) {
+		if (argv[i]->t != SPN_TYPE_NUMBER) {
 			return -1;
 		}
 
-		x = val2float(&argv[i]);
+		x = val2float(argv[i]);
 		h += x * x;
 	}
 
@@ -1320,65 +1856,78 @@ static int rtlb_hypot(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_deg2rad(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_deg2rad(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 1) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = SPN_TFLG_FLOAT;
-	ret->v.fltv = val2float(&argv[0]) / 180.0 * M_PI;
+	ret->v.fltv = val2float(argv[0]) / 180.0 * M_PI;
 
 	return 0;
 }
 
-static int rtlb_rad2deg(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_rad2deg(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 1) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = SPN_TFLG_FLOAT;
-	ret->v.fltv = val2float(&argv[0]) / M_PI * 180.0;
+	ret->v.fltv = val2float(argv[0]) / M_PI * 180.0;
 
 	return 0;
 }
 
-static int rtlb_random(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* the state of random() and seed(). `rand()` has a single hidden state
+ * which may not be used from several threads, so this is a xorshift
+ * generator instead, with a state per thread. It is not a decent PRNG
+ * either; if one needs one, one will use a dedicated library anyway.
+ */
+static SPN_THREAD_LOCAL unsigned long rand_state = 1;
+
+static int rtlb_random(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
-	/* I am sorry for the skew, but no way I am putting an unbounded loop
-	 * into this function. `rand()` is already pretty bad on its own, so
-	 * it's pointless to try improving it for simple use cases. If one
-	 * needs a decent PRNG, one will use a dedicated library anyway.
-	 */
+	/* 32 bits of state are enough, and `unsigned long' may not be wider */
+	unsigned long x = rand_state;
+	x ^= (x << 13) & 0xffffffff;
+	x ^= x >> 17;
+	x ^= (x << 5) & 0xffffffff;
+	rand_state = x;
+
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = SPN_TFLG_FLOAT;
-	ret->v.fltv = rand() * 1.0 / RAND_MAX;
+	ret->v.fltv = x / 4294967296.0;
 
 	return 0;
 }
 
-static int rtlb_seed(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_seed(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 1) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER || argv[0].f != 0) {
+	if (argv[0]->t != SPN_TYPE_NUMBER || argv[0]->f != 0) {
 		return -2;
 	}
 
-	srand(argv[0].v.intv);
+	/* the all-zero state is a fixed point of the generator */
+	rand_state = (unsigned long)(argv[0]->v.intv) & 0xffffffff;
+	if (rand_state == 0) {
+		rand_state = 1;
+	}
 
 	return 0;
 }
@@ -1405,49 +1954,49 @@ static int rtlb_aux_isinf(double x)
 }
 
 /* floating-point classification: double -> boolean */
-static int rtlb_aux_fltclass(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int (*fn)(double))
+static int rtlb_aux_fltclass(SpnValue *ret, int argc, SpnValue **argv, void *ctx, int (*fn)(double))
 {
 	if (argc != 1) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
 	ret->t = SPN_TYPE_BOOL;
 	ret->f = 0;
-	ret->v.boolv = fn(val2float(&argv[0]));
+	ret->v.boolv = fn(val2float(argv[0]));
 
 	return 0;
 }
 
-static int rtlb_isfin(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_isfin(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_fltclass(ret, argc, argv, ctx, rtlb_aux_isfin);
 }
 
-static int rtlb_isinf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_isinf(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_fltclass(ret, argc, argv, ctx, rtlb_aux_isinf);
 }
 
-static int rtlb_isnan(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_isnan(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	return rtlb_aux_fltclass(ret, argc, argv, ctx, rtlb_aux_isnan);
 }
 
-static int rtlb_abs(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_abs(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 1) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
-	*ret = argv[0];
+	*ret = *argv[0];
 
 	if (ret->f & SPN_TFLG_FLOAT) {
 		ret->v.fltv = fabs(ret->v.fltv);
@@ -1458,13 +2007,18 @@ static int rtlb_abs(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_pow(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_pow(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
+	SpnValue *x, *y;
+
 	if (argc != 2) {
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER || argv[1].t != SPN_TYPE_NUMBER) {
+	x = argv[0];
+	y = argv[1];
+
+	if (x->t != SPN_TYPE_NUMBER || y->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
@@ -1477,16 +2031,16 @@ static int rtlb_pow(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	 * The result is a integer only when the base is an integer and
 	 * the exponent is a non-negative integer at the same time.
 	 */
-	if (argv[0].f & SPN_TFLG_FLOAT || argv[1].f & SPN_TFLG_FLOAT) {
+	if (x->f & SPN_TFLG_FLOAT || y->f & SPN_TFLG_FLOAT) {
 		ret->f = SPN_TFLG_FLOAT;
-		ret->v.fltv = pow(val2float(&argv[0]), val2float(&argv[1]));	
-	} else if (argv[1].v.intv < 0) {
+		ret->v.fltv = pow(val2float(x), val2float(y));	
+	} else if (y->v.intv < 0) {
 		ret->f = SPN_TFLG_FLOAT;
-		ret->v.fltv = pow(val2float(&argv[0]), val2float(&argv[1]));	
+		ret->v.fltv = pow(val2float(x), val2float(y));	
 	} else {
 		/* base, exponent, result */
-		long b = argv[0].v.intv;
-		long e = argv[1].v.intv;
+		long b = x->v.intv;
+		long e = y->v.intv;
 		long r = 1;
 
 		/* exponentation by squaring - http://stackoverflow.com/q/101439/ */
@@ -1506,7 +2060,7 @@ static int rtlb_pow(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_min(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_min(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	int i;
 
@@ -1514,35 +2068,37 @@ static int rtlb_min(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
-	*ret = argv[0];
+	*ret = *argv[0];
 
 	for (i = 1; i < argc; i++) {
-		if (argv[i].t != SPN_TYPE_NUMBER) {
+		SpnValue *x = argv[i];
+
+		if (x->t != SPN_TYPE_NUMBER) {
 			return -2;
 		}
 
-		if (argv[i].f & SPN_TFLG_FLOAT) {
+		if (x->f & SPN_TFLG_FLOAT) {
 			if (ret->f & SPN_TFLG_FLOAT) {
-				if (argv[i].v.fltv < ret->v.fltv) {
-					*ret = argv[i];
+				if (x->v.fltv < ret->v.fltv) {
+					*ret = *x;
 				}
 			} else {
-				if (argv[i].v.fltv < ret->v.intv) {
-					*ret = argv[i];
+				if (x->v.fltv < ret->v.intv) {
+					*ret = *x;
 				}
 			}
 		} else {
 			if (ret->f & SPN_TFLG_FLOAT) {
-				if (argv[i].v.intv < ret->v.fltv) {
-					*ret = argv[i];
+				if (x->v.intv < ret->v.fltv) {
+					*ret = *x;
 				}
 			} else {
-				if (argv[i].v.intv < ret->v.intv) {
-					*ret = argv[i];
+				if (x->v.intv < ret->v.intv) {
+					*ret = *x;
 				}
 			}
 		}
@@ -1551,7 +2107,7 @@ static int rtlb_min(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_max(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_max(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	int i;
 
@@ -1559,35 +2115,37 @@ static int rtlb_max(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER) {
+	if (argv[0]->t != SPN_TYPE_NUMBER) {
 		return -2;
 	}
 
-	*ret = argv[0];
+	*ret = *argv[0];
 
 	for (i = 1; i < argc; i++) {
-		if (argv[i].t != SPN_TYPE_NUMBER) {
+		SpnValue *x = argv[i];
+
+		if (x->t != SPN_TYPE_NUMBER) {
 			return -2;
 		}
 
-		if (argv[i].f & SPN_TFLG_FLOAT) {
+		if (x->f & SPN_TFLG_FLOAT) {
 			if (ret->f & SPN_TFLG_FLOAT) {
-				if (argv[i].v.fltv > ret->v.fltv) {
-					*ret = argv[i];
+				if (x->v.fltv > ret->v.fltv) {
+					*ret = *x;
 				}
 			} else {
-				if (argv[i].v.fltv > ret->v.intv) {
-					*ret = argv[i];
+				if (x->v.fltv > ret->v.intv) {
+					*ret = *x;
 				}
 			}
 		} else {
 			if (ret->f & SPN_TFLG_FLOAT) {
-				if (argv[i].v.intv > ret->v.fltv) {
-					*ret = argv[i];
+				if (x->v.intv > ret->v.fltv) {
+					*ret = *x;
 				}
 			} else {
-				if (argv[i].v.intv > ret->v.intv) {
-					*ret = argv[i];
+				if (x->v.intv > ret->v.intv) {
+					*ret = *x;
 				}
 			}
 		}
@@ -1596,7 +2154,7 @@ static int rtlb_max(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_isfloat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_isfloat(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 1) {
 		return -1;
@@ -1605,8 +2163,8 @@ static int rtlb_isfloat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	ret->t = SPN_TYPE_BOOL;
 	ret->f = 0;
 
-	if (argv[0].t == SPN_TYPE_NUMBER) {
-		ret->v.boolv = (argv[0].f & SPN_TFLG_FLOAT) != 0;
+	if (argv[0]->t == SPN_TYPE_NUMBER) {
+		ret->v.boolv = (argv[0]->f & SPN_TFLG_FLOAT) != 0;
 	} else {
 		ret->v.boolv = 0;
 	}
@@ -1614,7 +2172,7 @@ static int rtlb_isfloat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_isint(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_isint(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	if (argc != 1) {
 		return -1;
@@ -1623,8 +2181,8 @@ static int rtlb_isint(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	ret->t = SPN_TYPE_BOOL;
 	ret->f = 0;
 
-	if (argv[0].t == SPN_TYPE_NUMBER) {
-		ret->v.boolv = (argv[0].f & SPN_TFLG_FLOAT) == 0;
+	if (argv[0]->t == SPN_TYPE_NUMBER) {
+		ret->v.boolv = (argv[0]->f & SPN_TFLG_FLOAT) == 0;
 	} else {
 		ret->v.boolv = 0;
 	}
@@ -1632,7 +2190,7 @@ static int rtlb_isint(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_fact(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_fact(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	long i;
 
@@ -1640,11 +2198,11 @@ static int rtlb_fact(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER || argv[0].f & SPN_TFLG_FLOAT) {
+	if (argv[0]->t != SPN_TYPE_NUMBER || argv[0]->f & SPN_TFLG_FLOAT) {
 		return -2;
 	}
 
-	if (argv[0].v.intv < 0) {
+	if (argv[0]->v.intv < 0) {
 		return -3;
 	}
 
@@ -1652,14 +2210,14 @@ static int rtlb_fact(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	ret->f = 0;
 	ret->v.intv = 1;
 
-	for (i = 2; i <= argv[0].v.intv; i++) {
+	for (i = 2; i <= argv[0]->v.intv; i++) {
 		ret->v.intv *= i;
 	}
 
 	return 0;
 }
 
-static int rtlb_binom(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_binom(SpnValue *ret, int argc, SpnValue **argv, void *ctx)
 {
 	long n, k, i, j, m, p;
 
@@ -1667,13 +2225,13 @@ static int rtlb_binom(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -1;
 	}
 
-	if (argv[0].t != SPN_TYPE_NUMBER || argv[0].f & SPN_TFLG_FLOAT
-	 || argv[1].t != SPN_TYPE_NUMBER || argv[1].f & SPN_TFLG_FLOAT) {
+	if (argv[0]->t != SPN_TYPE_NUMBER || argv[0]->f & SPN_TFLG_FLOAT
+	 || argv[1]->t != SPN_TYPE_NUMBER || argv[1]->f & SPN_TFLG_FLOAT) {
 		return -2;
 	}
 
-	n = argv[0].v.intv;
-	k = argv[1].v.intv;
+	n = argv[0]->v.intv;
+	k = argv[1]->v.intv;
 
 	if (n < 0 || k < 0 || n < k) {
 		return -3;
@@ -1697,46 +2255,650 @@ static int rtlb_binom(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
+const SpnExtFastFunc spn_libmath_fast[SPN_LIBSIZE_MATH] = {
+	{ "abs",	rtlb_abs,	0	},
+	{ "min",	rtlb_min,	0	},
+	{ "max",	rtlb_max,	0	},
+	{ "floor",	rtlb_floor,	0	},
+	{ "ceil",	rtlb_ceil,	0	},
+	{ "round",	rtlb_round,	0	},
+	{ "hypot",	rtlb_hypot,	0	},
+	{ "sqrt",	rtlb_sqrt,	0	},
+	{ "cbrt",	rtlb_cbrt,	0	},
+	{ "pow",	rtlb_pow,	0	},
+	{ "exp",	rtlb_exp,	0	},
+	{ "exp2",	rtlb_exp2,	0	},
+	{ "exp10",	rtlb_exp10,	0	},
+	{ "log",	rtlb_log,	0	},
+	{ "log2",	rtlb_log2,	0	},
+	{ "log10",	rtlb_log10,	0	},
+	{ "sin",	rtlb_sin,	0	},
+	{ "cos",	rtlb_cos,	0	},
+	{ "tan",	rtlb_tan,	0	},
+	{ "sinh",	rtlb_sinh,	0	},
+	{ "cosh",	rtlb_cosh,	0	},
+	{ "tanh",	rtlb_tanh,	0	},
+	{ "asin",	rtlb_asin,	0	},
+	{ "acos",	rtlb_acos,	0	},
+	{ "atan",	rtlb_atan,	0	},
+	{ "atan2",	rtlb_atan2,	0	},
+	{ "deg2rad",	rtlb_deg2rad,	0	},
+	{ "rad2deg",	rtlb_rad2deg,	0	},
+	{ "random",	rtlb_random,	1	},
+	{ "seed",	rtlb_seed,	0	},
+	{ "isfin",	rtlb_isfin,	0	},
+	{ "isinf",	rtlb_isinf,	0	},
+	{ "isnan",	rtlb_isnan,	0	},
+	{ "isfloat",	rtlb_isfloat,	0	},
+	{ "isint",	rtlb_isint,	0	},
+	{ "fact",	rtlb_fact,	0	},
+	{ "binom",	rtlb_binom,	0	}
+};
+
+/* the same functions, for hosts which register them with spn_vm_addlib().
+ * Each one collects pointers to its arguments and calls the fast version.
+ */
+#define RTLB_MATH_NARGS 16
+
+static int rtlb_aux_callfast(
+	int (*fn)(SpnValue *, int, SpnValue **, void *),
+	SpnValue *ret,
+	int argc,
+	SpnValue *argv,
+	void *ctx
+)
+{
+	SpnValue *args[RTLB_MATH_NARGS];
+	SpnValue **ptrs = args;
+	int i, err;
+
+	if (argc > RTLB_MATH_NARGS) {
+		ptrs = malloc(argc * sizeof(ptrs[0]));
+		if (ptrs == NULL) {
+			abort();
+		}
+	}
+
+	for (i = 0; i < argc; i++) {
+		ptrs[i] = &argv[i];
+	}
+
+	err = fn(ret, argc, ptrs, ctx);
+
+	if (ptrs != args) {
+		free(ptrs);
+	}
+
+	return err;
+}
+
+#define RTLB_CLASSIC(fn)						\
+	static int fn##_classic(SpnValue *ret, int argc, SpnValue *argv, void *ctx) \
+	{								\
+		return rtlb_aux_callfast(fn, ret, argc, argv, ctx);	\
+	}
+
+RTLB_CLASSIC(rtlb_abs)
+RTLB_CLASSIC(rtlb_min)
+RTLB_CLASSIC(rtlb_max)
+RTLB_CLASSIC(rtlb_floor)
+RTLB_CLASSIC(rtlb_ceil)
+RTLB_CLASSIC(rtlb_round)
+RTLB_CLASSIC(rtlb_hypot)
+RTLB_CLASSIC(rtlb_sqrt)
+RTLB_CLASSIC(rtlb_cbrt)
+RTLB_CLASSIC(rtlb_pow)
+RTLB_CLASSIC(rtlb_exp)
+RTLB_CLASSIC(rtlb_exp2)
+RTLB_CLASSIC(rtlb_exp10)
+RTLB_CLASSIC(rtlb_log)
+RTLB_CLASSIC(rtlb_log2)
+RTLB_CLASSIC(rtlb_log10)
+RTLB_CLASSIC(rtlb_sin)
+RTLB_CLASSIC(rtlb_cos)
+RTLB_CLASSIC(rtlb_tan)
+RTLB_CLASSIC(rtlb_sinh)
+RTLB_CLASSIC(rtlb_cosh)
+RTLB_CLASSIC(rtlb_tanh)
+RTLB_CLASSIC(rtlb_asin)
+RTLB_CLASSIC(rtlb_acos)
+RTLB_CLASSIC(rtlb_atan)
+RTLB_CLASSIC(rtlb_atan2)
+RTLB_CLASSIC(rtlb_deg2rad)
+RTLB_CLASSIC(rtlb_rad2deg)
+RTLB_CLASSIC(rtlb_random)
+RTLB_CLASSIC(rtlb_seed)
+RTLB_CLASSIC(rtlb_isfin)
+RTLB_CLASSIC(rtlb_isinf)
+RTLB_CLASSIC(rtlb_isnan)
+RTLB_CLASSIC(rtlb_isfloat)
+RTLB_CLASSIC(rtlb_isint)
+RTLB_CLASSIC(rtlb_fact)
+RTLB_CLASSIC(rtlb_binom)
+
 const SpnExtFunc spn_libmath[SPN_LIBSIZE_MATH] = {
-	{ "abs",	rtlb_abs	},
-	{ "min",	rtlb_min	},
-	{ "max",	rtlb_max	},
-	{ "floor",	rtlb_floor	},
-	{ "ceil",	rtlb_ceil	},
-	{ "round",	rtlb_round	},
-	{ "hypot",	rtlb_hypot	},
-	{ "sqrt",	rtlb_sqrt	},
-	{ "cbrt",	rtlb_cbrt	},
-	{ "pow",	rtlb_pow	},
-	{ "exp",	rtlb_exp	},
-	{ "exp2",	rtlb_exp2	},
-	{ "exp10",	rtlb_exp10	},
-	{ "log",	rtlb_log	},
-	{ "log2",	rtlb_log2	},
-	{ "log10",	rtlb_log10	},
-	{ "sin",	rtlb_sin	},
-	{ "cos",	rtlb_cos	},
-	{ "tan",	rtlb_tan	},
-	{ "sinh",	rtlb_sinh	},
-	{ "cosh",	rtlb_cosh	},
-	{ "tanh",	rtlb_tanh	},
-	{ "asin",	rtlb_asin	},
-	{ "acos",	rtlb_acos	},
-	{ "atan",	rtlb_atan	},
-	{ "atan2",	rtlb_atan2	},
-	{ "deg2rad",	rtlb_deg2rad	},
-	{ "rad2deg",	rtlb_rad2deg	},
-	{ "random",	rtlb_random	},
-	{ "seed",	rtlb_seed	},
-	{ "isfin",	rtlb_isfin	},
-	{ "isinf",	rtlb_isinf	},
-	{ "isnan",	rtlb_isnan	},
-	{ "isfloat",	rtlb_isfloat	},
-	{ "isint",	rtlb_isint	},
-	{ "fact",	rtlb_fact	},
-	{ "binom",	rtlb_binom	}
+	{ "abs",	rtlb_abs_classic	},
+	{ "min",	rtlb_min_classic	},
+	{ "max",	rtlb_max_classic	},
+	{ "floor",	rtlb_floor_classic	},
+	{ "ceil",	rtlb_ceil_classic	},
+	{ "round",	rtlb_round_classic	},
+	{ "hypot",	rtlb_hypot_classic	},
+	{ "sqrt",	rtlb_sqrt_classic	},
+	{ "cbrt",	rtlb_cbrt_classic	},
+	{ "pow",	rtlb_pow_classic	},
+	{ "exp",	rtlb_exp_classic	},
+	{ "exp2",	rtlb_exp2_classic	},
+	{ "exp10",	rtlb_exp10_classic	},
+	{ "log",	rtlb_log_classic	},
+	{ "log2",	rtlb_log2_classic	},
+	{ "log10",	rtlb_log10_classic	},
+	{ "sin",	rtlb_sin_classic	},
+	{ "cos",	rtlb_cos_classic	},
+	{ "tan",	rtlb_tan_classic	},
+	{ "sinh",	rtlb_sinh_classic	},
+	{ "cosh",	rtlb_cosh_classic	},
+	{ "tanh",	rtlb_tanh_classic	},
+	{ "asin",	rtlb_asin_classic	},
+	{ "acos",	rtlb_acos_classic	},
+	{ "atan",	rtlb_atan_classic	},
+	{ "atan2",	rtlb_atan2_classic	},
+	{ "deg2rad",	rtlb_deg2rad_classic	},
+	{ "rad2deg",	rtlb_rad2deg_classic	},
+	{ "random",	rtlb_random_classic	},
+	{ "seed",	rtlb_seed_classic	},
+	{ "isfin",	rtlb_isfin_classic	},
+	{ "isinf",	rtlb_isinf_classic	},
+	{ "isnan",	rtlb_isnan_classic	},
+	{ "isfloat",	rtlb_isfloat_classic	},
+	{ "isint",	rtlb_isint_classic	},
+	{ "fact",	rtlb_fact_classic	},
+	{ "binom",	rtlb_binom_classic	}
 };
 
+/**************************
+ * Numeric buffer library *
+ **************************/
+
+static void rtlb_aux_bufvalue(SpnValue *ret, SpnNumBuffer *buf)
+{
+	ret->t = SPN_TYPE_USRDAT;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = buf;
+}
+
+/* the element at index `i` of any buffer, converted to floating-point */
+static double rtlb_aux_bufelt(SpnNumBuffer *buf, size_t i)
+{
+	return buf->type == SPN_NUMBUF_INT ? buf->data.i[i] : buf->data.f[i];
+}
+
+/* creates a buffer either of the given length, filled with zeroes, or with
+ * the elements of an array (with indices 0...n-1, like join() expects)
+ */
+static int rtlb_aux_mkbuf(SpnValue *ret, int argc, SpnValue *argv, int type)
+{
+	SpnNumBuffer *buf;
+	SpnArray *arr;
+	size_t n, i;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	if (argv[0].t == SPN_TYPE_NUMBER) {
+		if (argv[0].f & SPN_TFLG_FLOAT || argv[0].v.intv < 0) {
+			return -2;
+		}
+
+		buf = spn_numbuf_new(type, argv[0].v.intv);
+		if (buf == NULL) {
+			return -4;
+		}
+
+		rtlb_aux_bufvalue(ret, buf);
+		return 0;
+	}
+
+	if (argv[0].t != SPN_TYPE_ARRAY) {
+		return -2;
+	}
+
+	arr = argv[0].v.ptrv;
+	n = spn_array_count(arr);
+
+	buf = spn_numbuf_new(type, n);
+	if (buf == NULL) {
+		return -4;
+	}
+
+	for (i = 0; i < n; i++) {
+		SpnValue key;
+		key.t = SPN_TYPE_NUMBER;
+		key.f = 0;
+		key.v.intv = i;
+
+		if (spn_numbuf_set(buf, i, spn_array_get(arr, &key)) != 0) {
+			spn_object_release(buf);
+			return -3;
+		}
+	}
+
+	rtlb_aux_bufvalue(ret, buf);
+	return 0;
+}
+
+static int rtlb_intbuf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_mkbuf(ret, argc, argv, SPN_NUMBUF_INT);
+}
+
+static int rtlb_floatbuf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_mkbuf(ret, argc, argv, SPN_NUMBUF_FLOAT);
+}
+
+static int rtlb_buftoarray(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *buf;
+	SpnArray *arr;
+	size_t i;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	buf = spn_value_numbuf(&argv[0]);
+	if (buf == NULL) {
+		return -2;
+	}
+
+	arr = spn_array_new();
+
+	for (i = 0; i < buf->len; i++) {
+		SpnValue key, val;
+		key.t = SPN_TYPE_NUMBER;
+		key.f = 0;
+		key.v.intv = i;
+
+		spn_numbuf_get(buf, i, &val);
+		spn_array_set(arr, &key, &val);
+	}
+
+	ret->t = SPN_TYPE_ARRAY;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = arr;
+
+	return 0;
+}
+
+/* The reductions below keep four independent partial sums instead of one,
+ * so that the additions don't have to wait for each other, and so that the
+ * compiler can map pairs of them onto SIMD registers. (It may not reorder
+ * floating-point additions on its own.) As a consequence, the result may
+ * differ from that of a sequential loop in the last bits.
+ */
+static double rtlb_aux_fsum(const double *x, size_t n)
+{
+	double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += x[i + 0];
+		s1 += x[i + 1];
+		s2 += x[i + 2];
+		s3 += x[i + 3];
+	}
+
+	for (; i < n; i++) {
+		s0 += x[i];
+	}
+
+	return (s0 + s1) + (s2 + s3);
+}
+
+static double rtlb_aux_fdot(const double *x, const double *y, size_t n)
+{
+	double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += x[i + 0] * y[i + 0];
+		s1 += x[i + 1] * y[i + 1];
+		s2 += x[i + 2] * y[i + 2];
+		s3 += x[i + 3] * y[i + 3];
+	}
+
+	for (; i < n; i++) {
+		s0 += x[i] * y[i];
+	}
+
+	return (s0 + s1) + (s2 + s3);
+}
+
+/* integer arithmetic wraps around, like it does in the VM; it is done on
+ * unsigned longs, since signed overflow is undefined behavior in C
+ */
+static int rtlb_bufsum(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *buf;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	buf = spn_value_numbuf(&argv[0]);
+	if (buf == NULL) {
+		return -2;
+	}
+
+	ret->t = SPN_TYPE_NUMBER;
+
+	if (buf->type == SPN_NUMBUF_INT) {
+		unsigned long s = 0;
+		size_t i;
+
+		for (i = 0; i < buf->len; i++) {
+			s += buf->data.i[i];
+		}
+
+		ret->f = 0;
+		ret->v.intv = s;
+	} else {
+		ret->f = SPN_TFLG_FLOAT;
+		ret->v.fltv = rtlb_aux_fsum(buf->data.f, buf->len);
+	}
+
+	return 0;
+}
+
+static int rtlb_bufdot(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *x, *y;
+	size_t i;
+
+	if (argc != 2) {
+		return -1;
+	}
+
+	x = spn_value_numbuf(&argv[0]);
+	y = spn_value_numbuf(&argv[1]);
+
+	if (x == NULL || y == NULL) {
+		return -2;
+	}
+
+	if (x->len != y->len) {
+		return -3;
+	}
+
+	ret->t = SPN_TYPE_NUMBER;
+
+	if (x->type == SPN_NUMBUF_INT && y->type == SPN_NUMBUF_INT) {
+		unsigned long s = 0;
+
+		for (i = 0; i < x->len; i++) {
+			s += (unsigned long)(x->data.i[i]) * y->data.i[i];
+		}
+
+		ret->f = 0;
+		ret->v.intv = s;
+	} else if (x->type == SPN_NUMBUF_FLOAT && y->type == SPN_NUMBUF_FLOAT) {
+		ret->f = SPN_TFLG_FLOAT;
+		ret->v.fltv = rtlb_aux_fdot(x->data.f, y->data.f, x->len);
+	} else {
+		double s = 0.0;
+
+		for (i = 0; i < x->len; i++) {
+			s += rtlb_aux_bufelt(x, i) * rtlb_aux_bufelt(y, i);
+		}
+
+		ret->f = SPN_TFLG_FLOAT;
+		ret->v.fltv = s;
+	}
+
+	return 0;
+}
+
+/* y = a * x + y, in place. The result is stored in `y`, so if `y` is an
+ * integer buffer, then `a` and `x` must be integers too.
+ */
+static int rtlb_bufaxpy(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *x, *y;
+	size_t i, n;
+
+	if (argc != 3) {
+		return -1;
+	}
+
+	x = spn_value_numbuf(&argv[1]);
+	y = spn_value_numbuf(&argv[2]);
+
+	if (argv[0].t != SPN_TYPE_NUMBER || x == NULL || y == NULL) {
+		return -2;
+	}
+
+	if (x->len != y->len) {
+		return -3;
+	}
+
+	n = x->len;
+
+	if (y->type == SPN_NUMBUF_INT) {
+		unsigned long a;
+		long *yi = y->data.i;
+		const long *xi = x->data.i;
+
+		if (argv[0].f & SPN_TFLG_FLOAT || x->type != SPN_NUMBUF_INT) {
+			return -2;
+		}
+
+		a = argv[0].v.intv;
+
+		for (i = 0; i < n; i++) {
+			yi[i] = a * xi[i] + yi[i];
+		}
+	} else {
+		double a = val2float(&argv[0]);
+		double *yf = y->data.f;
+
+		if (x->type == SPN_NUMBUF_FLOAT) {
+			const double *xf = x->data.f;
+
+			for (i = 0; i < n; i++) {
+				yf[i] += a * xf[i];
+			}
+		} else {
+			const long *xi = x->data.i;
+
+			for (i = 0; i < n; i++) {
+				yf[i] += a * xi[i];
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* multiplies each element by `k`, in place */
+static int rtlb_bufscale(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *buf;
+	size_t i;
+
+	if (argc != 2) {
+		return -1;
+	}
+
+	buf = spn_value_numbuf(&argv[0]);
+
+	if (buf == NULL || argv[1].t != SPN_TYPE_NUMBER) {
+		return -2;
+	}
+
+	if (buf->type == SPN_NUMBUF_INT) {
+		unsigned long k;
+		long *xi = buf->data.i;
+
+		if (argv[1].f & SPN_TFLG_FLOAT) {
+			return -2;
+		}
+
+		k = argv[1].v.intv;
+
+		for (i = 0; i < buf->len; i++) {
+			xi[i] = k * xi[i];
+		}
+	} else {
+		double k = val2float(&argv[1]);
+		double *xf = buf->data.f;
+
+		for (i = 0; i < buf->len; i++) {
+			xf[i] *= k;
+		}
+	}
+
+	return 0;
+}
+
+/* bufmap() accepts the unary functions of the maths library. Instead of
+ * calling the native function for each element, it looks up the
+ * corresponding C function, which is then applied in a plain loop.
+ */
+static const struct {
+	int (*fn)(SpnValue *, int, SpnValue **, void *);
+	double (*cfn)(double);
+} rtlb_bufmap_fns[] = {
+	{ rtlb_abs,	fabs		},
+	{ rtlb_floor,	floor		},
+	{ rtlb_ceil,	ceil		},
+	{ rtlb_round,	rtlb_aux_round	},
+	{ rtlb_sqrt,	sqrt		},
+	{ rtlb_cbrt,	rtlb_aux_cbrt	},
+	{ rtlb_exp,	exp		},
+	{ rtlb_exp2,	rtlb_aux_exp2	},
+	{ rtlb_exp10,	rtlb_aux_exp10	},
+	{ rtlb_log,	log		},
+	{ rtlb_log2,	rtlb_aux_log2	},
+	{ rtlb_log10,	log10		},
+	{ rtlb_sin,	sin		},
+	{ rtlb_cos,	cos		},
+	{ rtlb_tan,	tan		},
+	{ rtlb_sinh,	sinh		},
+	{ rtlb_cosh,	cosh		},
+	{ rtlb_tanh,	tanh		},
+	{ rtlb_asin,	asin		},
+	{ rtlb_acos,	acos		},
+	{ rtlb_atan,	atan		}
+};
+
+/* returns a new float buffer; the original one is left unchanged */
+static int rtlb_bufmap(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *src, *dst;
+	SpnFunction *func;
+	double (*cfn)(double) = NULL;
+	size_t i;
+
+	if (argc != 2) {
+		return -1;
+	}
+
+	src = spn_value_numbuf(&argv[0]);
+
+	if (src == NULL || argv[1].t != SPN_TYPE_FUNC) {
+		return -2;
+	}
+
+	func = argv[1].v.ptrv;
+
+	if (func->flags & SPN_TFLG_REGARGS) {
+		for (i = 0; i < COUNT(rtlb_bufmap_fns); i++) {
+			if (rtlb_bufmap_fns[i].fn == func->r.regfn) {
+				cfn = rtlb_bufmap_fns[i].cfn;
+				break;
+			}
+		}
+	}
+
+	if (cfn == NULL) {
+		return -3;
+	}
+
+	dst = spn_numbuf_new(SPN_NUMBUF_FLOAT, src->len);
+	if (dst == NULL) {
+		return -4;
+	}
+
+	if (src->type == SPN_NUMBUF_INT) {
+		for (i = 0; i < src->len; i++) {
+			dst->data.f[i] = cfn(src->data.i[i]);
+		}
+	} else {
+		for (i = 0; i < src->len; i++) {
+			dst->data.f[i] = cfn(src->data.f[i]);
+		}
+	}
+
+	rtlb_aux_bufvalue(ret, dst);
+	return 0;
+}
+
+static int rtlb_aux_intcmp(const void *lp, const void *rp)
+{
+	long l = *(const long *)(lp), r = *(const long *)(rp);
+	return (l > r) - (l < r);
+}
+
+/* NaNs are ordered after all other numbers, so the order is total */
+static int rtlb_aux_fltcmp(const void *lp, const void *rp)
+{
+	double l = *(const double *)(lp), r = *(const double *)(rp);
+
+	if (l != l || r != r) {
+		return (l != l) - (r != r);
+	}
+
+	return (l > r) - (l < r);
+}
+
+/* sorts the elements in ascending order, in place */
+static int rtlb_bufsort(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnNumBuffer *buf;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	buf = spn_value_numbuf(&argv[0]);
+	if (buf == NULL) {
+		return -2;
+	}
+
+	if (buf->type == SPN_NUMBUF_INT) {
+		qsort(buf->data.i, buf->len, sizeof buf->data.i[0], rtlb_aux_intcmp);
+	} else {
+		qsort(buf->data.f, buf->len, sizeof buf->data.f[0], rtlb_aux_fltcmp);
+	}
+
+	return 0;
+}
+
+const SpnExtFunc spn_libnumbuf[SPN_LIBSIZE_NUMBUF] = {
+	{ "intbuf",	rtlb_intbuf	},
+	{ "floatbuf",	rtlb_floatbuf	},
+	{ "buftoarray",	rtlb_buftoarray	},
+	{ "bufsum",	rtlb_bufsum	},
+	{ "bufdot",	rtlb_bufdot	},
+	{ "bufaxpy",	rtlb_bufaxpy	},
+	{ "bufscale",	rtlb_bufscale	},
+	{ "bufmap",	rtlb_bufmap	},
+	{ "bufsort",	rtlb_bufsort	}
+};
+
+
 
 /*********************
  * Date/time library *
@@ -1763,6 +2925,9 @@ static int rtlb_aux_gettm(SpnValue *ret, int argc, SpnValue *argv, void *ctx, in
 {
 	time_t tmstp;
 	struct tm *ts;
+#if SPN_USE_TIME_R
+	struct tm tmbuf;
+#endif
 
 	SpnArray *arr;
 	SpnValue key, val;
@@ -1777,7 +2942,17 @@ static int rtlb_aux_gettm(SpnValue *ret, int argc, SpnValue *argv, void *ctx, in
 
 	/* the argument of this function is an integer returned by time() */
 	tmstp = argv[0].v.intv;
+
+	/* localtime() and gmtime() return a pointer to a static buffer */
+#if SPN_USE_TIME_R
+	ts = islocal ? localtime_r(&tmstp, &tmbuf) : gmtime_r(&tmstp, &tmbuf);
+#else
 	ts = islocal ? localtime(&tmstp) : gmtime(&tmstp);
+#endif
+
+	if (ts == NULL) {
+		return -3;
+	}
 
 	arr = spn_array_new();
 
@@ -1855,7 +3030,7 @@ static int rtlb_localtime(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 static int rtlb_strftime(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	char *buf;
+	char buf[RTLB_STRFTIME_BUFSIZE];
 	struct tm ts;
 	size_t len;
 
@@ -1929,18 +3104,13 @@ static int rtlb_strftime(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	ts.tm_isdst = val->v.intv;
 	spn_object_release(key.v.ptrv);
 
-	buf = malloc(RTLB_STRFTIME_BUFSIZE);
-	if (buf == NULL) {
-		abort();
-	}
-
 	/* actually do the formatting */
-	len = strftime(buf, RTLB_STRFTIME_BUFSIZE, fmt->cstr, &ts);
+	len = strftime(buf, sizeof(buf), spn_string_cstr(fmt), &ts);
 
 	/* set return value */
 	ret->t = SPN_TYPE_STRING;
 	ret->f = SPN_TFLG_OBJECT;
-	ret->v.ptrv = spn_string_new_nocopy_len(buf, len, 1);
+	ret->v.ptrv = spn_string_new_len(buf, len);
 
 	return 0;
 }
@@ -1990,7 +3160,7 @@ static int rtlb_getenv(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	}
 
 	name = argv[0].v.ptrv;
-	env = getenv(name->cstr);
+	env = getenv(spn_string_cstr(name));
 
 	if (env != NULL) {
 		ret->t = SPN_TYPE_STRING;
@@ -2002,34 +3172,44 @@ static int rtlb_getenv(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-/* this function is a getter and a setter at the same time
- * (just so that we can use a local variable)
- * if the array pointed to by `array' is NULL, then it is set to
- * the `argv' array, else the `argv' array is assigned to `*array'.
+/* the arguments registered using spn_register_args(). Only the C strings are
+ * stored, so that they can be read by any number of threads and VMs at the
+ * same time; each call to getargs() makes a new array out of them.
  */
-static void rtlb_aux_argv(SpnArray **array)
+static int reg_argc = 0;
+static char **reg_argv = NULL;
+
+static int rtlb_getargs(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	static SpnArray *argv = NULL;
+	SpnArray *arr;
+	int i;
 
-	if (*array == NULL) {
-		*array = argv;
-	} else {
-		argv = *array;
+	/* if not set, leave the return value nil */
+	if (reg_argv == NULL) {
+		return 0;
 	}
-}
 
-static int rtlb_getargs(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	SpnArray *arr = NULL;
-	rtlb_aux_argv(&arr);
+	arr = spn_array_new();
 
-	if (arr != NULL) {
-		spn_object_retain(arr);
-		ret->t = SPN_TYPE_ARRAY;
-		ret->f = SPN_TFLG_OBJECT;
-		ret->v.ptrv = arr;
+	for (i = 0; i < reg_argc; i++) {
+		SpnValue key, val;
+		SpnString *arg = spn_string_new_nocopy(reg_argv[i], 0);
+
+		key.t = SPN_TYPE_NUMBER;
+		key.f = 0;
+		key.v.intv = i;
+
+		val.t = SPN_TYPE_STRING;
+		val.f = SPN_TFLG_OBJECT;
+		val.v.ptrv = arg;
+
+		spn_array_set(arr, &key, &val);
+		spn_object_release(arg);
 	}
-	/* if not set, leave the return value nil */
+
+	ret->t = SPN_TYPE_ARRAY;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = arr;
 
 	return 0;
 }
@@ -2048,7 +3228,7 @@ static int rtlb_system(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	}
 
 	cmd = argv[0].v.ptrv;
-	code = system(cmd->cstr);
+	code = system(spn_string_cstr(cmd));
 
 	ret->t = SPN_TYPE_NUMBER;
 	ret->f = 0;
@@ -2070,7 +3250,7 @@ static int rtlb_assert(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	/* actual assertion */
 	if (argv[0].v.boolv == 0) {
 		SpnString *msg = argv[1].v.ptrv;
-		fprintf(stderr, "Sparkling: assertion failed: %s\n", msg->cstr);
+		fprintf(stderr, "Sparkling: assertion failed: %s\n", spn_string_cstr(msg));
 		return -3;
 	}
 
@@ -2108,36 +3288,8 @@ const SpnExtFunc spn_libsys[SPN_LIBSIZE_SYS] = {
 
 void spn_register_args(int argc, char **argv)
 {
-	int i;
-	SpnArray *arr = NULL;
-
-	/* get old array and release it */
-	rtlb_aux_argv(&arr);	
-	if (arr != NULL) {
-		spn_object_release(arr);
-	}
-
-	/* initialize new array */
-	arr = spn_array_new();
-
-	for (i = 0; i < argc; i++) {
-		SpnValue key, val;		
-		SpnString *arg = spn_string_new_nocopy(argv[i], 0);
-
-		key.t = SPN_TYPE_NUMBER;
-		key.f = 0;
-		key.v.intv = i;
-
-		val.t = SPN_TYPE_STRING;
-		val.f = SPN_TFLG_OBJECT;
-		val.v.ptrv = arg;
-
-		spn_array_set(arr, &key, &val);
-		spn_object_release(arg);
-	}
-
-	/* write it back */
-	rtlb_aux_argv(&arr);
+	reg_argc = argc;
+	reg_argv = argv;
 }
 
 void spn_load_stdlib(SpnVMachine *vm)
@@ -2145,7 +3297,8 @@ void spn_load_stdlib(SpnVMachine *vm)
 	spn_vm_addlib(vm, spn_libio, SPN_LIBSIZE_IO);
 	spn_vm_addlib(vm, spn_libstring, SPN_LIBSIZE_STRING);
 	spn_vm_addlib(vm, spn_libarray, SPN_LIBSIZE_ARRAY);
-	spn_vm_addlib(vm, spn_libmath, SPN_LIBSIZE_MATH);
+	spn_vm_addfastlib(vm, spn_libmath_fast, SPN_LIBSIZE_MATH);
+	spn_vm_addlib(vm, spn_libnumbuf, SPN_LIBSIZE_NUMBUF);
 	spn_vm_addlib(vm, spn_libtime, SPN_LIBSIZE_TIME);
 	spn_vm_addlib(vm, spn_libsys, SPN_LIBSIZE_SYS);
 }
@@ -17,11 +17,12 @@
  * fopen(), fclose()
  * fprintf(), fgetline()
  * fread(), fwrite()
+ * mapfile(), lines(), nextline()
  * stdin(), stdout(), stderr()
  * fflush(), ftell(), fseek(), feof()
  * remove(), rename(), tmpnam(), tmpfile()
  */
-#define SPN_LIBSIZE_IO 20
+#define SPN_LIBSIZE_IO 23
 SPN_API const SpnExtFunc spn_libio[SPN_LIBSIZE_IO];
 
 /* indexof(), substr(), substrto(), substrfrom()
@@ -29,8 +30,9 @@ SPN_API const SpnExtFunc spn_libio[SPN_LIBSIZE_IO];
  * tolower(), toupper()
  * fmtstring()
  * tonumber(), toint(), tofloat()
+ * strbuilder(), sbappend(), sbformat(), sbreserve(), sblength(), sbfinish()
  */
-#define SPN_LIBSIZE_STRING 12
+#define SPN_LIBSIZE_STRING 18
 SPN_API const SpnExtFunc spn_libstring[SPN_LIBSIZE_STRING];
 
 /* array(), dict()
@@ -57,6 +59,18 @@ SPN_API const SpnExtFunc spn_libarray[SPN_LIBSIZE_ARRAY];
 #define SPN_LIBSIZE_MATH 37
 SPN_API const SpnExtFunc spn_libmath[SPN_LIBSIZE_MATH];
 
+/* the same functions with the faster calling convention (SpnExtFastFunc),
+ * to be registered with spn_vm_addfastlib(). spn_load_stdlib() uses these.
+ */
+SPN_API const SpnExtFastFunc spn_libmath_fast[SPN_LIBSIZE_MATH];
+
+/* intbuf(), floatbuf(), buftoarray()
+ * bufsum(), bufdot(), bufaxpy(), bufscale()
+ * bufmap(), bufsort()
+ */
+#define SPN_LIBSIZE_NUMBUF 9
+SPN_API const SpnExtFunc spn_libnumbuf[SPN_LIBSIZE_NUMBUF];
+
 /* time()
  * gmtime()
  * localtime()
@@ -84,7 +98,8 @@ SPN_API void spn_load_stdlib(SpnVMachine *vm);
  * `getargs()' access to command-line arguments. The `argc' and `argv'
  * variables are assumed to be the arguments of `main()' -- the strings are
  * not copied, you have to make sure that they are valid throughout the
- * lifetime of the program.
+ * lifetime of the program. The arguments are shared by all VMs, so call
+ * this before starting any threads that run Sparkling code.
  */
 SPN_API void spn_register_args(int argc, char **argv);
 
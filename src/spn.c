@@ -8,6 +8,26 @@
  * Public parts of the Sparkling API
  */
 
+/* object files are memory-mapped on POSIX systems. This must come before
+ * any header is included, since it asks for the POSIX declarations.
+ */
+#ifndef SPN_USE_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define SPN_USE_MMAP 1
+#else
+#define SPN_USE_MMAP 0
+#endif
+#endif
+
+#if SPN_USE_MMAP
+#define _POSIX_C_SOURCE 200112L
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -18,6 +38,7 @@
 #include "parser.h"
 #include "compiler.h"
 #include "vm.h"
+#include "func.h"
 #include "private.h"
 
 
@@ -28,7 +49,8 @@
 void spn_value_retain(SpnValue *val)
 {
 	if (val->f & SPN_TFLG_OBJECT) {
-		assert(val->t == SPN_TYPE_STRING
+		assert(val->t == SPN_TYPE_FUNC
+		    || val->t == SPN_TYPE_STRING
 		    || val->t == SPN_TYPE_ARRAY
 		    || val->t == SPN_TYPE_USRDAT);
 
@@ -39,7 +61,8 @@ void spn_value_retain(SpnValue *val)
 void spn_value_release(SpnValue *val)
 {
 	if (val->f & SPN_TFLG_OBJECT) {
-		assert(val->t == SPN_TYPE_STRING
+		assert(val->t == SPN_TYPE_FUNC
+		    || val->t == SPN_TYPE_STRING
 		    || val->t == SPN_TYPE_ARRAY
 		    || val->t == SPN_TYPE_USRDAT);
 
@@ -63,45 +86,6 @@ static int numeric_equal(const SpnValue *lhs, const SpnValue *rhs)
 	}
 }
 
-/* functions are considered equal if either their names are not
- * NULL (i. e. none of them are closures) and the names are the
- * same, or their names are both NULL (both functions are
- * lambdas) and they point to the same entry point inside
- * the bytecode.
- */
-static int function_equal(const SpnValue *lhs, const SpnValue *rhs)
-{
-	assert(lhs->t == SPN_TYPE_FUNC && rhs->t == SPN_TYPE_FUNC);
-
-	/* a native function cannot be the same as a script function */
-	if ((lhs->f & SPN_TFLG_NATIVE) != (rhs->f & SPN_TFLG_NATIVE)) {
-		return 0;
-	}
-
-	/* if both are native, then they must point to the same function */
-	if (lhs->f & SPN_TFLG_NATIVE) {
-		return lhs->v.fnv.r.fn == rhs->v.fnv.r.fn;
-	}
-
-	/* if both are script functions, then they must either have the same
-	 * name to be equal, or they must point to the same lambda function
-	 */
-	if (lhs->v.fnv.name != NULL && rhs->v.fnv.name != NULL) {
-		return strcmp(lhs->v.fnv.name, rhs->v.fnv.name) == 0;
-	} else if (lhs->v.fnv.name == NULL && rhs->v.fnv.name == NULL) {
-		/* an unnamed stub is nonsense (it's impossible to resolve) */
-		assert((lhs->f & SPN_TFLG_PENDING) == 0);
-		assert((rhs->f & SPN_TFLG_PENDING) == 0);
-
-		return lhs->v.fnv.r.bc == rhs->v.fnv.r.bc;
-	} else {
-		/* if one of them has a name but the other one hasn't, then
-		 * they cannot possibly be equal
-		 */
-		return 0;
-	}
-}
-
 int spn_value_equal(const SpnValue *lhs, const SpnValue *rhs)
 {
 	/* first, make sure that we compare values of the same type
@@ -115,7 +99,7 @@ int spn_value_equal(const SpnValue *lhs, const SpnValue *rhs)
 	case SPN_TYPE_NIL:	{ return 1; /* nil can only be nil */		}
 	case SPN_TYPE_BOOL:	{ return !lhs->v.boolv == !rhs->v.boolv;	}
 	case SPN_TYPE_NUMBER:	{ return numeric_equal(lhs, rhs);		}
-	case SPN_TYPE_FUNC:	{ return function_equal(lhs, rhs);		}
+	case SPN_TYPE_FUNC:
 	case SPN_TYPE_STRING:
 	case SPN_TYPE_ARRAY:	{
 		return spn_object_equal(lhs->v.ptrv, rhs->v.ptrv);
@@ -159,12 +143,13 @@ void spn_value_print(const SpnValue *val)
 
 		break;
 	case SPN_TYPE_FUNC: {
-		const char *name = val->v.fnv.name ? val->v.fnv.name : SPN_LAMBDA_NAME;
+		SpnFunction *func = val->v.ptrv;
+		const char *name = func->name ? func->name : SPN_LAMBDA_NAME;
 
 		if (val->f & SPN_TFLG_NATIVE) {
 			printf("<native function %s()>", name);
 		} else {
-			const void *ptr = val->v.fnv.r.bc;
+			const void *ptr = func->r.bc;
 			printf("<script function %s() %p>", name, ptr);
 		}
 
@@ -172,7 +157,7 @@ void spn_value_print(const SpnValue *val)
 	}
 	case SPN_TYPE_STRING: {
 		SpnString *s = val->v.ptrv;
-		printf("%s", s->cstr);
+		fwrite(s->cstr, 1, s->len, stdout);
 		break;
 	}
 	case SPN_TYPE_ARRAY: {
@@ -225,7 +210,8 @@ static char *read_file2mem(const char *name, size_t *sz, int nulterm)
 		return NULL;
 	}
 
-	if (fread(buf, n, 1, f) < 1) {
+	/* an empty file is not an error */
+	if (n > 0 && fread(buf, n, 1, f) < 1) {
 		fclose(f);
 		free(buf);
 		return NULL;
@@ -254,3 +240,112 @@ void *spn_read_binary_file(const char *name, size_t *sz)
 	return read_file2mem(name, sz, 0);
 }
 
+#if SPN_USE_MMAP
+
+void *spn_map_binary_file(const char *name, size_t *sz)
+{
+	struct stat st;
+	void *buf;
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	/* the mapping stays valid after the descriptor is closed */
+	close(fd);
+
+	if (buf == MAP_FAILED) {
+		return NULL;
+	}
+
+	*sz = st.st_size;
+	return buf;
+}
+
+void spn_unmap_binary_file(void *buf, size_t sz)
+{
+	munmap(buf, sz);
+}
+
+/* The terminating 0 is mapped too: the part of the last page that is past
+ * the end of the file reads as zeroes. If the file ends on a page boundary
+ * (or it is empty), there is no such part, so it is read into memory instead.
+ * spn_unmap_text_file() tells the two cases apart by the length as well.
+ */
+static int text_file_is_mapped(size_t len)
+{
+	return len % sysconf(_SC_PAGESIZE) != 0;
+}
+
+char *spn_map_text_file(const char *name, size_t *len)
+{
+	struct stat st;
+	void *buf;
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	if (!text_file_is_mapped(st.st_size)) {
+		close(fd);
+		return read_file2mem(name, len, 1);
+	}
+
+	buf = mmap(NULL, st.st_size + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (buf == MAP_FAILED) {
+		return NULL;
+	}
+
+	*len = st.st_size;
+	return buf;
+}
+
+void spn_unmap_text_file(char *buf, size_t len)
+{
+	if (text_file_is_mapped(len)) {
+		munmap(buf, len + 1);
+	} else {
+		free(buf);
+	}
+}
+
+#else	/* SPN_USE_MMAP */
+
+void *spn_map_binary_file(const char *name, size_t *sz)
+{
+	return read_file2mem(name, sz, 0);
+}
+
+void spn_unmap_binary_file(void *buf, size_t sz)
+{
+	free(buf);
+}
+
+char *spn_map_text_file(const char *name, size_t *len)
+{
+	return read_file2mem(name, len, 1);
+}
+
+void spn_unmap_text_file(char *buf, size_t len)
+{
+	free(buf);
+}
+
+#endif	/* SPN_USE_MMAP */
+
@@ -52,6 +52,8 @@ typedef signed long spn_sword;
  * to resolve the reference, and if it succeeds, it updates
  * the symbol in the local symtab, then it calls the function.
  * If the symbol cannot be resolved, a runtime error is generated.
+ * A pending string is a string constant in the local symbol table which
+ * has not been loaded yet; `v.ptrv` then points into the bytecode.
  */
 
 /* main types */
@@ -72,11 +74,13 @@ enum spn_val_flag {
 	SPN_TFLG_OBJECT		= 1 << 0,	/* type is an object type	*/
 	SPN_TFLG_FLOAT		= 1 << 1,	/* number is floating-point	*/
 	SPN_TFLG_NATIVE		= 1 << 2,	/* function is native		*/
-	SPN_TFLG_PENDING	= 1 << 3	/* unresolved (stub) function	*/
+	SPN_TFLG_PENDING	= 1 << 3,	/* unresolved (stub) function	*/
+	SPN_TFLG_REGARGS	= 1 << 4,	/* native reads args in place	*/
+	SPN_TFLG_NOFAIL		= 1 << 5	/* native never reports errors	*/
 };
 
-/* `symtabidx' is the index of the local symbol table
- * which represents the environment of the function
+/* functions are objects (see SpnFunction in func.h), so a value is not
+ * larger than a machine word plus the two tags
  */
 struct SpnValue {
 	union {
@@ -84,14 +88,6 @@ struct SpnValue {
 		long intv;			/* integer value  */
 		double fltv;			/* float value	  */
 		void *ptrv;			/* object value	  */
-		struct {
-			const char *name;	/* function name  */
-			int symtabidx;		/* environment	  */
-			union {
-				int (*fn)(SpnValue *, int, SpnValue *, void *);
-				spn_uword *bc;
-			} r;			/* representation */
-		} fnv;				/* function value */
 	} v;					/* value union	  */
 	enum spn_val_type t;			/* type	tag	  */
 	enum spn_val_flag f;			/* extra flags	  */
@@ -121,5 +117,21 @@ SPN_API char *spn_read_text_file(const char *name);
  */
 SPN_API void *spn_read_binary_file(const char *name, size_t *sz);
 
+/* like spn_read_binary_file(), but where the platform supports it, the file
+ * is mapped into memory read-only, so its pages are only loaded when they
+ * are actually used. The returned buffer must be released by calling
+ * spn_unmap_binary_file() with the size returned in `sz'.
+ */
+SPN_API void *spn_map_binary_file(const char *name, size_t *sz);
+SPN_API void spn_unmap_binary_file(void *buf, size_t sz);
+
+/* the same for text files: the contents are followed by a terminating 0, so
+ * the buffer can back an SpnString (see spn_string_new_mapped()). `len' is
+ * the length of the file, without the terminator. Release the buffer using
+ * spn_unmap_text_file().
+ */
+SPN_API char *spn_map_text_file(const char *name, size_t *len);
+SPN_API void spn_unmap_text_file(char *buf, size_t len);
+
 #endif /* SPN_SPN_H */
 
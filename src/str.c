@@ -8,10 +8,16 @@
  * Object-oriented wrapper for C strings
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <float.h>
 
 #include "str.h"
 #include "array.h"
+#include "func.h"
+#include "vm.h"
+#include "private.h"
 
 static int compare_strings(const void *l, const void *r);
 static int equal_strings(const void *l, const void *r);
@@ -24,29 +30,88 @@ static const SpnClass spn_class_string = {
 	equal_strings,
 	compare_strings,
 	hash_string,
-	free_string
+	free_string,
+	SPN_MEM_STRING,
+	1
 };
 
+/* values of the `dealloc' member: what to do with the buffer */
+enum {
+	STR_KEEP,	/* not owned by the string	*/
+	STR_FREE,	/* malloc()'d			*/
+	STR_POOL,	/* from the pool of the string	*/
+	STR_BUILT,	/* ditto, with a hidden size	*/
+	STR_UNMAP	/* see spn_map_text_file()	*/
+};
+
+/* the buffer of a string builder has room for its size after the
+ * terminator, so that it can be handed over to a string as it is
+ */
+#define SB_TRAILER	(1 + sizeof(size_t))
+
 static void free_string(void *obj)
 {
 	SpnString *str = obj;
-	if (str->dealloc) {
-		free(str->cstr);
+
+	if (str->parent != NULL) {
+		spn_object_release(str->parent);
 	}
 
-	free(str);
+	switch (str->dealloc) {
+	case STR_FREE:
+		free(str->cstr);
+		break;
+	case STR_POOL:
+		spn_mem_free(str->base.pool, SPN_MEM_STRING, str->cstr, str->len + 1);
+		break;
+	case STR_BUILT: {
+		size_t size;
+		memcpy(&size, str->cstr + str->len + 1, sizeof(size));
+		spn_mem_free(str->base.pool, SPN_MEM_STRING, str->cstr, size);
+		break;
+	}
+	case STR_UNMAP:
+		spn_unmap_text_file(str->cstr, str->len);
+		break;
+	default:
+		break;
+	}
 }
 
+/* slices need not be 0-terminated, so this can't use strcmp() */
 static int compare_strings(const void *l, const void *r)
 {
 	const SpnString *lo = l, *ro = r;
-	return strcmp(lo->cstr, ro->cstr);
+	int res = memcmp(lo->cstr, ro->cstr, lo->len < ro->len ? lo->len : ro->len);
+
+	if (res != 0) {
+		return res < 0 ? -1 : +1;
+	}
+
+	return lo->len < ro->len ? -1 : lo->len > ro->len;
 }
 
+/* interned strings are mostly compared to themselves, which is detected
+ * early. Else the lengths and the hashes (if they are already known) are
+ * cheap to compare before the contents.
+ */
 static int equal_strings(const void *l, const void *r)
 {
-	const SpnString *lo = l, *ro = r;	
-	return strcmp(lo->cstr, ro->cstr) == 0;
+	const SpnString *lo = l, *ro = r;
+
+	if (lo == ro) {
+		return 1;
+	}
+
+	if (lo->len != ro->len) {
+		return 0;
+	}
+
+	if (lo->ishashed && ro->ishashed && lo->hash != ro->hash) {
+		return 0;
+	}
+
+	return memcmp(lo->cstr, ro->cstr, lo->len) == 0;
 }
 
 /* since strings are immutable, it's enough to generate the hash on-demand,
@@ -75,49 +140,759 @@ SpnString *spn_string_new_nocopy(const char *cstr, int dealloc)
 	return spn_string_new_nocopy_len(cstr, strlen(cstr), dealloc);
 }
 
+/* sets up a new string which owns `buf`, `len` + 1 bytes from its pool */
+static void init_pooled(SpnString *str, char *buf, size_t len)
+{
+	str->dealloc = STR_POOL;
+	str->len = len;
+	str->cstr = buf;
+	str->cstr[len] = 0;
+	str->ishashed = 0;
+	str->parent = NULL;
+}
+
 SpnString *spn_string_new_len(const char *cstr, size_t len)
 {
-	char *buf = malloc(len + 1);
+	SpnString *str = spn_object_new(&spn_class_string);
+
+	init_pooled(str, spn_mem_xalloc(str->base.pool, SPN_MEM_STRING, len + 1), len);
+	memcpy(str->cstr, cstr, len); /* so that strings can hold binary data */
+
+	return str;
+}
+
+SpnString *spn_string_new_buffer(size_t len)
+{
+	SpnString *str;
+	char *buf = NULL;
+
+	/* the string will be allocated from the current pool too */
+	if (len < (size_t)(-1)) {
+		buf = spn_mem_alloc(spn_pool_get_current(), SPN_MEM_STRING, len + 1);
+	}
+
 	if (buf == NULL) {
-		abort();
+		return NULL;
 	}
 
-	memcpy(buf, cstr, len); /* so that strings can hold binary data */
-	buf[len] = 0;
+	str = spn_object_new(&spn_class_string);
+	init_pooled(str, buf, len);
 
-	return spn_string_new_nocopy_len(buf, len, 1);
+	return str;
 }
 
 SpnString *spn_string_new_nocopy_len(const char *cstr, size_t len, int dealloc)
 {
 	SpnString *str = spn_object_new(&spn_class_string);
 
-	str->dealloc = dealloc;
+	str->dealloc = dealloc ? STR_FREE : STR_KEEP;
 	str->len = len;
 	str->cstr = (char *)(cstr);
 	str->ishashed = 0;
+	str->parent = NULL;
 
 	return str;
 }
 
+SpnString *spn_string_new_mapped(const char *fname)
+{
+	SpnString *str;
+	size_t len;
+	char *buf = spn_map_text_file(fname, &len);
+
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	str = spn_string_new_nocopy_len(buf, len, 0);
+	str->dealloc = STR_UNMAP;
+
+	return str;
+}
+
+SpnString *spn_string_new_slice(SpnString *str, size_t begin, size_t len)
+{
+	SpnString *slice;
+	SpnString *owner = str->parent != NULL ? str->parent : str;
+
+	assert(begin <= str->len && len <= str->len - begin);
+
+	slice = spn_string_new_nocopy_len(str->cstr + begin, len, 0);
+	slice->parent = owner;
+	spn_object_retain(owner);
+
+	return slice;
+}
+
+/* the parent has at least one more byte after the end of any slice
+ * (its own terminator), so `cstr[len]` can always be read.
+ */
+const char *spn_string_cstr(SpnString *str)
+{
+	char *buf;
+
+	if (str->cstr[str->len] == 0) {
+		return str->cstr;
+	}
+
+	assert(str->parent != NULL);
+
+	buf = spn_mem_xalloc(str->base.pool, SPN_MEM_STRING, str->len + 1);
+	memcpy(buf, str->cstr, str->len);
+	buf[str->len] = 0;
+
+	spn_object_release(str->parent);
+	str->parent = NULL;
+	str->cstr = buf;
+	str->dealloc = STR_POOL;
+
+	return buf;
+}
+
+void spn_string_init_lookup(SpnString *str, const char *cstr, size_t len)
+{
+	str->base.isa = &spn_class_string;
+	str->base.pool = NULL;
+	str->base.refcnt = 1;
+
+	str->dealloc = STR_KEEP;
+	str->len = len;
+	str->cstr = (char *)(cstr);
+	str->ishashed = 0;
+	str->parent = NULL;
+}
+
 SpnString *spn_string_concat(SpnString *lhs, SpnString *rhs)
 {
-	size_t len = lhs->len + rhs->len;
+	SpnString *str = spn_string_new_buffer(lhs->len + rhs->len);
 
-	char *buf = malloc(len + 1);
+	if (str == NULL) {
+		return NULL;
+	}
+
+	memcpy(str->cstr, lhs->cstr, lhs->len);
+	memcpy(str->cstr + lhs->len, rhs->cstr, rhs->len);
+
+	return str;
+}
+
+/*
+ * String builder
+ */
+
+static void free_strbuilder(void *obj)
+{
+	SpnStringBuilder *sb = obj;
+	spn_mem_free(sb->base.pool, SPN_MEM_STRING, sb->buf, sb->cap);
+}
+
+static const SpnClass spn_class_strbuilder = {
+	"string builder",
+	sizeof(SpnStringBuilder),
+	NULL,
+	NULL,
+	NULL,
+	free_strbuilder,
+	SPN_MEM_STRING,
+	1
+};
+
+SpnStringBuilder *spn_strbuilder_new()
+{
+	SpnStringBuilder *sb = spn_object_new(&spn_class_strbuilder);
+
+	sb->buf = NULL;
+	sb->len = 0;
+	sb->cap = 0;
+	sb->failed = 0;
+
+	return sb;
+}
+
+SpnStringBuilder *spn_value_strbuilder(const SpnValue *val)
+{
+	if (val->t == SPN_TYPE_USRDAT
+	 && val->f & SPN_TFLG_OBJECT
+	 && ((SpnObject *)(val->v.ptrv))->isa == &spn_class_strbuilder) {
+		return val->v.ptrv;
+	}
+
+	return NULL;
+}
+
+/* SB_TRAILER bytes more than what's asked for are always kept free, so
+ * that finishing the string never needs to reallocate for the terminator
+ * and the size
+ */
+int spn_strbuilder_reserve(SpnStringBuilder *sb, size_t n)
+{
+	size_t cap;
+	char *buf;
+
+	if (sb->failed) {
+		return -1;
+	}
+
+	if (sb->cap - sb->len >= n + SB_TRAILER) {
+		return 0;
+	}
+
+	/* doubling the capacity must not overflow */
+	if (n > (size_t)(-1) / 2 - sb->len - SB_TRAILER) {
+		sb->failed = 1;
+		return -1;
+	}
+
+	cap = sb->cap > 0 ? sb->cap : 32;
+	while (cap - sb->len < n + SB_TRAILER) {
+		cap *= 2;
+	}
+
+	buf = spn_mem_realloc(sb->base.pool, SPN_MEM_STRING, sb->buf, sb->cap, cap);
 	if (buf == NULL) {
-		abort();
+		sb->failed = 1;
+		return -1;
 	}
 
-	strcpy(buf, lhs->cstr);
-	strcpy(buf + lhs->len, rhs->cstr);
+	sb->buf = buf;
+	sb->cap = cap;
+
+	return 0;
+}
+
+char *spn_strbuilder_extend(SpnStringBuilder *sb, size_t n)
+{
+	char *p;
+
+	if (spn_strbuilder_reserve(sb, n) != 0) {
+		return NULL;
+	}
+
+	p = sb->buf + sb->len;
+	sb->len += n;
+
+	return p;
+}
+
+void spn_strbuilder_append(SpnStringBuilder *sb, const char *buf, size_t len)
+{
+	char *p;
+
+	if (len > 0 && (p = spn_strbuilder_extend(sb, len)) != NULL) {
+		memcpy(p, buf, len);
+	}
+}
+
+void spn_strbuilder_append_string(SpnStringBuilder *sb, SpnString *str)
+{
+	spn_strbuilder_append(sb, str->cstr, str->len);
+}
+
+/* sprintf() is used for formatting numbers. The buffers are large enough
+ * for any integer or pointer, and for floating-point numbers printed using
+ * the `%g' or `%e' conversions. The `%f' conversion is taken care of
+ * separately, since it prints all the digits before the decimal point.
+ */
+#define NUMBUF_SIZE 128
 
-	return spn_string_new_nocopy_len(buf, len, 1);
+void spn_strbuilder_append_int(SpnStringBuilder *sb, long n)
+{
+	char buf[NUMBUF_SIZE];
+	spn_strbuilder_append(sb, buf, sprintf(buf, "%ld", n));
+}
+
+void spn_strbuilder_append_float(SpnStringBuilder *sb, double x)
+{
+	char buf[NUMBUF_SIZE];
+	spn_strbuilder_append(sb, buf, sprintf(buf, "%.*g", DBL_DIG, x));
+}
+
+static void append_cstr(SpnStringBuilder *sb, const char *str)
+{
+	spn_strbuilder_append(sb, str, strlen(str));
+}
+
+static void append_ptr(SpnStringBuilder *sb, const char *prefix, const void *ptr)
+{
+	char buf[NUMBUF_SIZE];
+
+	append_cstr(sb, prefix);
+	spn_strbuilder_append(sb, buf, sprintf(buf, "%p>", ptr));
+}
+
+/* keep this in sync with spn_value_print() */
+void spn_strbuilder_append_value(SpnStringBuilder *sb, const SpnValue *val)
+{
+	switch (val->t) {
+	case SPN_TYPE_NIL:
+		append_cstr(sb, "nil");
+		break;
+	case SPN_TYPE_BOOL:
+		append_cstr(sb, val->v.boolv ? "true" : "false");
+		break;
+	case SPN_TYPE_NUMBER:
+		if (val->f & SPN_TFLG_FLOAT) {
+			spn_strbuilder_append_float(sb, val->v.fltv);
+		} else {
+			spn_strbuilder_append_int(sb, val->v.intv);
+		}
+
+		break;
+	case SPN_TYPE_FUNC: {
+		SpnFunction *func = val->v.ptrv;
+		const char *name = func->name ? func->name : SPN_LAMBDA_NAME;
+
+		if (val->f & SPN_TFLG_NATIVE) {
+			append_cstr(sb, "<native function ");
+			append_cstr(sb, name);
+			append_cstr(sb, "()>");
+		} else {
+			append_cstr(sb, "<script function ");
+			append_cstr(sb, name);
+			append_ptr(sb, "() ", func->r.bc);
+		}
+
+		break;
+	}
+	case SPN_TYPE_STRING:
+		spn_strbuilder_append_string(sb, val->v.ptrv);
+		break;
+	case SPN_TYPE_ARRAY:
+		append_ptr(sb, "<array ", val->v.ptrv);
+		break;
+	case SPN_TYPE_USRDAT:
+		append_ptr(sb, "<userdata ", val->v.ptrv);
+		break;
+	default:
+		SHANT_BE_REACHED();
+		break;
+	}
+}
+
+SpnString *spn_strbuilder_finish(SpnStringBuilder *sb)
+{
+	SpnString *str;
+	SpnPool *prev;
+
+	/* there's always room for the terminator and the size, except if
+	 * the builder has never allocated a buffer. The string must live in
+	 * the same pool as the buffer.
+	 */
+	if (sb->buf == NULL) {
+		sb->cap = 32;
+		sb->buf = spn_mem_xalloc(sb->base.pool, SPN_MEM_STRING, sb->cap);
+	}
+
+	sb->buf[sb->len] = 0;
+	memcpy(sb->buf + sb->len + 1, &sb->cap, sizeof(sb->cap));
+
+	prev = spn_pool_set_current(sb->base.pool);
+	str = spn_string_new_nocopy_len(sb->buf, sb->len, 0);
+	str->dealloc = STR_BUILT;
+	spn_pool_set_current(prev);
+
+	sb->buf = NULL;
+	sb->len = 0;
+	sb->cap = 0;
+	sb->failed = 0;
+
+	return str;
+}
+
+/*
+ * Formatting
+ */
+
+/* a parsed conversion specification */
+typedef struct FormatSpec {
+	int	 sign;		/* `+': always print the sign		*/
+	int	 expsign;	/* `+' after the precision		*/
+	long	 width;		/* -1 if not specified			*/
+	long	 prec;		/* -1 if not specified			*/
+	char	 conv;		/* the conversion character		*/
+} FormatSpec;
+
+/* reads a width or a precision, which is either a decimal number or `*'.
+ * Returns zero on error.
+ */
+static int format_number(const char **fmt, long *num, int *argidx, int argc, SpnValue *argv)
+{
+	const char *p = *fmt;
+
+	if (*p == '*') {
+		SpnValue *arg;
+
+		if (*argidx >= argc) {
+			return 0;
+		}
+
+		arg = &argv[(*argidx)++];
+		if (arg->t != SPN_TYPE_NUMBER || arg->f != 0) {
+			return 0;
+		}
+
+		/* a negative width or precision is treated as if omitted */
+		*num = arg->v.intv >= 0 ? arg->v.intv : -1;
+		*fmt = p + 1;
+		return 1;
+	}
+
+	if (*p >= '0' && *p <= '9') {
+		*num = 0;
+
+		while (*p >= '0' && *p <= '9') {
+			if (*num > (LONG_MAX - 9) / 10) {
+				return 0;
+			}
+
+			*num = 10 * *num + (*p++ - '0');
+		}
+	}
+
+	*fmt = p;
+	return 1;
+}
+
+/* pads what has been appended since `start` with spaces on the left */
+static void format_pad(SpnStringBuilder *sb, size_t start, long width)
+{
+	size_t n = sb->len - start;
+
+	if (width > 0 && (size_t)(width) > n) {
+		size_t pad = width - n;
+
+		if (spn_strbuilder_extend(sb, pad) == NULL) {
+			return;
+		}
+
+		memmove(sb->buf + start + pad, sb->buf + start, n);
+		memset(sb->buf + start, ' ', pad);
+	}
+}
+
+static int format_int(SpnStringBuilder *sb, const FormatSpec *spec, const SpnValue *arg)
+{
+	char buf[NUMBUF_SIZE];
+	char *p;
+	unsigned long u;
+	long n;
+	size_t start = sb->len;
+
+	if (arg->t != SPN_TYPE_NUMBER) {
+		return -1;
+	}
+
+	if (arg->f & SPN_TFLG_FLOAT) {
+		double x = arg->v.fltv;
+
+		/* this is false for NaN too */
+		if (!(x >= LONG_MIN && x < LONG_MAX + 1.0)) {
+			return -1;
+		}
+
+		n = (long)(x);
+	} else {
+		n = arg->v.intv;
+	}
+
+	switch (spec->conv) {
+	case 'd':
+		spn_strbuilder_append(sb, buf, sprintf(buf, spec->sign ? "%+ld" : "%ld", n));
+		break;
+	case 'o':
+	case 'x':
+	case 'X': {
+		const char *fmt = spec->conv == 'o' ? "%lo" : spec->conv == 'x' ? "%lx" : "%lX";
+
+		if (spec->sign) {
+			spn_strbuilder_append(sb, "+", 1);
+		}
+
+		spn_strbuilder_append(sb, buf, sprintf(buf, fmt, (unsigned long)(n)));
+		break;
+	}
+	case 'b':
+		if (spec->sign) {
+			spn_strbuilder_append(sb, "+", 1);
+		}
+
+		/* digits are generated backwards, from the end of the buffer */
+		u = n;
+		p = buf + sizeof(buf);
+
+		do {
+			*--p = '0' + (u & 1);
+			u >>= 1;
+		} while (u != 0);
+
+		spn_strbuilder_append(sb, p, buf + sizeof(buf) - p);
+		break;
+	default:
+		SHANT_BE_REACHED();
+	}
+
+	format_pad(sb, start, spec->width);
+	return 0;
+}
+
+/* removes the leading zeroes, and unless requested, the plus sign of the
+ * exponent that sprintf() writes, so `1.5e+03' becomes `1.5e3'
+ */
+static size_t format_exponent(char *buf, size_t n, int expsign)
+{
+	char *e = strchr(buf, 'e');
+	char *src, *dst;
+
+	if (e == NULL) {
+		/* "inf" or "nan" */
+		return n;
+	}
+
+	src = dst = e + 1;
+
+	if (*src == '-' || (*src == '+' && expsign)) {
+		dst++;
+	}
+
+	if (*src == '-' || *src == '+') {
+		src++;
+	}
+
+	while (*src == '0' && src[1] != 0) {
+		src++;
+	}
+
+	while (*src != 0) {
+		*dst++ = *src++;
+	}
+
+	*dst = 0;
+	return dst - buf;
+}
+
+static int format_float(SpnStringBuilder *sb, const FormatSpec *spec, const SpnValue *arg)
+{
+	char fmt[8], *p = fmt;
+	size_t start = sb->len, n;
+	long prec = spec->prec >= 0 ? spec->prec : 6;
+	double x;
+
+	if (arg->t != SPN_TYPE_NUMBER) {
+		return -1;
+	}
+
+	x = arg->f & SPN_TFLG_FLOAT ? arg->v.fltv : arg->v.intv;
+
+	/* the precision must fit into the `int' argument of sprintf() */
+	if (prec > INT_MAX - DBL_MAX_10_EXP - NUMBUF_SIZE) {
+		return -1;
+	}
+
+	*p++ = '%';
+	if (spec->sign) {
+		*p++ = '+';
+	}
+
+	*p++ = '.';
+	*p++ = '*';
+	*p++ = spec->conv;
+	*p = 0;
+
+	/* the digits before the decimal point of an `f' conversion, as well as
+	 * the ones after it, are written straight into the builder
+	 */
+	p = spn_strbuilder_extend(sb, DBL_MAX_10_EXP + NUMBUF_SIZE + prec);
+	if (p == NULL) {
+		return -1;
+	}
+
+	n = sprintf(p, fmt, (int)(prec), x);
+
+	if (spec->conv == 'e') {
+		n = format_exponent(p, n, spec->expsign);
+	}
+
+	sb->len = start + n;
+
+	format_pad(sb, start, spec->width);
+	return 0;
+}
+
+static void format_escaped(SpnStringBuilder *sb, const char *str, size_t len)
+{
+	size_t i;
+
+	spn_strbuilder_append(sb, "\"", 1);
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+		char esc[8];
+
+		switch (c) {
+		case '\\': spn_strbuilder_append(sb, "\\\\", 2); break;
+		case '"':  spn_strbuilder_append(sb, "\\\"", 2); break;
+		case '\a': spn_strbuilder_append(sb, "\\a", 2);  break;
+		case '\b': spn_strbuilder_append(sb, "\\b", 2);  break;
+		case '\f': spn_strbuilder_append(sb, "\\f", 2);  break;
+		case '\n': spn_strbuilder_append(sb, "\\n", 2);  break;
+		case '\r': spn_strbuilder_append(sb, "\\r", 2);  break;
+		case '\t': spn_strbuilder_append(sb, "\\t", 2);  break;
+		case '\v': spn_strbuilder_append(sb, "\\v", 2);  break;
+		default:
+			if (c < 0x20 || c >= 0x7f) {
+				spn_strbuilder_append(sb, esc, sprintf(esc, "\\x%02x", c));
+			} else {
+				spn_strbuilder_append(sb, (const char *)(&c), 1);
+			}
+
+			break;
+		}
+	}
+
+	spn_strbuilder_append(sb, "\"", 1);
+}
+
+static int format_conversion(SpnStringBuilder *sb, const FormatSpec *spec, const SpnValue *arg)
+{
+	size_t start = sb->len;
+
+	switch (spec->conv) {
+	case 's':
+		spn_strbuilder_append_value(sb, arg);
+
+		/* the width is the maximal number of characters */
+		if (spec->width >= 0 && sb->len - start > (size_t)(spec->width)) {
+			sb->len = start + spec->width;
+		}
+
+		return 0;
+	case 'q': {
+		SpnString *str;
+		size_t len;
+
+		if (arg->t != SPN_TYPE_STRING) {
+			return -1;
+		}
+
+		str = arg->v.ptrv;
+		len = str->len;
+
+		if (spec->width >= 0 && len > (size_t)(spec->width)) {
+			len = spec->width;
+		}
+
+		format_escaped(sb, str->cstr, len);
+		return 0;
+	}
+	case 'B':
+		if (arg->t != SPN_TYPE_BOOL) {
+			return -1;
+		}
+
+		append_cstr(sb, arg->v.boolv ? "true" : "false");
+		return 0;
+	case 'd':
+	case 'o':
+	case 'x':
+	case 'X':
+	case 'b':
+		return format_int(sb, spec, arg);
+	case 'f':
+	case 'e':
+		return format_float(sb, spec, arg);
+	default:
+		/* unknown conversion specifier */
+		return -1;
+	}
+}
+
+int spn_strbuilder_format(SpnStringBuilder *sb, const char *fmt, int argc, SpnValue *argv)
+{
+	int argidx = 0;
+
+	while (*fmt != 0) {
+		FormatSpec spec;
+		const char *pct = strchr(fmt, '%');
+
+		/* copy the literal part */
+		if (pct == NULL) {
+			append_cstr(sb, fmt);
+			break;
+		}
+
+		spn_strbuilder_append(sb, fmt, pct - fmt);
+		fmt = pct + 1;
+
+		if (*fmt == '%') {
+			spn_strbuilder_append(sb, "%", 1);
+			fmt++;
+			continue;
+		}
+
+		/* parse the conversion specification */
+		spec.sign = 0;
+		spec.expsign = 0;
+		spec.width = -1;
+		spec.prec = -1;
+
+		if (*fmt == '+') {
+			spec.sign = 1;
+			fmt++;
+		}
+
+		if (!format_number(&fmt, &spec.width, &argidx, argc, argv)) {
+			return -1;
+		}
+
+		if (*fmt == '.') {
+			fmt++;
+			spec.prec = 0;
+
+			if (!format_number(&fmt, &spec.prec, &argidx, argc, argv)) {
+				return -1;
+			}
+		}
+
+		if (*fmt == '+') {
+			spec.expsign = 1;
+			fmt++;
+		}
+
+		spec.conv = *fmt;
+		if (spec.conv == 0 || argidx >= argc) {
+			return -1;
+		}
+
+		fmt++;
+
+		if (format_conversion(sb, &spec, &argv[argidx++]) != 0) {
+			return -1;
+		}
+	}
+
+	return sb->failed ? -1 : 0;
 }
 
-/* TODO: implement this */
 char *spn_string_format(const char *fmt, size_t *len, int argc, SpnValue *argv)
 {
-	return NULL;
+	SpnStringBuilder *sb = spn_strbuilder_new();
+	char *buf = NULL;
+
+	/* the buffer of the builder belongs to its pool, but the caller
+	 * expects to free() the result
+	 */
+	if (spn_strbuilder_format(sb, fmt, argc, argv) == 0) {
+		buf = malloc(sb->len + 1);
+		if (buf == NULL) {
+			abort();
+		}
+
+		memcpy(buf, sb->buf, sb->len);
+		buf[sb->len] = 0;
+		*len = sb->len;
+	}
+
+	spn_object_release(sb);
+	return buf;
 }
 
@@ -16,6 +16,10 @@
 #include "spn.h"
 #include "object.h"
 
+/* `cstr` points to `len` bytes. It is 0-terminated, except if the string is
+ * a slice (see spn_string_new_slice()) which ends before its parent does:
+ * code that needs a C string should use spn_string_cstr().
+ */
 typedef struct SpnString {
 	SpnObject	 base;		/* private		*/
 	char		*cstr;		/* public, readonly	*/
@@ -23,6 +27,7 @@ typedef struct SpnString {
 	int		 dealloc;	/* private		*/
 	int		 ishashed;	/* private		*/
 	unsigned long	 hash;		/* private		*/
+	struct SpnString *parent;	/* private		*/
 } SpnString;
 
 /* these create an SpnString object. "nocopy" versions don't copy the
@@ -35,15 +40,108 @@ SPN_API	SpnString	*spn_string_new_nocopy(const char *cstr, int dealloc);
 SPN_API	SpnString	*spn_string_new_len(const char *cstr, size_t len);
 SPN_API	SpnString	*spn_string_new_nocopy_len(const char *cstr, size_t len, int dealloc);
 
+/* creates a string of `len` bytes, which are not initialized (except for
+ * the 0 terminator after them), so that the caller can fill them in through
+ * `cstr` before using the string. The buffer comes from the pool of the new
+ * string (see spn_mem_alloc()), like the buffers of the strings created by
+ * the other functions which copy bytes. Unlike those, it returns NULL if
+ * the buffer can't be allocated (e. g. because of the memory limit), since
+ * `len` usually comes from a script.
+ */
+SPN_API	SpnString	*spn_string_new_buffer(size_t len);
+
+/* creates a string with the contents of a file, which is mapped into memory
+ * (where the platform supports it) instead of being read, so only the pages
+ * that are actually used are loaded. The mapping is released along with the
+ * string. The file must not be truncated while the string is alive. Returns
+ * NULL if the file can't be opened or if it is not a regular file.
+ */
+SPN_API	SpnString	*spn_string_new_mapped(const char *fname);
+
+/* creates a string that consists of `len` bytes of `str`, starting at
+ * `begin`, without copying them: the slice retains its parent (or rather,
+ * the string which owns the bytes, if `str` is a slice itself) instead.
+ * The range must be within `str`.
+ */
+SPN_API	SpnString	*spn_string_new_slice(SpnString *str, size_t begin, size_t len);
+
+/* returns the contents of the string as a 0-terminated C string. For a slice
+ * that isn't 0-terminated, this copies its bytes into a buffer owned by the
+ * slice, which then releases its parent.
+ */
+SPN_API	const char	*spn_string_cstr(SpnString *str);
+
+/* initializes a string with automatic or static storage duration, without
+ * copying the buffer. Such a string can be used as a key for looking up
+ * values in an array without allocating a new object. It must never be
+ * retained or released, so it must not be stored anywhere either.
+ */
+SPN_API void		 spn_string_init_lookup(SpnString *str, const char *cstr, size_t len);
+
 /* appends rhs to the end of lhs and returns the result.
- * the original strings aren't modified.
+ * the original strings aren't modified. Returns NULL if the result can't
+ * be allocated, like spn_string_new_buffer().
  */
 SPN_API SpnString	*spn_string_concat(SpnString *lhs, SpnString *rhs);
 
-/* Creates a formatted string.
- * The format specifiers are documented in doc/stdlib.md.
+/* Creates a formatted string. The format specifiers are documented in
+ * doc/stdlib.md. Returns a buffer allocated using malloc() and sets `*len`
+ * to its length (not including the 0 terminator), or returns NULL if the
+ * format string is invalid or the arguments don't match it.
  */
 SPN_API char		*spn_string_format(const char *fmt, size_t *len, int argc, SpnValue *argv);
 
+/* A string builder accumulates the pieces of a string in a buffer which
+ * grows exponentially, so that appending costs amortized constant time
+ * per byte. A builder is an object, so it can be passed to scripts as
+ * an object-typed user data value.
+ */
+typedef struct SpnStringBuilder {
+	SpnObject	 base;		/* private		*/
+	char		*buf;		/* private		*/
+	size_t		 len;		/* public, readonly	*/
+	size_t		 cap;		/* private		*/
+	int		 failed;	/* public, readonly	*/
+} SpnStringBuilder;
+
+SPN_API	SpnStringBuilder *spn_strbuilder_new();
+
+/* returns the builder if `val` is one (an object-typed user data), or NULL */
+SPN_API	SpnStringBuilder *spn_value_strbuilder(const SpnValue *val);
+
+/* ensures that `n` more bytes can be appended without reallocating.
+ * Returns zero on success. If the buffer can't grow (see spn_mem_realloc()),
+ * it returns nonzero and sets `failed`; from then on, nothing more can be
+ * appended (the functions below do nothing) until the builder is finished,
+ * so the contents are incomplete. `failed` is to be checked before that.
+ */
+SPN_API	int		 spn_strbuilder_reserve(SpnStringBuilder *sb, size_t n);
+
+/* appending raw bytes, strings, numbers (formatted like print() does) and
+ * the description of any value (the same as what print() writes)
+ */
+SPN_API	void		 spn_strbuilder_append(SpnStringBuilder *sb, const char *buf, size_t len);
+SPN_API	void		 spn_strbuilder_append_string(SpnStringBuilder *sb, SpnString *str);
+SPN_API	void		 spn_strbuilder_append_int(SpnStringBuilder *sb, long n);
+SPN_API	void		 spn_strbuilder_append_float(SpnStringBuilder *sb, double x);
+SPN_API	void		 spn_strbuilder_append_value(SpnStringBuilder *sb, const SpnValue *val);
+
+/* appends formatted arguments (see spn_string_format()). Returns zero on
+ * success, nonzero on error (including `failed` being set), in which case
+ * the contents of the builder are unspecified.
+ */
+SPN_API	int		 spn_strbuilder_format(SpnStringBuilder *sb, const char *fmt, int argc, SpnValue *argv);
+
+/* appends `n` uninitialized bytes, and returns a pointer to them, so
+ * that the caller can fill them in place (or NULL, see `failed`)
+ */
+SPN_API	char		*spn_strbuilder_extend(SpnStringBuilder *sb, size_t n);
+
+/* returns the contents as a string, then empties the builder (clearing
+ * `failed` too), which can be reused afterwards. The buffer is handed over to the string (which is
+ * created in the pool of the builder), so the bytes are not copied.
+ */
+SPN_API	SpnString	*spn_strbuilder_finish(SpnStringBuilder *sb);
+
 #endif /* SPN_STR_H */
 
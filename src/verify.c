@@ -0,0 +1,522 @@
+/*
+ * verify.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Load-time verifier for Sparkling bytecode
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "verify.h"
+#include "vm.h"
+#include "private.h"
+
+/* register indices are 8-bit operands */
+#define MAX_REGS	256
+
+/* flags of the words of the code */
+enum {
+	WORD_INSN	= 1 << 0,	/* first word of an instruction	*/
+	WORD_LAMBDA	= 1 << 1	/* header of a lambda function	*/
+};
+
+/* the operands of an instruction which are register indices */
+enum {
+	REG_A		= 1 << 0,
+	REG_B		= 1 << 1,
+	REG_C		= 1 << 2
+};
+
+/* the body of a function, or the top-level code of the program */
+typedef struct TScope {
+	size_t		 begin;		/* offset of the first instruction	*/
+	size_t		 end;		/* one past the last word		*/
+	size_t		 last;		/* offset of the last instruction seen	*/
+	spn_uword	 nregs;
+} TScope;
+
+/* jump targets can only be checked once all the code has been seen */
+typedef struct TJump {
+	size_t		 site;		/* offset of the jump instruction	*/
+	size_t		 target;
+} TJump;
+
+typedef struct TVerifier {
+	spn_uword	*bc;
+	size_t		 len;
+	size_t		 codeend;	/* offset of the symbol table		*/
+	size_t		 nsyms;
+	size_t		*syms;		/* offset of each symbol table entry	*/
+	unsigned char	*flags;		/* WORD_* flags of each word of code	*/
+	size_t		*owner;		/* `begin' of the body of each insn	*/
+	TScope		*scopes;	/* the stack of nested function bodies	*/
+	size_t		 nscopes;
+	size_t		 scopeallsz;
+	TJump		*jumps;
+	size_t		 njumps;
+	size_t		 jumpallsz;
+	const char	*errmsg;
+	size_t		 erraddr;
+} TVerifier;
+
+static int fail(TVerifier *v, size_t addr, const char *errmsg)
+{
+	v->errmsg = errmsg;
+	v->erraddr = addr;
+	return -1;
+}
+
+static void *grow(void *buf, size_t *allsz, size_t elsize)
+{
+	*allsz = *allsz == 0 ? 16 : *allsz * 2;
+
+	buf = realloc(buf, *allsz * elsize);
+	if (buf == NULL) {
+		abort();
+	}
+
+	return buf;
+}
+
+/* checks that `nbytes` bytes of text and a terminating NUL, padded to
+ * whole words and starting at word `off`, fit before word `limit`, and
+ * that the text doesn't contain a NUL byte
+ */
+static int string_ok(TVerifier *v, size_t off, size_t limit, size_t nbytes)
+{
+	const char *str = (const char *)(v->bc + off);
+
+	if (ROUNDUP(nbytes + 1, sizeof(spn_uword)) > limit - off) {
+		return 0;
+	}
+
+	return memchr(str, 0, nbytes) == NULL && str[nbytes] == 0;
+}
+
+static int verify_header(TVerifier *v)
+{
+	spn_uword *bc = v->bc;
+
+	if (v->len < SPN_PRGHDR_LEN) {
+		return fail(v, 0, "bytecode is too short");
+	}
+
+	if (bc[SPN_HDRIDX_MAGIC] != SPN_MAGIC) {
+		return fail(v, SPN_HDRIDX_MAGIC, "wrong magic number");
+	}
+
+	/* the top-level code must not be empty, it ends with a return */
+	if (bc[SPN_HDRIDX_SYMTABOFF] <= SPN_PRGHDR_LEN || bc[SPN_HDRIDX_SYMTABOFF] > v->len) {
+		return fail(v, SPN_HDRIDX_SYMTABOFF, "symbol table offset out of range");
+	}
+
+	if (bc[SPN_HDRIDX_FRMSIZE] > MAX_REGS) {
+		return fail(v, SPN_HDRIDX_FRMSIZE, "too many registers");
+	}
+
+	v->codeend = bc[SPN_HDRIDX_SYMTABOFF];
+	v->nsyms = bc[SPN_HDRIDX_SYMTABLEN];
+
+	/* each entry takes at least one word */
+	if (v->nsyms > v->len - v->codeend) {
+		return fail(v, SPN_HDRIDX_SYMTABLEN, "symbol table is truncated");
+	}
+
+	return 0;
+}
+
+static int verify_symtab(TVerifier *v)
+{
+	size_t off = v->codeend;
+	size_t i;
+
+	for (i = 0; i < v->nsyms; i++) {
+		spn_uword ins;
+
+		if (off >= v->len) {
+			return fail(v, off, "symbol table is truncated");
+		}
+
+		ins = v->bc[off];
+		v->syms[i] = off;
+
+		switch (OPCODE(ins)) {
+		case SPN_LOCSYM_STRCONST:
+		case SPN_LOCSYM_FUNCSTUB:
+			if (!string_ok(v, off + 1, v->len, OPLONG(ins))) {
+				return fail(v, off, "malformed string in symbol table");
+			}
+
+			off += 1 + ROUNDUP(OPLONG(ins) + 1, sizeof(spn_uword));
+			break;
+		case SPN_LOCSYM_LAMBDA:
+			/* the header it points to is checked by verify_refs() */
+			off++;
+			break;
+		default:
+			return fail(v, off, "invalid kind of symbol");
+		}
+	}
+
+	return 0;
+}
+
+static int check_regs(TVerifier *v, const TScope *s, size_t i, int mask)
+{
+	spn_uword ins = v->bc[i];
+
+	if ((mask & REG_A && OPA(ins) >= s->nregs)
+	 || (mask & REG_B && OPB(ins) >= s->nregs)
+	 || (mask & REG_C && OPC(ins) >= s->nregs)) {
+		return fail(v, i, "register index out of range");
+	}
+
+	return 0;
+}
+
+/* the register indices of the `n` operands following CALL and CONCAT_ALL */
+static int check_reglist(TVerifier *v, const TScope *s, size_t i, int n)
+{
+	int k;
+
+	for (k = 0; k < n; k++) {
+		if ((spn_uword)(nth_arg_idx(v->bc + i + 1, k)) >= s->nregs) {
+			return fail(v, i, "register index out of range");
+		}
+	}
+
+	return 0;
+}
+
+static int check_symbol(TVerifier *v, size_t i, spn_uword symidx, int kind)
+{
+	if (symidx >= v->nsyms) {
+		return fail(v, i, "symbol index out of range");
+	}
+
+	if (kind >= 0 && OPCODE(v->bc[v->syms[symidx]]) != (spn_uword)(kind)) {
+		return fail(v, i, "symbol is of the wrong kind");
+	}
+
+	return 0;
+}
+
+/* records the jump of instruction `i`, the offset of which is the word at
+ * `offidx` and is relative to the end of that word
+ */
+static int add_jump(TVerifier *v, size_t i, size_t offidx)
+{
+	spn_sword offset = v->bc[offidx];
+	size_t target = offidx + 1 + (size_t)(offset);
+
+	if (target >= v->codeend) {
+		return fail(v, i, "jump target out of range");
+	}
+
+	if (v->njumps >= v->jumpallsz) {
+		v->jumps = grow(v->jumps, &v->jumpallsz, sizeof(v->jumps[0]));
+	}
+
+	v->jumps[v->njumps].site = i;
+	v->jumps[v->njumps].target = target;
+	v->njumps++;
+
+	return 0;
+}
+
+/* the name and the header of a function; `n` is the length of GLBSYM */
+static int check_function(TVerifier *v, const TScope *s, size_t i, size_t n)
+{
+	spn_uword *bc = v->bc;
+	size_t hdr = i + n - SPN_FUNCHDR_LEN;
+	spn_uword bodylen = bc[hdr + SPN_FUNCHDR_IDX_BODYLEN];
+	spn_uword argc = bc[hdr + SPN_FUNCHDR_IDX_ARGC];
+	spn_uword nregs = bc[hdr + SPN_FUNCHDR_IDX_NREGS];
+
+	if (!string_ok(v, i + 1, hdr, OPLONG(bc[i]))) {
+		return fail(v, i, "malformed function name");
+	}
+
+	if (nregs > MAX_REGS) {
+		return fail(v, i, "too many registers");
+	}
+
+	if (argc > nregs) {
+		return fail(v, i, "more arguments than registers");
+	}
+
+	if (bodylen == 0 || bodylen > s->end - (i + n)) {
+		return fail(v, i, "function body length out of range");
+	}
+
+	if (strcmp((const char *)(bc + i + 1), SPN_LAMBDA_NAME) == 0) {
+		v->flags[hdr] |= WORD_LAMBDA;
+	}
+
+	return 0;
+}
+
+/* checks the instruction at `i` of the function `s`. Returns its length,
+ * or 0 if it's invalid.
+ */
+static size_t verify_insn(TVerifier *v, const TScope *s, size_t i)
+{
+	spn_uword *bc = v->bc;
+	spn_uword ins = bc[i];
+	int opcode = OPCODE(ins);
+	size_t n;
+	int err;
+
+	if (opcode >= SPN_INS_COUNT) {
+		fail(v, i, "illegal instruction");
+		return 0;
+	}
+
+	n = insn_length(bc, i);
+	if (n > s->end - i) {
+		fail(v, i, "instruction extends past the end of its function");
+		return 0;
+	}
+
+	v->flags[i] |= WORD_INSN;
+	v->owner[i] = s->begin;
+
+	switch (opcode) {
+	case SPN_INS_CALL:
+	case SPN_INS_TAILCALL:
+		err = check_regs(v, s, i, REG_A | REG_B)
+		   || check_reglist(v, s, i, OPC(ins));
+		break;
+	case SPN_INS_RET:
+	case SPN_INS_INC:
+	case SPN_INS_DEC:
+	case SPN_INS_NEWARR:
+		err = check_regs(v, s, i, REG_A);
+		break;
+	case SPN_INS_JMP:
+		err = add_jump(v, i, i + 1);
+		break;
+	case SPN_INS_JZE:
+	case SPN_INS_JNZ:
+		err = check_regs(v, s, i, REG_A) || add_jump(v, i, i + 1);
+		break;
+	case SPN_INS_EQ:
+	case SPN_INS_NE:
+	case SPN_INS_LT:
+	case SPN_INS_LE:
+	case SPN_INS_GT:
+	case SPN_INS_GE:
+	case SPN_INS_ADD:
+	case SPN_INS_SUB:
+	case SPN_INS_MUL:
+	case SPN_INS_DIV:
+	case SPN_INS_MOD:
+	case SPN_INS_AND:
+	case SPN_INS_OR:
+	case SPN_INS_XOR:
+	case SPN_INS_SHL:
+	case SPN_INS_SHR:
+	case SPN_INS_CONCAT:
+	case SPN_INS_ARRGET:
+	case SPN_INS_ARRSET:
+		err = check_regs(v, s, i, REG_A | REG_B | REG_C);
+		break;
+	case SPN_INS_NEG:
+	case SPN_INS_BITNOT:
+	case SPN_INS_LOGNOT:
+	case SPN_INS_SIZEOF:
+	case SPN_INS_TYPEOF:
+	case SPN_INS_MOV:
+	case SPN_INS_NTHARG:
+	case SPN_INS_ADDI:
+		err = check_regs(v, s, i, REG_A | REG_B);
+		break;
+	case SPN_INS_LDCONST:
+		err = check_regs(v, s, i, REG_A);
+
+		if (err == 0 && OPB(ins) > SPN_CONST_FLOAT) {
+			err = fail(v, i, "invalid kind of constant");
+		}
+
+		break;
+	case SPN_INS_LDSYM:
+		err = check_regs(v, s, i, REG_A) || check_symbol(v, i, OPMID(ins), -1);
+		break;
+	case SPN_INS_GLBSYM:
+		err = check_function(v, s, i, n);
+		break;
+	case SPN_INS_JEQ:
+	case SPN_INS_JNE:
+	case SPN_INS_JLT:
+	case SPN_INS_JLE:
+	case SPN_INS_JGT:
+	case SPN_INS_JGE:
+		err = check_regs(v, s, i, REG_A | REG_B) || add_jump(v, i, i + 1);
+		break;
+	case SPN_INS_CONCAT_ALL:
+		err = check_regs(v, s, i, REG_A) || check_reglist(v, s, i, OPB(ins));
+		break;
+	case SPN_INS_FLDGET:
+	case SPN_INS_FLDSET:
+		err = check_regs(v, s, i, REG_A | REG_B)
+		   || check_symbol(v, i, bc[i + 1], SPN_LOCSYM_STRCONST);
+
+		/* there can't be more caches than field accesses */
+		if (err == 0 && bc[i + 2] >= v->codeend) {
+			err = fail(v, i, "inline cache index out of range");
+		}
+
+		break;
+	case SPN_INS_NEXT:
+		err = check_regs(v, s, i, REG_A | REG_B | REG_C);
+
+		if (err == 0 && (bc[i + 2] & 0xff) >= s->nregs) {
+			err = fail(v, i, "register index out of range");
+		}
+
+		err = err || add_jump(v, i, i + 1);
+		break;
+	default:
+		SHANT_BE_REACHED();
+		err = -1;
+	}
+
+	return err ? 0 : n;
+}
+
+/* walks the code of each function, nested ones included, in order */
+static int verify_code(TVerifier *v)
+{
+	size_t i = SPN_PRGHDR_LEN;
+
+	v->scopes = grow(NULL, &v->scopeallsz, sizeof(v->scopes[0]));
+	v->scopes[0].begin = SPN_PRGHDR_LEN;
+	v->scopes[0].end = v->codeend;
+	v->scopes[0].last = SPN_PRGHDR_LEN;
+	v->scopes[0].nregs = v->bc[SPN_HDRIDX_FRMSIZE];
+	v->nscopes = 1;
+
+	while (v->nscopes > 0) {
+		TScope *s = &v->scopes[v->nscopes - 1];
+		size_t n;
+
+		if (i == s->end) {
+			/* execution must not run off the end of a body
+			 * (into the next function or into the symbol table)
+			 */
+			int last = OPCODE(v->bc[s->last]);
+
+			if (last != SPN_INS_RET && last != SPN_INS_JMP) {
+				return fail(v, s->last, "function doesn't end with a return or a jump");
+			}
+
+			v->nscopes--;
+			continue;
+		}
+
+		s->last = i;
+
+		n = verify_insn(v, s, i);
+		if (n == 0) {
+			return -1;
+		}
+
+		i += n;
+
+		if (OPCODE(v->bc[s->last]) == SPN_INS_GLBSYM) {
+			spn_uword *hdr = v->bc + i - SPN_FUNCHDR_LEN;
+
+			if (v->nscopes >= v->scopeallsz) {
+				v->scopes = grow(v->scopes, &v->scopeallsz, sizeof(v->scopes[0]));
+			}
+
+			s = &v->scopes[v->nscopes++];
+			s->begin = i;
+			s->end = i + hdr[SPN_FUNCHDR_IDX_BODYLEN];
+			s->last = i;
+			s->nregs = hdr[SPN_FUNCHDR_IDX_NREGS];
+		}
+	}
+
+	return 0;
+}
+
+/* checks jump targets and the headers referred to by lambda symbols */
+static int verify_refs(TVerifier *v)
+{
+	size_t i;
+
+	for (i = 0; i < v->njumps; i++) {
+		size_t site = v->jumps[i].site;
+		size_t target = v->jumps[i].target;
+
+		if ((v->flags[target] & WORD_INSN) == 0 || v->owner[target] != v->owner[site]) {
+			return fail(v, site, "jump to the middle of an instruction or out of its function");
+		}
+	}
+
+	for (i = 0; i < v->nsyms; i++) {
+		spn_uword ins = v->bc[v->syms[i]];
+
+		if (OPCODE(ins) != SPN_LOCSYM_LAMBDA) {
+			continue;
+		}
+
+		if (OPLONG(ins) >= v->codeend || (v->flags[OPLONG(ins)] & WORD_LAMBDA) == 0) {
+			return fail(v, v->syms[i], "lambda symbol doesn't refer to a lambda function");
+		}
+	}
+
+	return 0;
+}
+
+const char *spn_verify(spn_uword *bc, size_t len, size_t *addr)
+{
+	TVerifier v;
+	int err;
+
+	v.bc = bc;
+	v.len = len;
+	v.syms = NULL;
+	v.flags = NULL;
+	v.owner = NULL;
+	v.scopes = NULL;
+	v.nscopes = 0;
+	v.scopeallsz = 0;
+	v.jumps = NULL;
+	v.njumps = 0;
+	v.jumpallsz = 0;
+	v.errmsg = NULL;
+	v.erraddr = 0;
+
+	err = verify_header(&v);
+
+	if (err == 0) {
+		/* one more element, so that none of them is of size zero */
+		v.syms = malloc((v.nsyms + 1) * sizeof(v.syms[0]));
+		v.flags = calloc(v.codeend, sizeof(v.flags[0]));
+		v.owner = malloc(v.codeend * sizeof(v.owner[0]));
+
+		if (v.syms == NULL || v.flags == NULL || v.owner == NULL) {
+			abort();
+		}
+
+		err = verify_symtab(&v) || verify_code(&v) || verify_refs(&v);
+	}
+
+	free(v.syms);
+	free(v.flags);
+	free(v.owner);
+	free(v.scopes);
+	free(v.jumps);
+
+	if (err) {
+		*addr = v.erraddr;
+		return v.errmsg;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * verify.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Load-time verifier for Sparkling bytecode
+ */
+
+#ifndef SPN_VERIFY_H
+#define SPN_VERIFY_H
+
+#include <stddef.h>
+
+#include "spn.h"
+
+/* The virtual machine trusts the bytecode it runs: in order not to slow
+ * down every instruction, it doesn't check register indices, jump targets,
+ * symbol table indices or function headers (only assertions do so in debug
+ * builds). Code produced by the compiler is correct by construction, but a
+ * bytecode file read from disk may have been damaged or tampered with.
+ *
+ * spn_verify() checks, once, all the properties the VM relies on for the
+ * `len` words of bytecode starting at `bc`: the program header, the format
+ * of the symbol table, that each instruction is valid and fits in its
+ * function, that every register index is less than the number of registers
+ * of the function, that jumps land at the beginning of an instruction of
+ * the same function, that symbol indices refer to a symbol of the right
+ * kind, and that the header and the bounds of each function are consistent.
+ * Code which passes can be run without any further checks.
+ *
+ * Returns NULL if the bytecode is valid. Otherwise, returns a static string
+ * describing the first problem found, and sets `*addr` to the offset (in
+ * words) of the offending instruction or symbol table entry.
+ */
+SPN_API const char *spn_verify(spn_uword *bc, size_t len, size_t *addr);
+
+#endif /* SPN_VERIFY_H */
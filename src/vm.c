@@ -13,22 +13,38 @@
 #include <assert.h>
 #include <stddef.h>
 
+#ifdef SPN_PROFILE
+#include <time.h>
+#endif /* SPN_PROFILE */
+
 #include "vm.h"
 #include "str.h"
 #include "array.h"
+#include "func.h"
+#include "numbuf.h"
+#include "jit.h"
 #include "private.h"
 
 /* stack management macros 
- * 0th slot: header, 1st slot: implicit self
+ * the header comes first, then the registers:
  * register ordinal numbers grow _downwards_
  *
+ * The stack is made up of segments which are never reallocated, so frames
+ * never move and pointers to registers stay valid (even across calls).
+ * A frame is always contiguous within a single segment; each frame header
+ * points back to the stack pointer of the caller, which may be in the
+ * previous segment.
+ *
+ * A slot is only as large as a value, so the activation record header
+ * takes up EXTRA_SLOTS (N) slots.
+ *
  * |                          | <- SP
  * +--------------------------+
- * | activation record header | <- SP - 1
+ * | activation record header | <- SP - N ... SP - 1
  * +--------------------------+
- * | register #0              | <- SP - 2
+ * | register #0              | <- SP - N - 1
  * +--------------------------+
- * | register #1              | <- SP - 3
+ * | register #1              | <- SP - N - 2
  * +--------------------------+
  * |                          |
  * 
@@ -40,9 +56,12 @@
  * [nregs...nregs + extra_argc)	- unnamed (variadic) arguments
  */
 
-#define EXTRA_SLOTS	1
-#define IDX_FRMHDR	(-1)
-#define REG_OFFSET	(-2)
+#define EXTRA_SLOTS	((int)((sizeof(TFrame) + sizeof(TSlot) - 1) / sizeof(TSlot)))
+#define FRMHDR(s)	((TFrame *)((s) - EXTRA_SLOTS))
+#define REG_OFFSET	(-EXTRA_SLOTS - 1)
+
+/* minimal size of a stack segment, in slots */
+#define STACK_SEGSIZE	1024
 
 /* the debug versions of the following macros are defined in such a horrible
  * way because once I've shot myself in the foot trying to store the result of
@@ -61,8 +80,8 @@
  * arguments: `s` - stack pointer; `r`: register index
  */
 #ifndef NDEBUG
-#define VALPTR(s, r) (assert((r) < (s)[IDX_FRMHDR].h.size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)].v)
-#define SLOTPTR(s, r) (assert((r) < (s)[IDX_FRMHDR].h.size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)])
+#define VALPTR(s, r) (assert((r) < FRMHDR(s)->size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)].v)
+#define SLOTPTR(s, r) (assert((r) < FRMHDR(s)->size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)])
 #else
 #define VALPTR(s, r) (&(s)[(-(int)(r) + REG_OFFSET)].v)
 #define SLOTPTR(s, r) (&(s)[(-(int)(r) + REG_OFFSET)])
@@ -75,11 +94,21 @@
  * even if a certain file is run multiple times, its symtab should
  * only be created/added once. (duplicated symtabs do no real harm, but their
  * memory usage can add up if a certain file is run thousands of times...)
+ * `fldcache' holds the inline caches of FLDGET and FLDSET (see Remark (X)
+ * in vm.h): hash table positions used as hints for spn_array_get_hinted()
+ * and spn_array_set_hinted(). It's grown lazily, since the number of caches
+ * is not recorded in the bytecode.
+ * `jit' and `hotness' are the JIT state of the top-level code of the program
+ * (functions have their own, see SpnFunction).
  */
 typedef struct TSymtab {
 	SpnValue *vals;
 	size_t size;
 	spn_uword *bc;
+	size_t *fldcache;
+	size_t fldcachesz;
+	SpnJitCode *jit;
+	unsigned long hotness;
 } TSymtab;
 
 /* An index into the array of local symbol tables is used instead of a
@@ -87,60 +116,217 @@ typedef struct TSymtab {
  * `realloc()`ated, and then we have an invalid pointer once again
  */
 typedef struct TFrame {
-	size_t		 size;		/* no. of slots, including EXTRA_SLOTS	*/
+	unsigned	 size;		/* no. of slots, including EXTRA_SLOTS	*/
 	int		 decl_argc;	/* declaration argument count		*/
 	int		 extra_argc;	/* number of extra args, if any (or 0)	*/
-	spn_uword	*retaddr;	/* return address (points to bytecode)	*/
-	ptrdiff_t	 retidx;	/* pointer into the caller's frame	*/
 	int		 symtabidx;	/* index of the local symtab in use	*/
+	spn_uword	*retaddr;	/* return address (points to bytecode)	*/
+	SpnValue	*retptr;	/* register in the caller's frame	*/
 	const char	*fnname;	/* name of the function being called	*/
+	struct TSlot	*prevsp;	/* stack pointer of the caller		*/
+	unsigned long	 tailcalls;	/* no. of frames replaced by this one	*/
+#if SPN_USE_JIT
+	SpnFunction	*func;		/* function called (NULL: program)	*/
+#endif /* SPN_USE_JIT */
 } TFrame;
 
-/* see http://stackoverflow.com/q/18310789/ */
-typedef union TSlot {
-	TFrame h;
+/* a slot of the stack holds a register (see FRMHDR() for the header) */
+typedef struct TSlot {
 	SpnValue v;
 } TSlot;
 
+typedef struct TStackSeg {
+	TSlot			*base;
+	TSlot			*end;
+	struct TStackSeg	*prev;
+	struct TStackSeg	*next;	/* kept around when it's emptied */
+	SpnPool			*pool;	/* that of the VM		*/
+} TStackSeg;
+
+/* A coroutine (see cocreate() in doc/stdlib.md) has a stack of its own,
+ * which is the stack of the VM while the coroutine runs. Its first frame
+ * is that of its function; like the first frame of the program, it has no
+ * return address and no previous frame. When the coroutine yields, the
+ * VM saves where it is, and it switches back to the stack, the address and
+ * the result register of its resumer, i. e. the call to coresume() which
+ * made it run. A running coroutine is retained by the VM.
+ */
+enum {
+	CO_FRESH,		/* not resumed yet		*/
+	CO_SUSPENDED,		/* waiting in coyield()		*/
+	CO_RUNNING,
+	CO_NORMAL,		/* resumed another one		*/
+	CO_DEAD			/* its function has returned	*/
+};
+
+typedef struct TCoroutine {
+	SpnObject		 base;
+	int			 state;
+	SpnValue		 func;	/* the function it runs		*/
+	SpnValue		 ret;	/* what the function returned	*/
+	TStackSeg		*stack;	/* first segment of its stack	*/
+	TStackSeg		*seg;	/* state while it is suspended	*/
+	TSlot			*sp;
+	spn_uword		*ip;
+	SpnValue		*dst;	/* result register of coyield()	*/
+	TStackSeg		*rseg;	/* state of the resumer		*/
+	TSlot			*rsp;
+	spn_uword		*rip;
+	SpnValue		*rdst;	/* result register of coresume() */
+	struct TCoroutine	*prev;	/* coroutine of the resumer	*/
+	SpnVMachine		*vm;	/* non-NULL while it has a stack */
+	struct TCoroutine	*lprev;	/* list of those, see spn_vm_free() */
+	struct TCoroutine	*lnext;
+} TCoroutine;
+
+#ifdef SPN_PROFILE
+
+/* per-function data of the profiler. Times are kept in clock ticks, they
+ * are only converted to seconds when queried.
+ */
+typedef struct TProfFunc {
+	const char	*name;		/* owned by `funcindex`		*/
+	unsigned long	 calls;
+	unsigned long	 active;	/* number of unfinished calls	*/
+	clock_t		 inclusive;
+	clock_t		 exclusive;
+} TProfFunc;
+
+/* an activation record on the shadow call stack of the profiler */
+typedef struct TProfFrame {
+	size_t		 func;		/* index into `funcs`		*/
+	clock_t		 start;		/* time of entering		*/
+	clock_t		 children;	/* time spent in callees	*/
+} TProfFrame;
+
+typedef struct TProfile {
+	int		 flags;		/* SPN_PROFILE_* (0: disabled)	*/
+	unsigned long	 interval;	/* sampling interval		*/
+	unsigned long	 countdown;	/* instructions until sampling	*/
+	unsigned long	 opcounts[SPN_INS_COUNT];
+
+	TProfFunc	*funcs;
+	size_t		 nfuncs;
+	size_t		 funcsallsz;
+	SpnArray	*funcindex;	/* name -> index into `funcs`	*/
+	SpnFuncProfile	*report;	/* see spn_vm_funcprofile()	*/
+
+	TProfFrame	*stack;
+	size_t		 depth;
+	size_t		 stackallsz;
+
+	SpnStackSample	*samples;
+	size_t		 nsamples;
+	size_t		 samplesallsz;
+	SpnArray	*sampleindex;	/* stack -> index into `samples` */
+	char		*buf;		/* for building folded stacks	*/
+	size_t		 bufsz;
+} TProfile;
+
+#endif /* SPN_PROFILE */
+
 struct SpnVMachine {
-	TSlot		*stack;		/* base of the stack		*/
-	TSlot		*sp;		/* stack pointer		*/
-	size_t		 stackallsz;	/* stack alloc size in frames	*/
+	TStackSeg	*seg;		/* segment of the topmost frame	*/
+	TSlot		*sp;		/* stack pointer (NULL: empty)	*/
 
 	SpnArray	*glbsymtab;	/* global symbol table		*/
+	SpnArray	*strings;	/* interned strings		*/
 
 	TSymtab		*lsymtabs;	/* local symbol table		*/
 	size_t		 lscount;	/* number of the local symtabs	*/
+	size_t		 lsallsz;	/* allocation size of lsymtabs	*/
+	SpnArray	*lsindex;	/* bytecode -> index of symtab	*/
 
 	SpnValue	*argv;		/* space for function arguments	*/
 	int		 argvsz;	/* number of call arguments	*/
+	SpnValue	**argp;		/* argument pointers (fast ABI)	*/
+	int		 argpsz;	/* size of `argp`		*/
 
 	char		*errmsg;	/* last (runtime) error message	*/
 	void		*ctx;		/* user data			*/
 
 	SpnValue	 retval;	/* program return value	*/
+
+	size_t		 gcthreshold;	/* see spn_vm_autocollect()	*/
+	int		 jit;		/* see spn_vm_setjit()		*/
+
+	unsigned long	 budget;	/* see spn_vm_setbudget()	*/
+	unsigned long	 countdown;	/* steps left (0: no limit)	*/
+	spn_uword	*resumeip;	/* NULL if nothing's suspended	*/
+	TCoroutine	*co;		/* coroutine running, if any	*/
+	TCoroutine	*colist;	/* every one which has a stack	*/
+	const char	*interrupt;	/* see spn_vm_interrupt()	*/
+	int		 running;	/* depth of run_program() calls	*/
+
+	SpnPool		*pool;		/* current when created		*/
+
+#ifdef SPN_PROFILE
+	TProfile	 prof;		/* profiler state, data	*/
+#endif /* SPN_PROFILE */
 };
 
-static int dispatch_loop(SpnVMachine *vm);
+/* runs the code of the topmost frame from `ip'. Returns 0 when the program
+ * has finished, 1 if it has been suspended, and -1 on a runtime error.
+ */
+static int dispatch_loop(SpnVMachine *vm, spn_uword *ip);
+static SpnValue *run_program(SpnVMachine *vm, spn_uword *ip);
 
-/* this only releases the values stored in the stack frames */
+/* this only releases the values stored in the stack frames
+ * (including those of the coroutines which are running)
+ */
 static void free_frames(SpnVMachine *vm);
 
 /* stack manipulation */
-static size_t stacksize(SpnVMachine *vm);
 static void push_first_frame(SpnVMachine *vm, int symtabidx);
-static void expand_stack(SpnVMachine *vm, size_t nregs);
+static TSlot *next_segment(SpnVMachine *vm, size_t nslots);
+static void free_segments(TStackSeg *seg);
 static void push_frame(
 	SpnVMachine *vm,
 	int nregs,
 	int decl_argc,
 	int extra_argc,
+	int argc,
 	spn_uword *retaddr,
-	ptrdiff_t retidx,
+	SpnValue *retptr,
 	int symtabidx,
 	const char *fnname
 );
 static void pop_frame(SpnVMachine *vm);
+static void release_frame(TSlot *sp);
+
+/* the frame of the caller of the frame `sp'. After the first frame of a
+ * coroutine comes the frame of its resumer; `*co' is the coroutine the
+ * frame belongs to (start from `vm->co').
+ */
+static TSlot *caller_frame(TSlot *sp, TCoroutine **co);
+
+/* coroutines. coresume() and coyield() are not actually called: the VM
+ * switches stacks in co_transfer() instead (see SPN_INS_CALL). It returns
+ * where to continue, or NULL on error. co_finish() switches back from a
+ * coroutine (which has no frames left) to its resumer.
+ */
+static int co_create(SpnValue *ret, int argc, SpnValue *argv, void *ctx);
+static int co_resume(SpnValue *ret, int argc, SpnValue *argv, void *ctx);
+static int co_yield(SpnValue *ret, int argc, SpnValue *argv, void *ctx);
+static int co_status(SpnValue *ret, int argc, SpnValue *argv, void *ctx);
+static spn_uword *co_transfer(SpnVMachine *vm, spn_uword *ip, SpnFunction *fn, SpnValue *retval, int argc);
+static spn_uword *co_finish(SpnVMachine *vm);
+
+/* frees the stack of a coroutine left suspended when the VM is freed. Its
+ * frames may hold the only references to it, or to other coroutines.
+ */
+static void co_abandon(TCoroutine *co);
+
+/* the list of coroutines which have a stack (`vm->colist') */
+static void co_link(SpnVMachine *vm, TCoroutine *co);
+static void co_unlink(TCoroutine *co);
+
+static const SpnExtFunc co_lib[] = {
+	{ "cocreate",	co_create	},
+	{ "coresume",	co_resume	},
+	{ "coyield",	co_yield	},
+	{ "costatus",	co_status	}
+};
 
 /* bytecode validation - returns 0 on success, nonzero on error */
 static int validate_magic(SpnVMachine *vm, spn_uword *bc);
@@ -149,10 +335,16 @@ static int validate_magic(SpnVMachine *vm, spn_uword *bc);
  * necessary. Returns -1 on error.
  */
 static int read_local_symtab(SpnVMachine *vm, spn_uword *bc);
+static void strconst_from_bytecode(SpnVMachine *vm, SpnValue *symp);
+
+/* helpers for FLDGET and FLDSET */
+static SpnValue *field_key(SpnVMachine *vm, spn_uword *ip);
+static size_t *field_cache(SpnVMachine *vm, spn_uword *ip);
 
 /* accessing function arguments */
 static SpnValue *nth_call_arg(TSlot *sp, spn_uword *ip, int idx);
 static SpnValue *nth_vararg(TSlot *sp, int idx);
+static void reserve_argv(SpnVMachine *vm, int argc);
 
 /* "throwing an exception", runtime errors */
 static void runerror(SpnVMachine *vm, spn_uword *ip, const char *fmt, ...);
@@ -160,47 +352,165 @@ static void runerror(SpnVMachine *vm, spn_uword *ip, const char *fmt, ...);
 /* emulating the ALU... */
 static int numeric_compare(const SpnValue *lhs, const SpnValue *rhs, int op);
 static int cmp2bool(int res, int op);
+static int ordered_compare(
+	SpnVMachine *vm,
+	spn_uword *ip,
+	const SpnValue *lhs,
+	const SpnValue *rhs,
+	int op,
+	int *res
+);
 static SpnValue arith_op(const SpnValue *lhs, const SpnValue *rhs, int op);
 static long bitwise_op(const SpnValue *lhs, const SpnValue *rhs, int op);
 
 /* ...and a weak dynamic linker */
 static SpnValue *resolve_symbol(SpnVMachine *vm, const char *name);
 
+/* returns the unique string object with the given contents. The caller
+ * owns a reference to it. Names of global symbols and string literals
+ * are interned, so that they are allocated and hashed only once, and
+ * comparing them usually boils down to comparing pointers.
+ */
+static SpnString *intern_string(SpnVMachine *vm, const char *cstr, size_t len);
+
+/* adds a native function to the global symbol table */
+static void add_global(SpnVMachine *vm, const char *name, SpnValue *val);
+
+/* checks and normalizes the index of an element of a numeric buffer,
+ * like string indexing does. Returns nonzero (after reporting the error)
+ * if the index is not an integer or if it is out of bounds.
+ */
+static int numbuf_index(SpnVMachine *vm, spn_uword *ip, SpnNumBuffer *buf, const SpnValue *idx, size_t *pos);
+
 /* type information, reflection */
 static SpnValue sizeof_value(SpnValue *val);
-static SpnValue typeof_value(SpnValue *val);
+static SpnValue typeof_value(SpnVMachine *vm, SpnValue *val);
+
+/* the profiler hooks compile to nothing unless SPN_PROFILE is defined.
+ * Otherwise, they only cost a test of the flags while profiling is off.
+ */
+#ifdef SPN_PROFILE
+static void prof_init(TProfile *prof);
+static void prof_clear(TProfile *prof);
+static void prof_insn(SpnVMachine *vm, enum spn_vm_ins opcode);
+static void prof_enter(SpnVMachine *vm, const char *fnname);
+static void prof_leave(SpnVMachine *vm);
+
+#define PROF_INSN(vm, op)	do {					\
+					if ((vm)->prof.flags != 0) {	\
+						prof_insn((vm), (op));	\
+					}				\
+				} while (0)
+#define PROF_ENTER(vm, name)	do {					\
+					if ((vm)->prof.flags & SPN_PROFILE_COUNTS) { \
+						prof_enter((vm), (name)); \
+					}				\
+				} while (0)
+#define PROF_LEAVE(vm)		do {					\
+					if ((vm)->prof.flags & SPN_PROFILE_COUNTS) { \
+						prof_leave(vm);		\
+					}				\
+				} while (0)
+#define PROF_UNWIND(vm)		do {					\
+					while ((vm)->prof.depth > 0) {	\
+						prof_leave(vm);		\
+					}				\
+				} while (0)
+#else
+#define PROF_INSN(vm, op)	((void)0)
+#define PROF_ENTER(vm, name)	((void)0)
+#define PROF_LEAVE(vm)		((void)0)
+#define PROF_UNWIND(vm)		((void)0)
+#endif /* SPN_PROFILE */
+
+/* the cycle collector runs between instructions which may have created
+ * arrays, when all of them are in a consistent state
+ */
+#define GC_CHECK(vm)		do {					\
+					if ((vm)->gcthreshold != 0	\
+					 && spn_array_gcdue((vm)->pool, (vm)->gcthreshold)) { \
+						spn_array_collect((vm)->pool); \
+					}				\
+				} while (0)
+
+/* the interpreter hands over to the JIT (see jit.h) where execution enters
+ * a function or goes round a loop: on calls and returns, and on jumps
+ * backwards. The native code runs as far as it can, then the interpreter
+ * continues at the instruction it returns.
+ */
+#if SPN_USE_JIT
+static spn_uword *jit_enter(SpnVMachine *vm, spn_uword *ip);
+
+#define JIT_ENTER(vm, ip)	do {					\
+					if ((vm)->jit) {		\
+						(ip) = jit_enter((vm), (ip)); \
+					}				\
+				} while (0)
+#else
+#define JIT_ENTER(vm, ip)	((void)0)
+#endif /* SPN_USE_JIT */
+
+/* the same places are the steps counted by the budget of an execution
+ * (see spn_vm_setbudget()). They are between two instructions, so when
+ * it runs out, the program can be suspended by simply leaving the loop.
+ * An interrupt (see spn_vm_interrupt()) makes the next step the last one
+ * too, so it costs nothing until it happens.
+ */
+static int safepoint_stop(SpnVMachine *vm, spn_uword *ip);
+
+/* the runtime error of an instruction whose result can't be allocated
+ * (see spn_mem_alloc()). Returns -1, like the dispatch loop on errors.
+ */
+static int nomem(SpnVMachine *vm, spn_uword *ip);
+
+#define SAFEPOINT(vm, ip)	do {					\
+					if ((vm)->countdown != 0	\
+					 && --(vm)->countdown == 0) {	\
+						return safepoint_stop((vm), (ip)); \
+					}				\
+				} while (0)
 
 /* releases the entries of a local symbol table */
-static void free_local_symtab(TSymtab *symtab)
+static void free_local_symtab(SpnVMachine *vm, TSymtab *symtab)
 {
 	size_t i;
 	for (i = 0; i < symtab->size; i++) {
 		spn_value_release(&symtab->vals[i]);
 	}
 
-	free(symtab->vals);
+	spn_mem_free(vm->pool, SPN_MEM_BYTECODE, symtab->vals, symtab->size * sizeof(symtab->vals[0]));
+	spn_mem_free(vm->pool, SPN_MEM_BYTECODE, symtab->fldcache, symtab->fldcachesz * sizeof(symtab->fldcache[0]));
+
+	if (symtab->jit != NULL) {
+		spn_jit_free(symtab->jit);
+	}
 }
 
 SpnVMachine *spn_vm_new()
 {
-	SpnVMachine *vm = malloc(sizeof(*vm));
-	if (vm == NULL) {
-		abort();
-	}
+	SpnPool *pool = spn_pool_get_current();
+	SpnVMachine *vm = spn_mem_xalloc(pool, SPN_MEM_OTHER, sizeof(*vm));
+
+	/* the buffers of the VM come from the same pool */
+	vm->pool = pool;
 
 	/* initialize stack */
-	vm->stackallsz = 0;
-	vm->stack = NULL;
+	vm->seg = NULL;
 	vm->sp = NULL;
 
 	/* initialize the global and local symbol tables */
 	vm->glbsymtab = spn_array_new();
+	vm->strings = spn_array_new();
 	vm->lsymtabs = NULL;
 	vm->lscount = 0;
+	vm->lsallsz = 0;
+	vm->lsindex = spn_array_new();
 
 	/* set an (empty) argument vector */
 	vm->argv = NULL;
 	vm->argvsz = 0;
+	vm->argp = NULL;
+	vm->argpsz = 0;
 
 	/* set up error reporting, user data and return value */
 	vm->errmsg = NULL;
@@ -210,6 +520,24 @@ SpnVMachine *spn_vm_new()
 	vm->retval.t = SPN_TYPE_NIL;
 	vm->retval.f = 0;
 
+	vm->gcthreshold = SPN_GC_THRESHOLD;
+	vm->jit = SPN_USE_JIT;
+
+	vm->budget = 0;
+	vm->countdown = 0;
+	vm->resumeip = NULL;
+	vm->co = NULL;
+	vm->colist = NULL;
+	vm->interrupt = NULL;
+	vm->running = 0;
+
+#ifdef SPN_PROFILE
+	prof_init(&vm->prof);
+#endif /* SPN_PROFILE */
+
+	/* coroutines are built into the VM */
+	spn_vm_addlib(vm, co_lib, COUNT(co_lib));
+
 	return vm;
 }
 
@@ -217,23 +545,32 @@ void spn_vm_free(SpnVMachine *vm)
 {
 	size_t i;
 
-	/* free the stack */
+	/* free the stack, then those of the suspended coroutines */
 	free_frames(vm);
-	free(vm->stack);
+	free_segments(vm->seg);
+
+	while (vm->colist != NULL) {
+		co_abandon(vm->colist);
+	}
 
 	/* free the global symbol table */
 	spn_object_release(vm->glbsymtab);
 
 	/* free each local symbol table... */
 	for (i = 0; i < vm->lscount; i++) {
-		free_local_symtab(&vm->lsymtabs[i]);
+		free_local_symtab(vm, &vm->lsymtabs[i]);
 	}
 
 	/* ...then free the array that contains them */
-	free(vm->lsymtabs);
+	spn_mem_free(vm->pool, SPN_MEM_BYTECODE, vm->lsymtabs, vm->lsallsz * sizeof(vm->lsymtabs[0]));
+	spn_object_release(vm->lsindex);
+
+	/* the interned strings may only be freed after the symbol tables */
+	spn_object_release(vm->strings);
 
 	/* free the argument vector */
-	free(vm->argv);
+	spn_mem_free(vm->pool, SPN_MEM_OTHER, vm->argv, vm->argvsz * sizeof(vm->argv[0]));
+	spn_mem_free(vm->pool, SPN_MEM_OTHER, vm->argp, vm->argpsz * sizeof(vm->argp[0]));
 
 	/* free the error message buffer */
 	free(vm->errmsg);
@@ -241,7 +578,16 @@ void spn_vm_free(SpnVMachine *vm)
 	/* release return value */
 	spn_value_release(&vm->retval);
 
-	free(vm);
+#ifdef SPN_PROFILE
+	prof_clear(&vm->prof);
+#endif /* SPN_PROFILE */
+
+	/* arrays of the program that are only kept alive by cycles */
+	if (vm->gcthreshold != 0) {
+		spn_array_collect(vm->pool);
+	}
+
+	spn_mem_free(vm->pool, SPN_MEM_OTHER, vm, sizeof(*vm));
 }
 
 const char **spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
@@ -250,6 +596,7 @@ const char **spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 	const char **buf;
 
 	TSlot *sp = vm->sp;
+	TCoroutine *co = vm->co;
 
 	/* handle empty stack */
 	if (sp == NULL) {
@@ -257,11 +604,11 @@ const char **spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 		return NULL;
 	}
 
-	/* count frames */
-	while (sp > vm->stack) {
-		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
-		i++;
-		sp -= frmhdr->size;
+	/* count frames, and a marker for each run of elided ones */
+	while (sp != NULL) {
+		TFrame *frmhdr = FRMHDR(sp);
+		i += frmhdr->tailcalls > 0 ? 2 : 1;
+		sp = caller_frame(sp, &co);
 	}
 
 	/* allocate buffer */
@@ -274,10 +621,16 @@ const char **spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 
 	i = 0;
 	sp = vm->sp;
-	while (sp > vm->stack) {
-		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
+	co = vm->co;
+	while (sp != NULL) {
+		TFrame *frmhdr = FRMHDR(sp);
 		buf[i++] = frmhdr->fnname ? frmhdr->fnname : SPN_LAMBDA_NAME;
-		sp -= frmhdr->size;
+
+		if (frmhdr->tailcalls > 0) {
+			buf[i++] = SPN_ELIDED_FRAMES;
+		}
+
+		sp = caller_frame(sp, &co);
 	}
 
 	return buf;
@@ -286,6 +639,7 @@ const char **spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 static void print_stacktrace(SpnVMachine *vm)
 {
 	TSlot *sp = vm->sp;
+	TCoroutine *co = vm->co;
 	unsigned long i = 0;
 
 	if (sp == NULL) {
@@ -294,11 +648,16 @@ static void print_stacktrace(SpnVMachine *vm)
 
 	printf("\nCall stack:\n");
 
-	while (sp > vm->stack) {
-		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
+	while (sp != NULL) {
+		TFrame *frmhdr = FRMHDR(sp);
 		const char *fnname = frmhdr->fnname ? frmhdr->fnname : SPN_LAMBDA_NAME;
 		printf("\t[#%lu]\tin %s\n", i++, fnname);
-		sp -= frmhdr->size;
+
+		if (frmhdr->tailcalls > 0) {
+			printf("\t\t(%lu frames elided by tail calls)\n", frmhdr->tailcalls);
+		}
+
+		sp = caller_frame(sp, &co);
 	}
 
 	printf("\n");
@@ -306,16 +665,23 @@ static void print_stacktrace(SpnVMachine *vm)
 
 static void free_frames(SpnVMachine *vm)
 {
-	if (vm->stack != NULL) {
-		while (vm->sp > vm->stack) {
+	while (1) {
+		while (vm->sp != NULL) {
 			pop_frame(vm);
 		}
+
+		/* unwind into the resumer of a coroutine left running */
+		if (vm->co == NULL) {
+			break;
+		}
+
+		co_finish(vm);
 	}
 }
 
 static spn_uword *current_bytecode(SpnVMachine *vm)
 {
-	TFrame *stkhdr = &vm->sp[IDX_FRMHDR].h;
+	TFrame *stkhdr = FRMHDR(vm->sp);
 	int symtabidx = stkhdr->symtabidx;
 	assert(symtabidx >= 0 && symtabidx < vm->lscount);
 	return vm->lsymtabs[symtabidx].bc;
@@ -324,7 +690,6 @@ static spn_uword *current_bytecode(SpnVMachine *vm)
 SpnValue *spn_vm_exec(SpnVMachine *vm, spn_uword *bc)
 {
 	int symtabidx;
-	int err;
 
 	/* release previous return value */
 	spn_value_release(&vm->retval);
@@ -332,8 +697,10 @@ SpnValue *spn_vm_exec(SpnVMachine *vm, spn_uword *bc)
 	/* releases values in stack frames from the previous execution.
 	 * This is not done immediately after the dispatch loop because if
 	 * a runtime error occurred, we want the backtrace functions to
-	 * be able to unwind the stack.
+	 * be able to unwind the stack. (A suspended program is abandoned.)
 	 */
+	vm->resumeip = NULL;
+	PROF_UNWIND(vm);
 	free_frames(vm);
 
 	/* check bytecode for magic bytes */
@@ -349,34 +716,143 @@ SpnValue *spn_vm_exec(SpnVMachine *vm, spn_uword *bc)
 
 	/* initialize global stack (read 1st frame size from bytecode) */
 	push_first_frame(vm, symtabidx);
+	PROF_ENTER(vm, FRMHDR(vm->sp)->fnname);
 
 	/* actually run the program */
-	err = dispatch_loop(vm);
+	return run_program(vm, bc + SPN_PRGHDR_LEN);
+}
+
+SpnValue *spn_vm_resume(SpnVMachine *vm)
+{
+	spn_uword *ip = vm->resumeip;
+
+	if (ip == NULL) {
+		return NULL;
+	}
+
+	vm->resumeip = NULL;
+	return run_program(vm, ip);
+}
+
+static SpnValue *run_program(SpnVMachine *vm, spn_uword *ip)
+{
+	int status;
+
+	vm->countdown = vm->budget;
+	vm->running++;
+
+	/* memory still in use may be over the limit already */
+	if (vm->pool != NULL) {
+		spn_pool_checklimit(vm->pool);
+	}
+
+	status = dispatch_loop(vm, ip);
+	vm->running--;
+
+	/* one that came too late to stop the program is void */
+	vm->interrupt = NULL;
+
+	/* the frames of a suspended program are kept for resuming it */
+	if (status > 0) {
+		return NULL;
+	}
+
+	/* close the calls a runtime error left unfinished */
+	PROF_UNWIND(vm);
 
 	/* return the result of the program (NULL on error) */
-	return err ? NULL : &vm->retval;
+	return status < 0 ? NULL : &vm->retval;
+}
+
+void spn_vm_setbudget(SpnVMachine *vm, unsigned long budget)
+{
+	vm->budget = budget;
+}
+
+void spn_vm_suspend(SpnVMachine *vm)
+{
+	/* the next step is the last one */
+	vm->countdown = 1;
+}
+
+int spn_vm_suspended(SpnVMachine *vm)
+{
+	return vm->resumeip != NULL;
+}
+
+void spn_vm_interrupt(SpnVMachine *vm, const char *reason)
+{
+	if (vm->running > 0 && vm->interrupt == NULL) {
+		vm->interrupt = reason;
+		vm->countdown = 1;
+	}
+}
+
+static int safepoint_stop(SpnVMachine *vm, spn_uword *ip)
+{
+	if (vm->interrupt != NULL) {
+		runerror(vm, ip, "%s", vm->interrupt);
+		vm->interrupt = NULL;
+		return -1;
+	}
+
+	vm->resumeip = ip;
+	return 1;
+}
+
+static int nomem(SpnVMachine *vm, spn_uword *ip)
+{
+	/* over the limit of a context, it has interrupted the program */
+	if (vm->interrupt != NULL) {
+		return safepoint_stop(vm, ip);
+	}
+
+	runerror(vm, ip, "out of memory");
+	return -1;
 }
 
 void spn_vm_addlib(SpnVMachine *vm, const SpnExtFunc fns[], size_t n)
 {
 	size_t i;
 	for (i = 0; i < n; i++) {
-		SpnValue key, val;
+		SpnValue val;
+		spn_func_value(&val, spn_func_new_native(fns[i].name, fns[i].fn));
+
+		add_global(vm, fns[i].name, &val);
+		spn_value_release(&val);
+	}
+}
+
+void spn_vm_addfastlib(SpnVMachine *vm, const SpnExtFastFunc fns[], size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		SpnValue val;
+		int flags = SPN_TFLG_REGARGS;
 
-		key.t = SPN_TYPE_STRING;
-		key.f = SPN_TFLG_OBJECT;
-		key.v.ptrv = spn_string_new_nocopy(fns[i].name, 0);
+		if (fns[i].nofail) {
+			flags |= SPN_TFLG_NOFAIL;
+		}
 
-		val.t = SPN_TYPE_FUNC;
-		val.f = SPN_TFLG_NATIVE;
-		val.v.fnv.name = fns[i].name;
-		val.v.fnv.r.fn = fns[i].fn;
+		spn_func_value(&val, spn_func_new_fastnative(fns[i].name, fns[i].fn, flags));
 
-		spn_array_set(vm->glbsymtab, &key, &val);
-		spn_object_release(key.v.ptrv);
+		add_global(vm, fns[i].name, &val);
+		spn_value_release(&val);
 	}
 }
 
+static void add_global(SpnVMachine *vm, const char *name, SpnValue *val)
+{
+	SpnValue key;
+
+	key.t = SPN_TYPE_STRING;
+	key.f = SPN_TFLG_OBJECT;
+	key.v.ptrv = intern_string(vm, name, strlen(name));
+
+	spn_array_set(vm->glbsymtab, &key, val);
+	spn_object_release(key.v.ptrv);
+}
+
 #define ERRMSG_FORMAT "Sparkling: at address 0x%08lx: runtime error: "
 static void runerror(SpnVMachine *vm, spn_uword *ip, const char *fmt, ...)
 {
@@ -432,53 +908,167 @@ void spn_vm_setcontext(SpnVMachine *vm, void *ctx)
 	vm->ctx = ctx;
 }
 
-static size_t stacksize(SpnVMachine *vm)
+size_t spn_vm_collect(SpnVMachine *vm)
+{
+	return spn_array_collect(vm->pool);
+}
+
+void spn_vm_autocollect(SpnVMachine *vm, size_t threshold)
 {
-	return vm->stackallsz != 0 ? vm->sp - vm->stack : 0;
+	vm->gcthreshold = threshold;
 }
 
-static void expand_stack(SpnVMachine *vm, size_t nregs)
+int spn_vm_profile(SpnVMachine *vm, int flags, unsigned long interval)
 {
-	/* because `NULL - NULL` is UB */
-	size_t oldsize = stacksize(vm);
-	size_t newsize = oldsize + nregs;
+#ifdef SPN_PROFILE
+	TProfile *prof = &vm->prof;
+
+	prof_clear(prof);
 
-	if (vm->stackallsz == 0) {
-		vm->stackallsz = 8;
-		/* or however many; something greater than 0 so the << works */
+	if (flags != 0) {
+		prof->funcindex = spn_array_new();
+		prof->sampleindex = spn_array_new();
 	}
 
-	while (vm->stackallsz < newsize) {
-		vm->stackallsz <<= 1;
+	prof->flags = flags;
+	prof->interval = interval > 0 ? interval : SPN_PROFILE_INTERVAL;
+	prof->countdown = prof->interval;
+
+	return 0;
+#else
+	/* profiling isn't compiled in, so it can only be disabled */
+	return flags != 0;
+#endif /* SPN_PROFILE */
+}
+
+int spn_vm_setjit(SpnVMachine *vm, int enable)
+{
+	vm->jit = enable && SPN_USE_JIT;
+
+	/* without the JIT compiler, it can only be disabled */
+	return enable && !SPN_USE_JIT;
+}
+
+unsigned long *spn_vm_opcounts(SpnVMachine *vm, size_t *n)
+{
+#ifdef SPN_PROFILE
+	*n = SPN_INS_COUNT;
+	return vm->prof.opcounts;
+#else
+	*n = 0;
+	return NULL;
+#endif /* SPN_PROFILE */
+}
+
+SpnFuncProfile *spn_vm_funcprofile(SpnVMachine *vm, size_t *n)
+{
+#ifdef SPN_PROFILE
+	TProfile *prof = &vm->prof;
+	size_t i;
+
+	*n = prof->nfuncs;
+
+	if (prof->nfuncs == 0) {
+		return NULL;
 	}
 
-	vm->stack = realloc(vm->stack, vm->stackallsz * sizeof(vm->stack[0]));
-	if (vm->stack == NULL) {
+	prof->report = realloc(prof->report, prof->nfuncs * sizeof(prof->report[0]));
+	if (prof->report == NULL) {
 		abort();
 	}
 
-	/* re-initialize stack pointer because we realloc()'d the stack */
-	vm->sp = vm->stack + oldsize;
+	for (i = 0; i < prof->nfuncs; i++) {
+		TProfFunc *func = &prof->funcs[i];
+		prof->report[i].name = func->name;
+		prof->report[i].calls = func->calls;
+		prof->report[i].inclusive = (double)func->inclusive / CLOCKS_PER_SEC;
+		prof->report[i].exclusive = (double)func->exclusive / CLOCKS_PER_SEC;
+	}
+
+	return prof->report;
+#else
+	*n = 0;
+	return NULL;
+#endif /* SPN_PROFILE */
+}
+
+SpnStackSample *spn_vm_samples(SpnVMachine *vm, size_t *n)
+{
+#ifdef SPN_PROFILE
+	*n = vm->prof.nsamples;
+	return vm->prof.samples;
+#else
+	*n = 0;
+	return NULL;
+#endif /* SPN_PROFILE */
+}
+
+/* moves on to the segment after the current one (allocating it if needed)
+ * and returns its base. `nslots` is the size of the frame to be pushed.
+ */
+static TSlot *next_segment(SpnVMachine *vm, size_t nslots)
+{
+	TStackSeg *seg = vm->seg != NULL ? vm->seg->next : NULL;
+
+	/* a cached segment that is too small is of no use */
+	if (seg != NULL && (size_t)(seg->end - seg->base) < nslots) {
+		free_segments(seg);
+		vm->seg->next = seg = NULL;
+	}
+
+	if (seg == NULL) {
+		size_t size = nslots > STACK_SEGSIZE ? nslots : STACK_SEGSIZE;
+
+		seg = spn_mem_xalloc(vm->pool, SPN_MEM_FRAMES, sizeof(*seg));
+		seg->base = spn_mem_xalloc(vm->pool, SPN_MEM_FRAMES, size * sizeof(seg->base[0]));
+		seg->pool = vm->pool;
+		seg->end = seg->base + size;
+		seg->prev = vm->seg;
+		seg->next = NULL;
+
+		if (vm->seg != NULL) {
+			vm->seg->next = seg;
+		}
+	}
+
+	vm->seg = seg;
+	return seg->base;
+}
+
+/* frees `seg` and all the segments after it */
+static void free_segments(TStackSeg *seg)
+{
+	while (seg != NULL) {
+		TStackSeg *next = seg->next;
+		spn_mem_free(seg->pool, SPN_MEM_FRAMES, seg->base, (seg->end - seg->base) * sizeof(seg->base[0]));
+		spn_mem_free(seg->pool, SPN_MEM_FRAMES, seg, sizeof(*seg));
+		seg = next;
+	}
 }
 
 /* nregs is the logical size (without the activation record header and the
- * implicit self) of the new stack frame, in slots
+ * implicit self) of the new stack frame, in slots. The registers of the
+ * first `argc` named arguments and of the extra arguments are left
+ * uninitialized: the caller fills them in right away.
  */
 static void push_frame(
 	SpnVMachine *vm,
 	int nregs,
 	int decl_argc,
 	int extra_argc,
+	int argc,
 	spn_uword *retaddr,
-	ptrdiff_t retidx,
+	SpnValue *retptr,
 	int symtabidx,
 	const char *fnname
 )
 {
 	int i;
+	TSlot *base, *sp;
+	TFrame *hdr;
 
 	/* real frame allocation size, including extra call-time arguments,
-	 * frame header and implicit self
+	 * and frame header
 	 */
 	int real_nregs = nregs + extra_argc + EXTRA_SLOTS;
 
@@ -487,29 +1077,42 @@ static void push_frame(
 	 */
 	assert(extra_argc >= 0);
 
-	/* reallocate stack if necessary */
-	if (vm->stackallsz == 0					/* empty stack	*/
-	 || vm->stackallsz < stacksize(vm) + real_nregs) {	/* too small	*/
-		expand_stack(vm, real_nregs);
+	/* when the stack is empty, the current segment is the first one */
+	if (vm->sp != NULL) {
+		base = vm->sp;
+	} else {
+		base = vm->seg != NULL ? vm->seg->base : NULL;
+	}
+
+	/* continue in the next segment if the frame doesn't fit */
+	if (base == NULL || vm->seg->end - base < real_nregs) {
+		base = next_segment(vm, real_nregs);
 	}
 
-	/* adjust stack pointer */
-	vm->sp += real_nregs;
+	sp = base + real_nregs;
 
-	/* initialize registers to nil */
-	for (i = -real_nregs; i < -EXTRA_SLOTS; i++) {
-		vm->sp[i].v.t = SPN_TYPE_NIL;
-		vm->sp[i].v.f = 0;
+	/* initialize the registers that aren't arguments to nil */
+	for (i = argc < decl_argc ? argc : decl_argc; i < nregs; i++) {
+		sp[-i + REG_OFFSET].v.t = SPN_TYPE_NIL;
+		sp[-i + REG_OFFSET].v.f = 0;
 	}
 
 	/* initialize activation record header */
-	vm->sp[IDX_FRMHDR].h.size = real_nregs;
-	vm->sp[IDX_FRMHDR].h.decl_argc = decl_argc;
-	vm->sp[IDX_FRMHDR].h.extra_argc = extra_argc;
-	vm->sp[IDX_FRMHDR].h.retaddr = retaddr; /* if NULL, return from main program */
-	vm->sp[IDX_FRMHDR].h.retidx = retidx; /* if negative, return from main program */
-	vm->sp[IDX_FRMHDR].h.symtabidx = symtabidx;
-	vm->sp[IDX_FRMHDR].h.fnname = fnname;
+	hdr = FRMHDR(sp);
+	hdr->size = real_nregs;
+	hdr->decl_argc = decl_argc;
+	hdr->extra_argc = extra_argc;
+	hdr->retaddr = retaddr; /* if NULL, return from main program */
+	hdr->retptr = retptr; /* if NULL, return from main program */
+	hdr->symtabidx = symtabidx;
+	hdr->fnname = fnname;
+	hdr->prevsp = vm->sp;
+	hdr->tailcalls = 0;
+#if SPN_USE_JIT
+	hdr->func = NULL;
+#endif /* SPN_USE_JIT */
+
+	vm->sp = sp;
 }
 
 static void push_first_frame(SpnVMachine *vm, int symtabidx)
@@ -519,12 +1122,12 @@ static void push_first_frame(SpnVMachine *vm, int symtabidx)
 	size_t nregs = symtab->bc[SPN_HDRIDX_FRMSIZE];
 
 	/* push a large enough frame - return address: NULL (nowhere to
-	 * return from top-level program scope). A return value index < 0
-	 * (-1 in this case) indicates that the program itself returns,
-	 * and instead of indexing the stack, the return value should be
-	 * copied directly into vm->retval.
+	 * return from top-level program scope). A NULL return value pointer
+	 * indicates that the program itself returns, and instead of storing
+	 * it in a register, the return value should be copied directly
+	 * into vm->retval.
 	 */
-	push_frame(vm, nregs, 0, 0, NULL, -1, symtabidx, "<main program>");
+	push_frame(vm, nregs, 0, 0, 0, NULL, NULL, symtabidx, "<main program>");
 }
 
 static void pop_frame(SpnVMachine *vm)
@@ -535,17 +1138,42 @@ static void pop_frame(SpnVMachine *vm)
 	 * destination register, but not the source(s) (if any).
 	 * the implicit self argument needs to be released as well.
 	 */
-	TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
+	TFrame *hdr = FRMHDR(vm->sp);
 	int nregs = hdr->size;
 
-	/* release registers */
-	int i;
-	for (i = -nregs; i < -EXTRA_SLOTS; i++) {
-		spn_value_release(&vm->sp[i].v);
+	release_frame(vm->sp);
+
+	/* if this was the first frame in its segment, the caller's frame is
+	 * in the previous one. The segment is kept, so the popped frame may
+	 * still be read until the next push.
+	 */
+	if (vm->sp - nregs == vm->seg->base && vm->seg->prev != NULL) {
+		vm->seg = vm->seg->prev;
 	}
 
 	/* adjust stack pointer */
-	vm->sp -= nregs;
+	vm->sp = hdr->prevsp;
+}
+
+/* releases the registers of a frame */
+static void release_frame(TSlot *sp)
+{
+	int i;
+	for (i = -(int)FRMHDR(sp)->size; i < -EXTRA_SLOTS; i++) {
+		spn_value_release(&sp[i].v);
+	}
+}
+
+static TSlot *caller_frame(TSlot *sp, TCoroutine **co)
+{
+	TSlot *prevsp = FRMHDR(sp)->prevsp;
+
+	if (prevsp == NULL && *co != NULL) {
+		prevsp = (*co)->rsp;
+		*co = (*co)->prev;
+	}
+
+	return prevsp;
 }
 
 /* retrieve a pointer to the register denoted by the `idx`th octet
@@ -563,7 +1191,7 @@ static SpnValue *nth_call_arg(TSlot *sp, spn_uword *ip, int idx)
  */
 static SpnValue *nth_vararg(TSlot *sp, int idx)
 {
-	TFrame *hdr = &sp[IDX_FRMHDR].h;
+	TFrame *hdr = FRMHDR(sp);
 	int vararg_off = hdr->size - EXTRA_SLOTS - hdr->extra_argc;
 
 	assert(idx >= 0 && idx < hdr->extra_argc);
@@ -571,42 +1199,157 @@ static SpnValue *nth_vararg(TSlot *sp, int idx)
 	return VALPTR(sp, vararg_off + idx);
 }
 
-/* This function uses switch dispatch instead of token-threaded dispatch
- * for the sake of conformance to standard C. (in GNU C, I could have used
- * the `goto labels_array[*ip++];` extension, though.)
+/* makes `vm->argv' large enough for `argc' arguments */
+static void reserve_argv(SpnVMachine *vm, int argc)
+{
+	if (argc > vm->argvsz) {
+		vm->argv = spn_mem_xrealloc(
+			vm->pool,
+			SPN_MEM_OTHER,
+			vm->argv,
+			vm->argvsz * sizeof(vm->argv[0]),
+			argc * sizeof(vm->argv[0])
+		);
+		vm->argvsz = argc;
+	}
+}
+
+/* By default, this function uses switch dispatch for the sake of
+ * conformance to standard C. When compiled as GNU C (i. e. the compiler
+ * supports the labels-as-values extension and it's not in strict ANSI
+ * mode), the instruction handlers are token-threaded instead: each one
+ * fetches the next instruction and jumps straight to its handler through
+ * `jmptbl', so that every handler gets its own indirect branch (which is
+ * much easier on the branch predictor than one shared `switch`).
+ * Define SPN_THREADED_DISPATCH to 0 or 1 in order to override the default.
+ *
+ * The handlers are written using the VM_* macros below, so the very same
+ * code is used in both dispatch modes; VM_NEXT ends an instruction handler.
+ */
+#ifndef SPN_THREADED_DISPATCH
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+#define SPN_THREADED_DISPATCH 1
+#else
+#define SPN_THREADED_DISPATCH 0
+#endif /* __GNUC__ && !__STRICT_ANSI__ */
+#endif /* SPN_THREADED_DISPATCH */
+
+#if SPN_THREADED_DISPATCH
+
+/* In release builds, the opcode isn't checked before indexing `jmptbl':
+ * the code comes either from the compiler or from spn_verify() (see ctx.c).
+ * The code after VM_DEFAULT is unreachable then.
  */
+#define VM_LABEL(op)		lbl_##op
+#define VM_CASE(op)		VM_LABEL(op):
+#ifdef NDEBUG
+#define VM_SWITCH(op)		goto *jmptbl[op];
+#define VM_DEFAULT
+#else
+#define VM_SWITCH(op)		goto *((size_t)(op) < COUNT(jmptbl) ? jmptbl[op] : &&lbl_illegal);
+#define VM_DEFAULT		lbl_illegal:
+#endif
+#define VM_NEXT			do {				\
+					ins = *ip++;		\
+					opcode = OPCODE(ins);	\
+					PROF_INSN(vm, opcode);	\
+					VM_SWITCH(opcode)	\
+				} while (0)
 
-static int dispatch_loop(SpnVMachine *vm)
+#else /* SPN_THREADED_DISPATCH */
+
+#define VM_SWITCH(op)		switch (op)
+#define VM_CASE(op)		case op:
+#define VM_DEFAULT		default:
+#define VM_NEXT			break
+
+#endif /* SPN_THREADED_DISPATCH */
+
+static int dispatch_loop(SpnVMachine *vm, spn_uword *ip)
 {
-	spn_uword *ip = current_bytecode(vm) + SPN_PRGHDR_LEN;
+#if SPN_THREADED_DISPATCH
+	/* the order of the labels must match that of `enum spn_vm_ins' */
+	static const void *const jmptbl[] = {
+		&&VM_LABEL(SPN_INS_CALL),
+		&&VM_LABEL(SPN_INS_RET),
+		&&VM_LABEL(SPN_INS_JMP),
+		&&VM_LABEL(SPN_INS_JZE),
+		&&VM_LABEL(SPN_INS_JNZ),
+		&&VM_LABEL(SPN_INS_EQ),
+		&&VM_LABEL(SPN_INS_NE),
+		&&VM_LABEL(SPN_INS_LT),
+		&&VM_LABEL(SPN_INS_LE),
+		&&VM_LABEL(SPN_INS_GT),
+		&&VM_LABEL(SPN_INS_GE),
+		&&VM_LABEL(SPN_INS_ADD),
+		&&VM_LABEL(SPN_INS_SUB),
+		&&VM_LABEL(SPN_INS_MUL),
+		&&VM_LABEL(SPN_INS_DIV),
+		&&VM_LABEL(SPN_INS_MOD),
+		&&VM_LABEL(SPN_INS_NEG),
+		&&VM_LABEL(SPN_INS_INC),
+		&&VM_LABEL(SPN_INS_DEC),
+		&&VM_LABEL(SPN_INS_AND),
+		&&VM_LABEL(SPN_INS_OR),
+		&&VM_LABEL(SPN_INS_XOR),
+		&&VM_LABEL(SPN_INS_SHL),
+		&&VM_LABEL(SPN_INS_SHR),
+		&&VM_LABEL(SPN_INS_BITNOT),
+		&&VM_LABEL(SPN_INS_LOGNOT),
+		&&VM_LABEL(SPN_INS_SIZEOF),
+		&&VM_LABEL(SPN_INS_TYPEOF),
+		&&VM_LABEL(SPN_INS_CONCAT),
+		&&VM_LABEL(SPN_INS_LDCONST),
+		&&VM_LABEL(SPN_INS_LDSYM),
+		&&VM_LABEL(SPN_INS_MOV),
+		&&VM_LABEL(SPN_INS_NEWARR),
+		&&VM_LABEL(SPN_INS_ARRGET),
+		&&VM_LABEL(SPN_INS_ARRSET),
+		&&VM_LABEL(SPN_INS_NTHARG),
+		&&VM_LABEL(SPN_INS_GLBSYM),
+		&&VM_LABEL(SPN_INS_JEQ),
+		&&VM_LABEL(SPN_INS_JNE),
+		&&VM_LABEL(SPN_INS_JLT),
+		&&VM_LABEL(SPN_INS_JLE),
+		&&VM_LABEL(SPN_INS_JGT),
+		&&VM_LABEL(SPN_INS_JGE),
+		&&VM_LABEL(SPN_INS_ADDI),
+		&&VM_LABEL(SPN_INS_CONCAT_ALL),
+		&&VM_LABEL(SPN_INS_FLDGET),
+		&&VM_LABEL(SPN_INS_FLDSET),
+		&&VM_LABEL(SPN_INS_NEXT),
+		&&VM_LABEL(SPN_INS_TAILCALL)
+	};
+#endif /* SPN_THREADED_DISPATCH */
 
 	while (1) {
 		spn_uword ins = *ip++;
 		enum spn_vm_ins opcode = OPCODE(ins);
 
-		switch (opcode) {
-		case SPN_INS_CALL: {
+		PROF_INSN(vm, opcode);
+
+		VM_SWITCH(opcode) {
+		VM_CASE(SPN_INS_CALL)
+		VM_CASE(SPN_INS_TAILCALL) {
 			/* XXX: the return value of a call to a Sparkling
-			 * function is stored in stack[header->retidx] and has
+			 * function is stored in *header->retptr and has
 			 * a reference count of one. Here, it MUST NOT be
 			 * retained, only its contents should be copied to the
 			 * destination register.
 			 * 
-			 * offsets insetad of pointers are used here because
-			 * a function call (in particular, push_frame()) may
-			 * `realloc()` the stack, thus rendering saved pointers
-			 * invalid.
+			 * Stack frames never move, so pointers into the
+			 * frame of the caller remain valid during the call.
+			 * 
+			 * TAILCALL only differs when it calls a Sparkling
+			 * function, see Remark (XII) in vm.h.
 			 * 
 			 * TODO: the implementation of this instruction needs
 			 * a fair amound of refactoring.
 			 */
-			TSlot *retslot = SLOTPTR(vm->sp, OPA(ins));
+			SpnValue *retval = VALPTR(vm->sp, OPA(ins));
 			SpnValue *func = VALPTR(vm->sp, OPB(ins));
 			int argc = OPC(ins);
 
-			SpnValue *retval = &retslot->v;
-			ptrdiff_t retidx = retslot - vm->stack;
-
 			/* this is the minimal number of `spn_uword`s needed
 			 * to store the register numbers representing
 			 * call-time arguments
@@ -625,32 +1368,76 @@ static int dispatch_loop(SpnVMachine *vm)
 
 			if (func->f & SPN_TFLG_NATIVE) {
 				/* call native function */
-				int i, err;
+				int err;
 				SpnValue tmpret;
 
-				/* allocate a big enough array for the arguments */
-				if (argc > vm->argvsz) {
-					vm->argvsz = argc;
-					vm->argv = realloc(vm->argv, argc * sizeof(vm->argv[0]));
-					if (vm->argv == NULL) {
-						abort();
+				/* the function value itself may be overwritten
+				 * by the return value, so save what's needed
+				 */
+				SpnFunction *fn = func->v.ptrv;
+				enum spn_val_flag fnflags = func->f;
+				const char *fnname = fn->name;
+
+				/* coresume() and coyield() switch stacks */
+				if ((fnflags & SPN_TFLG_REGARGS) == 0
+				 && (fn->r.fn == co_resume || fn->r.fn == co_yield)) {
+					ip = co_transfer(vm, ip, fn, retval, argc);
+					if (ip == NULL) {
+						return -1;
 					}
-				}
 
-				/* copy the arguments into the argument array */
-				for (i = 0; i < argc; i++) {
-					SpnValue *val = nth_call_arg(vm->sp, ip, i);
-					vm->argv[i] = *val;
+					SAFEPOINT(vm, ip);
+					JIT_ENTER(vm, ip);
+					VM_NEXT;
 				}
 
 				/* return nil unless otherwise specified */
 				tmpret.t = SPN_TYPE_NIL;
 				tmpret.f = 0;
 
+				PROF_ENTER(vm, fnname);
+
 				/* then call the native function. its return
 				 * value must have a reference count of one.
 				 */
-				err = func->v.fnv.r.fn(&tmpret, argc, vm->argv, vm->ctx);
+				if (fnflags & SPN_TFLG_REGARGS) {
+					/* no copying, the function reads
+					 * the arguments from our registers
+					 */
+					int i;
+
+					if (argc > vm->argpsz) {
+						vm->argp = spn_mem_xrealloc(
+							vm->pool,
+							SPN_MEM_OTHER,
+							vm->argp,
+							vm->argpsz * sizeof(vm->argp[0]),
+							argc * sizeof(vm->argp[0])
+						);
+						vm->argpsz = argc;
+					}
+
+					for (i = 0; i < argc; i++) {
+						vm->argp[i] = nth_call_arg(vm->sp, ip, i);
+					}
+
+					err = fn->r.regfn(&tmpret, argc, vm->argp, vm->ctx);
+				} else {
+					int i;
+
+					/* allocate a big enough array for the arguments */
+					reserve_argv(vm, argc);
+
+					/* copy the arguments into the argument array */
+					for (i = 0; i < argc; i++) {
+						SpnValue *val = nth_call_arg(vm->sp, ip, i);
+						vm->argv[i] = *val;
+					}
+
+					err = fn->r.fn(&tmpret, argc, vm->argv, vm->ctx);
+				}
+
+				PROF_LEAVE(vm);
 
 				/* clear and set return value register
 				 * (it's released only now because it may be
@@ -661,15 +1448,24 @@ static int dispatch_loop(SpnVMachine *vm)
 				spn_value_release(retval);
 				*retval = tmpret;
 
+				GC_CHECK(vm);
+
 				/* check if the native function returned
 				 * an error. If so, abort execution.
 				 */
-				if (err != 0) {
+				if ((fnflags & SPN_TFLG_NOFAIL) == 0 && err != 0) {
+					/* a refused allocation interrupts the
+					 * program too, then that's the reason
+					 */
+					if (vm->interrupt != NULL) {
+						return safepoint_stop(vm, ip - 1);
+					}
+
 					runerror(
 						vm,
 						ip - 1,
 						"error in function %s() (code %d)",
-						func->v.fnv.name,
+						fnname,
 						err
 					);
 					return -1;
@@ -680,6 +1476,8 @@ static int dispatch_loop(SpnVMachine *vm)
 				 * can accomodate `argc` octets)
 				 */
 				ip += narggroups;
+				SAFEPOINT(vm, ip);
+				JIT_ENTER(vm, ip);
 			} else {
 				/* call Sparkling function */
 				int i;
@@ -688,12 +1486,13 @@ static int dispatch_loop(SpnVMachine *vm)
 				 * understanding of the layout of the
 				 * bytecode representing a function
 				 */
-				spn_uword *fnhdr = func->v.fnv.r.bc;
-				int symtabidx = func->v.fnv.symtabidx;
+				SpnFunction *fn = func->v.ptrv;
+				spn_uword *fnhdr = fn->r.bc;
+				int symtabidx = fn->symtabidx;
 				int decl_argc = fnhdr[SPN_FUNCHDR_IDX_ARGC];
 				int nregs = fnhdr[SPN_FUNCHDR_IDX_NREGS];
 				spn_uword *entry = fnhdr + SPN_FUNCHDR_LEN;
-				const char *fnname = func->v.fnv.name;
+				const char *fnname = fn->name;
 
 				/* if there are less call arguments than formal
 				 * parameters, we set extra_argc to 0 (and all
@@ -704,23 +1503,47 @@ static int dispatch_loop(SpnVMachine *vm)
 
 				spn_uword *retaddr = ip + narggroups;
 
-				/* store the offset of the stack frame of the
-				 * caller so we can read the call arguments
-				 * later, when the active frame is that of the
-				 * called function. An offset is stored instead
-				 * of the stack pointer itself because the
-				 * push_frame() function reallocates the stack.
+				/* save the stack frame of the caller so we can
+				 * read the call arguments later, when the
+				 * active frame is that of the called function
 				 */
-				ptrdiff_t calleroff = vm->sp - vm->stack;
-				TSlot *caller;
+				TSlot *caller = vm->sp;
+
+				int tail = opcode == SPN_INS_TAILCALL;
+				unsigned long tailcalls = 0;
 
 				/* sanity check: decl_argc should be <= nregs,
 				 * else arguments wouldn't fit in the registers
 				 */
 				assert(decl_argc <= nregs);
 
+				if (tail) {
+					/* the frame of the caller is popped
+					 * first, so the arguments are moved out
+					 * of its registers (which pop_frame()
+					 * releases) into `argv'. The callee
+					 * returns where the caller would have.
+					 */
+					TFrame *self = FRMHDR(vm->sp);
+
+					retaddr = self->retaddr;
+					retval = self->retptr;
+					tailcalls = self->tailcalls + 1;
+
+					reserve_argv(vm, argc);
+
+					for (i = 0; i < argc; i++) {
+						SpnValue *val = nth_call_arg(vm->sp, ip, i);
+						spn_value_retain(val);
+						vm->argv[i] = *val;
+					}
+
+					pop_frame(vm);
+					PROF_LEAVE(vm);
+				}
+
 				/* push a new stack frame - after that,
-				 * `&vm->sp[IDX_FRMHDR].h` is a pointer to
+				 * `FRMHDR(vm->sp)` is a pointer to
 				 * the stack frame of the *called* function.
 				 */
 				push_frame(
@@ -728,16 +1551,22 @@ static int dispatch_loop(SpnVMachine *vm)
 					nregs,
 					decl_argc,
 					extra_argc,
+					argc,
 					retaddr,
-					retidx,
+					retval,
 					symtabidx,
 					fnname
 				);
 
-				/* and grab the (now potentially changed)
-				 * frame pointer of the caller function
+				FRMHDR(vm->sp)->tailcalls = tailcalls;
+				PROF_ENTER(vm, fnname);
+
+#if SPN_USE_JIT
+				/* the function is kept alive by the global
+				 * or the local symbol table while it runs
 				 */
-				caller = vm->stack + calleroff;
+				FRMHDR(vm->sp)->func = fn;
+#endif /* SPN_USE_JIT */
 
 				/* first, fill in arguments that fit into the
 				 * first `decl_argc` registers (i. e. those
@@ -755,23 +1584,33 @@ static int dispatch_loop(SpnVMachine *vm)
 					 * within the called function, which
 					 * releases its previous value.
 					 */
-					SpnValue *src = nth_call_arg(caller, ip, i);
+					SpnValue *src = tail ? &vm->argv[i] : nth_call_arg(caller, ip, i);
 
 					/* the first `decl_argc` registers hold
 					 * the named arguments
 					 */
 					SpnValue *dst = VALPTR(vm->sp, i);
-					spn_value_retain(src);
+
+					/* (the values in `argv' already
+					 * own a reference)
+					 */
+					if (tail == 0) {
+						spn_value_retain(src);
+					}
+
 					*dst = *src;
 				}
 
 				/* next, copy over the extra (unnamed) args */
 				for (i = decl_argc; i < argc; i++) {
-					SpnValue *src = nth_call_arg(caller, ip, i);
+					SpnValue *src = tail ? &vm->argv[i] : nth_call_arg(caller, ip, i);
 					int dstidx = i - decl_argc;
 					SpnValue *dst = nth_vararg(vm->sp, dstidx);
 
-					spn_value_retain(src);
+					if (tail == 0) {
+						spn_value_retain(src);
+					}
+
 					*dst = *src;
 				}
 
@@ -779,12 +1618,14 @@ static int dispatch_loop(SpnVMachine *vm)
 				 * to kick off the function call
 				 */
 				ip = entry;
+				SAFEPOINT(vm, ip);
+				JIT_ENTER(vm, ip);
 			}
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_RET: {
-			TFrame *callee = &vm->sp[IDX_FRMHDR].h;
+		VM_CASE(SPN_INS_RET) {
+			TFrame *callee = FRMHDR(vm->sp);
 			
 			/* storing the return value is done in two steps
 			 * because we need to ensure that if the return
@@ -796,7 +1637,7 @@ static int dispatch_loop(SpnVMachine *vm)
 			 */
 
 			/* this relies on the fact that pop_frame()
-			 * does NOT reallocate the stack
+			 * does NOT free the memory of the popped frame
 			 */
 			SpnValue *res = VALPTR(vm->sp, OPA(ins));
 
@@ -805,31 +1646,39 @@ static int dispatch_loop(SpnVMachine *vm)
 
 			/* pop the callee's frame */
 			pop_frame(vm);
+			PROF_LEAVE(vm);
 
 			/* transfer return value to caller's frame */
-			if (callee->retidx < 0) {	/* return from main program */
+			if (callee->retptr == NULL) {	/* return from main program */
 				vm->retval = *res;
 			} else {			/* return from a Sparkling function */
-				SpnValue *retptr = &vm->stack[callee->retidx].v;
-				spn_value_release(retptr);
-				*retptr = *res;
+				spn_value_release(callee->retptr);
+				*callee->retptr = *res;
 			}
 
 			/* check the return address. If it's NULL, then
-			 * we were at global (program) scope, so we terminate;
-			 * else we just adjust the instruction pointer.
-			 * In addition, of course, the top stack frame
-			 * needs to be popped.
+			 * we were at global (program) scope, so we terminate,
+			 * or a coroutine has finished, so we switch back to
+			 * its resumer; else we just adjust the instruction
+			 * pointer. In addition, of course, the top stack
+			 * frame needs to be popped.
 			 */
 			if (callee->retaddr == NULL) {
-				return 0;
+				if (vm->co == NULL) {
+					return 0;
+				}
+
+				ip = co_finish(vm);
 			} else {
 				ip = callee->retaddr;
 			}
 
-			break;
+			SAFEPOINT(vm, ip);
+			JIT_ENTER(vm, ip);
+
+			VM_NEXT;
 		}
-		case SPN_INS_JMP: {
+		VM_CASE(SPN_INS_JMP) {
 			/* ip has already passed by the opcode, it now
 			 * points to the beginning of the jump offset, so
 			 * store the offset and skip it
@@ -840,10 +1689,16 @@ static int dispatch_loop(SpnVMachine *vm)
 			 */
 			spn_sword offset = *ip++;
 			ip += offset;
-			break;
+
+			if (offset < 0) {
+				SAFEPOINT(vm, ip);
+				JIT_ENTER(vm, ip);
+			}
+
+			VM_NEXT;
 		}
-		case SPN_INS_JZE:
-		case SPN_INS_JNZ: {
+		VM_CASE(SPN_INS_JZE)
+		VM_CASE(SPN_INS_JNZ) {
 			SpnValue *reg = VALPTR(vm->sp, OPA(ins));
 
 			/* XXX: if offset is supposed to be negative, the
@@ -868,13 +1723,18 @@ static int dispatch_loop(SpnVMachine *vm)
 			if (opcode == SPN_INS_JZE && reg->v.boolv == 0    /* JZE jumps only if zero */
 			 || opcode == SPN_INS_JNZ && reg->v.boolv != 0) { /* JNZ jumps only if nonzero */
 				ip += offset;
+
+				if (offset < 0) {
+					SAFEPOINT(vm, ip);
+					JIT_ENTER(vm, ip);
+				}
 			}
 
-			break;
+			VM_NEXT;
 
 		}
-		case SPN_INS_EQ:
-		case SPN_INS_NE: {
+		VM_CASE(SPN_INS_EQ)
+		VM_CASE(SPN_INS_NE) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -894,75 +1754,33 @@ static int dispatch_loop(SpnVMachine *vm)
 			a->f = 0;
 			a->v.boolv = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_LT:
-		case SPN_INS_LE:
-		case SPN_INS_GT:
-		case SPN_INS_GE: {
+		VM_CASE(SPN_INS_LT)
+		VM_CASE(SPN_INS_LE)
+		VM_CASE(SPN_INS_GT)
+		VM_CASE(SPN_INS_GE) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
+			int res;
 
-			/* values must be checked for being orderable */
-			if (b->t == SPN_TYPE_NUMBER
-			 && c->t == SPN_TYPE_NUMBER) {
-
-				int res = numeric_compare(b, c, opcode);
-
-				spn_value_release(a);
-				a->t = SPN_TYPE_BOOL;
-				a->f = 0;
-				a->v.boolv = res;
-				
-			} else if (b->f & SPN_TFLG_OBJECT
-				&& c->f & SPN_TFLG_OBJECT) {
-
-				SpnObject *lhs = b->v.ptrv;
-				SpnObject *rhs = c->v.ptrv;
-				int res;
-
-				if (lhs->isa != rhs->isa) {
-					runerror(
-						vm,
-						ip - 1,
-						"ordered comparison of objects of different types"
-					);
-					return -1;
-				}
-
-				if (lhs->isa->compare == NULL) {
-					runerror(
-						vm,
-						ip - 1,
-						"ordered comparison of uncomparable objects"
-					);
-					return -1;
-				}
-
-				/* compute answer */
-				res = spn_object_cmp(lhs, rhs);
-
-				/* clean and update destination register */
-				spn_value_release(a);
-				a->t = SPN_TYPE_BOOL;
-				a->f = 0;
-				a->v.boolv = cmp2bool(res, opcode);
-			} else {
-				runerror(
-					vm,
-					ip - 1,
-					"ordered comparison of uncomparable values"
-				);
+			if (ordered_compare(vm, ip - 1, b, c, opcode, &res) != 0) {
 				return -1;
 			}
 
-			break;
+			/* clean and update destination register */
+			spn_value_release(a);
+			a->t = SPN_TYPE_BOOL;
+			a->f = 0;
+			a->v.boolv = res;
+
+			VM_NEXT;
 		}
-		case SPN_INS_ADD:
-		case SPN_INS_SUB:
-		case SPN_INS_MUL:
-		case SPN_INS_DIV: {
+		VM_CASE(SPN_INS_ADD)
+		VM_CASE(SPN_INS_SUB)
+		VM_CASE(SPN_INS_MUL)
+		VM_CASE(SPN_INS_DIV) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -974,6 +1792,27 @@ static int dispatch_loop(SpnVMachine *vm)
 				return -1;
 			}
 
+			/* fast path for the most common case: integer addition,
+			 * subtraction and multiplication
+			 */
+			if (((b->f | c->f) & SPN_TFLG_FLOAT) == 0
+			 && opcode != SPN_INS_DIV) {
+				long x = b->v.intv, y = c->v.intv;
+
+				/* numbers need not be released */
+				if (a->t != SPN_TYPE_NUMBER) {
+					spn_value_release(a);
+					a->t = SPN_TYPE_NUMBER;
+				}
+
+				a->f = 0;
+				a->v.intv = opcode == SPN_INS_ADD ? x + y
+					  : opcode == SPN_INS_SUB ? x - y
+					  :			    x * y;
+
+				VM_NEXT;
+			}
+
 			/* compute result */
 			res = arith_op(b, c, opcode);
 
@@ -981,9 +1820,9 @@ static int dispatch_loop(SpnVMachine *vm)
 			spn_value_release(a);
 			*a = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_MOD: {
+		VM_CASE(SPN_INS_MOD) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1007,9 +1846,9 @@ static int dispatch_loop(SpnVMachine *vm)
 			a->f = 0;
 			a->v.intv = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_NEG: {
+		VM_CASE(SPN_INS_NEG) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1034,10 +1873,10 @@ static int dispatch_loop(SpnVMachine *vm)
 				a->v.intv = res;
 			}
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_INC:
-		case SPN_INS_DEC: {
+		VM_CASE(SPN_INS_INC)
+		VM_CASE(SPN_INS_DEC) {
 			SpnValue *val = VALPTR(vm->sp, OPA(ins));
 
 			if (val->t != SPN_TYPE_NUMBER) {
@@ -1059,13 +1898,13 @@ static int dispatch_loop(SpnVMachine *vm)
 				}
 			}
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_AND:
-		case SPN_INS_OR:
-		case SPN_INS_XOR:
-		case SPN_INS_SHL:
-		case SPN_INS_SHR: {
+		VM_CASE(SPN_INS_AND)
+		VM_CASE(SPN_INS_OR)
+		VM_CASE(SPN_INS_XOR)
+		VM_CASE(SPN_INS_SHL)
+		VM_CASE(SPN_INS_SHR) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1090,9 +1929,9 @@ static int dispatch_loop(SpnVMachine *vm)
 			a->f = 0;
 			a->v.intv = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_BITNOT: {
+		VM_CASE(SPN_INS_BITNOT) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			long res;
@@ -1114,9 +1953,9 @@ static int dispatch_loop(SpnVMachine *vm)
 			a->f = 0;
 			a->v.intv = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_LOGNOT: {
+		VM_CASE(SPN_INS_LOGNOT) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			int res;
@@ -1133,22 +1972,22 @@ static int dispatch_loop(SpnVMachine *vm)
 			a->f = 0;
 			a->v.boolv = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_SIZEOF:
-		case SPN_INS_TYPEOF: {
+		VM_CASE(SPN_INS_SIZEOF)
+		VM_CASE(SPN_INS_TYPEOF) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue res = opcode == SPN_INS_SIZEOF
 					       ? sizeof_value(b)
-					       : typeof_value(b);
+					       : typeof_value(vm, b);
 
 			spn_value_release(a);
 			*a = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_CONCAT: {
+		VM_CASE(SPN_INS_CONCAT) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1161,15 +2000,18 @@ static int dispatch_loop(SpnVMachine *vm)
 			}
 
 			res = spn_string_concat(b->v.ptrv, c->v.ptrv);
+			if (res == NULL) {
+				return nomem(vm, ip - 1);
+			}
 
 			spn_value_release(a);
 			a->t = SPN_TYPE_STRING;
 			a->f = SPN_TFLG_OBJECT;
 			a->v.ptrv = res;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_LDCONST: {
+		VM_CASE(SPN_INS_LDCONST) {
 			/* the first argument is the destination register */
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 
@@ -1220,13 +2062,13 @@ static int dispatch_loop(SpnVMachine *vm)
 				SHANT_BE_REACHED();
 			}
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_LDSYM: {
+		VM_CASE(SPN_INS_LDSYM) {
 			/* operand A is the destination; operand B (16 bits)
 			 * is the index of the symbol in the local symbol table
 			 */
-			TFrame *frmhdr = &vm->sp[IDX_FRMHDR].h;
+			TFrame *frmhdr = FRMHDR(vm->sp);
 			int symtabidx = frmhdr->symtabidx;
 			TSymtab *symtab = &vm->lsymtabs[symtabidx];
 
@@ -1235,19 +2077,27 @@ static int dispatch_loop(SpnVMachine *vm)
 
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 
+			/* string constants are only created when they are
+			 * first used (see read_local_symtab())
+			 */
+			if (symp->t == SPN_TYPE_STRING
+			 && symp->f & SPN_TFLG_PENDING) {
+				strconst_from_bytecode(vm, symp);
+			}
+
 			/* if the symbol is an unresolved reference
 			 * to a global function, then attempt to resolve it
 			 */
 			if (symp->t == SPN_TYPE_FUNC
 			 && symp->f & SPN_TFLG_PENDING) {
-			 	const char *fnname = symp->v.fnv.name;
+			 	const char *fnname = ((SpnFunction *)(symp->v.ptrv))->name;
 				SpnValue *res = resolve_symbol(vm, fnname);
 			 	if (res->t == SPN_TYPE_NIL) {
 			 		runerror(
 			 			vm,
 			 			ip - 1,
 			 			"global `%s' was not found",
-			 			symp->v.fnv.name
+			 			fnname
 			 		);
 			 		return -1;
 			 	}
@@ -1257,6 +2107,8 @@ static int dispatch_loop(SpnVMachine *vm)
 			 	 * local symbol table so that we don't
 			 	 * need to resolve it anymore
 			 	 */
+			 	spn_value_retain(res);
+			 	spn_value_release(symp);
 			 	*symp = *res;
 			}
 
@@ -1273,9 +2125,9 @@ static int dispatch_loop(SpnVMachine *vm)
 			spn_value_release(dst);
 			*dst = *symp;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_MOV: {
+		VM_CASE(SPN_INS_MOV) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1290,9 +2142,9 @@ static int dispatch_loop(SpnVMachine *vm)
 			spn_value_release(a);
 			*a = *b;
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_NEWARR: {
+		VM_CASE(SPN_INS_NEWARR) {
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 
 			spn_value_release(dst);
@@ -1300,9 +2152,11 @@ static int dispatch_loop(SpnVMachine *vm)
 			dst->f = SPN_TFLG_OBJECT;
 			dst->v.ptrv = spn_array_new();
 
-			break;
+			GC_CHECK(vm);
+
+			VM_NEXT;
 		}
-		case SPN_INS_ARRGET: {
+		VM_CASE(SPN_INS_ARRGET) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1351,27 +2205,57 @@ static int dispatch_loop(SpnVMachine *vm)
 				a->t = SPN_TYPE_NUMBER;
 				a->f = 0;
 				a->v.intv = (unsigned char)(str->cstr[idx]);
+			} else if (spn_value_numbuf(b) != NULL) {
+				SpnValue val;
+				size_t idx;
+
+				if (numbuf_index(vm, ip - 1, b->v.ptrv, c, &idx) != 0) {
+					return -1;
+				}
+
+				/* `a` and `b` may be the same register */
+				spn_numbuf_get(b->v.ptrv, idx, &val);
+				spn_value_release(a);
+				*a = val;
 			} else {
-				runerror(vm, ip - 1, "first operand of [] operator must be an array or a string");
+				runerror(vm, ip - 1, "first operand of [] operator must be an array, a string or a numeric buffer");
 				return -1;
 			}
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_ARRSET: {
+		VM_CASE(SPN_INS_ARRSET) {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
 
-			if (a->t != SPN_TYPE_ARRAY) {
+			if (a->t == SPN_TYPE_ARRAY) {
+				spn_array_set(a->v.ptrv, b, c);
+			} else if (spn_value_numbuf(a) != NULL) {
+				size_t idx;
+
+				if (numbuf_index(vm, ip - 1, a->v.ptrv, b, &idx) != 0) {
+					return -1;
+				}
+
+				if (spn_numbuf_set(a->v.ptrv, idx, c) != 0) {
+					runerror(
+						vm,
+						ip - 1,
+						((SpnNumBuffer *)(a->v.ptrv))->type == SPN_NUMBUF_INT
+							? "storing non-integer value into integer buffer"
+							: "storing non-number value into float buffer"
+					);
+					return -1;
+				}
+			} else {
 				runerror(vm, ip - 1, "indexing into non-array value");
 				return -1;
 			}
 
-			spn_array_set(a->v.ptrv, b, c);
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_NTHARG: {
+		VM_CASE(SPN_INS_NTHARG) {
 			/* this accesses unnamed arguments only, so regardless
 			 * of the number of formal parameters, #0 always yields
 			 * the first **unnamed** argument, which is *not*
@@ -1379,7 +2263,7 @@ static int dispatch_loop(SpnVMachine *vm)
 			 */
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
-			TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
+			TFrame *hdr = FRMHDR(vm->sp);
 			long argidx;
 
 			if (b->t != SPN_TYPE_NUMBER) {
@@ -1413,9 +2297,9 @@ static int dispatch_loop(SpnVMachine *vm)
 				a->f = 0;
 			}
 
-			break;
+			VM_NEXT;
 		}
-		case SPN_INS_GLBSYM: {
+		VM_CASE(SPN_INS_GLBSYM) {
 			SpnValue funcval;
 			SpnValue funckey;
 
@@ -1458,48 +2342,289 @@ static int dispatch_loop(SpnVMachine *vm)
 			 * skip the code of the function body.)
 			 */
 			if (strcmp(symname, SPN_LAMBDA_NAME) == 0) {
-				break;
+				VM_NEXT;
 			}
 
-			/* create function value, insert it in global symtab */
-			funcval.t = SPN_TYPE_FUNC;
-			funcval.f = 0;
-			funcval.v.fnv.name = symname;
-			funcval.v.fnv.r.bc = hdr;
-			funcval.v.fnv.symtabidx = vm->sp[IDX_FRMHDR].h.symtabidx;
-			/* (the environment of a global function is always the
-			 * environment of the compilation unit itself)
-			 */
-
-			funckey.t = SPN_TYPE_STRING;
-			funckey.f = SPN_TFLG_OBJECT;
-			funckey.v.ptrv = spn_string_new_nocopy_len(symname, namelen, 0);
-
 			/* check for a function with the same name -- if one
 			 * exists, it's an error, there should be no functions
 			 * with identical names (except lambdas, they all have
 			 * the same name, but it's unused anyway).
 			 */
-			if (spn_array_get(vm->glbsymtab, &funckey)->t != SPN_TYPE_NIL) {
+			if (resolve_symbol(vm, symname)->t != SPN_TYPE_NIL) {
 				runerror(
 					vm,
 					ip,
 					"re-definition of global `%s'",
 					symname
 				);
-				spn_object_release(funckey.v.ptrv);
 				return -1;
 			}
 
+			/* create function value, insert it in global symtab
+			 * (the environment of a global function is always the
+			 * environment of the compilation unit itself)
+			 */
+			spn_func_value(
+				&funcval,
+				spn_func_new_script(
+					symname,
+					hdr,
+					FRMHDR(vm->sp)->symtabidx
+				)
+			);
+
+			funckey.t = SPN_TYPE_STRING;
+			funckey.f = SPN_TFLG_OBJECT;
+			funckey.v.ptrv = intern_string(vm, symname, namelen);
+
 			/* if everything was OK, add the function to the global
 			 * symbol table
 			 */
 			spn_array_set(vm->glbsymtab, &funckey, &funcval);
 			spn_object_release(funckey.v.ptrv);
+			spn_value_release(&funcval);
 
-			break;
+			VM_NEXT;
 		}
-		default:
+		VM_CASE(SPN_INS_JEQ)
+		VM_CASE(SPN_INS_JNE) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			int expect = OPC(ins) != 0;
+			spn_sword offset = *ip++;
+
+			int res = opcode == SPN_INS_JEQ
+				? spn_value_equal(a, b)
+				: spn_value_noteq(a, b);
+
+			if ((res != 0) == expect) {
+				ip += offset;
+
+				if (offset < 0) {
+					SAFEPOINT(vm, ip);
+					JIT_ENTER(vm, ip);
+				}
+			}
+
+			VM_NEXT;
+		}
+		VM_CASE(SPN_INS_JLT)
+		VM_CASE(SPN_INS_JLE)
+		VM_CASE(SPN_INS_JGT)
+		VM_CASE(SPN_INS_JGE) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			int expect = OPC(ins) != 0;
+			spn_sword offset = *ip++;
+			int res;
+
+			/* fast path: integer loop counters and the like */
+			if (a->t == SPN_TYPE_NUMBER
+			 && b->t == SPN_TYPE_NUMBER
+			 && ((a->f | b->f) & SPN_TFLG_FLOAT) == 0) {
+				long x = a->v.intv, y = b->v.intv;
+
+				switch (opcode) {
+				case SPN_INS_JLT: res = x <  y; break;
+				case SPN_INS_JLE: res = x <= y; break;
+				case SPN_INS_JGT: res = x >  y; break;
+				case SPN_INS_JGE: res = x >= y; break;
+				default: res = 0; SHANT_BE_REACHED();
+				}
+			} else {
+				/* XXX: this relies on the order of the ordered
+				 * comparison instructions being identical to
+				 * that of their fused counterparts
+				 */
+				int op = opcode - SPN_INS_JLT + SPN_INS_LT;
+
+				if (ordered_compare(vm, ip - 2, a, b, op, &res) != 0) {
+					return -1;
+				}
+			}
+
+			if (res == expect) {
+				ip += offset;
+
+				if (offset < 0) {
+					SAFEPOINT(vm, ip);
+					JIT_ENTER(vm, ip);
+				}
+			}
+
+			VM_NEXT;
+		}
+		VM_CASE(SPN_INS_ADDI) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			long imm = OPSIMMC(ins);
+			SpnValue res;
+
+			if (b->t != SPN_TYPE_NUMBER) {
+				runerror(vm, ip - 1, "arithmetic on non-numbers");
+				return -1;
+			}
+
+			res.t = SPN_TYPE_NUMBER;
+
+			if (b->f & SPN_TFLG_FLOAT) {
+				res.f = SPN_TFLG_FLOAT;
+				res.v.fltv = b->v.fltv + imm;
+			} else {
+				res.f = 0;
+				res.v.intv = b->v.intv + imm;
+			}
+
+			spn_value_release(a);
+			*a = res;
+
+			VM_NEXT;
+		}
+		VM_CASE(SPN_INS_CONCAT_ALL) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			int n = OPB(ins);
+			size_t len = 0;
+			char *p;
+			SpnString *res;
+			int i;
+
+			/* first pass: type check and compute the length */
+			for (i = 0; i < n; i++) {
+				SpnValue *val = nth_call_arg(vm->sp, ip, i);
+
+				if (val->t != SPN_TYPE_STRING) {
+					runerror(vm, ip - 1, "concatenation of non-string values");
+					return -1;
+				}
+
+				len += ((SpnString *)(val->v.ptrv))->len;
+			}
+
+			res = spn_string_new_buffer(len);
+			if (res == NULL) {
+				return nomem(vm, ip - 1);
+			}
+
+			/* second pass: copy the operands */
+			p = res->cstr;
+			for (i = 0; i < n; i++) {
+				SpnString *str = nth_call_arg(vm->sp, ip, i)->v.ptrv;
+				memcpy(p, str->cstr, str->len);
+				p += str->len;
+			}
+
+			/* the result is computed, `a' may now be overwritten */
+
+			spn_value_release(a);
+			a->t = SPN_TYPE_STRING;
+			a->f = SPN_TFLG_OBJECT;
+			a->v.ptrv = res;
+
+			/* skip operand register indices */
+			ip += ROUNDUP(n, SPN_WORD_OCTETS);
+
+			VM_NEXT;
+		}
+		VM_CASE(SPN_INS_FLDGET) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+
+			if (b->t == SPN_TYPE_ARRAY) {
+				SpnValue *key = field_key(vm, ip);
+				size_t *hint = field_cache(vm, ip);
+				SpnValue *val = spn_array_get_hinted(b->v.ptrv, key, hint);
+				spn_value_retain(val);
+
+				spn_value_release(a);
+				*a = *val;
+			} else if (b->t == SPN_TYPE_STRING) {
+				runerror(vm, ip - 1, "indexing string with non-number value");
+				return -1;
+			} else {
+				runerror(vm, ip - 1, "first operand of [] operator must be an array or a string");
+				return -1;
+			}
+
+			/* skip symbol index and cache index */
+			ip += 2;
+
+			VM_NEXT;
+		}
+		VM_CASE(SPN_INS_FLDSET) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+
+			if (a->t != SPN_TYPE_ARRAY) {
+				runerror(vm, ip - 1, "indexing into non-array value");
+				return -1;
+			}
+
+			spn_array_set_hinted(a->v.ptrv, field_key(vm, ip), b, field_cache(vm, ip));
+
+			/* skip symbol index and cache index */
+			ip += 2;
+
+			VM_NEXT;
+		}
+		VM_CASE(SPN_INS_NEXT) {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			SpnValue *c = VALPTR(vm->sp, OPC(ins));
+			spn_sword offset = ip[0];
+			SpnValue *cursor = VALPTR(vm->sp, (int)(ip[1] & 0xff));
+			SpnValue key, val;
+			int more;
+
+			/* the verifier can't tell what's in the register
+			 * at runtime, and a cursor of the wrong type would
+			 * corrupt the value (the compiler never emits such code)
+			 */
+			if (cursor->t != SPN_TYPE_NUMBER || cursor->f != 0) {
+				runerror(vm, ip - 1, "foreach cursor is not an integer");
+				return -1;
+			}
+
+			if (a->t == SPN_TYPE_ARRAY) {
+				more = spn_array_next(a->v.ptrv, &cursor->v.intv, &key, &val);
+			} else if (spn_value_numbuf(a) != NULL) {
+				/* elements of a buffer are visited in order */
+				SpnNumBuffer *buf = a->v.ptrv;
+
+				more = (size_t)(cursor->v.intv) < buf->len;
+
+				if (more) {
+					key.t = SPN_TYPE_NUMBER;
+					key.f = 0;
+					key.v.intv = cursor->v.intv++;
+					spn_numbuf_get(buf, key.v.intv, &val);
+				}
+			} else {
+				runerror(vm, ip - 1, "iterating over non-array value in foreach loop");
+				return -1;
+			}
+
+			/* skip jump offset and cursor register index */
+			ip += 2;
+
+			if (more) {
+				spn_value_retain(&key);
+				spn_value_retain(&val);
+
+				spn_value_release(b);
+				*b = key;
+
+				spn_value_release(c);
+				*c = val;
+
+				/* the offset is relative to the end of the offset word */
+				ip += offset - 1;
+				SAFEPOINT(vm, ip);
+				JIT_ENTER(vm, ip);
+			}
+
+			VM_NEXT;
+		}
+		VM_DEFAULT
 			runerror(vm, ip - 1, "illegal instruction 0x%02x", opcode);
 			return -1;
 		}
@@ -1525,15 +2650,18 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 	size_t symcount = bc[SPN_HDRIDX_SYMTABLEN];
 
 	spn_uword *stp = bc + offset;
-	size_t lsidx;
+	size_t lsidx, i;
+	SpnValue key, idxval, *res;
 
 	/* we only read the symbol table if it hasn't been read yet before */
-	size_t i;
-	for (i = 0; i < vm->lscount; i++) {
-		if (vm->lsymtabs[i].bc == bc) {
-			/* already known bytecode chunk, don't read symtab */
-			return i;
-		}
+	key.t = SPN_TYPE_USRDAT;
+	key.f = 0;
+	key.v.ptrv = bc;
+
+	res = spn_array_get(vm->lsindex, &key);
+	if (res->t != SPN_TYPE_NIL) {
+		/* already known bytecode chunk, don't read symtab */
+		return res->v.intv;
 	}
 
 	/* if we got here, the bytecode file is being run for the first time
@@ -1541,20 +2669,32 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 	 */
 	lsidx = vm->lscount++;
 
-	vm->lsymtabs = realloc(vm->lsymtabs, vm->lscount * sizeof(vm->lsymtabs[0]));
-	if (vm->lsymtabs == NULL) {
-		abort();
+	if (vm->lscount > vm->lsallsz) {
+		size_t allsz = vm->lsallsz == 0 ? 8 : vm->lsallsz * 2;
+		vm->lsymtabs = spn_mem_xrealloc(
+			vm->pool,
+			SPN_MEM_BYTECODE,
+			vm->lsymtabs,
+			vm->lsallsz * sizeof(vm->lsymtabs[0]),
+			allsz * sizeof(vm->lsymtabs[0])
+		);
+		vm->lsallsz = allsz;
 	}
 
+	idxval.t = SPN_TYPE_NUMBER;
+	idxval.f = 0;
+	idxval.v.intv = lsidx;
+	spn_array_set(vm->lsindex, &key, &idxval);
+
 	/* initialize new local symbol table */
 	cursymtab = &vm->lsymtabs[lsidx];
 	cursymtab->bc = bc;
 	cursymtab->size = symcount;
-	cursymtab->vals = malloc(symcount * sizeof(cursymtab->vals[0]));
-
-	if (cursymtab->vals == NULL) {
-		abort();
-	}
+	cursymtab->vals = spn_mem_xalloc(vm->pool, SPN_MEM_BYTECODE, symcount * sizeof(cursymtab->vals[0]));
+	cursymtab->fldcache = NULL;
+	cursymtab->fldcachesz = 0;
+	cursymtab->jit = NULL;
+	cursymtab->hotness = 0;
 
 	/* then actually read the symbols */
 	for (i = 0; i < symcount; i++) {
@@ -1563,9 +2703,6 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 
 		switch (sym) {
 		case SPN_LOCSYM_STRCONST: {
-			SpnString *str;
-			const char *cstr = (const char *)(stp);
-
 			size_t len = OPLONG(ins);
 			size_t nwords = ROUNDUP(len + 1, sizeof(spn_uword));
 
@@ -1575,15 +2712,17 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 			 * reported by `strlen()` shall match.
 			 */
 
-			size_t reallen = strlen(cstr);
+			size_t reallen = strlen((const char *)(stp));
 			assert(len == reallen);
 #endif
 
-			str = spn_string_new_nocopy_len(cstr, len, 0);
-
+			/* only remember where the string is: it is interned
+			 * when it's first loaded, so that programs don't pay
+			 * for the constants they never use
+			 */
 			cursymtab->vals[i].t = SPN_TYPE_STRING;
-			cursymtab->vals[i].f = SPN_TFLG_OBJECT;
-			cursymtab->vals[i].v.ptrv = str;
+			cursymtab->vals[i].f = SPN_TFLG_PENDING;
+			cursymtab->vals[i].v.ptrv = stp - 1;
 
 			stp += nwords;
 			break;
@@ -1603,16 +2742,10 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 			assert(len == reallen);
 #endif
 
-			cursymtab->vals[i].t = SPN_TYPE_FUNC;
-			cursymtab->vals[i].f = SPN_TFLG_PENDING;
-			cursymtab->vals[i].v.fnv.name = fnname;
-
-			/* note that `cursymtab->vals[i].v.fnv.symtabidx`
-			 * _must not_ be set here: a function stub is merely
-			 * an unresolved reference to a global function,
-			 * we don't know yet in which translation unit
-			 * the actual definition will be.
+			/* see spn_func_new_stub() about why there's
+			 * no symtab index for a stub
 			 */
+			spn_func_value(&cursymtab->vals[i], spn_func_new_stub(fnname));
 
 			stp += nwords;
 			break;	
@@ -1621,17 +2754,14 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 			size_t hdroff = OPLONG(ins);
 			spn_uword *entry = bc + hdroff;
 
-			cursymtab->vals[i].t = SPN_TYPE_FUNC;
-			cursymtab->vals[i].f = 0;
-			cursymtab->vals[i].v.fnv.name = NULL; /* lambda -> unnamed */
-			cursymtab->vals[i].v.fnv.r.bc = entry;
-			cursymtab->vals[i].v.fnv.symtabidx = lsidx;
+			/* lambda -> unnamed */
+			spn_func_value(&cursymtab->vals[i], spn_func_new_script(NULL, entry, lsidx));
 
 			/* unlike global functions, lambda functions can only
 			 * be implemented in the same translation unit int
 			 * which their local symtab entry is defined.
 			 * So we *can* (and should) fill in the `symtabidx'
-			 * member of the SpnValue while reading the symtab.
+			 * member of the function while reading the symtab.
 			 */
 
 			break;
@@ -1657,6 +2787,64 @@ static int read_local_symtab(SpnVMachine *vm, spn_uword *bc)
 	return lsidx;
 }
 
+/* turns a pending local symtab entry into the string object it refers to */
+static void strconst_from_bytecode(SpnVMachine *vm, SpnValue *symp)
+{
+	spn_uword *hdr = symp->v.ptrv;
+	const char *cstr = (const char *)(hdr + 1);
+	size_t len = OPLONG(*hdr);
+
+	symp->f = SPN_TFLG_OBJECT;
+	symp->v.ptrv = intern_string(vm, cstr, len);
+}
+
+/* `ip' points to the symbol index following a FLDGET or FLDSET.
+ * Returns the name of the field from the current local symbol table.
+ */
+static SpnValue *field_key(SpnVMachine *vm, spn_uword *ip)
+{
+	TSymtab *symtab = &vm->lsymtabs[FRMHDR(vm->sp)->symtabidx];
+	SpnValue *symp = &symtab->vals[ip[0]];
+
+	if (symp->f & SPN_TFLG_PENDING) {
+		strconst_from_bytecode(vm, symp);
+	}
+
+	assert(symp->t == SPN_TYPE_STRING);
+	return symp;
+}
+
+/* returns the inline cache of the FLDGET or FLDSET instruction
+ * the symbol index of which is pointed to by `ip'
+ */
+static size_t *field_cache(SpnVMachine *vm, spn_uword *ip)
+{
+	TSymtab *symtab = &vm->lsymtabs[FRMHDR(vm->sp)->symtabidx];
+	size_t idx = ip[1];
+
+	if (idx >= symtab->fldcachesz) {
+		size_t oldsz = symtab->fldcachesz;
+		size_t newsz = oldsz == 0 ? 16 : oldsz;
+
+		while (newsz <= idx) {
+			newsz *= 2;
+		}
+
+		symtab->fldcache = spn_mem_xrealloc(
+			vm->pool,
+			SPN_MEM_BYTECODE,
+			symtab->fldcache,
+			oldsz * sizeof(symtab->fldcache[0]),
+			newsz * sizeof(symtab->fldcache[0])
+		);
+
+		memset(symtab->fldcache + oldsz, 0, (newsz - oldsz) * sizeof(symtab->fldcache[0]));
+		symtab->fldcachesz = newsz;
+	}
+
+	return &symtab->fldcache[idx];
+}
+
 /* ordered comparisons */
 static int cmp2bool(int res, int op)
 {
@@ -1702,9 +2890,53 @@ static int numeric_compare(const SpnValue *lhs, const SpnValue *rhs, int op)
 	return cmp2bool(res, op);
 }
 
-static SpnValue arith_op(const SpnValue *lhs, const SpnValue *rhs, int op)
+/* the common part of LT, LE, GT, GE and their fused counterparts:
+ * numbers are compared by value, objects of the same class using their
+ * `compare' method. Returns 0 and sets `*res` on success; raises a runtime
+ * error at the instruction pointed to by `ip` and returns -1 otherwise.
+ */
+static int ordered_compare(
+	SpnVMachine *vm,
+	spn_uword *ip,
+	const SpnValue *lhs,
+	const SpnValue *rhs,
+	int op,
+	int *res
+)
 {
-	SpnValue res;
+	/* values must be checked for being orderable */
+	if (lhs->t == SPN_TYPE_NUMBER
+	 && rhs->t == SPN_TYPE_NUMBER) {
+		*res = numeric_compare(lhs, rhs, op);
+		return 0;
+	}
+
+	if (lhs->f & SPN_TFLG_OBJECT
+	 && rhs->f & SPN_TFLG_OBJECT) {
+		SpnObject *lobj = lhs->v.ptrv;
+		SpnObject *robj = rhs->v.ptrv;
+
+		if (lobj->isa != robj->isa) {
+			runerror(vm, ip, "ordered comparison of objects of different types");
+			return -1;
+		}
+
+		if (lobj->isa->compare == NULL) {
+			runerror(vm, ip, "ordered comparison of uncomparable objects");
+			return -1;
+		}
+
+		*res = cmp2bool(spn_object_cmp(lobj, robj), op);
+		return 0;
+	}
+
+	runerror(vm, ip, "ordered comparison of uncomparable values");
+	return -1;
+}
+
+static SpnValue arith_op(const SpnValue *lhs, const SpnValue *rhs, int op)
+{
+	SpnValue res;
 
 	assert(lhs->t == SPN_TYPE_NUMBER && rhs->t == SPN_TYPE_NUMBER);
 
@@ -1769,17 +3001,43 @@ static long bitwise_op(const SpnValue *lhs, const SpnValue *rhs, int op)
 
 static SpnValue *resolve_symbol(SpnVMachine *vm, const char *name)
 {
-	SpnValue *res;
-
+	/* only a lookup, so there's no need for a heap-allocated string */
+	SpnString str;
 	SpnValue nameval;
+
+	spn_string_init_lookup(&str, name, strlen(name));
+
 	nameval.t = SPN_TYPE_STRING;
 	nameval.f = SPN_TFLG_OBJECT;
-	nameval.v.ptrv = spn_string_new_nocopy(name, 0);
+	nameval.v.ptrv = &str;
 
-	res = spn_array_get(vm->glbsymtab, &nameval);
-	spn_object_release(nameval.v.ptrv);
+	return spn_array_get(vm->glbsymtab, &nameval);
+}
 
-	return res;
+static SpnString *intern_string(SpnVMachine *vm, const char *cstr, size_t len)
+{
+	SpnString str;
+	SpnValue key, *res;
+
+	spn_string_init_lookup(&str, cstr, len);
+
+	key.t = SPN_TYPE_STRING;
+	key.f = SPN_TFLG_OBJECT;
+	key.v.ptrv = &str;
+
+	res = spn_array_get(vm->strings, &key);
+
+	if (res->t == SPN_TYPE_NIL) {
+		/* not yet seen: make a copy, which is its own key. Inserting it
+		 * computes its hash, which is thenceforth cached.
+		 */
+		key.v.ptrv = spn_string_new_len(cstr, len);
+		spn_array_set(vm->strings, &key, &key);
+		return key.v.ptrv;
+	}
+
+	spn_object_retain(res->v.ptrv);
+	return res->v.ptrv;
 }
 
 static SpnValue sizeof_value(SpnValue *val)
@@ -1805,8 +3063,9 @@ static SpnValue sizeof_value(SpnValue *val)
 		break;
 	}
 	case SPN_TYPE_USRDAT: {
-		/* TODO: implement sizeof() for custom object types */
-		res.v.intv = 1;
+		/* TODO: implement sizeof() for other custom object types */
+		SpnNumBuffer *buf = spn_value_numbuf(val);
+		res.v.intv = buf != NULL ? (long)(buf->len) : 1;
 		break;
 	}
 	default:
@@ -1818,89 +3077,764 @@ static SpnValue sizeof_value(SpnValue *val)
 	return res;
 }
 
-static SpnValue typeof_value(SpnValue *val)
+static int numbuf_index(SpnVMachine *vm, spn_uword *ip, SpnNumBuffer *buf, const SpnValue *idx, size_t *pos)
 {
-	static SpnString *niltype	= NULL,
-			 *booltype	= NULL,
-			 *numtype	= NULL,
-			 *fntype	= NULL,
-			 *strtype	= NULL,
-			 *arrtype	= NULL,
-			 *usrtype	= NULL;
+	long len = buf->len;
+	long i;
 
-	int retainflag = 1;
+	if (idx->t != SPN_TYPE_NUMBER || idx->f != 0) {
+		runerror(vm, ip, "indexing numeric buffer with non-integer value");
+		return -1;
+	}
+
+	i = idx->v.intv;
+
+	/* negative indices count from the end of the buffer */
+	if (i < 0) {
+		i = len + i;
+	}
+
+	if (i < 0 || i >= len) {
+		runerror(
+			vm,
+			ip,
+			"element at normalized index %ld is\n"
+			"out of bounds for buffer of length %ld",
+			i,
+			len
+		);
+		return -1;
+	}
+
+	*pos = i;
+	return 0;
+}
 
+/* the names of the types are interned, so that they are per VM (they could
+ * be shared between all VMs, but reference counting isn't thread-safe)
+ */
+static SpnValue typeof_value(SpnVMachine *vm, SpnValue *val)
+{
+	const char *name;
 	SpnValue res;
+
+	switch (val->t) {
+	case SPN_TYPE_NIL:	name = "nil";		break;
+	case SPN_TYPE_BOOL:	name = "bool";		break;
+	case SPN_TYPE_NUMBER:	name = "number";	break;
+	case SPN_TYPE_FUNC:	name = "function";	break;
+	case SPN_TYPE_STRING:	name = "string";	break;
+	case SPN_TYPE_ARRAY:	name = "array";		break;
+	case SPN_TYPE_USRDAT:
+		/* custom object or non-object */
+		name = val->f & SPN_TFLG_OBJECT
+		     ? spn_object_type(val->v.ptrv)
+		     : "userdata";
+		break;
+	default:
+		SHANT_BE_REACHED();
+		name = NULL;
+	}
+
 	res.t = SPN_TYPE_STRING;
 	res.f = SPN_TFLG_OBJECT;
+	res.v.ptrv = intern_string(vm, name, strlen(name));
 
-	switch (val->t) {
-	case SPN_TYPE_NIL:
-		if (niltype == NULL) {
-			niltype = spn_string_new_nocopy("nil", 0);
+	return res;
+}
+
+/* coroutines */
+
+static void free_coroutine(void *obj);
+
+static const SpnClass spn_class_coroutine = {
+	"coroutine",
+	sizeof(TCoroutine),
+	NULL,
+	NULL,
+	NULL,
+	free_coroutine,
+	SPN_MEM_FRAMES,
+	1
+};
+
+static void free_coroutine(void *obj)
+{
+	TCoroutine *co = obj;
+
+	/* only a suspended coroutine has frames of its own (a running
+	 * one isn't freed, since the VM holds a reference to it)
+	 */
+	if (co->state == CO_SUSPENDED) {
+		TSlot *sp;
+		for (sp = co->sp; sp != NULL; sp = FRMHDR(sp)->prevsp) {
+			release_frame(sp);
 		}
+	}
 
-		res.v.ptrv = niltype;
-		break;
-	case SPN_TYPE_BOOL:
-		if (booltype == NULL) {
-			booltype = spn_string_new_nocopy("bool", 0);
+	co_unlink(co);
+	free_segments(co->stack);
+	spn_value_release(&co->func);
+	spn_value_release(&co->ret);
+}
+
+static void co_link(SpnVMachine *vm, TCoroutine *co)
+{
+	co->vm = vm;
+	co->lprev = NULL;
+	co->lnext = vm->colist;
+
+	if (vm->colist != NULL) {
+		vm->colist->lprev = co;
+	}
+
+	vm->colist = co;
+}
+
+static void co_unlink(TCoroutine *co)
+{
+	if (co->vm == NULL) {
+		return;
+	}
+
+	if (co->lprev != NULL) {
+		co->lprev->lnext = co->lnext;
+	} else {
+		co->vm->colist = co->lnext;
+	}
+
+	if (co->lnext != NULL) {
+		co->lnext->lprev = co->lprev;
+	}
+
+	co->vm = NULL;
+}
+
+static void co_abandon(TCoroutine *co)
+{
+	TSlot *sp = co->sp;
+
+	/* releasing the frames may free it otherwise */
+	spn_object_retain(co);
+	co_unlink(co);
+
+	if (co->state == CO_SUSPENDED) {
+		while (sp != NULL) {
+			TSlot *prevsp = FRMHDR(sp)->prevsp;
+			release_frame(sp);
+			sp = prevsp;
 		}
+	}
 
-		res.v.ptrv = booltype;
-		break;
-	case SPN_TYPE_NUMBER:
-		if (numtype == NULL) {
-			numtype = spn_string_new_nocopy("number", 0);
+	free_segments(co->stack);
+	co->stack = NULL;
+	co->state = CO_DEAD;
+
+	spn_object_release(co);
+}
+
+static TCoroutine *coroutine_value(const SpnValue *val)
+{
+	if (val->t == SPN_TYPE_USRDAT
+	 && val->f & SPN_TFLG_OBJECT
+	 && ((SpnObject *)(val->v.ptrv))->isa == &spn_class_coroutine) {
+		return val->v.ptrv;
+	}
+
+	return NULL;
+}
+
+static const char *co_state_name(int state)
+{
+	switch (state) {
+	case CO_FRESH:
+	case CO_SUSPENDED:	return "suspended";
+	case CO_RUNNING:	return "running";
+	case CO_NORMAL:		return "normal";
+	case CO_DEAD:		return "dead";
+	default:		SHANT_BE_REACHED();
+	}
+
+	return NULL;
+}
+
+static int co_create(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	TCoroutine *co;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	/* the function must be a Sparkling function */
+	if (argv[0].t != SPN_TYPE_FUNC || argv[0].f & (SPN_TFLG_NATIVE | SPN_TFLG_PENDING)) {
+		return -2;
+	}
+
+	co = spn_object_new(&spn_class_coroutine);
+	co->state = CO_FRESH;
+
+	spn_value_retain(&argv[0]);
+	co->func = argv[0];
+
+	co->ret.t = SPN_TYPE_NIL;
+	co->ret.f = 0;
+
+	co->stack = NULL;
+	co->seg = NULL;
+	co->sp = NULL;
+	co->ip = NULL;
+	co->dst = NULL;
+	co->prev = NULL;
+	co->vm = NULL;
+	co->lprev = NULL;
+	co->lnext = NULL;
+
+	ret->t = SPN_TYPE_USRDAT;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = co;
+
+	return 0;
+}
+
+static int co_resume(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	/* the VM does the work, see co_transfer() */
+	return -1;
+}
+
+static int co_yield(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return -1;
+}
+
+static int co_status(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	TCoroutine *co;
+
+	if (argc != 1) {
+		return -1;
+	}
+
+	co = coroutine_value(&argv[0]);
+	if (co == NULL) {
+		return -2;
+	}
+
+	ret->t = SPN_TYPE_STRING;
+	ret->f = SPN_TFLG_OBJECT;
+	ret->v.ptrv = spn_string_new_nocopy(co_state_name(co->state), 0);
+
+	return 0;
+}
+
+/* pushes the first frame of a coroutine on its (new) stack, with the call
+ * arguments after the coroutine itself in the frame `caller'. Returns the
+ * entry point of its function.
+ */
+static spn_uword *co_start(SpnVMachine *vm, TCoroutine *co, TSlot *caller, spn_uword *ip, int argc)
+{
+	SpnFunction *fn = co->func.v.ptrv;
+	spn_uword *fnhdr = fn->r.bc;
+	int decl_argc = fnhdr[SPN_FUNCHDR_IDX_ARGC];
+	int nregs = fnhdr[SPN_FUNCHDR_IDX_NREGS];
+	int extra_argc = argc > decl_argc ? argc - decl_argc : 0;
+	int i;
+
+	/* the function returns into the coroutine, see co_finish() */
+	vm->seg = NULL;
+	vm->sp = NULL;
+	push_frame(vm, nregs, decl_argc, extra_argc, argc, NULL, &co->ret, fn->symtabidx, fn->name);
+	co->stack = vm->seg;
+	co_link(vm, co);
+
+	PROF_ENTER(vm, fn->name);
+
+#if SPN_USE_JIT
+	/* `co->func' keeps the function alive */
+	FRMHDR(vm->sp)->func = fn;
+#endif /* SPN_USE_JIT */
+
+	for (i = 0; i < argc; i++) {
+		SpnValue *src = nth_call_arg(caller, ip, i + 1);
+		SpnValue *dst = i < decl_argc ? VALPTR(vm->sp, i) : nth_vararg(vm->sp, i - decl_argc);
+
+		spn_value_retain(src);
+		*dst = *src;
+	}
+
+	return fnhdr + SPN_FUNCHDR_LEN;
+}
+
+/* switches from the running coroutine back to its resumer. `val' is the
+ * result of coresume(); the reference to it is transferred.
+ */
+static spn_uword *co_return(SpnVMachine *vm, SpnValue *val)
+{
+	TCoroutine *co = vm->co;
+	spn_uword *ip = co->rip;
+
+	vm->seg = co->rseg;
+	vm->sp = co->rsp;
+	vm->co = co->prev;
+	co->prev = NULL;
+
+	if (vm->co != NULL) {
+		vm->co->state = CO_RUNNING;
+	}
+
+	spn_value_release(co->rdst);
+	*co->rdst = *val;
+
+	spn_object_release(co);
+	return ip;
+}
+
+static spn_uword *co_transfer(SpnVMachine *vm, spn_uword *ip, SpnFunction *fn, SpnValue *retval, int argc)
+{
+	spn_uword *next = ip + ROUNDUP(argc, SPN_WORD_OCTETS);
+	TCoroutine *co;
+	SpnValue val;
+
+	if (fn->r.fn == co_yield) {
+		co = vm->co;
+
+		if (co == NULL) {
+			runerror(vm, ip - 1, "coyield() called outside of a coroutine");
+			return NULL;
 		}
 
-		res.v.ptrv = numtype;
-		break;
-	case SPN_TYPE_FUNC:
-		if (fntype == NULL) {
-			fntype = spn_string_new_nocopy("function", 0);
+		if (argc > 1) {
+			runerror(vm, ip - 1, "coyield() takes at most one argument");
+			return NULL;
 		}
 
-		res.v.ptrv = fntype;
-		break;
-	case SPN_TYPE_STRING:
-		if (strtype == NULL) {
-			strtype = spn_string_new_nocopy("string", 0);
+		if (argc > 0) {
+			val = *nth_call_arg(vm->sp, ip, 0);
+			spn_value_retain(&val);
+		} else {
+			val.t = SPN_TYPE_NIL;
+			val.f = 0;
 		}
 
-		res.v.ptrv = strtype;
-		break;
-	case SPN_TYPE_ARRAY:
-		if (arrtype == NULL) {
-			arrtype = spn_string_new_nocopy("array", 0);
+		/* save where the coroutine continues */
+		co->state = CO_SUSPENDED;
+		co->seg = vm->seg;
+		co->sp = vm->sp;
+		co->ip = next;
+		co->dst = retval;
+
+		return co_return(vm, &val);
+	}
+
+	co = argc > 0 ? coroutine_value(nth_call_arg(vm->sp, ip, 0)) : NULL;
+
+	if (co == NULL) {
+		runerror(vm, ip - 1, "first argument of coresume() must be a coroutine");
+		return NULL;
+	}
+
+	if (co->state != CO_FRESH && co->state != CO_SUSPENDED) {
+		runerror(vm, ip - 1, "cannot resume %s coroutine", co_state_name(co->state));
+		return NULL;
+	}
+
+	if (co->state == CO_SUSPENDED && argc > 2) {
+		runerror(vm, ip - 1, "coresume() passes at most one value to coyield()");
+		return NULL;
+	}
+
+	/* save where the resumer continues */
+	co->rseg = vm->seg;
+	co->rsp = vm->sp;
+	co->rip = next;
+	co->rdst = retval;
+	co->prev = vm->co;
+
+	if (vm->co != NULL) {
+		vm->co->state = CO_NORMAL;
+	}
+
+	spn_object_retain(co);
+	vm->co = co;
+
+	if (co->state == CO_FRESH) {
+		co->state = CO_RUNNING;
+		return co_start(vm, co, vm->sp, ip, argc - 1);
+	}
+
+	/* the value passed in is the result of coyield() */
+	if (argc > 1) {
+		val = *nth_call_arg(vm->sp, ip, 1);
+		spn_value_retain(&val);
+	} else {
+		val.t = SPN_TYPE_NIL;
+		val.f = 0;
+	}
+
+	spn_value_release(co->dst);
+	*co->dst = val;
+
+	co->state = CO_RUNNING;
+	vm->seg = co->seg;
+	vm->sp = co->sp;
+
+	return co->ip;
+}
+
+static spn_uword *co_finish(SpnVMachine *vm)
+{
+	TCoroutine *co = vm->co;
+	SpnValue val = co->ret;
+
+	/* the frames are gone, and RET has read the last one already */
+	free_segments(co->stack);
+	co->stack = NULL;
+	co_unlink(co);
+
+	co->ret.t = SPN_TYPE_NIL;
+	co->ret.f = 0;
+
+	co->state = CO_DEAD;
+
+	return co_return(vm, &val);
+}
+
+#if SPN_USE_JIT
+
+/* `ip' is in the code of the topmost frame: the body of a function, or the
+ * top-level code of a program. That code is compiled once it has been
+ * entered SPN_JIT_THRESHOLD times, and from then on, it's run natively.
+ */
+static spn_uword *jit_enter(SpnVMachine *vm, spn_uword *ip)
+{
+	TFrame *hdr = FRMHDR(vm->sp);
+	SpnJitCode **jit;
+	unsigned long *hotness;
+	spn_uword *code;
+	size_t len;
+
+#ifdef SPN_PROFILE
+	/* native code doesn't count instructions */
+	if (vm->prof.flags != 0) {
+		return ip;
+	}
+#endif /* SPN_PROFILE */
+
+	/* nor the steps of a budget */
+	if (vm->countdown != 0) {
+		return ip;
+	}
+
+	if (hdr->func != NULL) {
+		jit = &hdr->func->jit;
+		hotness = &hdr->func->hotness;
+	} else {
+		TSymtab *symtab = &vm->lsymtabs[hdr->symtabidx];
+		jit = &symtab->jit;
+		hotness = &symtab->hotness;
+	}
+
+	if (*jit == NULL) {
+		/* compile only once, even if it fails */
+		if (++*hotness != SPN_JIT_THRESHOLD) {
+			return ip;
 		}
 
-		res.v.ptrv = arrtype;
-		break;
-	case SPN_TYPE_USRDAT:
-		if (val->f & SPN_TFLG_OBJECT) {
-			/* custom object */
-			const char *classname = spn_object_type(val->v.ptrv);
-			res.v.ptrv = spn_string_new_nocopy(classname, 0);
-			retainflag = 0;
+		if (hdr->func != NULL) {
+			spn_uword *fnhdr = hdr->func->r.bc;
+			code = fnhdr + SPN_FUNCHDR_LEN;
+			len = fnhdr[SPN_FUNCHDR_IDX_BODYLEN];
 		} else {
-			/* custom non-object */
-			if (usrtype == NULL) {
-				usrtype = spn_string_new_nocopy("userdata", 0);
-			}
+			spn_uword *bc = vm->lsymtabs[hdr->symtabidx].bc;
+			code = bc + SPN_PRGHDR_LEN;
+			len = bc[SPN_HDRIDX_SYMTABOFF] - SPN_PRGHDR_LEN;
+		}
 
-			res.v.ptrv = usrtype;
+		*jit = spn_jit_compile(code, len);
+		if (*jit == NULL) {
+			return ip;
 		}
+	}
 
-		break;
-	default:
-		SHANT_BE_REACHED();
+	/* the generated code addresses registers relative to register 0 */
+	assert(sizeof(TSlot) == sizeof(SpnValue));
+
+	return spn_jit_run(*jit, ip, VALPTR(vm->sp, 0));
+}
+
+#endif /* SPN_USE_JIT */
+
+
+#ifdef SPN_PROFILE
+
+/* makes room for `count` elements of size `elsize` in the array `ptr`,
+ * of which `*allsz` elements are allocated
+ */
+static void *prof_reserve(void *ptr, size_t *allsz, size_t count, size_t elsize)
+{
+	if (count <= *allsz) {
+		return ptr;
 	}
 
-	if (retainflag) {
-		spn_value_retain(&res);
+	*allsz = *allsz == 0 ? 16 : *allsz * 2;
+	if (*allsz < count) {
+		*allsz = count;
 	}
 
-	return res;
+	ptr = realloc(ptr, *allsz * elsize);
+	if (ptr == NULL) {
+		abort();
+	}
+
+	return ptr;
+}
+
+static void prof_init(TProfile *prof)
+{
+	size_t i;
+
+	prof->flags = 0;
+	prof->interval = SPN_PROFILE_INTERVAL;
+	prof->countdown = SPN_PROFILE_INTERVAL;
+
+	for (i = 0; i < SPN_INS_COUNT; i++) {
+		prof->opcounts[i] = 0;
+	}
+
+	prof->funcs = NULL;
+	prof->nfuncs = 0;
+	prof->funcsallsz = 0;
+	prof->funcindex = NULL;
+	prof->report = NULL;
+
+	prof->stack = NULL;
+	prof->depth = 0;
+	prof->stackallsz = 0;
+
+	prof->samples = NULL;
+	prof->nsamples = 0;
+	prof->samplesallsz = 0;
+	prof->sampleindex = NULL;
+	prof->buf = NULL;
+	prof->bufsz = 0;
+}
+
+/* frees the collected data and disables profiling */
+static void prof_clear(TProfile *prof)
+{
+	free(prof->funcs);
+	free(prof->report);
+	free(prof->stack);
+	free(prof->samples);
+	free(prof->buf);
+
+	/* the names of the functions and the stacks are owned by these */
+	if (prof->funcindex != NULL) {
+		spn_object_release(prof->funcindex);
+	}
+
+	if (prof->sampleindex != NULL) {
+		spn_object_release(prof->sampleindex);
+	}
+
+	prof_init(prof);
+}
+
+/* returns the index of the entry in `arr` keyed by the string `str`. If
+ * there's no such entry yet, it gets the index `*count`, which is then
+ * incremented, and `*name` is set to the copy of `str` that is the key
+ * of the new entry (so it is owned by `arr`).
+ */
+static size_t prof_index(SpnArray *arr, const char *str, size_t len, size_t *count, const char **name)
+{
+	SpnString lookup;
+	SpnValue key, idxval, *res;
+
+	spn_string_init_lookup(&lookup, str, len);
+
+	key.t = SPN_TYPE_STRING;
+	key.f = SPN_TFLG_OBJECT;
+	key.v.ptrv = &lookup;
+
+	res = spn_array_get(arr, &key);
+	if (res->t != SPN_TYPE_NIL) {
+		return res->v.intv;
+	}
+
+	idxval.t = SPN_TYPE_NUMBER;
+	idxval.f = 0;
+	idxval.v.intv = (*count)++;
+
+	key.v.ptrv = spn_string_new_len(str, len);
+	spn_array_set(arr, &key, &idxval);
+	*name = ((SpnString *)key.v.ptrv)->cstr;
+	spn_object_release(key.v.ptrv);
+
+	return idxval.v.intv;
+}
+
+/* returns the index of the profile of the function called `fnname` */
+static size_t prof_func(SpnVMachine *vm, const char *fnname)
+{
+	TProfile *prof = &vm->prof;
+	SpnValue key, idxval, *res;
+	const char *name = NULL;
+	size_t idx;
+
+	/* a function is usually called through the same name pointer (into
+	 * the bytecode or a native library), so that is looked up first.
+	 * The name is compared too, in case the memory has been reused.
+	 */
+	key.t = SPN_TYPE_USRDAT;
+	key.f = 0;
+	key.v.ptrv = (void *)fnname;
+
+	res = spn_array_get(prof->funcindex, &key);
+	if (res->t != SPN_TYPE_NIL) {
+		idx = res->v.intv;
+		if (strcmp(prof->funcs[idx].name, fnname) == 0) {
+			return idx;
+		}
+	}
+
+	idx = prof_index(prof->funcindex, fnname, strlen(fnname), &prof->nfuncs, &name);
+
+	if (name != NULL) {
+		/* first call of this function */
+		TProfFunc *func;
+
+		prof->funcs = prof_reserve(prof->funcs, &prof->funcsallsz, prof->nfuncs, sizeof(prof->funcs[0]));
+
+		func = &prof->funcs[idx];
+		func->name = name;
+		func->calls = 0;
+		func->active = 0;
+		func->inclusive = 0;
+		func->exclusive = 0;
+	}
+
+	idxval.t = SPN_TYPE_NUMBER;
+	idxval.f = 0;
+	idxval.v.intv = idx;
+	spn_array_set(prof->funcindex, &key, &idxval);
+
+	return idx;
+}
+
+static void prof_enter(SpnVMachine *vm, const char *fnname)
+{
+	TProfile *prof = &vm->prof;
+	size_t idx = prof_func(vm, fnname != NULL ? fnname : SPN_LAMBDA_NAME);
+	TProfFrame *frame;
+
+	prof->stack = prof_reserve(prof->stack, &prof->stackallsz, prof->depth + 1, sizeof(prof->stack[0]));
+
+	frame = &prof->stack[prof->depth++];
+	frame->func = idx;
+	frame->children = 0;
+
+	prof->funcs[idx].calls++;
+	prof->funcs[idx].active++;
+
+	/* last, so that the bookkeeping above isn't billed to the callee */
+	frame->start = clock();
+}
+
+static void prof_leave(SpnVMachine *vm)
+{
+	TProfile *prof = &vm->prof;
+	TProfFrame *frame;
+	TProfFunc *func;
+	clock_t elapsed;
+
+	/* the function was entered before profiling had been enabled */
+	if (prof->depth == 0) {
+		return;
+	}
+
+	frame = &prof->stack[--prof->depth];
+	func = &prof->funcs[frame->func];
+	elapsed = clock() - frame->start;
+
+	func->exclusive += elapsed - frame->children;
+
+	/* recursive calls are already included in the outermost one */
+	if (--func->active == 0) {
+		func->inclusive += elapsed;
+	}
+
+	if (prof->depth > 0) {
+		prof->stack[prof->depth - 1].children += elapsed;
+	}
+}
+
+/* records the current call stack in the folded format */
+static void prof_sample(SpnVMachine *vm)
+{
+	TProfile *prof = &vm->prof;
+	const char *name = NULL;
+	size_t len = 0, idx;
+	TCoroutine *co;
+	TSlot *sp;
+	char *p;
+
+	/* each name is followed by a separator or the terminating NUL */
+	for (sp = vm->sp, co = vm->co; sp != NULL; sp = caller_frame(sp, &co)) {
+		const char *fnname = FRMHDR(sp)->fnname;
+		len += strlen(fnname != NULL ? fnname : SPN_LAMBDA_NAME) + 1;
+	}
+
+	if (len == 0) {
+		return;
+	}
+
+	prof->buf = prof_reserve(prof->buf, &prof->bufsz, len, 1);
+
+	/* the innermost frame is the last one in the folded stack */
+	p = prof->buf + len - 1;
+	*p = 0;
+
+	for (sp = vm->sp, co = vm->co; sp != NULL; sp = caller_frame(sp, &co)) {
+		const char *fnname = FRMHDR(sp)->fnname;
+		size_t n;
+
+		if (fnname == NULL) {
+			fnname = SPN_LAMBDA_NAME;
+		}
+
+		n = strlen(fnname);
+		p -= n;
+		memcpy(p, fnname, n);
+
+		if (p > prof->buf) {
+			*--p = ';';
+		}
+	}
+
+	idx = prof_index(prof->sampleindex, prof->buf, len - 1, &prof->nsamples, &name);
+
+	if (name != NULL) {
+		prof->samples = prof_reserve(prof->samples, &prof->samplesallsz, prof->nsamples, sizeof(prof->samples[0]));
+		prof->samples[idx].stack = name;
+		prof->samples[idx].count = 0;
+	}
+
+	prof->samples[idx].count++;
+}
+
+static void prof_insn(SpnVMachine *vm, enum spn_vm_ins opcode)
+{
+	TProfile *prof = &vm->prof;
+
+	if ((prof->flags & SPN_PROFILE_COUNTS) && (size_t)opcode < SPN_INS_COUNT) {
+		prof->opcounts[opcode]++;
+	}
+
+	if ((prof->flags & SPN_PROFILE_SAMPLES) && --prof->countdown == 0) {
+		prof->countdown = prof->interval;
+		prof_sample(vm);
+	}
 }
 
+#endif /* SPN_PROFILE */
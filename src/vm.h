@@ -32,9 +32,27 @@ typedef struct SpnExtFunc {
 	int (*fn)(SpnValue *, int, SpnValue *, void *);
 } SpnExtFunc;
 
+/* an extension function using the faster calling convention. It does not
+ * get a copy of the arguments: `argv` is an array of pointers to the
+ * registers of the caller that hold the arguments. Apart from that, the
+ * same rules apply as for SpnExtFunc (in particular, the arguments must not
+ * be modified). The pointers are only valid during the call.
+ * If `nofail` is nonzero, the function promises that it always succeeds, and
+ * its C return value is not checked.
+ */
+typedef struct SpnExtFastFunc {
+	const char *name;
+	int (*fn)(SpnValue *, int, SpnValue **, void *);
+	int nofail;
+} SpnExtFastFunc;
+
 /* the virtual machine */
 typedef struct SpnVMachine SpnVMachine;
 
+/* the VM allocates its stack, its symbol tables and its other buffers from
+ * the pool which is current when it's created (see spn_mem_alloc()), and it
+ * checks the limit of that pool before running or resuming a program.
+ */
 SPN_API SpnVMachine	 *spn_vm_new();
 SPN_API void		  spn_vm_free(SpnVMachine *vm);
 
@@ -43,13 +61,47 @@ SPN_API void		  spn_vm_free(SpnVMachine *vm);
  * Furthermore, it is invalidated by a subsequent call to `spn_vm_exec()`, so
  * if you need to store the value for later use, retain it AND make a COPY
  * of the SpnValue struct it points to.
+ * The bytecode is trusted: it must have been produced by the compiler or
+ * have passed spn_verify() (see verify.h), otherwise anything can happen.
  */
 SPN_API SpnValue	 *spn_vm_exec(SpnVMachine *vm, spn_uword *bc);
 
+/* resumable execution. With a nonzero budget, spn_vm_exec() runs at most
+ * `budget` steps of the program, then it suspends the program and returns
+ * NULL, even though there was no error. A step is a function call or return,
+ * or a backward jump (an iteration of a loop): between two steps, at most
+ * as many instructions are executed as there are in a function body, so a
+ * step takes bounded time (apart from the time spent in native functions).
+ * spn_vm_suspended() returns nonzero while a program is suspended, and
+ * spn_vm_resume() continues it with a fresh budget. That function has the
+ * same return values as spn_vm_exec(); when there's nothing to resume, it
+ * returns NULL.
+ * A budget of 0 (the default) means no limit. In order to keep to a
+ * deadline, run the program in slices of a small budget, and check the
+ * clock between them. A native function can call spn_vm_suspend(): then
+ * the program is suspended as soon as the function returns.
+ * spn_vm_exec() abandons the suspended program, if any (its stack frames
+ * are released). The JIT steps aside while a budget is set, since the
+ * native code doesn't count steps.
+ */
+SPN_API void		  spn_vm_setbudget(SpnVMachine *vm, unsigned long budget);
+SPN_API void		  spn_vm_suspend(SpnVMachine *vm);
+SPN_API int		  spn_vm_suspended(SpnVMachine *vm);
+SPN_API SpnValue	 *spn_vm_resume(SpnVMachine *vm);
+
+/* makes the running program fail with the runtime error `reason` at its
+ * next step (when called from a native function, as soon as it returns).
+ * `reason` must stay valid until then. It does nothing if no program is
+ * running, so it is safe to call from an allocator or from the limit
+ * handler of a pool (see spn_pool_setlimit()), which may run any time.
+ */
+SPN_API void		  spn_vm_interrupt(SpnVMachine *vm, const char *reason);
+
 /* this function does NOT copy the names of the native functions,
  * so make sure that they are pointers during the entire runtime
  */
 SPN_API void		  spn_vm_addlib(SpnVMachine *vm, const SpnExtFunc fns[], size_t n);
+SPN_API void		  spn_vm_addfastlib(SpnVMachine *vm, const SpnExtFastFunc fns[], size_t n);
 
 /* get and set user data */
 SPN_API void		 *spn_vm_getcontext(SpnVMachine *vm);
@@ -60,9 +112,88 @@ SPN_API const char	 *spn_vm_errmsg(SpnVMachine *vm);
 
 /* returns an array of strings containing a symbolicated stack trace.
  * Must be `free()`'d when you're done with it.
+ * The frames of functions which ended in a tail call (see SPN_INS_TAILCALL)
+ * are gone: the frame which replaced them is followed by one entry which is
+ * SPN_ELIDED_FRAMES, standing for all of them. The frames of a running
+ * coroutine are followed by those of the function which resumed it.
  */
+#define SPN_ELIDED_FRAMES	"<elided by tail calls>"
+
 SPN_API const char	**spn_vm_stacktrace(SpnVMachine *vm, size_t *size);
 
+/* the cycle collector frees arrays which are unreachable but are kept alive
+ * by reference cycles (see spn_array_collect() in array.h). It considers
+ * the arrays of the pool which was current when `vm` was created, which
+ * are those of its programs unless they run with another pool current.
+ * spn_vm_collect() runs it immediately, and returns the number of arrays
+ * freed. The VM also runs it automatically when the memory in use in that
+ * pool has grown by at least `threshold` bytes since the last collection
+ * (and by at least as much as that one left in use, so the time it takes
+ * is proportional to the amount allocated), and when `vm` is freed.
+ * A threshold of 0 turns the automatic collection off.
+ */
+#define SPN_GC_THRESHOLD	0x100000	/* 1 MB */
+
+SPN_API size_t		  spn_vm_collect(SpnVMachine *vm);
+SPN_API void		  spn_vm_autocollect(SpnVMachine *vm, size_t threshold);
+
+/* the profiler. It is only compiled in if the library is built with
+ * SPN_PROFILE defined (`make PROFILE=1`); otherwise, the VM contains no
+ * profiling code at all, spn_vm_profile() returns nonzero for any nonzero
+ * `flags` and the accessors below report no data.
+ *
+ * SPN_PROFILE_COUNTS counts executed instructions by opcode, and calls and
+ * CPU time per function (native functions included). The inclusive time
+ * of a function contains the time spent in its callees, the exclusive time
+ * doesn't; the time of recursive calls is only counted once. (Times are
+ * only approximate for functions which run in coroutines and yield.)
+ *
+ * SPN_PROFILE_SAMPLES records the call stack every `interval` instructions
+ * (0 selects a default). That's cheaper than timing every call, and the
+ * stacks are in the "folded" format of flame graph tools: function names
+ * separated by semicolons, outermost first.
+ *
+ * Calling spn_vm_profile() discards the data collected so far; profiling
+ * is disabled by passing 0 as `flags`. Data accumulates across calls to
+ * spn_vm_exec(). The arrays returned by the accessors are owned by the VM
+ * and are valid until the next call to any of them, to spn_vm_profile()
+ * or to spn_vm_exec(). The caller may reorder their elements.
+ */
+enum {
+	SPN_PROFILE_COUNTS	= 1 << 0,
+	SPN_PROFILE_SAMPLES	= 1 << 1
+};
+
+#define SPN_PROFILE_INTERVAL	1000
+
+typedef struct SpnFuncProfile {
+	const char	*name;
+	unsigned long	 calls;
+	double		 inclusive;	/* in seconds	*/
+	double		 exclusive;	/* in seconds	*/
+} SpnFuncProfile;
+
+typedef struct SpnStackSample {
+	const char	*stack;		/* e. g. "<main program>;foo;bar"	*/
+	unsigned long	 count;
+} SpnStackSample;
+
+SPN_API int		  spn_vm_profile(SpnVMachine *vm, int flags, unsigned long interval);
+
+/* `*n` is set to SPN_INS_COUNT; the array is indexed by opcode */
+SPN_API unsigned long	 *spn_vm_opcounts(SpnVMachine *vm, size_t *n);
+SPN_API SpnFuncProfile	 *spn_vm_funcprofile(SpnVMachine *vm, size_t *n);
+SPN_API SpnStackSample	 *spn_vm_samples(SpnVMachine *vm, size_t *n);
+
+/* the JIT compiler (see jit.h) is only compiled in if the library is built
+ * with SPN_JIT defined (`make JIT=1`) for x86-64. It is enabled by default
+ * then; spn_vm_setjit() turns it off and on again at runtime. Without the
+ * JIT, or when the OS refuses to map executable memory, code is always
+ * interpreted, and spn_vm_setjit() returns nonzero if `enable` is nonzero.
+ * The JIT steps aside while the profiler is running.
+ */
+SPN_API int		  spn_vm_setjit(SpnVMachine *vm, int enable);
+
 /* layout of a Sparkling bytecode file:
  * 
  * +------------------------------------+
@@ -86,6 +217,13 @@ SPN_API const char	**spn_vm_stacktrace(SpnVMachine *vm, size_t *size);
 /* Bytecode magic number */
 #define SPN_MAGIC		0x4e50537f	/* "\x7fSPN" */
 
+/* revision of the bytecode format. It is not stored in the bytecode, but
+ * persisted compiled code (see spn_ctx_setcachedir()) is tagged with it,
+ * so it must be incremented whenever the code generator or the meaning of
+ * an instruction changes in an incompatible way.
+ */
+#define SPN_BYTECODE_VERSION	2
+
 /* description of the program header format */
 #define SPN_HDRIDX_MAGIC	0
 #define SPN_HDRIDX_SYMTABOFF	1
@@ -192,9 +330,24 @@ enum spn_vm_ins {
 	SPN_INS_ARRGET,		/* a = b[c]				*/
 	SPN_INS_ARRSET,		/* a[b] = c				*/
 	SPN_INS_NTHARG,		/* a = argv[b] (accesses varargs only!)	*/
-	SPN_INS_GLBSYM		/* add to global symtab		(VI)	*/
+	SPN_INS_GLBSYM,		/* add to global symtab		(VI)	*/
+	SPN_INS_JEQ,		/* jump if (a == b) is c	(VII)	*/
+	SPN_INS_JNE,		/* jump if (a != b) is c		*/
+	SPN_INS_JLT,		/* jump if (a < b) is c			*/
+	SPN_INS_JLE,		/* jump if (a <= b) is c		*/
+	SPN_INS_JGT,		/* jump if (a > b) is c			*/
+	SPN_INS_JGE,		/* jump if (a >= b) is c		*/
+	SPN_INS_ADDI,		/* a = b + <immediate c>	(VIII)	*/
+	SPN_INS_CONCAT_ALL,	/* a = x .. y .. z ... [b operands] (IX)	*/
+	SPN_INS_FLDGET,		/* a = b.<symbol>		(X)	*/
+	SPN_INS_FLDSET,		/* a.<symbol> = b			*/
+	SPN_INS_NEXT,		/* b, c = next pair in a, jump	(XI)	*/
+	SPN_INS_TAILCALL	/* a = b(...) in place of caller (XII)	*/
 };
 
+/* the number of opcodes. Keep it in sync with the last instruction above! */
+#define SPN_INS_COUNT		(SPN_INS_TAILCALL + 1)
+
 /* Remarks:
  * --------
  * 
@@ -251,6 +404,52 @@ enum spn_vm_ins {
  *                                        |   |   +--- total register count
  *                                        |   +--- number of decl. arguments
  *                                        +--- body length, without header
+ * 
+ * (VII): fused compare-and-branch instructions. `a' and `b' are the registers
+ * to be compared, `c' is the expected truth value of the comparison: if it's
+ * nonzero, the jump is taken when the comparison yields true, otherwise it is
+ * taken when the comparison yields false. Just like JMP, JZE and JNZ, these
+ * instructions are followed by a jump offset in the next `spn_uword`. Their
+ * semantics is the same as that of the corresponding EQ ... GE instruction
+ * followed by a JNZ or JZE.
+ * 
+ * (VIII): `c' is not a register index but a signed 8-bit integer constant
+ * (in the range [-128...127]). The instruction behaves like an ADD of which
+ * the right-hand side operand is an integer with the value of `c'.
+ * 
+ * (IX): `b' is the number of operands, which are all strings. Their register
+ * indices follow the instruction in the same format as the register indices
+ * of call-time arguments do after CALL (see Remark (I)). The length of the
+ * result is computed beforehand, so each operand is copied exactly once.
+ * 
+ * (X): field access, i. e. subscripting an array with a string literal
+ * (this is what `obj.name`, `obj->name` and `obj["name"]` compile to).
+ * The instruction is followed by two words: the index of the field name in
+ * the local symbol table, and the index of an inline cache. Cache indices
+ * are numbered from zero in each compiled program; the VM keeps the caches
+ * along with the local symbol table. A cache remembers where the field was
+ * last found in the hash table of an array (see spn_array_get_hinted()), so
+ * repeated accesses to the same field of arrays with the same layout do not
+ * need to hash the name or to probe the table. Apart from that, FLDGET and
+ * FLDSET behave like ARRGET and ARRSET.
+ *
+ * (XI): one step of a `foreach' loop over the array in register `a'. The
+ * instruction is followed by a jump offset, like JMP and the conditional
+ * jumps (it is relative to the end of the offset word too), and by a word
+ * whose lowest octet is the index of the register holding the cursor, an
+ * integer which must be 0 before the first step (see spn_array_next()).
+ * If the array has another key-value pair, the key is stored in `b', the
+ * value in `c', the cursor is advanced and the jump is taken. Otherwise,
+ * none of the registers is modified and execution continues after the
+ * instruction.
+ *
+ * (XII): a call in tail position, i. e. `return f(...)'. The operands are
+ * the same as those of CALL, and the compiler always follows it with a
+ * `ret a'. If the callee is a Sparkling function, the frame of the caller
+ * is popped before the frame of the callee is pushed (so it takes up the
+ * same stack slots), and the callee returns directly to where the caller
+ * would have returned; thus, the `ret' is skipped. A native function is
+ * called like by CALL, then the `ret' returns its result.
  */
 
 #endif /* SPN_VM_H */